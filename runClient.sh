@@ -1,12 +1,23 @@
 #!/bin/bash
 
-g++ -o build/client \
+g++ -std=c++20 -o build/client \
  src/libs/client/fileState.cpp \
  src/libs/client/userCommands.cpp \
  src/libs/client/fileWatcher.cpp \
+ src/libs/client/connectionPool.cpp \
+ src/libs/client/parallelTransfer.cpp \
  src/libs/common/socket.cpp \
+ src/libs/common/bufferPool.cpp \
+ src/libs/common/eventLoop.cpp \
  src/libs/common/helpers.cpp \
  src/libs/common/message.cpp \
+ src/libs/common/multiplexer.cpp \
+ src/libs/common/hash.cpp \
+ src/libs/common/blake3.cpp \
+ src/libs/common/delta.cpp \
+ src/libs/common/chunking.cpp \
+ src/libs/common/compression.cpp \
+ src/libs/common/transfer.cpp \
  src/client.cpp
 
 cd in/$1
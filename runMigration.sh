@@ -0,0 +1,10 @@
+#!/bin/bash
+
+g++ -std=c++20 -pthread -o build/migrateStorage \
+ src/libs/common/hash.cpp \
+ src/libs/common/blake3.cpp \
+ src/libs/server/sharding.cpp \
+ src/migrateStorage.cpp
+
+cd in/server
+../../build/migrateStorage $1
@@ -1,11 +1,30 @@
 #!/bin/bash
 
-g++ -o build/server \
+g++ -std=c++20 -o build/server \
 src/libs/common/socket.cpp \
+ src/libs/common/bufferPool.cpp \
+ src/libs/common/eventLoop.cpp \
  src/libs/common/message.cpp \
+ src/libs/common/multiplexer.cpp \
+ src/libs/common/hash.cpp \
+ src/libs/common/blake3.cpp \
+ src/libs/common/delta.cpp \
+ src/libs/common/chunking.cpp \
+ src/libs/common/compression.cpp \
+ src/libs/common/transfer.cpp \
  src/libs/common/helpers.cpp \
  src/libs/server/fileManager.cpp \
+ src/libs/server/notifications.cpp \
+ src/libs/server/chunkIndex.cpp \
+ src/libs/server/storage.cpp \
+ src/libs/server/contentAddressedStorage.cpp \
+ src/libs/server/segmentStorage.cpp \
+ src/libs/server/sharding.cpp \
+ src/libs/server/multiRootStorage.cpp \
+ src/libs/server/durability.cpp \
+ src/libs/server/writeBehindStorage.cpp \
+ src/libs/server/parallelTransfer.cpp \
  src/server.cpp
 
 cd in/server
-../../build/server $1
\ No newline at end of file
+../../build/server $@
\ No newline at end of file
@@ -15,9 +15,9 @@ int main(int argc, char *argv[])
 {
     // Um cliente deve poder estabelecer uma sessão com o servidor via linha de comando utilizando:
     // ># ./myClient <username> <server_ip_address> <port>
-    if (argc != 4)
+    if (argc != 4 && argc != 5)
     {
-        cerr << "Expected usage: ./client <username> <server_ip_address> <port>" << endl;
+        cerr << "Expected usage: ./client <username> <server_ip_address> <port> [connection_pool_size]" << endl;
         exit(0);
     }
 
@@ -26,17 +26,23 @@ int main(int argc, char *argv[])
     std::string username = argv[1];
     char *serverIpAddress = argv[2];
     int port = atoi(argv[3]);
+    int connectionPoolSize = argc == 5 ? atoi(argv[4]) : CONNECTION_POOL_SIZE;
 
     ServerConnection serverConnection(serverIpAddress, port, username.c_str());
 
     std::cout << "Connecting to server..." << std::endl;
+    if (USE_MULTIPLEXED_CONNECTION)
+    {
+        serverConnection.enableMultiplexing();
+    }
+
     auto message = serverConnection.connect();
     std::cout << "CONNECTED!" << std::endl;
 
     std::filesystem::remove_all("sync_dir_" + username);
     std::filesystem::create_directory("sync_dir_" + username);
 
-    LocalFileStatesManager manager(serverConnection);
+    LocalFileStatesManager manager(serverConnection, connectionPoolSize);
     ServerSynchronization synch(serverConnection, &manager);
 
     auto onCreate = [&manager](string filename)
@@ -74,7 +80,7 @@ int main(int argc, char *argv[])
 
         if (command.type == CommandType::Upload)
         {
-            uploadCommand(message.socket, command.parameter);
+            uploadCommand(serverConnection, message.socket, command.parameter, serverConnection.inlineLimit);
             continue;
         }
 
@@ -84,7 +90,7 @@ int main(int argc, char *argv[])
 
         if (command.type == CommandType::Download)
         {
-            downloadCommand(message.socket, command.parameter);
+            downloadCommand(serverConnection, message.socket, command.parameter);
             continue;
         }
 
@@ -115,6 +121,13 @@ int main(int argc, char *argv[])
             continue;
         }
 
+        // # transfer_stats Mostra as estimativas de RTT e banda de cada conexão
+        if (command.type == CommandType::TransferStats)
+        {
+            transferStatsCommand();
+            continue;
+        }
+
         // # exit Fecha a sessão com o servidor
         if (command.type == CommandType::Exit)
         {
@@ -1,13 +1,28 @@
+#pragma once
+
 #include <string>
 #include <ctime>
 #include <map>
 
 #include "../common/helpers.h"
 #include "../common/message.h"
+#include "../common/delta.h"
+#include "../common/chunking.h"
+#include "../common/transfer.h"
 #include "fileWatcher.h"
+#include "connectionPool.h"
+#include "parallelTransfer.h"
 
 using namespace std;
 
+// Carry the command line, the update subscription and every transfer as
+// streams of a single connection instead of one socket each.
+#define USE_MULTIPLEXED_CONNECTION true
+
+// Durability asked for on every upload, DefaultDurability defers to the
+// server's --durability.
+#define UPLOAD_DURABILITY Durability::DefaultDurability
+
 enum FileAction
 {
     Created,
@@ -43,6 +58,15 @@ public:
     time_t ctime;
     time_t mtime;
 
+    bool hasInlineData = false;
+    std::string inlineData;
+
+    // What the server holds, "" when it didn't say.
+    std::string contentHash;
+    uint64_t contentSize = 0;
+    // The server already held what was uploaded and won't echo it back.
+    bool isUnchanged = false;
+
     FileOperation(FileOperationTag tag, string filename)
     {
         this->tag = tag;
@@ -119,6 +143,7 @@ public:
 class LocalFileStatesManager : public QueueProcessor<FileOperation>
 {
     ServerConnection serverConnection;
+    ConnectionPool connectionPool;
     std::map<std::string, FileState> fileStatesByFilename;
     AsyncRunner asyncs;
 
@@ -132,8 +157,10 @@ class LocalFileStatesManager : public QueueProcessor<FileOperation>
         return fileStatesByFilename[filename];
     }
 
+    bool hasLocally(std::string filename, std::string contentHash, uint64_t contentSize);
     void StartDownload(string filename);
-    void StartUpload(string filename);
+    bool CommitInlineDownload(string filename, string data);
+    void StartUpload(string filename, bool isKnownOnServer);
     void Delete(string filename);
 
     FileState nextFileState(FileOperation entry, FileState fileState);
@@ -200,10 +227,11 @@ class LocalFileStatesManager : public QueueProcessor<FileOperation>
     }
 
 public:
-    LocalFileStatesManager(ServerConnection serverConnection)
+    LocalFileStatesManager(ServerConnection serverConnection, int connectionPoolSize = CONNECTION_POOL_SIZE)
         : QueueProcessor<FileOperation>(
               [this](FileOperation operation)
-              { processEntry(operation); })
+              { processEntry(operation); }),
+          connectionPool(serverConnection, connectionPoolSize)
     {
         this->serverConnection = serverConnection;
     }
@@ -263,6 +291,10 @@ class ServerSynchronization
             operation.atime = message.atime;
             operation.ctime = message.ctime;
             operation.mtime = message.mtime;
+            operation.hasInlineData = message.hasInlineData;
+            operation.inlineData = message.data;
+            operation.contentHash = message.contentHash;
+            operation.contentSize = message.contentSize;
 
             localManager->queue(operation);
             message = message.Reply(Message::Response(ResponseType::Ok));
@@ -293,6 +325,7 @@ enum CommandType
     ListServer,
     ListClient,
     GetSyncDir,
+    TransferStats,
     Exit
 };
 
@@ -312,7 +345,8 @@ public:
     static Command Parse(string input);
 };
 
-void uploadCommand(int socket, string path);
-void downloadCommand(int socket, string filename);
+void uploadCommand(ServerConnection serverConnection, int socket, string parameters, int inlineLimit);
+void downloadCommand(ServerConnection serverConnection, int socket, string parameters);
 void deleteCommand(int socket, string filename);
 void listServerCommand(int socket);
+void transferStatsCommand();
@@ -0,0 +1,96 @@
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <unistd.h>
+#include <errno.h>
+#include <algorithm>
+
+#include "connectionPool.h"
+#include "../common/transfer.h"
+
+ConnectionPool::ConnectionPool(ServerConnection serverConnection, int size)
+{
+    this->serverConnection = serverConnection;
+    this->size = serverConnection.multiplexer != nullptr ? 0 : std::max(0, size);
+
+    for (size_t i = 0; i < this->size; i++)
+    {
+        idleSockets.push_back(open());
+    }
+}
+
+int ConnectionPool::open()
+{
+    int socket = serverConnection.connect().socket;
+
+    if (serverConnection.multiplexer == nullptr)
+    {
+        timeval timeout = {CONNECTION_POOL_RECEIVE_TIMEOUT_SECONDS, 0};
+        setsockopt(socket, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+    }
+
+    return socket;
+}
+
+// An idle connection must have nothing to read: a closed socket reads 0 bytes
+// and leftover data means the conversation is out of sync.
+bool ConnectionPool::isHealthy(int socket)
+{
+    char byte;
+    int result = recv(socket, &byte, 1, MSG_PEEK | MSG_DONTWAIT);
+
+    return result == -1 && (errno == EAGAIN || errno == EWOULDBLOCK);
+}
+
+Message ConnectionPool::acquire()
+{
+    Message message = Message::Response(ResponseType::Ok);
+
+    while (true)
+    {
+        int socket;
+
+        {
+            std::unique_lock<std::mutex> lock(_mutex);
+
+            if (idleSockets.empty())
+            {
+                break;
+            }
+
+            socket = idleSockets.front();
+            idleSockets.pop_front();
+        }
+
+        if (isHealthy(socket))
+        {
+            message.socket = socket;
+            return message;
+        }
+
+        forgetTransferEstimate(socket);
+        close(socket);
+    }
+
+    message.socket = open();
+    return message;
+}
+
+void ConnectionPool::release(int socket)
+{
+    std::unique_lock<std::mutex> lock(_mutex);
+
+    if (idleSockets.size() >= size)
+    {
+        forgetTransferEstimate(socket);
+        close(socket);
+        return;
+    }
+
+    idleSockets.push_back(socket);
+}
+
+void ConnectionPool::discard(int socket)
+{
+    forgetTransferEstimate(socket);
+    close(socket);
+}
@@ -0,0 +1,33 @@
+#pragma once
+
+#include <list>
+#include <mutex>
+
+#include "../common/message.h"
+
+#define CONNECTION_POOL_SIZE 4
+#define CONNECTION_POOL_RECEIVE_TIMEOUT_SECONDS 60
+
+// Keeps already authenticated connections to the server so uploads, downloads
+// and deletes don't pay a TCP handshake and a Login round trip each. Reads on
+// them give up after CONNECTION_POOL_RECEIVE_TIMEOUT_SECONDS, and the caller
+// discards the connection then. Streams of a multiplexed connection are
+// opened without either, so they are not pooled.
+class ConnectionPool
+{
+    ServerConnection serverConnection;
+    size_t size;
+
+    std::mutex _mutex;
+    std::list<int> idleSockets;
+
+    bool isHealthy(int socket);
+    int open();
+
+public:
+    ConnectionPool(ServerConnection serverConnection, int size = CONNECTION_POOL_SIZE);
+
+    Message acquire();
+    void release(int socket);
+    void discard(int socket);
+};
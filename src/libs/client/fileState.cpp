@@ -1,3 +1,5 @@
+#include <sys/stat.h>
+
 #include "client.h"
 
 string fileActionTagToString(FileAction tag)
@@ -114,6 +116,22 @@ FileState LocalFileStatesManager::nextFileState(FileOperation entry, FileState f
     return FileState::Inexistent();
 }
 
+// Whether the local copy already holds what the server announced. Sizes
+// are compared first, so most changed files are told apart without hashing.
+bool LocalFileStatesManager::hasLocally(string filename, string contentHash, uint64_t contentSize)
+{
+    std::string path = "sync_dir_" + serverConnection.username + "/" + filename;
+
+    struct stat attributes;
+    if (contentHash.empty() || stat(path.c_str(), &attributes) != 0 || (uint64_t)attributes.st_size != contentSize)
+    {
+        return false;
+    }
+
+    uint64_t size;
+    return contentHashFile(path, &size) == contentHash && size == contentSize;
+}
+
 void LocalFileStatesManager::StartDownload(string filename)
 {
     auto download = [this, filename]
@@ -121,20 +139,49 @@ void LocalFileStatesManager::StartDownload(string filename)
         std::string temporaryPath = "TEMP_" + serverConnection.username + "_" + filename;
         std::string path = "sync_dir_" + serverConnection.username + "/" + filename;
 
-        auto message = serverConnection.connect();
+        auto message = connectionPool.acquire();
 
-        message = message.Reply(Message::DownloadCommand(filename));
+        // Files without a local copy to diff against are asked for in
+        // ranges; the answer tells whether they are large enough for it.
+        bool useDelta = isDeltaWorthwhile(path);
+        bool isSmall = false;
+        bool isDownloaded = !useDelta && downloadParallel(serverConnection, message.socket, filename, temporaryPath, path, 0, &isSmall);
 
-        if (!message.isOk())
+        if (useDelta || isSmall)
         {
-            message.panic();
+            if (useDelta)
+            {
+                message = message.Reply(Message::DeltaDownloadCommand(filename));
+            }
+            else
+            {
+                message = message.Reply(Message::DownloadCommand(filename));
+            }
+
+            if (!message.isOk())
+            {
+                message.panic();
+                connectionPool.discard(message.socket);
+                FileOperation operation(FileOperationTag::Fail, filename);
+                queue(operation);
+                return;
+            }
+
+            Session session(0, message.socket, "");
+            isDownloaded = useDelta
+                               ? sendSignatures(session, path) && downloadDelta(session, path, temporaryPath, path)
+                               : downloadFile(session, temporaryPath, path);
+        }
+
+        if (!isDownloaded)
+        {
+            connectionPool.discard(message.socket);
             FileOperation operation(FileOperationTag::Fail, filename);
             queue(operation);
             return;
         }
 
-        downloadFile(Session(0, message.socket, ""), temporaryPath, path);
-        close(message.socket);
+        connectionPool.release(message.socket);
 
         FileOperation operation(FileOperationTag::DownloadComplete, filename);
         queue(operation);
@@ -143,27 +190,115 @@ void LocalFileStatesManager::StartDownload(string filename)
     asyncs.queue(download);
 }
 
-void LocalFileStatesManager::StartUpload(string filename)
+bool LocalFileStatesManager::CommitInlineDownload(string filename, string data)
 {
-    auto upload = [this, filename]
+    std::string temporaryPath = "TEMP_" + serverConnection.username + "_" + filename;
+    std::string path = "sync_dir_" + serverConnection.username + "/" + filename;
+
+    return commitInlinePayload(data, temporaryPath, path);
+}
+
+void LocalFileStatesManager::StartUpload(string filename, bool isKnownOnServer)
+{
+    auto upload = [this, filename, isKnownOnServer]
     {
         std::string path = "sync_dir_" + serverConnection.username + "/" + filename;
 
-        auto message = serverConnection.connect();
+        auto message = connectionPool.acquire();
+
+        std::string inlineData;
+        if (readInlinePayload(path, serverConnection.inlineLimit, &inlineData))
+        {
+            message = message.Reply(Message::UploadCommand(filename, inlineData, UPLOAD_DURABILITY));
+
+            if (!message.isOk())
+            {
+                message.panic();
+                connectionPool.discard(message.socket);
+                FileOperation operation(FileOperationTag::Fail, filename);
+                queue(operation);
+                return;
+            }
+
+            connectionPool.release(message.socket);
+            FileOperation operation(FileOperationTag::UploadCompleted, filename);
+            operation.isUnchanged = message.data == UPLOAD_UNCHANGED;
+            queue(operation);
+            return;
+        }
 
-        message = message.Reply(Message::UploadCommand(filename));
+        // Edits of a file the server already has are diffed against its copy,
+        // other large files are sent in parallel ranges, and the rest of the
+        // new files are matched chunk by chunk against everything stored.
+        uint64_t size;
+        std::string hash = contentHashFile(path, &size);
 
-        if (!message.isOk())
+        bool useDelta = isKnownOnServer && isDeltaWorthwhile(path);
+        bool useParallel = !useDelta && parallelStreamsFor(size) > 1;
+        bool useChunks = !isKnownOnServer && !useParallel && isChunkingWorthwhile(path);
+
+        Message command = Message::UploadCommand(filename, UPLOAD_DURABILITY);
+        if (useDelta)
+        {
+            command = Message::DeltaUploadCommand(filename, UPLOAD_DURABILITY);
+        }
+        else if (useChunks)
+        {
+            command = Message::ChunkedUploadCommand(filename, UPLOAD_DURABILITY);
+        }
+
+        command.contentHash = hash;
+        command.contentSize = size;
+        if (!useParallel)
+        {
+            message = message.Reply(command);
+        }
+
+        if (!useParallel && !message.isOk())
         {
             message.panic();
+            connectionPool.discard(message.socket);
+            FileOperation operation(FileOperationTag::Fail, filename);
+            queue(operation);
+            return;
+        }
+
+        Session session(0, message.socket, "");
+        Signatures signatures;
+        bool isUnchanged = !useParallel && message.data == UPLOAD_UNCHANGED;
+        bool isUploaded;
+        if (useParallel)
+        {
+            isUploaded = uploadParallel(serverConnection, message.socket, path, filename, 0, UPLOAD_DURABILITY, hash, &isUnchanged);
+        }
+        else if (isUnchanged)
+        {
+            isUploaded = true;
+        }
+        else if (useDelta)
+        {
+            isUploaded = receiveSignatures(session, &signatures) && sendDelta(session, path, signatures);
+        }
+        else if (useChunks)
+        {
+            isUploaded = sendChunked(session, path);
+        }
+        else
+        {
+            isUploaded = sendFile(session, path);
+        }
+
+        if (!isUploaded)
+        {
+            connectionPool.discard(message.socket);
             FileOperation operation(FileOperationTag::Fail, filename);
             queue(operation);
             return;
         }
 
-        sendFile(Session(0, message.socket, ""), path);
-        close(message.socket);
+        connectionPool.release(message.socket);
         FileOperation operation(FileOperationTag::UploadCompleted, filename);
+        operation.isUnchanged = isUnchanged;
         queue(operation);
     };
 
@@ -174,20 +309,28 @@ void LocalFileStatesManager::Delete(string filename)
 {
     auto deleteFn = [this, filename]
     {
-        auto message = serverConnection.connect();
+        auto message = connectionPool.acquire();
 
         message = message.Reply(Message::DeleteCommand(filename));
 
         if (!message.isOk())
         {
             message.panic();
+            connectionPool.discard(message.socket);
             FileOperation operation(FileOperationTag::Fail, filename);
             queue(operation);
             return;
         }
 
-        message.Reply(Message::Start());
-        close(message.socket);
+        message = message.Reply(Message::Start());
+
+        if (!message.isOk())
+        {
+            connectionPool.discard(message.socket);
+            return;
+        }
+
+        connectionPool.release(message.socket);
     };
 
     asyncs.queue(deleteFn);
@@ -197,12 +340,33 @@ FileState LocalFileStatesManager::onServerUpdate(FileOperation entry, FileState
 {
     FileState nextState = previousState;
 
+    // Echoes of what this device uploaded itself, and files another one
+    // changed to what is already here, need no download.
+    if ((previousState.tag == FileStateTag::Inexistent || previousState.tag == FileStateTag::Ready) &&
+        hasLocally(entry.fileName, entry.contentHash, entry.contentSize))
+    {
+        nextState.tag = FileStateTag::Ready;
+        nextState.creationTime = entry.ctime;
+        nextState.lastAccessedTime = entry.atime;
+        nextState.lastModificationTime = entry.mtime;
+        return nextState;
+    }
+
     if (previousState.tag == FileStateTag::Inexistent)
     {
         nextState.tag = FileStateTag::Downloading;
         nextState.creationTime = entry.ctime;
         nextState.lastAccessedTime = entry.atime;
         nextState.lastModificationTime = entry.mtime;
+
+        // Inline data that can't be written is downloaded instead.
+        if (entry.hasInlineData && CommitInlineDownload(entry.fileName, entry.inlineData))
+        {
+            // The file watcher reports the commit as a local update, which completes the download
+            nextState.tag = FileStateTag::DownloadCompleted;
+            return nextState;
+        }
+
         StartDownload(entry.fileName);
         return nextState;
     }
@@ -211,6 +375,13 @@ FileState LocalFileStatesManager::onServerUpdate(FileOperation entry, FileState
     {
         nextState.tag = FileStateTag::Downloading;
         nextState.lastModificationTime = entry.mtime;
+
+        if (entry.hasInlineData && CommitInlineDownload(entry.fileName, entry.inlineData))
+        {
+            nextState.tag = FileStateTag::DownloadCompleted;
+            return nextState;
+        }
+
         StartDownload(entry.fileName);
         return nextState;
     }
@@ -333,7 +504,7 @@ FileState LocalFileStatesManager::onLocalUpdate(FileOperation entry, FileState p
         nextState.lastAccessedTime = now();
         nextState.lastModificationTime = now();
         nextState.tag = FileStateTag::Uploading;
-        StartUpload(entry.fileName);
+        StartUpload(entry.fileName, false);
         return nextState;
     }
 
@@ -353,7 +524,7 @@ FileState LocalFileStatesManager::onLocalUpdate(FileOperation entry, FileState p
     {
         nextState.lastModificationTime = now();
         nextState.tag = FileStateTag::Uploading;
-        StartUpload(entry.fileName);
+        StartUpload(entry.fileName, true);
         return nextState;
     }
 
@@ -413,7 +584,7 @@ FileState LocalFileStatesManager::onUploadCompleted(FileOperation entry, FileSta
 
     if (previousState.tag == FileStateTag::Uploading)
     {
-        nextState.tag = FileStateTag::UploadingCompleted;
+        nextState.tag = entry.isUnchanged ? FileStateTag::Ready : FileStateTag::UploadingCompleted;
         return nextState;
     }
 
@@ -0,0 +1,212 @@
+#include <future>
+#include <fstream>
+#include <functional>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include "parallelTransfer.h"
+#include "../common/transfer.h"
+
+std::vector<ByteRange> splitRanges(uint64_t size, int streams)
+{
+    uint64_t count = std::max(1, std::min(streams, PARALLEL_TRANSFER_MAX_STREAMS));
+    uint64_t rangeSize = (size + count - 1) / count;
+    rangeSize = (rangeSize + 4095) / 4096 * 4096;
+
+    std::vector<ByteRange> ranges;
+    for (uint64_t offset = 0; offset < size; offset += rangeSize)
+    {
+        ranges.push_back(ByteRange{offset, std::min(rangeSize, size - offset)});
+    }
+
+    return ranges;
+}
+
+int parallelStreamsFor(uint64_t size)
+{
+    if (size < PARALLEL_TRANSFER_MIN_SIZE)
+    {
+        return 1;
+    }
+
+    return std::min<uint64_t>(PARALLEL_TRANSFER_STREAMS, size / PARALLEL_TRANSFER_MIN_RANGE);
+}
+
+// The first range goes over socket, every other one over a new connection
+// of its own, retried on a fresh one when it breaks.
+static bool transferRanges(ServerConnection serverConnection, int socket, std::string transferId, uint64_t size, int streams,
+                           std::function<bool(Session, ByteRange)> transfer)
+{
+    std::vector<ByteRange> ranges = splitRanges(size, streams);
+    serverConnection.multiplexer = nullptr;
+
+    auto transferRange = [transferId, transfer](int socket, ByteRange range)
+    {
+        Message message = Message::TransferRange(transferId, range.offset, range.size).send(socket);
+
+        if (!message.isOk())
+        {
+            message.panic();
+            return false;
+        }
+
+        return transfer(Session(0, socket, ""), range);
+    };
+
+    std::vector<std::future<bool>> others;
+    for (size_t i = 1; i < ranges.size(); i++)
+    {
+        ByteRange range = ranges[i];
+        others.push_back(std::async(
+            std::launch::async,
+            [serverConnection, range, transferRange]() mutable
+            {
+                for (int attempt = 0; attempt < PARALLEL_TRANSFER_RANGE_ATTEMPTS; attempt++)
+                {
+                    int rangeSocket = serverConnection.connect().socket;
+                    bool isTransferred = transferRange(rangeSocket, range);
+
+                    forgetTransferEstimate(rangeSocket);
+                    close(rangeSocket);
+
+                    if (isTransferred)
+                    {
+                        return true;
+                    }
+                }
+
+                return false;
+            }));
+    }
+
+    bool isTransferred = ranges.empty() || transferRange(socket, ranges[0]);
+    for (auto &other : others)
+    {
+        isTransferred = other.get() && isTransferred;
+    }
+
+    return isTransferred;
+}
+
+bool uploadParallel(ServerConnection serverConnection, int socket, std::string path, std::string filename, int streams, Durability durability,
+                    std::string contentHash, bool *isUnchanged)
+{
+    struct stat attributes;
+    if (stat(path.c_str(), &attributes) != 0)
+    {
+        return false;
+    }
+
+    uint64_t size = attributes.st_size;
+    streams = streams > 0 ? streams : parallelStreamsFor(size);
+
+    Message command = Message::ParallelUploadCommand(filename, size, durability);
+    command.contentHash = contentHash;
+    command.contentSize = size;
+    Message message = command.send(socket);
+
+    if (!message.isOk())
+    {
+        message.panic();
+        return false;
+    }
+
+    if (message.data == UPLOAD_UNCHANGED)
+    {
+        std::cout << "Server already holds this content" << std::endl;
+        if (isUnchanged != nullptr)
+        {
+            *isUnchanged = true;
+        }
+        return true;
+    }
+
+    std::cout << "Sending " << size << " bytes over " << splitRanges(size, streams).size() << " streams..." << std::endl;
+
+    bool isUploaded = transferRanges(
+        serverConnection, socket, message.data, size, streams,
+        [path](Session session, ByteRange range)
+        {
+            std::ifstream file(path, std::ios::in | std::ios::binary);
+            return sendRange(session, file, range.offset, range.size);
+        });
+
+    if (!isUploaded)
+    {
+        return false;
+    }
+
+    message = Message::EndCommand().send(socket);
+
+    if (!message.isOk())
+    {
+        message.panic();
+        return false;
+    }
+
+    return true;
+}
+
+bool downloadParallel(ServerConnection serverConnection, int socket, std::string filename, std::string temporaryPath, std::string finalPath, int streams, bool *isSmall)
+{
+    Message message = Message::ParallelDownloadCommand(filename).send(socket);
+
+    if (!message.isOk())
+    {
+        message.panic();
+        return false;
+    }
+
+    size_t separator = message.data.find(":");
+    std::string transferId = message.data.substr(0, separator);
+    uint64_t size = separator == std::string::npos ? 0 : strtoull(message.data.c_str() + separator + 1, nullptr, 10);
+
+    if (streams <= 0)
+    {
+        streams = parallelStreamsFor(size);
+
+        if (streams == 1 && isSmall != nullptr)
+        {
+            *isSmall = Message::EndCommand().send(socket).isOk();
+            return false;
+        }
+    }
+
+    int file = open(temporaryPath.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (file < 0)
+    {
+        return false;
+    }
+
+    if (size > 0 && posix_fallocate(file, 0, size) != 0 && ftruncate(file, size) != 0)
+    {
+        close(file);
+        return false;
+    }
+
+    std::cout << "Receiving " << size << " bytes over " << splitRanges(size, streams).size() << " streams..." << std::endl;
+
+    bool isDownloaded = transferRanges(
+        serverConnection, socket, transferId, size, streams,
+        [file](Session session, ByteRange range)
+        { return receiveRange(session, file, range.offset, range.size); });
+
+    close(file);
+
+    if (!isDownloaded)
+    {
+        remove(temporaryPath.c_str());
+        return false;
+    }
+
+    message = Message::EndCommand().send(socket);
+
+    if (!message.isOk())
+    {
+        message.panic();
+        return false;
+    }
+
+    return rename(temporaryPath.c_str(), finalPath.c_str()) == 0;
+}
@@ -0,0 +1,33 @@
+#pragma once
+
+#include <string>
+#include <vector>
+#include <stdint.h>
+
+#include "../common/message.h"
+
+// Files from PARALLEL_TRANSFER_MIN_SIZE on are split into ranges of at
+// least PARALLEL_TRANSFER_MIN_RANGE, moved over PARALLEL_TRANSFER_STREAMS
+// connections unless the transfer asks for another count. Every range but
+// the first gets a TCP connection of its own, so they don't share a window.
+#define PARALLEL_TRANSFER_STREAMS 4
+#define PARALLEL_TRANSFER_MIN_SIZE (64 * 1024 * 1024)
+#define PARALLEL_TRANSFER_MIN_RANGE (8 * 1024 * 1024)
+#define PARALLEL_TRANSFER_MAX_STREAMS 32
+// A range whose connection breaks is sent again this many times in total.
+#define PARALLEL_TRANSFER_RANGE_ATTEMPTS 3
+
+std::vector<ByteRange> splitRanges(uint64_t size, int streams);
+int parallelStreamsFor(uint64_t size);
+
+// Both run on socket, which must be free, and leave it free again when
+// they succeed.
+// Nothing is sent, and isUnchanged is set, when the server says it already
+// holds contentHash.
+bool uploadParallel(ServerConnection serverConnection, int socket, std::string path, std::string filename, int streams, Durability durability,
+                    std::string contentHash = "", bool *isUnchanged = nullptr);
+
+// A streams count of 0 picks parallelStreamsFor the file size. When that is a
+// single stream, downloadParallel ends the transfer without moving anything
+// and sets isSmall, so the caller can use a resumable download instead.
+bool downloadParallel(ServerConnection serverConnection, int socket, std::string filename, std::string temporaryPath, std::string finalPath, int streams, bool *isSmall = nullptr);
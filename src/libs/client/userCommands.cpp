@@ -1,6 +1,9 @@
 #include <iostream>
 #include <string>
 #include <fstream>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
 
 #include "client.h"
 
@@ -46,6 +49,11 @@ Command Command::Parse(string input)
         return Command(CommandType::GetSyncDir, parameter);
     }
 
+    if (startsWith("transfer_stats"))
+    {
+        return Command(CommandType::TransferStats, parameter);
+    }
+
     if (startsWith("exit"))
     {
         return Command(CommandType::Exit, parameter);
@@ -54,14 +62,90 @@ Command Command::Parse(string input)
     return Command(CommandType::InvalidCommand, input);
 }
 
-void uploadCommand(int socket, string path)
+// Takes a trailing stream count off the parameters, 0 when there is none.
+static int takeStreams(string *parameters)
+{
+    size_t space = parameters->rfind(" ");
+    if (space == string::npos || space + 1 == parameters->size() ||
+        parameters->find_first_not_of("0123456789", space + 1) != string::npos)
+    {
+        return 0;
+    }
+
+    int streams = atoi(parameters->c_str() + space + 1);
+    parameters->resize(space);
+    return streams;
+}
+
+// Takes all trailing numeric tokens off parameters.
+static vector<uint64_t> takeNumbers(string *parameters)
+{
+    vector<uint64_t> numbers;
+    while (true)
+    {
+        size_t space = parameters->rfind(" ");
+        if (space == string::npos || space + 1 == parameters->size() ||
+            parameters->find_first_not_of("0123456789", space + 1) != string::npos)
+        {
+            return numbers;
+        }
+
+        numbers.insert(numbers.begin(), strtoull(parameters->c_str() + space + 1, nullptr, 10));
+        parameters->resize(space);
+    }
+}
+
+// Writes each range at its offset into the local copy of the file, which
+// takes the size of the one on the server but keeps its other bytes.
+static void downloadRanges(int socket, string filename, vector<ByteRange> ranges)
+{
+    Message message = Message::RangeDownloadCommand(filename, ranges).send(socket);
+
+    if (!message.isOk())
+    {
+        message.panic();
+        return;
+    }
+
+    uint64_t size = strtoull(message.data.c_str(), nullptr, 10);
+    int file = open(filename.c_str(), O_WRONLY | O_CREAT, 0644);
+    bool isReceived = file >= 0 && ftruncate(file, size) == 0;
+
+    for (ByteRange range : ranges)
+    {
+        range = range.clip(size);
+        if (!receiveRange(Session(0, socket, ""), file, range.offset, range.size))
+        {
+            isReceived = false;
+            break;
+        }
+
+        cout << "Received bytes " << range.offset << " to " << range.offset + range.size << " of " << size << endl;
+    }
+
+    if (file >= 0)
+    {
+        close(file);
+    }
+
+    if (!isReceived)
+    {
+        cout << Color::red << "Range download failed" << Color::reset << endl;
+        return;
+    }
+
+    cout << Color::green << "File ranges downloaded succesfully!" << Color::reset << endl;
+}
+
+void uploadCommand(ServerConnection serverConnection, int socket, string path, int inlineLimit)
 {
+    int streams = takeStreams(&path);
 
     if (path.length() <= 0)
     {
         cout << Color::red
              << "Missing path arg on upload command.\n"
-             << "Expected usage: upload <path/filename.ext>"
+             << "Expected usage: upload <path/filename.ext> [streams]"
              << Color::reset
              << endl;
         return;
@@ -84,7 +168,33 @@ void uploadCommand(int socket, string path)
 
     string filename = extractFilenameFromPath(path);
 
-    Message response = Message::UploadCommand(filename).send(socket);
+    struct stat attributes;
+    uint64_t size = stat(path.c_str(), &attributes) == 0 ? attributes.st_size : 0;
+    if (streams > 1 || (streams == 0 && parallelStreamsFor(size) > 1))
+    {
+        if (uploadParallel(serverConnection, socket, path, filename, streams, UPLOAD_DURABILITY, contentHashFile(path, &size)))
+        {
+            std::cout << Color::green << "File uploaded succesfully!" << Color::reset << std::endl;
+        }
+        return;
+    }
+
+    string inlineData;
+    if (readInlinePayload(path, inlineLimit, &inlineData))
+    {
+        Message response = Message::UploadCommand(filename, inlineData).send(socket);
+
+        if (!response.isOk())
+        {
+            response.panic();
+        }
+
+        return;
+    }
+
+    Message command = Message::UploadCommand(filename);
+    command.contentHash = contentHashFile(path, &command.contentSize);
+    Message response = command.send(socket);
 
     if (!response.isOk())
     {
@@ -92,21 +202,56 @@ void uploadCommand(int socket, string path)
         return;
     }
 
+    if (response.data == UPLOAD_UNCHANGED)
+    {
+        cout << "Server already holds this content" << endl;
+        return;
+    }
+
     sendFile(Session(0, socket, ""), path);
 }
 
-void downloadCommand(int socket, string filename)
+void downloadCommand(ServerConnection serverConnection, int socket, string filename)
 {
-    if (!isFilenameValid(filename))
+    vector<uint64_t> numbers = takeNumbers(&filename);
+
+    if (!isFilenameValid(filename) || numbers.size() > 2 * RANGE_DOWNLOAD_MAX_RANGES ||
+        (numbers.size() > 1 && numbers.size() % 2 != 0))
     {
         cout << Color::red
              << "Invalid filename.\n"
-             << "Expected usage: download <filename.ext>"
+             << "Expected usage: download <filename.ext> [streams | <offset> <length>...]"
              << Color::reset
              << endl;
         return;
     }
 
+    if (numbers.size() > 1)
+    {
+        vector<ByteRange> ranges;
+        for (size_t i = 0; i < numbers.size(); i += 2)
+        {
+            ranges.push_back(ByteRange{numbers[i], numbers[i + 1]});
+        }
+
+        downloadRanges(socket, filename, ranges);
+        return;
+    }
+
+    int streams = numbers.empty() ? 0 : numbers.front();
+
+    bool isSmall = false;
+    if (streams != 1 && downloadParallel(serverConnection, socket, filename, "TEMP_" + filename, filename, streams, &isSmall))
+    {
+        std::cout << Color::green << "File downloaded succesfully!" << Color::reset << std::endl;
+        return;
+    }
+
+    if (streams != 1 && !isSmall)
+    {
+        return;
+    }
+
     Message message = Message::DownloadCommand(filename).send(socket);
 
     if (!message.isOk())
@@ -198,4 +343,12 @@ void listServerCommand(int socket)
     }
 
     message.Reply(Message::Response(ResponseType::Ok), false);
-}
\ No newline at end of file
+}
+
+void transferStatsCommand()
+{
+    for (auto &[socket, estimate] : transferEstimates())
+    {
+        std::cout << Color::blue << "socket " << socket << Color::reset << ": " << estimate.toString() << endl;
+    }
+}
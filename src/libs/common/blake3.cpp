@@ -0,0 +1,532 @@
+#include <future>
+#include <memory>
+#include <thread>
+#include <vector>
+#include <string.h>
+#include <algorithm>
+
+#if defined(__x86_64__) || defined(__i386__)
+#define BLAKE3_HAS_X86_KERNELS
+#endif
+
+#include "blake3.h"
+
+// The build scripts compile without optimization, which leaves the vector
+// kernels spilling every lane to memory.
+#pragma GCC optimize("O2")
+
+#define BLAKE3_CHUNK_START 1
+#define BLAKE3_CHUNK_END 2
+#define BLAKE3_PARENT 4
+#define BLAKE3_ROOT 8
+
+#define BLAKE3_BLOCKS_PER_CHUNK (BLAKE3_CHUNK_SIZE / BLAKE3_BLOCK_SIZE)
+#define BLAKE3_SUBTREE_CHUNKS (BLAKE3_SUBTREE_SIZE / BLAKE3_CHUNK_SIZE)
+
+static const uint32_t BLAKE3_IV[8] = {
+    0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a,
+    0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19};
+
+static const uint8_t BLAKE3_SCHEDULE[7][16] = {
+    {0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15},
+    {2, 6, 3, 10, 7, 0, 4, 13, 1, 11, 12, 5, 9, 14, 15, 8},
+    {3, 4, 10, 12, 13, 2, 7, 14, 6, 5, 9, 0, 11, 15, 8, 1},
+    {10, 7, 12, 9, 14, 3, 13, 15, 4, 0, 11, 2, 5, 8, 1, 6},
+    {12, 13, 9, 11, 15, 10, 14, 8, 7, 2, 5, 3, 0, 1, 6, 4},
+    {9, 14, 11, 5, 8, 12, 15, 1, 13, 3, 0, 10, 2, 6, 4, 7},
+    {11, 15, 5, 0, 1, 9, 8, 6, 14, 10, 2, 12, 3, 4, 7, 13}};
+
+typedef uint32_t Lanes4 __attribute__((vector_size(16)));
+#ifdef BLAKE3_HAS_X86_KERNELS
+typedef uint32_t Lanes8 __attribute__((vector_size(32)));
+typedef uint32_t Lanes16 __attribute__((vector_size(64)));
+#endif
+
+static inline uint32_t load32(const uint8_t *bytes)
+{
+    return (uint32_t)bytes[0] | (uint32_t)bytes[1] << 8 | (uint32_t)bytes[2] << 16 | (uint32_t)bytes[3] << 24;
+}
+
+static inline void store32(uint8_t *bytes, uint32_t value)
+{
+    bytes[0] = (uint8_t)value;
+    bytes[1] = (uint8_t)(value >> 8);
+    bytes[2] = (uint8_t)(value >> 16);
+    bytes[3] = (uint8_t)(value >> 24);
+}
+
+// The round function is written once for plain words and for vectors of
+// them, where every lane belongs to a different input. Vectors only pass by
+// reference, so the helpers don't depend on the vector ABI.
+#define BLAKE3_ROTATE(value, bits) (((value) >> (bits)) | ((value) << (32 - (bits))))
+
+template <typename Word>
+static inline __attribute__((always_inline)) void mix(Word *v, int a, int b, int c, int d, const Word &x, const Word &y)
+{
+    v[a] = v[a] + v[b] + x;
+    v[d] = BLAKE3_ROTATE(v[d] ^ v[a], 16);
+    v[c] = v[c] + v[d];
+    v[b] = BLAKE3_ROTATE(v[b] ^ v[c], 12);
+    v[a] = v[a] + v[b] + y;
+    v[d] = BLAKE3_ROTATE(v[d] ^ v[a], 8);
+    v[c] = v[c] + v[d];
+    v[b] = BLAKE3_ROTATE(v[b] ^ v[c], 7);
+}
+
+template <typename Word>
+static inline __attribute__((always_inline)) void rounds(Word *v, const Word *m)
+{
+#pragma GCC unroll 7
+    for (int round = 0; round < 7; round++)
+    {
+        const uint8_t *s = BLAKE3_SCHEDULE[round];
+        mix<Word>(v, 0, 4, 8, 12, m[s[0]], m[s[1]]);
+        mix<Word>(v, 1, 5, 9, 13, m[s[2]], m[s[3]]);
+        mix<Word>(v, 2, 6, 10, 14, m[s[4]], m[s[5]]);
+        mix<Word>(v, 3, 7, 11, 15, m[s[6]], m[s[7]]);
+        mix<Word>(v, 0, 5, 10, 15, m[s[8]], m[s[9]]);
+        mix<Word>(v, 1, 6, 11, 12, m[s[10]], m[s[11]]);
+        mix<Word>(v, 2, 7, 8, 13, m[s[12]], m[s[13]]);
+        mix<Word>(v, 3, 4, 9, 14, m[s[14]], m[s[15]]);
+    }
+}
+
+// Compresses one block into the first 8 words of its output, which is all
+// a 32 byte digest needs. cv and out may be the same.
+static void compress(const uint32_t cv[8], const uint8_t block[BLAKE3_BLOCK_SIZE], uint32_t blockLength, uint64_t counter, uint32_t flags, uint32_t out[8])
+{
+    uint32_t m[16];
+    for (int i = 0; i < 16; i++)
+    {
+        m[i] = load32(block + 4 * i);
+    }
+
+    uint32_t v[16] = {
+        cv[0], cv[1], cv[2], cv[3], cv[4], cv[5], cv[6], cv[7],
+        BLAKE3_IV[0], BLAKE3_IV[1], BLAKE3_IV[2], BLAKE3_IV[3],
+        (uint32_t)counter, (uint32_t)(counter >> 32), blockLength, flags};
+
+    rounds<uint32_t>(v, m);
+
+    for (int i = 0; i < 8; i++)
+    {
+        out[i] = v[i] ^ v[i + 8];
+    }
+}
+
+static void hashOne(const uint8_t *input, size_t blocks, const uint32_t key[8], uint64_t counter, uint32_t flags, uint32_t flagsStart, uint32_t flagsEnd, uint8_t out[32])
+{
+    uint32_t cv[8];
+    memcpy(cv, key, sizeof(cv));
+
+    for (size_t i = 0; i < blocks; i++)
+    {
+        uint32_t blockFlags = flags | (i == 0 ? flagsStart : 0) | (i == blocks - 1 ? flagsEnd : 0);
+        compress(cv, input + i * BLAKE3_BLOCK_SIZE, BLAKE3_BLOCK_SIZE, counter, blockFlags, cv);
+    }
+
+    for (int i = 0; i < 8; i++)
+    {
+        store32(out + 4 * i, cv[i]);
+    }
+}
+
+// Hashes Lanes inputs of the same number of blocks side by side, word i of
+// every input in vector m[i].
+template <typename Vector, int Lanes>
+static inline __attribute__((always_inline)) void hashLanes(const uint8_t *const *inputs, size_t blocks, const uint32_t key[8], uint64_t counter, bool isCounted, uint32_t flags, uint32_t flagsStart, uint32_t flagsEnd, uint8_t *out)
+{
+    Vector h[8];
+    for (int i = 0; i < 8; i++)
+    {
+        h[i] = Vector{} + key[i];
+    }
+
+    Vector counterLow, counterHigh;
+    for (int lane = 0; lane < Lanes; lane++)
+    {
+        uint64_t laneCounter = counter + (isCounted ? lane : 0);
+        counterLow[lane] = (uint32_t)laneCounter;
+        counterHigh[lane] = (uint32_t)(laneCounter >> 32);
+    }
+
+    for (size_t block = 0; block < blocks; block++)
+    {
+        // Transposed through memory: scalar stores into whole vectors are
+        // far cheaper than inserting every word into its lane.
+        uint32_t words[16][Lanes] __attribute__((aligned(64)));
+        for (int lane = 0; lane < Lanes; lane++)
+        {
+            for (int i = 0; i < 16; i++)
+            {
+                words[i][lane] = load32(inputs[lane] + block * BLAKE3_BLOCK_SIZE + 4 * i);
+            }
+        }
+
+        Vector m[16];
+        memcpy(m, words, sizeof(m));
+
+        uint32_t blockFlags = flags | (block == 0 ? flagsStart : 0) | (block == blocks - 1 ? flagsEnd : 0);
+        Vector v[16] = {
+            h[0], h[1], h[2], h[3], h[4], h[5], h[6], h[7],
+            Vector{} + BLAKE3_IV[0], Vector{} + BLAKE3_IV[1], Vector{} + BLAKE3_IV[2], Vector{} + BLAKE3_IV[3],
+            counterLow, counterHigh, Vector{} + (uint32_t)BLAKE3_BLOCK_SIZE, Vector{} + blockFlags};
+
+        rounds<Vector>(v, m);
+
+        for (int i = 0; i < 8; i++)
+        {
+            h[i] = v[i] ^ v[i + 8];
+        }
+    }
+
+    for (int lane = 0; lane < Lanes; lane++)
+    {
+        for (int i = 0; i < 8; i++)
+        {
+            store32(out + lane * 32 + 4 * i, h[i][lane]);
+        }
+    }
+}
+
+// Writes the 32 byte chaining value of every input to out, in order. Chunk
+// inputs get consecutive counters, parents all use 0.
+template <typename Vector, int Lanes>
+static inline __attribute__((always_inline)) void hashManyLanes(const uint8_t *const *inputs, size_t count, size_t blocks, const uint32_t key[8], uint64_t counter, bool isCounted, uint32_t flags, uint32_t flagsStart, uint32_t flagsEnd, uint8_t *out)
+{
+    for (; count >= Lanes; count -= Lanes)
+    {
+        hashLanes<Vector, Lanes>(inputs, blocks, key, counter, isCounted, flags, flagsStart, flagsEnd, out);
+        inputs += Lanes;
+        counter += isCounted ? Lanes : 0;
+        out += Lanes * 32;
+    }
+
+    for (; count > 0; count--)
+    {
+        hashOne(*inputs, blocks, key, counter, flags, flagsStart, flagsEnd, out);
+        inputs++;
+        counter += isCounted ? 1 : 0;
+        out += 32;
+    }
+}
+
+typedef void (*HashManyFunction)(const uint8_t *const *inputs, size_t count, size_t blocks, const uint32_t key[8], uint64_t counter, bool isCounted, uint32_t flags, uint32_t flagsStart, uint32_t flagsEnd, uint8_t *out);
+
+static void hashMany4(const uint8_t *const *inputs, size_t count, size_t blocks, const uint32_t key[8], uint64_t counter, bool isCounted, uint32_t flags, uint32_t flagsStart, uint32_t flagsEnd, uint8_t *out)
+{
+    hashManyLanes<Lanes4, 4>(inputs, count, blocks, key, counter, isCounted, flags, flagsStart, flagsEnd, out);
+}
+
+#ifdef BLAKE3_HAS_X86_KERNELS
+__attribute__((target("avx2"))) static void hashMany8(const uint8_t *const *inputs, size_t count, size_t blocks, const uint32_t key[8], uint64_t counter, bool isCounted, uint32_t flags, uint32_t flagsStart, uint32_t flagsEnd, uint8_t *out)
+{
+    hashManyLanes<Lanes8, 8>(inputs, count, blocks, key, counter, isCounted, flags, flagsStart, flagsEnd, out);
+}
+
+__attribute__((target("avx512f"))) static void hashMany16(const uint8_t *const *inputs, size_t count, size_t blocks, const uint32_t key[8], uint64_t counter, bool isCounted, uint32_t flags, uint32_t flagsStart, uint32_t flagsEnd, uint8_t *out)
+{
+    hashManyLanes<Lanes16, 16>(inputs, count, blocks, key, counter, isCounted, flags, flagsStart, flagsEnd, out);
+}
+#endif
+
+static int chooseLanes()
+{
+#ifdef BLAKE3_HAS_X86_KERNELS
+    if (__builtin_cpu_supports("avx512f"))
+    {
+        return 16;
+    }
+    if (__builtin_cpu_supports("avx2"))
+    {
+        return 8;
+    }
+#endif
+    return 4;
+}
+
+static HashManyFunction chooseHashMany()
+{
+#ifdef BLAKE3_HAS_X86_KERNELS
+    switch (chooseLanes())
+    {
+    case 16:
+        return hashMany16;
+    case 8:
+        return hashMany8;
+    }
+#endif
+    return hashMany4;
+}
+
+static void hashMany(const uint8_t *const *inputs, size_t count, size_t blocks, const uint32_t key[8], uint64_t counter, bool isCounted, uint32_t flags, uint32_t flagsStart, uint32_t flagsEnd, uint8_t *out)
+{
+    static const HashManyFunction function = chooseHashMany();
+    function(inputs, count, blocks, key, counter, isCounted, flags, flagsStart, flagsEnd, out);
+}
+
+static void parentCv(const uint8_t left[32], const uint8_t right[32], const uint32_t key[8], uint8_t out[32])
+{
+    uint8_t block[BLAKE3_BLOCK_SIZE];
+    memcpy(block, left, 32);
+    memcpy(block + 32, right, 32);
+    hashOne(block, 1, key, 0, BLAKE3_PARENT, 0, 0, out);
+}
+
+// Chaining value of the complete subtree of chunks chunks, a power of two,
+// which is never the root. Each level is hashed in vector lanes: the
+// chunks first, then pairs of their chaining values, which lie next to each
+// other, into the space the level below took.
+static void hashSubtree(const uint8_t *data, uint64_t chunks, uint64_t counter, const uint32_t key[8], uint8_t out[32])
+{
+    std::vector<uint8_t> cvs(chunks * 32);
+    std::vector<const uint8_t *> inputs(chunks);
+
+    for (uint64_t i = 0; i < chunks; i++)
+    {
+        inputs[i] = data + i * BLAKE3_CHUNK_SIZE;
+    }
+    hashMany(inputs.data(), chunks, BLAKE3_BLOCKS_PER_CHUNK, key, counter, true, 0, BLAKE3_CHUNK_START, BLAKE3_CHUNK_END, cvs.data());
+
+    for (; chunks > 1; chunks /= 2)
+    {
+        for (uint64_t i = 0; i < chunks / 2; i++)
+        {
+            inputs[i] = cvs.data() + i * 64;
+        }
+        hashMany(inputs.data(), chunks / 2, 1, key, 0, false, BLAKE3_PARENT, 0, 0, cvs.data());
+    }
+
+    memcpy(out, cvs.data(), 32);
+}
+
+Blake3::Blake3(int threads)
+{
+    memcpy(key, BLAKE3_IV, sizeof(key));
+    memcpy(chunkCv, key, sizeof(chunkCv));
+    this->threads = std::max(1, threads);
+}
+
+void Blake3::updateChunk(const uint8_t *data, size_t size)
+{
+    while (size > 0)
+    {
+        if (blockLength == BLAKE3_BLOCK_SIZE)
+        {
+            compress(chunkCv, block, BLAKE3_BLOCK_SIZE, chunkCounter, blocksCompressed == 0 ? BLAKE3_CHUNK_START : 0, chunkCv);
+            blocksCompressed++;
+            blockLength = 0;
+        }
+
+        size_t length = std::min(BLAKE3_BLOCK_SIZE - blockLength, size);
+        memcpy(block + blockLength, data, length);
+        blockLength += length;
+        data += length;
+        size -= length;
+    }
+}
+
+// Hashes chunks whole chunks, which are followed by more input, as aligned
+// subtrees of at most BLAKE3_SUBTREE_CHUNKS. Large updates hash them on
+// several threads and push their chaining values in order afterwards.
+void Blake3::updateSubtrees(const uint8_t *data, uint64_t chunks)
+{
+    std::vector<std::pair<uint64_t, uint64_t>> subtrees;
+    for (uint64_t first = 0; first < chunks;)
+    {
+        uint64_t size = BLAKE3_SUBTREE_CHUNKS;
+        while (size > chunks - first || (chunkCounter + first) % size != 0)
+        {
+            size /= 2;
+        }
+
+        subtrees.push_back({first, size});
+        first += size;
+    }
+
+    std::vector<uint8_t> cvs(subtrees.size() * 32);
+    auto hashSubtrees = [&](size_t first, size_t step)
+    {
+        for (size_t i = first; i < subtrees.size(); i += step)
+        {
+            hashSubtree(data + subtrees[i].first * BLAKE3_CHUNK_SIZE, subtrees[i].second,
+                        chunkCounter + subtrees[i].first, key, cvs.data() + i * 32);
+        }
+    };
+
+    int workers = chunks * BLAKE3_CHUNK_SIZE < BLAKE3_PARALLEL_MIN_SIZE ? 1 : std::min<int>(threads, subtrees.size());
+    std::vector<std::future<void>> running;
+    for (int worker = 1; worker < workers; worker++)
+    {
+        running.push_back(std::async(std::launch::async, hashSubtrees, worker, workers));
+    }
+    hashSubtrees(0, workers);
+
+    for (auto &worker : running)
+    {
+        worker.wait();
+    }
+
+    for (size_t i = 0; i < subtrees.size(); i++)
+    {
+        pushSubtree(cvs.data() + i * 32, subtrees[i].second);
+    }
+}
+
+// Merges the new subtree with the ones on the stack that it completes, the
+// same way a carry moves up when chunkCounter grows by chunks.
+void Blake3::pushSubtree(const uint8_t cv[32], uint64_t chunks)
+{
+    uint8_t node[32];
+    memcpy(node, cv, sizeof(node));
+
+    chunkCounter += chunks;
+    for (uint64_t total = chunkCounter / chunks; (total & 1) == 0; total >>= 1)
+    {
+        stackSize--;
+        parentCv(stack[stackSize], node, key, node);
+    }
+
+    memcpy(stack[stackSize], node, sizeof(node));
+    stackSize++;
+
+    memcpy(chunkCv, key, sizeof(chunkCv));
+    blocksCompressed = 0;
+    blockLength = 0;
+}
+
+void Blake3::update(const char *data, size_t size)
+{
+    const uint8_t *input = (const uint8_t *)data;
+
+    while (size > 0)
+    {
+        size_t chunkLength = blocksCompressed * BLAKE3_BLOCK_SIZE + blockLength;
+
+        // More input came, so the full chunk isn't the root.
+        if (chunkLength == BLAKE3_CHUNK_SIZE)
+        {
+            uint32_t cv[8];
+            uint8_t bytes[32];
+            compress(chunkCv, block, BLAKE3_BLOCK_SIZE, chunkCounter, BLAKE3_CHUNK_END, cv);
+            for (int i = 0; i < 8; i++)
+            {
+                store32(bytes + 4 * i, cv[i]);
+            }
+
+            pushSubtree(bytes, 1);
+            continue;
+        }
+
+        // Whole chunks go straight to the vector kernels. The last byte
+        // always goes through the chunk, which might be the root.
+        if (chunkLength == 0 && size > BLAKE3_CHUNK_SIZE)
+        {
+            uint64_t chunks = (size - 1) / BLAKE3_CHUNK_SIZE;
+            updateSubtrees(input, chunks);
+            input += chunks * BLAKE3_CHUNK_SIZE;
+            size -= chunks * BLAKE3_CHUNK_SIZE;
+            continue;
+        }
+
+        size_t length = std::min(BLAKE3_CHUNK_SIZE - chunkLength, size);
+        updateChunk(input, length);
+        input += length;
+        size -= length;
+    }
+}
+
+void Blake3::update(std::string data)
+{
+    update(data.data(), data.size());
+}
+
+std::string Blake3::digest()
+{
+    uint32_t cv[8];
+    uint8_t node[BLAKE3_BLOCK_SIZE] = {0};
+    memcpy(cv, chunkCv, sizeof(cv));
+    memcpy(node, block, blockLength);
+
+    uint32_t length = blockLength;
+    uint64_t counter = chunkCounter;
+    uint32_t flags = BLAKE3_CHUNK_END | (blocksCompressed == 0 ? BLAKE3_CHUNK_START : 0);
+
+    for (int i = stackSize - 1; i >= 0; i--)
+    {
+        uint32_t child[8];
+        compress(cv, node, length, counter, flags, child);
+
+        memcpy(node, stack[i], 32);
+        for (int j = 0; j < 8; j++)
+        {
+            store32(node + 32 + 4 * j, child[j]);
+        }
+
+        memcpy(cv, key, sizeof(cv));
+        length = BLAKE3_BLOCK_SIZE;
+        counter = 0;
+        flags = BLAKE3_PARENT;
+    }
+
+    uint32_t root[8];
+    compress(cv, node, length, counter, flags | BLAKE3_ROOT, root);
+
+    std::string result(BLAKE3_DIGEST_SIZE, '\0');
+    for (int i = 0; i < 8; i++)
+    {
+        store32((uint8_t *)&result[4 * i], root[i]);
+    }
+
+    return result;
+}
+
+std::string blake3(std::string data)
+{
+    Blake3 hash;
+    hash.update(data);
+    return hash.digest();
+}
+
+bool blake3Stream(std::istream &file, std::string *digest, uint64_t *size)
+{
+    Blake3 hash(blake3Threads());
+    std::unique_ptr<char[]> buffers[2] = {std::unique_ptr<char[]>(new char[BLAKE3_READ_SIZE]),
+                                          std::unique_ptr<char[]>(new char[BLAKE3_READ_SIZE])};
+
+    auto read = [&file](char *buffer) -> size_t
+    {
+        file.read(buffer, BLAKE3_READ_SIZE);
+        return file.gcount();
+    };
+
+    *size = 0;
+    size_t length = read(buffers[0].get());
+
+    for (int current = 0; length > 0; current ^= 1)
+    {
+        std::future<size_t> next;
+        if (file)
+        {
+            next = std::async(std::launch::async, read, buffers[current ^ 1].get());
+        }
+
+        hash.update(buffers[current].get(), length);
+        *size += length;
+        length = next.valid() ? next.get() : 0;
+    }
+
+    *digest = hash.digest();
+    return file.eof();
+}
+
+int blake3Threads()
+{
+    static const int threads = std::max(1u, std::thread::hardware_concurrency());
+    return threads;
+}
+
+std::string blake3Kernel()
+{
+    return std::to_string(chooseLanes()) + " lanes, " + std::to_string(blake3Threads()) + " threads";
+}
@@ -0,0 +1,60 @@
+#pragma once
+
+#include <string>
+#include <istream>
+#include <stdint.h>
+
+#define BLAKE3_DIGEST_SIZE 32
+#define BLAKE3_BLOCK_SIZE 64
+#define BLAKE3_CHUNK_SIZE 1024
+#define BLAKE3_MAX_DEPTH 54
+
+// Whole chunks are hashed in subtrees of up to BLAKE3_SUBTREE_SIZE bytes,
+// spread over threads once an update brings BLAKE3_PARALLEL_MIN_SIZE bytes.
+// Streams are read BLAKE3_READ_SIZE bytes at a time, the next part while
+// the last one is hashed.
+#define BLAKE3_SUBTREE_SIZE (1024 * 1024)
+#define BLAKE3_PARALLEL_MIN_SIZE (4 * 1024 * 1024)
+#define BLAKE3_READ_SIZE (32 * 1024 * 1024)
+
+// BLAKE3, a hash tree over 1KB chunks. Chunks are independent, so several
+// are hashed at once in the lanes of the widest vector unit the CPU has,
+// and whole subtrees on different threads.
+class Blake3
+{
+    uint32_t key[8];
+    int threads;
+
+    // The chunk being filled. Its last block is only compressed once more
+    // input arrives, because the final one is flagged differently.
+    uint32_t chunkCv[8];
+    uint64_t chunkCounter = 0;
+    uint8_t block[BLAKE3_BLOCK_SIZE];
+    size_t blockLength = 0;
+    int blocksCompressed = 0;
+
+    // Chaining values of complete subtrees, one per set bit of chunkCounter.
+    uint8_t stack[BLAKE3_MAX_DEPTH][32];
+    int stackSize = 0;
+
+    void updateChunk(const uint8_t *data, size_t size);
+    void updateSubtrees(const uint8_t *data, uint64_t chunks);
+    void pushSubtree(const uint8_t cv[32], uint64_t chunks);
+
+public:
+    Blake3(int threads = 1);
+
+    void update(const char *data, size_t size);
+    void update(std::string data);
+
+    // Raw 32 byte digest. Can be taken at any point.
+    std::string digest();
+};
+
+std::string blake3(std::string data);
+
+// Hashes everything left in file. False when it can't be read to its end.
+bool blake3Stream(std::istream &file, std::string *digest, uint64_t *size);
+
+int blake3Threads();
+std::string blake3Kernel();
@@ -0,0 +1,308 @@
+#include <new>
+#include <algorithm>
+#include <stdlib.h>
+
+#include "bufferPool.h"
+
+#if COUNT_HEAP_ALLOCATIONS
+static thread_local uint64_t heapAllocations = 0;
+
+void *operator new(size_t size)
+{
+    heapAllocations++;
+
+    void *memory = malloc(size == 0 ? 1 : size);
+    if (memory == nullptr)
+    {
+        throw std::bad_alloc();
+    }
+
+    return memory;
+}
+
+void operator delete(void *memory) noexcept
+{
+    free(memory);
+}
+
+void operator delete(void *memory, size_t) noexcept
+{
+    free(memory);
+}
+
+uint64_t threadHeapAllocations()
+{
+    return heapAllocations;
+}
+#else
+uint64_t threadHeapAllocations()
+{
+    return 0;
+}
+#endif
+
+PooledBuffer::PooledBuffer(PooledSlot *slot)
+{
+    this->slot = slot;
+}
+
+PooledBuffer::PooledBuffer(const PooledBuffer &other)
+{
+    slot = other.slot;
+    offset = other.offset;
+    length = other.length;
+
+    if (slot != nullptr)
+    {
+        slot->references.fetch_add(1, std::memory_order_relaxed);
+    }
+}
+
+PooledBuffer::PooledBuffer(PooledBuffer &&other)
+{
+    slot = other.slot;
+    offset = other.offset;
+    length = other.length;
+    other.slot = nullptr;
+    other.offset = 0;
+    other.length = 0;
+}
+
+PooledBuffer::~PooledBuffer()
+{
+    release();
+}
+
+PooledBuffer &PooledBuffer::operator=(const PooledBuffer &other)
+{
+    if (this != &other)
+    {
+        PooledBuffer copy(other);
+        *this = std::move(copy);
+    }
+
+    return *this;
+}
+
+PooledBuffer &PooledBuffer::operator=(PooledBuffer &&other)
+{
+    if (this != &other)
+    {
+        release();
+        slot = other.slot;
+        offset = other.offset;
+        length = other.length;
+        other.slot = nullptr;
+        other.offset = 0;
+        other.length = 0;
+    }
+
+    return *this;
+}
+
+void PooledBuffer::release()
+{
+    if (slot == nullptr)
+    {
+        return;
+    }
+
+    if (slot->references.fetch_sub(1, std::memory_order_acq_rel) == 1)
+    {
+        if (slot->pool != nullptr)
+        {
+            slot->pool->release(slot);
+        }
+        else
+        {
+            free(slot->data);
+            delete slot;
+        }
+    }
+
+    slot = nullptr;
+    offset = 0;
+    length = 0;
+}
+
+char *PooledBuffer::data() const
+{
+    return slot == nullptr ? nullptr : slot->data + offset;
+}
+
+size_t PooledBuffer::size() const
+{
+    return length;
+}
+
+bool PooledBuffer::empty() const
+{
+    return length == 0;
+}
+
+size_t PooledBuffer::capacity() const
+{
+    return slot == nullptr ? 0 : slot->capacity - offset;
+}
+
+void PooledBuffer::resize(size_t size)
+{
+    length = std::min(size, capacity());
+}
+
+PooledBuffer PooledBuffer::slice(size_t offset, size_t size) const
+{
+    PooledBuffer part(*this);
+    part.offset += std::min(offset, length);
+    part.length = std::min(size, length - std::min(offset, length));
+    return part;
+}
+
+std::string PooledBuffer::toString() const
+{
+    return length == 0 ? std::string() : std::string(data(), length);
+}
+
+// Lives at the end of the memory of its buffers.
+class PooledSlab
+{
+public:
+    PooledSlot slots[BUFFER_POOL_SLAB_BUFFERS];
+    PooledSlot *available = nullptr;
+    int free = 0;
+    PooledSlab *next = nullptr;
+};
+
+BufferPool::BufferPool(size_t bufferSize)
+{
+    this->bufferSize = bufferSize;
+}
+
+// Must be called with _mutex held. Later slabs are only used once the
+// earlier ones are taken, so those are the ones that empty again.
+PooledSlab *BufferPool::grow()
+{
+    void *memory = nullptr;
+    size_t buffersSize = bufferSize * BUFFER_POOL_SLAB_BUFFERS;
+    if (posix_memalign(&memory, BUFFER_POOL_ALIGNMENT, buffersSize + sizeof(PooledSlab)) != 0)
+    {
+        throw std::bad_alloc();
+    }
+
+    PooledSlab *slab = new ((char *)memory + buffersSize) PooledSlab();
+    for (int i = BUFFER_POOL_SLAB_BUFFERS - 1; i >= 0; i--)
+    {
+        PooledSlot *slot = &slab->slots[i];
+        slot->data = (char *)memory + i * bufferSize;
+        slot->capacity = bufferSize;
+        slot->pool = this;
+        slot->slab = slab;
+        slot->next = slab->available;
+        slab->available = slot;
+    }
+
+    slab->free = BUFFER_POOL_SLAB_BUFFERS;
+    idle += BUFFER_POOL_SLAB_BUFFERS;
+
+    PooledSlab **last = &slabs;
+    while (*last != nullptr)
+    {
+        last = &(*last)->next;
+    }
+    *last = slab;
+
+    metrics.slabs++;
+    metrics.buffers += BUFFER_POOL_SLAB_BUFFERS;
+    return slab;
+}
+
+PooledBuffer BufferPool::acquire()
+{
+    PooledSlot *slot;
+
+    {
+        std::lock_guard<std::mutex> lock(_mutex);
+
+        PooledSlab *slab = slabs;
+        while (slab != nullptr && slab->available == nullptr)
+        {
+            slab = slab->next;
+        }
+
+        if (slab == nullptr)
+        {
+            slab = grow();
+        }
+
+        slot = slab->available;
+        slab->available = slot->next;
+        slab->free--;
+        idle--;
+    }
+
+    slot->next = nullptr;
+    slot->references.store(1, std::memory_order_relaxed);
+    metrics.acquired++;
+    metrics.inUse++;
+    return PooledBuffer(slot);
+}
+
+PooledBuffer BufferPool::acquire(size_t size)
+{
+    if (size <= bufferSize)
+    {
+        return acquire();
+    }
+
+    void *memory = nullptr;
+    if (posix_memalign(&memory, BUFFER_POOL_ALIGNMENT, size) != 0)
+    {
+        throw std::bad_alloc();
+    }
+
+    PooledSlot *slot = new PooledSlot();
+    slot->data = (char *)memory;
+    slot->capacity = size;
+    slot->references.store(1, std::memory_order_relaxed);
+    metrics.oversized++;
+    return PooledBuffer(slot);
+}
+
+void BufferPool::release(PooledSlot *slot)
+{
+    metrics.inUse--;
+
+    std::lock_guard<std::mutex> lock(_mutex);
+
+    PooledSlab *slab = slot->slab;
+    slot->next = slab->available;
+    slab->available = slot;
+    slab->free++;
+    idle++;
+
+    if (slab->free < BUFFER_POOL_SLAB_BUFFERS || idle - BUFFER_POOL_SLAB_BUFFERS < BUFFER_POOL_IDLE_BUFFERS)
+    {
+        return;
+    }
+
+    PooledSlab **entry = &slabs;
+    while (*entry != slab)
+    {
+        entry = &(*entry)->next;
+    }
+    *entry = slab->next;
+
+    idle -= BUFFER_POOL_SLAB_BUFFERS;
+    metrics.slabs--;
+    metrics.buffers -= BUFFER_POOL_SLAB_BUFFERS;
+
+    void *memory = slab->slots[0].data;
+    slab->~PooledSlab();
+    free(memory);
+}
+
+BufferPool *bufferPool()
+{
+    static BufferPool pool;
+    return &pool;
+}
@@ -0,0 +1,117 @@
+#pragma once
+
+#include <mutex>
+#include <atomic>
+#include <string>
+#include <stddef.h>
+#include <stdint.h>
+
+// Transfer data moves in buffers of BUFFER_POOL_BUFFER_SIZE bytes, room for
+// the largest data message and what compressing or framing it adds. They
+// are carved BUFFER_POOL_SLAB_BUFFERS at a time out of slabs aligned to
+// BUFFER_POOL_ALIGNMENT, which the size is a multiple of, and are handed
+// out again rather than freed. A slab goes back to the system once all of
+// its buffers are free and at least BUFFER_POOL_IDLE_BUFFERS others are.
+#define BUFFER_POOL_BUFFER_SIZE (1024 * 1024 + 4096)
+#define BUFFER_POOL_SLAB_BUFFERS 8
+#define BUFFER_POOL_ALIGNMENT 4096
+#define BUFFER_POOL_IDLE_BUFFERS 32
+
+// Building with -DCOUNT_HEAP_ALLOCATIONS=1 replaces operator new with one
+// that counts allocations per thread, so transfers can tell how many they
+// made once they got going. Shipped builds keep the system allocator.
+#ifndef COUNT_HEAP_ALLOCATIONS
+#define COUNT_HEAP_ALLOCATIONS 0
+#endif
+
+class BufferPool;
+class PooledSlab;
+
+class PooledSlot
+{
+public:
+    char *data = nullptr;
+    size_t capacity = 0;
+    std::atomic<int> references{0};
+    // Buffers too large for the pool have neither and are freed instead.
+    BufferPool *pool = nullptr;
+    PooledSlab *slab = nullptr;
+    PooledSlot *next = nullptr;
+};
+
+// size bytes from offset in a buffer that copies share. The buffer goes
+// back to its pool once the last copy is gone, so it can be passed from
+// the stage that fills it to the one that sends or writes it as is.
+class PooledBuffer
+{
+    PooledSlot *slot = nullptr;
+    size_t offset = 0;
+    size_t length = 0;
+
+    void release();
+
+public:
+    PooledBuffer() {}
+    PooledBuffer(PooledSlot *slot);
+    PooledBuffer(const PooledBuffer &other);
+    PooledBuffer(PooledBuffer &&other);
+    ~PooledBuffer();
+
+    PooledBuffer &operator=(const PooledBuffer &other);
+    PooledBuffer &operator=(PooledBuffer &&other);
+
+    char *data() const;
+    size_t size() const;
+    bool empty() const;
+    // Bytes from offset to the end of the buffer.
+    size_t capacity() const;
+
+    // Only within capacity.
+    void resize(size_t size);
+    // Shares the buffer, without copying.
+    PooledBuffer slice(size_t offset, size_t size) const;
+    std::string toString() const;
+};
+
+class BufferPoolMetrics
+{
+public:
+    std::atomic<uint64_t> slabs{0};
+    std::atomic<uint64_t> buffers{0};
+    std::atomic<int64_t> inUse{0};
+    std::atomic<uint64_t> acquired{0};
+    std::atomic<uint64_t> oversized{0};
+
+    // Heap allocations transfer stages made past their warmup.
+    std::atomic<uint64_t> steadyAllocations{0};
+};
+
+// Slabs come from the system rather than operator new, so the pool growing
+// shows in its metrics and not in the heap allocations counted.
+class BufferPool
+{
+    std::mutex _mutex;
+    PooledSlab *slabs = nullptr;
+    size_t idle = 0;
+    size_t bufferSize;
+
+    PooledSlab *grow();
+
+public:
+    BufferPoolMetrics metrics;
+
+    BufferPool(size_t bufferSize = BUFFER_POOL_BUFFER_SIZE);
+
+    // An empty buffer of the pool's size, from a new slab when none is free.
+    PooledBuffer acquire();
+    // One that holds at least size bytes, of its own when that is more.
+    PooledBuffer acquire(size_t size);
+    void release(PooledSlot *slot);
+};
+
+// The pool sockets and transfers share.
+BufferPool *bufferPool();
+
+// Heap allocations the calling thread made so far, or 0 when they are not
+// counted.
+uint64_t threadHeapAllocations();
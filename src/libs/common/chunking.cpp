@@ -0,0 +1,270 @@
+#include <fstream>
+#include <string.h>
+#include <sys/stat.h>
+#include <arpa/inet.h>
+
+#include "chunking.h"
+#include "blake3.h"
+
+using namespace std;
+
+// Cut point masks look at the upper bits of the gear hash, which depend on
+// the last 64 bytes. Before the average size the stricter mask makes cuts
+// rarer, after it the looser one makes them likelier.
+#define CHUNK_MASK_STRICT (((1ull << 15) - 1) << 49)
+#define CHUNK_MASK_LOOSE (((1ull << 11) - 1) << 53)
+#define CHUNK_MANIFEST_ENTRY_SIZE (BLAKE3_DIGEST_SIZE + 4)
+
+static uint64_t GEAR_TABLE[256];
+
+static bool initializeGearTable()
+{
+    uint64_t seed = 0x9e3779b97f4a7c15ull;
+
+    for (int i = 0; i < 256; i++)
+    {
+        seed += 0x9e3779b97f4a7c15ull;
+        uint64_t value = seed;
+        value = (value ^ (value >> 30)) * 0xbf58476d1ce4e5b9ull;
+        value = (value ^ (value >> 27)) * 0x94d049bb133111ebull;
+        GEAR_TABLE[i] = value ^ (value >> 31);
+    }
+
+    return true;
+}
+
+static bool isGearTableInitialized = initializeGearTable();
+
+static size_t findCutPoint(const uint8_t *data, size_t size)
+{
+    if (size <= CHUNK_MIN_SIZE)
+    {
+        return size;
+    }
+
+    size_t normal = std::min((size_t)CHUNK_AVERAGE_SIZE, size);
+    size_t maximum = std::min((size_t)CHUNK_MAX_SIZE, size);
+    uint64_t hash = 0;
+    size_t i = CHUNK_MIN_SIZE;
+
+    for (; i < normal; i++)
+    {
+        hash = (hash << 1) + GEAR_TABLE[data[i]];
+        if (!(hash & CHUNK_MASK_STRICT))
+        {
+            return i + 1;
+        }
+    }
+
+    for (; i < maximum; i++)
+    {
+        hash = (hash << 1) + GEAR_TABLE[data[i]];
+        if (!(hash & CHUNK_MASK_LOOSE))
+        {
+            return i + 1;
+        }
+    }
+
+    return i;
+}
+
+std::vector<ChunkReference> chunkFile(std::string path)
+{
+    std::ifstream file(path, ios::in | ios::binary);
+    return chunkFile(file);
+}
+
+std::vector<ChunkReference> chunkFile(std::istream &file)
+{
+    std::vector<ChunkReference> chunks;
+
+    std::string buffer;
+    size_t position = 0;
+    uint64_t offset = 0;
+    bool isEndOfFile = false;
+
+    while (true)
+    {
+        while (!isEndOfFile && buffer.size() - position < CHUNK_MAX_SIZE)
+        {
+            buffer.erase(0, position);
+            position = 0;
+
+            size_t previousSize = buffer.size();
+            buffer.resize(previousSize + 4 * CHUNK_MAX_SIZE);
+            file.read(&buffer[previousSize], 4 * CHUNK_MAX_SIZE);
+            buffer.resize(previousSize + file.gcount());
+
+            if (file.gcount() == 0)
+            {
+                isEndOfFile = true;
+            }
+        }
+
+        size_t available = buffer.size() - position;
+        if (available == 0)
+        {
+            break;
+        }
+
+        size_t length = findCutPoint((const uint8_t *)buffer.data() + position, available);
+
+        Blake3 hash;
+        hash.update(buffer.data() + position, length);
+
+        ChunkReference chunk;
+        chunk.hash = hash.digest();
+        chunk.offset = offset;
+        chunk.length = length;
+        chunks.push_back(chunk);
+
+        position += length;
+        offset += length;
+    }
+
+    return chunks;
+}
+
+bool isChunkingWorthwhile(std::string path)
+{
+    struct stat attributes;
+    return stat(path.c_str(), &attributes) == 0 && attributes.st_size >= CHUNKING_MIN_FILE_SIZE;
+}
+
+static void appendUint32(std::string *data, uint32_t value)
+{
+    uint32_t encoded = htonl(value);
+    data->append((char *)&encoded, 4);
+}
+
+static uint32_t readUint32(const std::string &data, size_t offset)
+{
+    uint32_t encoded;
+    memcpy(&encoded, data.data() + offset, 4);
+    return ntohl(encoded);
+}
+
+std::string encodeChunkManifest(std::vector<ChunkReference> chunks, size_t first, size_t last)
+{
+    std::string data;
+
+    for (size_t i = first; i < last; i++)
+    {
+        data.append(chunks[i].hash);
+        appendUint32(&data, chunks[i].length);
+    }
+
+    return data;
+}
+
+bool decodeChunkManifest(std::string data, std::vector<ChunkReference> *chunks)
+{
+    if (data.size() % CHUNK_MANIFEST_ENTRY_SIZE != 0)
+    {
+        return false;
+    }
+
+    uint64_t offset = 0;
+    if (!chunks->empty())
+    {
+        offset = chunks->back().offset + chunks->back().length;
+    }
+
+    for (size_t position = 0; position < data.size(); position += CHUNK_MANIFEST_ENTRY_SIZE)
+    {
+        ChunkReference chunk;
+        chunk.hash = data.substr(position, BLAKE3_DIGEST_SIZE);
+        chunk.length = readUint32(data, position + BLAKE3_DIGEST_SIZE);
+        chunk.offset = offset;
+        chunks->push_back(chunk);
+
+        offset += chunk.length;
+    }
+
+    return true;
+}
+
+std::string encodeChunkIndexes(std::vector<uint32_t> indexes)
+{
+    std::string data;
+
+    for (uint32_t index : indexes)
+    {
+        appendUint32(&data, index);
+    }
+
+    return data;
+}
+
+std::vector<uint32_t> decodeChunkIndexes(std::string data)
+{
+    std::vector<uint32_t> indexes;
+
+    for (size_t position = 0; position + 4 <= data.size(); position += 4)
+    {
+        indexes.push_back(readUint32(data, position));
+    }
+
+    return indexes;
+}
+
+bool sendChunked(Session session, std::string path)
+{
+    std::vector<ChunkReference> chunks = chunkFile(path);
+
+    for (size_t first = 0; first < chunks.size(); first += CHUNK_MANIFEST_ENTRIES_PER_MESSAGE)
+    {
+        size_t last = std::min(first + CHUNK_MANIFEST_ENTRIES_PER_MESSAGE, chunks.size());
+        Message message = Message::DataMessage(encodeChunkManifest(chunks, first, last)).send(session.socket);
+
+        if (!message.isOk())
+        {
+            message.panic();
+            return false;
+        }
+    }
+
+    Message message = Message::EndCommand().send(session.socket);
+
+    if (!message.isOk())
+    {
+        message.panic();
+        return false;
+    }
+
+    std::vector<uint32_t> missing = decodeChunkIndexes(message.data);
+
+    message = message.Reply(Message::Start());
+
+    if (!message.isOk())
+    {
+        message.panic();
+        return false;
+    }
+
+    std::ifstream file(path, ios::in | ios::binary);
+    std::string chunk;
+
+    for (uint32_t index : missing)
+    {
+        if (index >= chunks.size())
+        {
+            return false;
+        }
+
+        chunk.resize(chunks[index].length);
+        file.seekg(chunks[index].offset);
+        file.read(&chunk[0], chunk.size());
+
+        message = message.Reply(Message::DataMessage(chunk));
+
+        if (!message.isOk())
+        {
+            message.panic();
+            return false;
+        }
+    }
+
+    message = message.Reply(Message::EndCommand());
+    return message.isOk();
+}
@@ -0,0 +1,40 @@
+#pragma once
+
+#include <string>
+#include <vector>
+#include <stdint.h>
+
+#include "message.h"
+#include "hash.h"
+
+// Gear based content defined chunking (FastCDC style normalized cut points),
+// so an insert only changes the chunks around it instead of every block after.
+#define CHUNK_MIN_SIZE (2 * 1024)
+#define CHUNK_AVERAGE_SIZE (8 * 1024)
+#define CHUNK_MAX_SIZE (64 * 1024)
+#define CHUNK_MANIFEST_ENTRIES_PER_MESSAGE 1024
+
+// New files below this size are sent inline or whole.
+#define CHUNKING_MIN_FILE_SIZE (64 * 1024)
+
+class ChunkReference
+{
+public:
+    std::string hash;
+    uint64_t offset;
+    uint32_t length;
+};
+
+std::vector<ChunkReference> chunkFile(std::string path);
+std::vector<ChunkReference> chunkFile(std::istream &file);
+bool isChunkingWorthwhile(std::string path);
+
+std::string encodeChunkManifest(std::vector<ChunkReference> chunks, size_t first, size_t last);
+bool decodeChunkManifest(std::string data, std::vector<ChunkReference> *chunks);
+
+std::string encodeChunkIndexes(std::vector<uint32_t> indexes);
+std::vector<uint32_t> decodeChunkIndexes(std::string data);
+
+// Announces the chunk hashes of path and then sends only the chunks the
+// receiver asked for, in manifest order.
+bool sendChunked(Session session, std::string path);
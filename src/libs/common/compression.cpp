@@ -0,0 +1,557 @@
+#include <vector>
+#include <chrono>
+#include <sstream>
+#include <algorithm>
+#include <string.h>
+
+#include "compression.h"
+
+static uint32_t read32(const char *data)
+{
+    uint32_t value;
+    memcpy(&value, data, 4);
+    return value;
+}
+
+static uint32_t hashOf(uint32_t sequence)
+{
+    return (sequence * 2654435761U) >> (32 - LZ_HASH_BITS);
+}
+
+static void appendLength(std::string *output, size_t length)
+{
+    while (length >= 255)
+    {
+        output->push_back((char)255);
+        length -= 255;
+    }
+
+    output->push_back((char)length);
+}
+
+static bool readLength(const uint8_t **input, const uint8_t *end, size_t *length)
+{
+    while (*input < end)
+    {
+        uint8_t byte = *(*input)++;
+        *length += byte;
+
+        if (byte != 255)
+        {
+            return true;
+        }
+    }
+
+    return false;
+}
+
+// One sequence: token, literal length overflow, literals, and unless it is
+// the last one, the offset and the match length overflow.
+static void appendSequence(std::string *output, const char *literals, size_t literalLength, size_t offset, size_t matchLength)
+{
+    bool isLast = matchLength == 0;
+    size_t matchCode = isLast ? 0 : matchLength - LZ_MIN_MATCH;
+
+    uint8_t token = (std::min(literalLength, (size_t)15) << 4) | std::min(matchCode, (size_t)15);
+    output->push_back((char)token);
+
+    if (literalLength >= 15)
+    {
+        appendLength(output, literalLength - 15);
+    }
+
+    output->append(literals, literalLength);
+
+    if (isLast)
+    {
+        return;
+    }
+
+    output->push_back((char)(offset & 0xff));
+    output->push_back((char)(offset >> 8));
+
+    if (matchCode >= 15)
+    {
+        appendLength(output, matchCode - 15);
+    }
+}
+
+// Compresses data[start, end). Matches may reach back to the start of data,
+// so earlier bytes act as history. table holds position + 1 of the last
+// occurrence of each hash.
+static void compressRange(const char *data, size_t start, size_t end, std::vector<uint32_t> &table, std::string *output)
+{
+    size_t anchor = start;
+    size_t position = start;
+
+    while (position + LZ_MIN_MATCH <= end)
+    {
+        uint32_t sequence = read32(data + position);
+        uint32_t hash = hashOf(sequence);
+        size_t candidate = table[hash];
+        table[hash] = position + 1;
+
+        if (candidate == 0 ||
+            position + 1 - candidate > 0xffff ||
+            read32(data + candidate - 1) != sequence)
+        {
+            // Skip faster through data that doesn't match.
+            position += 1 + ((position - anchor) >> 6);
+            continue;
+        }
+
+        candidate--;
+        size_t matchLength = LZ_MIN_MATCH;
+        while (position + matchLength < end && data[candidate + matchLength] == data[position + matchLength])
+        {
+            matchLength++;
+        }
+
+        appendSequence(output, data + anchor, position - anchor, position - candidate, matchLength);
+
+        position += matchLength;
+        anchor = position;
+    }
+
+    appendSequence(output, data + anchor, end - anchor, 0, 0);
+}
+
+// Appends the decoded bytes to output, whose current contents are the
+// history matches can reach back into. Fails past limit bytes in total.
+static bool expand(const char *data, size_t size, size_t limit, std::string *output)
+{
+    const uint8_t *input = (const uint8_t *)data;
+    const uint8_t *end = input + size;
+
+    while (input < end)
+    {
+        uint8_t token = *input++;
+
+        size_t literalLength = token >> 4;
+        if (literalLength == 15 && !readLength(&input, end, &literalLength))
+        {
+            return false;
+        }
+
+        if (literalLength > (size_t)(end - input) || output->size() + literalLength > limit)
+        {
+            return false;
+        }
+
+        output->append((const char *)input, literalLength);
+        input += literalLength;
+
+        if (input == end)
+        {
+            break;
+        }
+
+        if (end - input < 2)
+        {
+            return false;
+        }
+
+        size_t offset = input[0] | (input[1] << 8);
+        input += 2;
+
+        size_t matchLength = token & 0x0f;
+        if (matchLength == 15 && !readLength(&input, end, &matchLength))
+        {
+            return false;
+        }
+        matchLength += LZ_MIN_MATCH;
+
+        if (offset == 0 || offset > output->size() || output->size() + matchLength > limit)
+        {
+            return false;
+        }
+
+        // Byte by byte when the match overlaps the bytes it produces.
+        size_t from = output->size() - offset;
+        if (offset >= matchLength)
+        {
+            output->append(output->data() + from, matchLength);
+            continue;
+        }
+
+        for (size_t i = 0; i < matchLength; i++)
+        {
+            output->push_back((*output)[from + i]);
+        }
+    }
+
+    return true;
+}
+
+std::string lzCompress(const char *data, size_t size)
+{
+    std::string output;
+    output.reserve(size / 2 + 16);
+
+    std::vector<uint32_t> table(1 << LZ_HASH_BITS, 0);
+    compressRange(data, 0, size, table, &output);
+    return output;
+}
+
+bool lzDecompress(const char *data, size_t size, size_t originalSize, std::string *output)
+{
+    output->clear();
+    output->reserve(originalSize);
+
+    return expand(data, size, originalSize, output) && output->size() == originalSize;
+}
+
+LzEncoder::LzEncoder() : table(1 << LZ_HASH_BITS, 0)
+{
+}
+
+void LzEncoder::reserve(size_t size)
+{
+    window.reserve(2 * LZ_STREAM_WINDOW + size);
+    compressed.reserve(size + size / 255 + 16);
+}
+
+// Keeps at least the last LZ_STREAM_WINDOW bytes as history, trimming it
+// only once it doubles so the positions in the table are rarely shifted.
+size_t LzEncoder::encode(const char *data, size_t size, char *output)
+{
+    size_t start = window.size();
+    window.append(data, size);
+
+    compressed.clear();
+    compressRange(window.data(), start, window.size(), table, &compressed);
+
+    if (window.size() > 2 * LZ_STREAM_WINDOW)
+    {
+        size_t dropped = window.size() - LZ_STREAM_WINDOW;
+        window.erase(0, dropped);
+
+        for (auto &position : table)
+        {
+            position = position > dropped ? position - dropped : 0;
+        }
+    }
+
+    if (compressed.size() >= size)
+    {
+        output[0] = 'R';
+        memcpy(output + 1, data, size);
+        return size + 1;
+    }
+
+    output[0] = 'Z';
+    memcpy(output + 1, compressed.data(), compressed.size());
+    return compressed.size() + 1;
+}
+
+void LzDecoder::reserve(size_t size)
+{
+    window.reserve(2 * LZ_STREAM_WINDOW + size);
+}
+
+bool LzDecoder::decode(const char *payload, size_t size, char *data, size_t capacity, size_t *decoded)
+{
+    if (size == 0)
+    {
+        return false;
+    }
+
+    size_t start = window.size();
+    size_t limit = start + std::min<size_t>(capacity, LZ_STREAM_MAX_MESSAGE);
+
+    if (payload[0] == 'R')
+    {
+        if (size - 1 > limit - start)
+        {
+            return false;
+        }
+
+        window.append(payload + 1, size - 1);
+    }
+    else if (payload[0] != 'Z' || !expand(payload + 1, size - 1, limit, &window))
+    {
+        return false;
+    }
+
+    *decoded = window.size() - start;
+    memcpy(data, window.data() + start, *decoded);
+
+    if (window.size() > 2 * LZ_STREAM_WINDOW)
+    {
+        window.erase(0, window.size() - LZ_STREAM_WINDOW);
+    }
+
+    return true;
+}
+
+static bool startsWith(std::string data, std::string prefix)
+{
+    return data.compare(0, prefix.size(), prefix) == 0;
+}
+
+// Formats that are compressed already, and a trial run on the sample for
+// everything else.
+bool isWorthCompressing(std::string sample)
+{
+    std::vector<std::string> compressedFormats = {
+        std::string("\x1f\x8b", 2),              // gzip
+        std::string("PK\x03\x04", 4),            // zip, docx, jar
+        std::string("\x89PNG", 4),
+        std::string("\xff\xd8\xff", 3),          // jpeg
+        std::string("GIF8", 4),
+        std::string("\x28\xb5\x2f\xfd", 4),      // zstd
+        std::string("\xfd" "7zXZ", 5),             // xz
+        std::string("BZh", 3),
+        std::string("7z\xbc\xaf", 4),
+        std::string("Rar!", 4),
+        std::string("%PDF", 4),
+        std::string(LZ_ARCHIVE_MAGIC, LZ_ARCHIVE_MAGIC_SIZE),
+    };
+
+    for (auto const &magic : compressedFormats)
+    {
+        if (startsWith(sample, magic))
+        {
+            return false;
+        }
+    }
+
+    if (sample.size() >= 8 && sample.compare(4, 4, "ftyp") == 0)
+    {
+        return false; // mp4, mov, heic
+    }
+
+    std::string compressed = lzCompress(sample.data(), sample.size());
+    return compressed.size() < sample.size() * (1 - WIRE_COMPRESSION_MIN_SAVINGS);
+}
+
+bool isArchive(std::string data)
+{
+    return data.compare(0, LZ_ARCHIVE_MAGIC_SIZE, LZ_ARCHIVE_MAGIC, LZ_ARCHIVE_MAGIC_SIZE) == 0;
+}
+
+bool isArchive(std::istream &file)
+{
+    std::string magic(LZ_ARCHIVE_MAGIC_SIZE, '\0');
+    file.read(&magic[0], LZ_ARCHIVE_MAGIC_SIZE);
+    magic.resize(file.gcount());
+
+    file.clear();
+    file.seekg(0);
+
+    return isArchive(magic);
+}
+
+uint64_t archiveStream(std::istream &file, std::ostream &archive)
+{
+    uint64_t originalSize = 0;
+    uint64_t archiveSize = LZ_ARCHIVE_HEADER_SIZE;
+
+    archive.write(LZ_ARCHIVE_MAGIC, LZ_ARCHIVE_MAGIC_SIZE);
+    archive.write((const char *)&originalSize, 8);
+
+    std::string block(LZ_BLOCK_SIZE, '\0');
+
+    while (file)
+    {
+        file.read(&block[0], LZ_BLOCK_SIZE);
+        uint32_t length = file.gcount();
+
+        if (length == 0)
+        {
+            break;
+        }
+
+        std::string compressed = lzCompress(block.data(), length);
+        bool isCompressed = compressed.size() < length;
+        uint32_t storedLength = isCompressed ? compressed.size() : length;
+
+        archive.write((const char *)&length, 4);
+        archive.write((const char *)&storedLength, 4);
+        archive.write(isCompressed ? compressed.data() : block.data(), storedLength);
+
+        originalSize += length;
+        archiveSize += LZ_BLOCK_HEADER_SIZE + storedLength;
+    }
+
+    archive.seekp(LZ_ARCHIVE_MAGIC_SIZE);
+    archive.write((const char *)&originalSize, 8);
+    archive.seekp(0, std::ios::end);
+
+    return archive ? archiveSize : 0;
+}
+
+std::string archiveData(std::string data)
+{
+    std::istringstream file(data);
+    std::ostringstream archive;
+    archiveStream(file, archive);
+    return archive.str();
+}
+
+class ArchiveReader : public std::streambuf
+{
+    std::unique_ptr<std::istream> source;
+    uint64_t originalSize = 0;
+    uint64_t blockStart = 0;
+    uint64_t nextBlockStart = 0;
+    std::string block;
+
+    bool readBlockHeader(uint32_t *length, uint32_t *storedLength)
+    {
+        char header[LZ_BLOCK_HEADER_SIZE];
+        source->read(header, LZ_BLOCK_HEADER_SIZE);
+
+        if (source->gcount() != LZ_BLOCK_HEADER_SIZE)
+        {
+            return false;
+        }
+
+        memcpy(length, header, 4);
+        memcpy(storedLength, header + 4, 4);
+        return true;
+    }
+
+    bool readBlock(uint32_t length, uint32_t storedLength)
+    {
+        std::string stored(storedLength, '\0');
+        source->read(&stored[0], storedLength);
+
+        if (source->gcount() != storedLength)
+        {
+            return false;
+        }
+
+        if (storedLength == length)
+        {
+            block = stored;
+            return true;
+        }
+
+        auto start = std::chrono::steady_clock::now();
+        bool isDecompressed = lzDecompress(stored.data(), stored.size(), length, &block);
+        auto elapsed = std::chrono::steady_clock::now() - start;
+
+        compressionMetrics()->decompressedBlocks++;
+        compressionMetrics()->decompressionMicroseconds += std::chrono::duration_cast<std::chrono::microseconds>(elapsed).count();
+
+        return isDecompressed;
+    }
+
+protected:
+    int_type underflow() override
+    {
+        if (gptr() < egptr())
+        {
+            return traits_type::to_int_type(*gptr());
+        }
+
+        uint32_t length, storedLength;
+        if (!readBlockHeader(&length, &storedLength) || !readBlock(length, storedLength))
+        {
+            return traits_type::eof();
+        }
+
+        blockStart = nextBlockStart;
+        nextBlockStart += length;
+        setg(&block[0], &block[0], &block[0] + block.size());
+        return traits_type::to_int_type(*gptr());
+    }
+
+    pos_type seekpos(pos_type position, std::ios_base::openmode) override
+    {
+        uint64_t target = position;
+        if (target > originalSize)
+        {
+            return pos_type(off_type(-1));
+        }
+
+        source->clear();
+        source->seekg(LZ_ARCHIVE_HEADER_SIZE);
+        block.clear();
+        setg(nullptr, nullptr, nullptr);
+        blockStart = 0;
+        nextBlockStart = 0;
+
+        uint32_t length, storedLength;
+        while (nextBlockStart < target && readBlockHeader(&length, &storedLength))
+        {
+            if (nextBlockStart + length <= target)
+            {
+                source->seekg(storedLength, std::ios::cur);
+                nextBlockStart += length;
+                continue;
+            }
+
+            if (!readBlock(length, storedLength))
+            {
+                return pos_type(off_type(-1));
+            }
+
+            blockStart = nextBlockStart;
+            nextBlockStart += length;
+            setg(&block[0], &block[0] + (target - blockStart), &block[0] + block.size());
+            return position;
+        }
+
+        return nextBlockStart == target ? position : pos_type(off_type(-1));
+    }
+
+    pos_type seekoff(off_type offset, std::ios_base::seekdir direction, std::ios_base::openmode which) override
+    {
+        uint64_t current = blockStart + (gptr() - eback());
+
+        if (direction == std::ios::cur)
+        {
+            if (offset == 0)
+            {
+                return pos_type(current);
+            }
+
+            return seekpos(pos_type(current + offset), which);
+        }
+
+        if (direction == std::ios::end)
+        {
+            return seekpos(pos_type(originalSize + offset), which);
+        }
+
+        return seekpos(pos_type(offset), which);
+    }
+
+public:
+    ArchiveReader(std::unique_ptr<std::istream> archive)
+    {
+        source = std::move(archive);
+
+        char header[LZ_ARCHIVE_HEADER_SIZE];
+        source->read(header, LZ_ARCHIVE_HEADER_SIZE);
+
+        if (source->gcount() == LZ_ARCHIVE_HEADER_SIZE)
+        {
+            memcpy(&originalSize, header + LZ_ARCHIVE_MAGIC_SIZE, 8);
+        }
+    }
+};
+
+class ArchiveStream : public std::istream
+{
+    ArchiveReader reader;
+
+public:
+    ArchiveStream(std::unique_ptr<std::istream> archive) : std::istream(nullptr), reader(std::move(archive))
+    {
+        rdbuf(&reader);
+    }
+};
+
+std::unique_ptr<std::istream> openArchive(std::unique_ptr<std::istream> archive)
+{
+    return std::unique_ptr<std::istream>(new ArchiveStream(std::move(archive)));
+}
+
+CompressionMetrics *compressionMetrics()
+{
+    static CompressionMetrics *metrics = new CompressionMetrics();
+    return metrics;
+}
@@ -0,0 +1,94 @@
+#pragma once
+
+#include <string>
+#include <memory>
+#include <istream>
+#include <atomic>
+#include <vector>
+#include <stdint.h>
+
+// LZ77 with LZ4 style sequences: a token with the literal and match
+// lengths, the literals, then a 16 bit offset back into the block. Blocks
+// are compressed independently so a reader can seek by skipping blocks.
+#define LZ_BLOCK_SIZE (64 * 1024)
+#define LZ_MIN_MATCH 4
+#define LZ_HASH_BITS 14
+
+// Archives are "\x89LZA\r\n\x1a\n", the u64 original size, then blocks of
+// [u32 original length][u32 stored length] and the stored bytes, which are
+// the original bytes themselves when compressing didn't pay off.
+#define LZ_ARCHIVE_MAGIC "\x89LZA\r\n\x1a\n"
+#define LZ_ARCHIVE_MAGIC_SIZE 8
+#define LZ_ARCHIVE_HEADER_SIZE 16
+#define LZ_BLOCK_HEADER_SIZE 8
+
+std::string lzCompress(const char *data, size_t size);
+bool lzDecompress(const char *data, size_t size, size_t originalSize, std::string *output);
+
+// Streams compress every message against the messages before it, so even
+// small messages find matches. Each message is "Z" and the compressed
+// bytes, or "R" and the bytes themselves when compressing didn't pay off.
+#define LZ_STREAM_WINDOW (64 * 1024)
+#define LZ_STREAM_MAX_MESSAGE (16 * 1024 * 1024)
+
+// A message for size bytes takes at most LZ_STREAM_MESSAGE_BOUND(size).
+#define LZ_STREAM_MESSAGE_BOUND(size) ((size) + 1)
+
+class LzEncoder
+{
+    std::string window;
+    std::string compressed;
+    std::vector<uint32_t> table;
+
+public:
+    LzEncoder();
+
+    // Makes room for messages of up to size bytes, so encoding them doesn't
+    // allocate.
+    void reserve(size_t size);
+    // Writes the message to output and returns its size.
+    size_t encode(const char *data, size_t size, char *output);
+};
+
+class LzDecoder
+{
+    std::string window;
+
+public:
+    void reserve(size_t size);
+    // Fails when the message is invalid or takes more than capacity bytes.
+    bool decode(const char *payload, size_t size, char *data, size_t capacity, size_t *decoded);
+};
+
+// Transfers announce the codec in Start and use it once the receiver
+// echoes it back. Content that doesn't shrink by WIRE_COMPRESSION_MIN_SAVINGS
+// in a sample of its start is sent as is.
+#define WIRE_COMPRESSION_CODEC "lz"
+#define WIRE_COMPRESSION_SAMPLE_SIZE (64 * 1024)
+#define WIRE_COMPRESSION_MIN_SAVINGS 0.1
+
+bool isWorthCompressing(std::string sample);
+
+bool isArchive(std::istream &file);
+bool isArchive(std::string data);
+
+// Returns the archive size, or 0 when file couldn't be read or written.
+uint64_t archiveStream(std::istream &file, std::ostream &archive);
+std::string archiveData(std::string data);
+
+// Reads an archive as the original bytes, decompressing a block at a time.
+// Seeking skips whole blocks without decompressing them.
+std::unique_ptr<std::istream> openArchive(std::unique_ptr<std::istream> archive);
+
+class CompressionMetrics
+{
+public:
+    std::atomic<uint64_t> archivedFiles{0};
+    std::atomic<uint64_t> originalBytes{0};
+    std::atomic<uint64_t> archivedBytes{0};
+
+    std::atomic<uint64_t> decompressedBlocks{0};
+    std::atomic<uint64_t> decompressionMicroseconds{0};
+};
+
+CompressionMetrics *compressionMetrics();
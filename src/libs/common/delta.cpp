@@ -0,0 +1,574 @@
+#include <fstream>
+#include <unordered_map>
+#include <string.h>
+#include <arpa/inet.h>
+#include <sys/stat.h>
+
+#include "delta.h"
+#include "blake3.h"
+
+using namespace std;
+
+#define DELTA_READ_CHUNK_SIZE (1024 * 1024)
+
+static void appendUint32(std::string *data, uint32_t value)
+{
+    uint32_t encoded = htonl(value);
+    data->append((char *)&encoded, 4);
+}
+
+static uint32_t readUint32(const std::string &data, size_t offset)
+{
+    uint32_t encoded;
+    memcpy(&encoded, data.data() + offset, 4);
+    return ntohl(encoded);
+}
+
+static std::string strongHash(const char *data, size_t size)
+{
+    Blake3 hash;
+    hash.update(data, size);
+    return hash.digest().substr(0, DELTA_STRONG_HASH_SIZE);
+}
+
+DeltaInstruction DeltaInstruction::Literal(std::string literal)
+{
+    DeltaInstruction instruction;
+    instruction.isBlockReference = false;
+    instruction.literal = literal;
+    return instruction;
+}
+
+DeltaInstruction DeltaInstruction::Blocks(uint32_t firstBlock, uint32_t blockCount)
+{
+    DeltaInstruction instruction;
+    instruction.isBlockReference = true;
+    instruction.firstBlock = firstBlock;
+    instruction.blockCount = blockCount;
+    return instruction;
+}
+
+std::string DeltaInstruction::encode()
+{
+    if (!isBlockReference)
+    {
+        return "L" + literal;
+    }
+
+    std::string data = "B";
+    appendUint32(&data, firstBlock);
+    appendUint32(&data, blockCount);
+    return data;
+}
+
+bool DeltaInstruction::Decode(std::string data, DeltaInstruction *instruction)
+{
+    if (data.length() >= 1 && data[0] == 'L')
+    {
+        *instruction = DeltaInstruction::Literal(data.substr(1));
+        return true;
+    }
+
+    if (data.length() == 9 && data[0] == 'B')
+    {
+        *instruction = DeltaInstruction::Blocks(readUint32(data, 1), readUint32(data, 5));
+        return true;
+    }
+
+    return false;
+}
+
+bool isDeltaWorthwhile(std::string path)
+{
+    struct stat attributes;
+    return stat(path.c_str(), &attributes) == 0 && attributes.st_size >= DELTA_MIN_FILE_SIZE;
+}
+
+Signatures computeSignatures(std::string path, uint32_t blockSize)
+{
+    std::ifstream file(path, ios::in | ios::binary);
+    return computeSignatures(file, blockSize);
+}
+
+Signatures computeSignatures(std::istream &file, uint32_t blockSize)
+{
+    Signatures signatures;
+    signatures.blockSize = blockSize;
+
+    std::string block(blockSize, '\0');
+
+    while (file)
+    {
+        file.read(&block[0], blockSize);
+        size_t length = file.gcount();
+
+        if (length == 0)
+        {
+            break;
+        }
+
+        RollingChecksum checksum;
+        checksum.reset(block.data(), length);
+
+        BlockSignature signature;
+        signature.weak = checksum.value();
+        signature.strong = strongHash(block.data(), length);
+        signature.length = length;
+        signatures.blocks.push_back(signature);
+    }
+
+    return signatures;
+}
+
+bool computeDelta(std::string path, Signatures signatures, std::function<bool(DeltaInstruction)> emit)
+{
+    std::ifstream file(path, ios::in | ios::binary);
+    return computeDelta(file, signatures, emit);
+}
+
+bool computeDelta(std::istream &file, Signatures signatures, std::function<bool(DeltaInstruction)> emit)
+{
+    if (!file)
+    {
+        return false;
+    }
+
+    uint32_t blockSize = signatures.blockSize;
+
+    std::unordered_map<uint32_t, std::vector<uint32_t>> blocksByWeakChecksum;
+    for (uint32_t i = 0; i < signatures.blocks.size(); i++)
+    {
+        if (signatures.blocks[i].length == blockSize)
+        {
+            blocksByWeakChecksum[signatures.blocks[i].weak].push_back(i);
+        }
+    }
+
+    std::string buffer;
+    size_t position = 0;
+    bool isEndOfFile = false;
+
+    auto fill = [&](size_t needed)
+    {
+        while (!isEndOfFile && buffer.size() - position < needed)
+        {
+            if (position > DELTA_READ_CHUNK_SIZE)
+            {
+                buffer.erase(0, position);
+                position = 0;
+            }
+
+            size_t previousSize = buffer.size();
+            buffer.resize(previousSize + DELTA_READ_CHUNK_SIZE);
+            file.read(&buffer[previousSize], DELTA_READ_CHUNK_SIZE);
+            buffer.resize(previousSize + file.gcount());
+
+            if (file.gcount() == 0)
+            {
+                isEndOfFile = true;
+            }
+        }
+    };
+
+    std::string literal;
+    uint32_t runFirstBlock = 0;
+    uint32_t runBlockCount = 0;
+
+    auto flushLiteral = [&]
+    {
+        if (literal.empty())
+        {
+            return true;
+        }
+
+        bool result = emit(DeltaInstruction::Literal(literal));
+        literal.clear();
+        return result;
+    };
+
+    auto flushBlocks = [&]
+    {
+        if (runBlockCount == 0)
+        {
+            return true;
+        }
+
+        bool result = emit(DeltaInstruction::Blocks(runFirstBlock, runBlockCount));
+        runBlockCount = 0;
+        return result;
+    };
+
+    auto addBlock = [&](uint32_t index)
+    {
+        if (!flushLiteral())
+        {
+            return false;
+        }
+
+        if (runBlockCount > 0 && runFirstBlock + runBlockCount == index)
+        {
+            runBlockCount++;
+            return true;
+        }
+
+        if (!flushBlocks())
+        {
+            return false;
+        }
+
+        runFirstBlock = index;
+        runBlockCount = 1;
+        return true;
+    };
+
+    RollingChecksum checksum;
+    bool hasChecksum = false;
+
+    while (true)
+    {
+        fill(blockSize + 1);
+        size_t available = buffer.size() - position;
+
+        if (available < blockSize || blockSize == 0)
+        {
+            break;
+        }
+
+        if (!hasChecksum)
+        {
+            checksum.reset(buffer.data() + position, blockSize);
+            hasChecksum = true;
+        }
+
+        int matchedBlock = -1;
+        auto candidates = blocksByWeakChecksum.find(checksum.value());
+
+        if (candidates != blocksByWeakChecksum.end())
+        {
+            std::string strong = strongHash(buffer.data() + position, blockSize);
+
+            for (uint32_t index : candidates->second)
+            {
+                if (signatures.blocks[index].strong == strong)
+                {
+                    matchedBlock = index;
+                    break;
+                }
+            }
+        }
+
+        if (matchedBlock >= 0)
+        {
+            if (!addBlock(matchedBlock))
+            {
+                return false;
+            }
+
+            position += blockSize;
+            hasChecksum = false;
+            continue;
+        }
+
+        if (!flushBlocks())
+        {
+            return false;
+        }
+
+        literal.push_back(buffer[position]);
+        if (literal.size() >= DELTA_LITERAL_CHUNK_SIZE && !flushLiteral())
+        {
+            return false;
+        }
+
+        if (available > blockSize)
+        {
+            checksum.roll(buffer[position], buffer[position + blockSize]);
+        }
+        else
+        {
+            hasChecksum = false;
+        }
+
+        position++;
+    }
+
+    std::string rest = buffer.substr(position);
+    bool isTailMatched = false;
+
+    if (!rest.empty() && !signatures.blocks.empty())
+    {
+        uint32_t tailIndex = signatures.blocks.size() - 1;
+        BlockSignature tail = signatures.blocks[tailIndex];
+
+        if (tail.length == rest.size())
+        {
+            RollingChecksum restChecksum;
+            restChecksum.reset(rest.data(), rest.size());
+
+            isTailMatched = restChecksum.value() == tail.weak &&
+                            strongHash(rest.data(), rest.size()) == tail.strong;
+        }
+
+        if (isTailMatched && !addBlock(tailIndex))
+        {
+            return false;
+        }
+    }
+
+    if (!isTailMatched)
+    {
+        if (!flushBlocks())
+        {
+            return false;
+        }
+
+        literal.append(rest);
+    }
+
+    return flushLiteral() && flushBlocks();
+}
+
+bool sendSignatures(Session session, std::string basePath)
+{
+    std::ifstream base(basePath, ios::in | ios::binary);
+    return sendSignatures(session, base);
+}
+
+bool sendSignatures(Session session, std::istream &base)
+{
+    Signatures signatures = computeSignatures(base);
+
+    for (size_t first = 0; first < signatures.blocks.size(); first += DELTA_SIGNATURES_PER_MESSAGE)
+    {
+        std::string data;
+        appendUint32(&data, signatures.blockSize);
+
+        size_t last = std::min(first + DELTA_SIGNATURES_PER_MESSAGE, signatures.blocks.size());
+        for (size_t i = first; i < last; i++)
+        {
+            appendUint32(&data, signatures.blocks[i].weak);
+            appendUint32(&data, signatures.blocks[i].length);
+            data.append(signatures.blocks[i].strong);
+        }
+
+        Message message = Message::DataMessage(data).send(session.socket);
+
+        if (!message.isOk())
+        {
+            message.panic();
+            return false;
+        }
+    }
+
+    Message::EndCommand().send(session.socket, false);
+    return true;
+}
+
+bool receiveSignatures(Session session, Signatures *signatures)
+{
+    size_t entrySize = 8 + DELTA_STRONG_HASH_SIZE;
+    Message message = Message::Listen(session.socket);
+
+    while (true)
+    {
+        if (message.type == MessageType::EndCommand)
+        {
+            return true;
+        }
+
+        if (message.type != MessageType::DataMessage ||
+            message.data.size() < 4 ||
+            (message.data.size() - 4) % entrySize != 0)
+        {
+            message.panic();
+            return false;
+        }
+
+        signatures->blockSize = readUint32(message.data, 0);
+
+        for (size_t offset = 4; offset < message.data.size(); offset += entrySize)
+        {
+            BlockSignature signature;
+            signature.weak = readUint32(message.data, offset);
+            signature.length = readUint32(message.data, offset + 4);
+            signature.strong = message.data.substr(offset + 8, DELTA_STRONG_HASH_SIZE);
+            signatures->blocks.push_back(signature);
+        }
+
+        message = message.Reply(Message::Response(ResponseType::Ok));
+    }
+}
+
+bool sendDelta(Session session, std::string path, Signatures signatures)
+{
+    std::ifstream file(path, ios::in | ios::binary);
+    return sendDelta(session, file, signatures);
+}
+
+bool sendDelta(Session session, std::istream &file, Signatures signatures)
+{
+    // The receiver checks what it rebuilt against this.
+    uint32_t checksum = 0;
+    std::streampos start = file.tellg();
+    std::string buffer(DELTA_LITERAL_CHUNK_SIZE, '\0');
+    while (file.read(&buffer[0], buffer.size()) || file.gcount() > 0)
+    {
+        checksum = crc32c(buffer.data(), file.gcount(), checksum);
+    }
+    file.clear();
+    file.seekg(start);
+
+    Message message = Message::Start().send(session.socket);
+
+    if (!message.isOk())
+    {
+        message.panic();
+        return false;
+    }
+
+    bool isDeltaSent = computeDelta(
+        file,
+        signatures,
+        [&message](DeltaInstruction instruction)
+        {
+            message = message.Reply(Message::DataMessage(instruction.encode()));
+
+            if (!message.isOk())
+            {
+                message.panic();
+                return false;
+            }
+
+            return true;
+        });
+
+    if (!isDeltaSent)
+    {
+        return false;
+    }
+
+    message = message.Reply(Message::EndCommand(checksum));
+    return message.isOk();
+}
+
+bool receiveDelta(Session session, std::string basePath, std::string path)
+{
+    std::ifstream base(basePath, ios::in | ios::binary);
+    return receiveDelta(session, base, path);
+}
+
+// Copies blocks of base into file, which must all be there in full, but
+// for the last block of base.
+static bool copyBlocks(std::istream &base, uint64_t baseSize, DeltaInstruction instruction, std::fstream &file, uint32_t *checksum)
+{
+    uint64_t baseBlocks = (baseSize + DELTA_BLOCK_SIZE - 1) / DELTA_BLOCK_SIZE;
+    if ((uint64_t)instruction.firstBlock + instruction.blockCount > baseBlocks)
+    {
+        return false;
+    }
+
+    std::string block(DELTA_BLOCK_SIZE, '\0');
+    uint64_t offset = (uint64_t)instruction.firstBlock * DELTA_BLOCK_SIZE;
+
+    base.clear();
+    base.seekg((std::streamoff)offset);
+
+    for (uint32_t i = 0; i < instruction.blockCount; i++)
+    {
+        size_t size = std::min<uint64_t>(DELTA_BLOCK_SIZE, baseSize - offset);
+        base.read(&block[0], size);
+
+        if ((size_t)base.gcount() != size || !file.write(block.data(), size))
+        {
+            return false;
+        }
+
+        *checksum = crc32c(block.data(), size, *checksum);
+        offset += size;
+    }
+
+    return true;
+}
+
+// What was rebuilt must match the CRC32C of the sender's file, sent with
+// EndCommand, as blocks are matched by hashes that can collide.
+bool receiveDelta(Session session, std::istream &base, std::string path)
+{
+    std::fstream file;
+    file.open(path, ios::out | ios::binary);
+
+    base.clear();
+    base.seekg(0, std::ios::end);
+    std::streamoff baseSize = std::max<std::streamoff>(0, base.tellg());
+
+    Message message = Message::Listen(session.socket);
+
+    if (message.type != MessageType::Start)
+    {
+        message.panic();
+        file.close();
+        return false;
+    }
+
+    message = message.Reply(Message::Response(ResponseType::Ok));
+    uint32_t checksum = 0;
+
+    while (true)
+    {
+        DeltaInstruction instruction;
+
+        if (message.type == MessageType::DataMessage && DeltaInstruction::Decode(message.data, &instruction))
+        {
+            bool isWritten;
+            if (!instruction.isBlockReference)
+            {
+                isWritten = (bool)file.write(instruction.literal.data(), instruction.literal.size());
+                checksum = crc32c(instruction.literal, checksum);
+            }
+            else
+            {
+                isWritten = copyBlocks(base, baseSize, instruction, file, &checksum);
+            }
+
+            if (!isWritten)
+            {
+                std::cout << Color::red << "Failed to apply delta instruction" << Color::reset << std::endl;
+                message.Reply(Message::Response(ResponseType::Invalid), false);
+                file.close();
+                return false;
+            }
+
+            message = message.Reply(Message::Response(ResponseType::Ok));
+            continue;
+        }
+
+        if (message.type == MessageType::EndCommand)
+        {
+            file.close();
+
+            if (!file || !message.hasChecksum || message.checksum != checksum)
+            {
+                std::cout << Color::red << "Delta doesn't rebuild the sent file" << Color::reset << std::endl;
+                message.Reply(Message::Response(ResponseType::Invalid), false);
+                return false;
+            }
+
+            message.Reply(Message::Response(ResponseType::Ok), false);
+            return true;
+        }
+
+        message.panic();
+        file.close();
+        return false;
+    }
+}
+
+bool downloadDelta(Session session, std::string basePath, std::string temporaryPath, std::string finalPath)
+{
+    if (!receiveDelta(session, basePath, temporaryPath))
+    {
+        return false;
+    }
+
+    return rename(temporaryPath.c_str(), finalPath.c_str()) == 0;
+}
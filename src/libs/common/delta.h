@@ -0,0 +1,66 @@
+#pragma once
+
+#include <string>
+#include <vector>
+#include <functional>
+#include <stdint.h>
+
+#include "message.h"
+#include "hash.h"
+
+// Files smaller than this are cheaper to resend than to diff.
+#define DELTA_MIN_FILE_SIZE (128 * 1024)
+#define DELTA_BLOCK_SIZE 4096
+#define DELTA_STRONG_HASH_SIZE 16
+#define DELTA_SIGNATURES_PER_MESSAGE 2048
+#define DELTA_LITERAL_CHUNK_SIZE (32 * 1024)
+
+class BlockSignature
+{
+public:
+    uint32_t weak;
+    std::string strong;
+    uint32_t length;
+};
+
+class Signatures
+{
+public:
+    uint32_t blockSize = DELTA_BLOCK_SIZE;
+    std::vector<BlockSignature> blocks;
+};
+
+// Either a run of bytes the receiver doesn't have, or a run of blocks of the
+// receiver's current copy.
+class DeltaInstruction
+{
+public:
+    bool isBlockReference;
+    std::string literal;
+    uint32_t firstBlock;
+    uint32_t blockCount;
+
+    static DeltaInstruction Literal(std::string literal);
+    static DeltaInstruction Blocks(uint32_t firstBlock, uint32_t blockCount);
+
+    std::string encode();
+    static bool Decode(std::string data, DeltaInstruction *instruction);
+};
+
+bool isDeltaWorthwhile(std::string path);
+
+Signatures computeSignatures(std::string path, uint32_t blockSize = DELTA_BLOCK_SIZE);
+Signatures computeSignatures(std::istream &file, uint32_t blockSize = DELTA_BLOCK_SIZE);
+bool computeDelta(std::string path, Signatures signatures, std::function<bool(DeltaInstruction)> emit);
+bool computeDelta(std::istream &file, Signatures signatures, std::function<bool(DeltaInstruction)> emit);
+
+// Receiver side sends the signatures of its copy, sender side streams the
+// delta, mirroring the Start/DataMessage/EndCommand shape of sendFile.
+bool sendSignatures(Session session, std::string basePath);
+bool sendSignatures(Session session, std::istream &base);
+bool receiveSignatures(Session session, Signatures *signatures);
+bool sendDelta(Session session, std::string path, Signatures signatures);
+bool sendDelta(Session session, std::istream &file, Signatures signatures);
+bool receiveDelta(Session session, std::string basePath, std::string path);
+bool receiveDelta(Session session, std::istream &base, std::string path);
+bool downloadDelta(Session session, std::string basePath, std::string temporaryPath, std::string finalPath);
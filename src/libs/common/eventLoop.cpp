@@ -0,0 +1,239 @@
+#include <errno.h>
+#include <unistd.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+
+#include "eventLoop.h"
+
+EventLoop::EventLoop(int workers, int transfers) : workers(workers), transfers(transfers)
+{
+    epoll = epoll_create1(EPOLL_CLOEXEC);
+    wakeup = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+
+    epoll_event event;
+    event.events = EPOLLIN;
+    event.data.fd = wakeup;
+    epoll_ctl(epoll, EPOLL_CTL_ADD, wakeup, &event);
+
+    runner = std::async(
+        launch::async,
+        [this]
+        { run(); });
+}
+
+void EventLoop::post(std::coroutine_handle<> handle)
+{
+    {
+        std::lock_guard<std::mutex> lock(_mutex);
+        posted.push_back(handle);
+    }
+
+    uint64_t signal = 1;
+    write(wakeup, &signal, sizeof(signal));
+}
+
+// Each socket has at most one coroutine waiting for it, and is only
+// registered until that one is resumed. Sockets are closed between waits,
+// so a reused descriptor never finds a registration of the old one.
+void EventLoop::watch(int socket, uint32_t events, int timeoutMilliseconds, bool *timedOut, std::coroutine_handle<> handle)
+{
+    epoll_event event;
+    event.events = events | EPOLLONESHOT | EPOLLRDHUP;
+    event.data.fd = socket;
+
+    if (epoll_ctl(epoll, EPOLL_CTL_ADD, socket, &event) != 0 &&
+        (errno != EEXIST || epoll_ctl(epoll, EPOLL_CTL_MOD, socket, &event) != 0))
+    {
+        // Sockets that can't be watched are resumed right away, to fail on
+        // their next read or write.
+        post(handle);
+        return;
+    }
+
+    Waiter waiter;
+    waiter.handle = handle;
+    waiter.timedOut = timedOut;
+    waiter.hasDeadline = timeoutMilliseconds >= 0;
+
+    if (waiter.hasDeadline)
+    {
+        Deadline deadline = std::chrono::steady_clock::now() + std::chrono::milliseconds(timeoutMilliseconds);
+        waiter.deadline = deadlines.insert({deadline, socket});
+    }
+
+    waiting[socket] = waiter;
+}
+
+void EventLoop::resume(int socket, bool timedOut)
+{
+    auto found = waiting.find(socket);
+    if (found == waiting.end())
+    {
+        return;
+    }
+
+    Waiter waiter = found->second;
+    waiting.erase(found);
+
+    if (waiter.hasDeadline)
+    {
+        deadlines.erase(waiter.deadline);
+    }
+
+    epoll_ctl(epoll, EPOLL_CTL_DEL, socket, nullptr);
+
+    if (timedOut)
+    {
+        *waiter.timedOut = true;
+    }
+
+    waiter.handle.resume();
+}
+
+// Milliseconds until the earliest wait times out, or -1 when none can.
+int EventLoop::nextTimeout()
+{
+    if (deadlines.empty())
+    {
+        return -1;
+    }
+
+    auto remaining = deadlines.begin()->first - std::chrono::steady_clock::now();
+    auto milliseconds = std::chrono::ceil<std::chrono::milliseconds>(remaining).count();
+    return milliseconds < 0 ? 0 : (int)milliseconds;
+}
+
+void EventLoop::run()
+{
+    epoll_event events[EVENT_LOOP_MAX_EVENTS];
+    std::vector<std::coroutine_handle<>> ready;
+
+    while (true)
+    {
+        int count = epoll_wait(epoll, events, EVENT_LOOP_MAX_EVENTS, nextTimeout());
+
+        if (count < 0 && errno != EINTR)
+        {
+            std::cerr << "Event loop failed waiting for sockets" << std::endl;
+            return;
+        }
+
+        for (int i = 0; i < count; i++)
+        {
+            if (events[i].data.fd == wakeup)
+            {
+                uint64_t signals;
+                read(wakeup, &signals, sizeof(signals));
+                continue;
+            }
+
+            resume(events[i].data.fd, false);
+        }
+
+        auto now = std::chrono::steady_clock::now();
+        while (!deadlines.empty() && deadlines.begin()->first <= now)
+        {
+            resume(deadlines.begin()->second, true);
+        }
+
+        {
+            std::lock_guard<std::mutex> lock(_mutex);
+            ready.swap(posted);
+        }
+
+        for (auto handle : ready)
+        {
+            handle.resume();
+        }
+
+        ready.clear();
+    }
+}
+
+void EventLoop::BackgroundAwaiter::await_suspend(std::coroutine_handle<> handle)
+{
+    EventLoop *loop = this->loop;
+    WorkerPool *pool = this->pool;
+    std::function<void()> *work = &this->work;
+
+    pool->queue(
+        [loop, work, handle]
+        {
+            (*work)();
+            loop->post(handle);
+        });
+}
+
+void EventLoop::CompletionAwaiter::await_suspend(std::coroutine_handle<> handle)
+{
+    EventLoop *loop = this->loop;
+
+    completion->then(
+        [loop, handle]
+        { loop->post(handle); });
+}
+
+EventLoop::PostAwaiter EventLoop::schedule()
+{
+    return PostAwaiter{this};
+}
+
+EventLoop::SocketAwaiter EventLoop::readable(int socket, int timeoutMilliseconds)
+{
+    return SocketAwaiter{this, socket, EPOLLIN, timeoutMilliseconds};
+}
+
+EventLoop::SocketAwaiter EventLoop::writable(int socket, int timeoutMilliseconds)
+{
+    return SocketAwaiter{this, socket, EPOLLOUT, timeoutMilliseconds};
+}
+
+EventLoop::BackgroundAwaiter EventLoop::background(std::function<void()> work)
+{
+    return BackgroundAwaiter{this, &workers, work};
+}
+
+EventLoop::BackgroundAwaiter EventLoop::transfer(std::function<void()> work)
+{
+    return BackgroundAwaiter{this, &transfers, work};
+}
+
+EventLoop::CompletionAwaiter EventLoop::after(std::shared_ptr<Completion> completion)
+{
+    return CompletionAwaiter{this, completion};
+}
+
+bool Completion::finished()
+{
+    std::lock_guard<std::mutex> lock(_mutex);
+    return isFinished;
+}
+
+void Completion::then(std::function<void()> next)
+{
+    {
+        std::lock_guard<std::mutex> lock(_mutex);
+        if (!isFinished)
+        {
+            waiting.push_back(next);
+            return;
+        }
+    }
+
+    next();
+}
+
+void Completion::finish()
+{
+    std::vector<std::function<void()>> finished;
+    {
+        std::lock_guard<std::mutex> lock(_mutex);
+        isFinished = true;
+        finished.swap(waiting);
+    }
+
+    for (auto const &next : finished)
+    {
+        next();
+    }
+}
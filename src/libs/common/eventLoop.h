@@ -0,0 +1,219 @@
+#pragma once
+
+#include <map>
+#include <mutex>
+#include <chrono>
+#include <vector>
+#include <unordered_map>
+#include <future>
+#include <memory>
+#include <optional>
+#include <exception>
+#include <coroutine>
+#include <functional>
+#include <stdint.h>
+
+#include "helpers.h"
+
+// Blocking calls of coroutines, like storage reads, run on this many
+// threads of their event loop.
+#define EVENT_LOOP_WORKERS 4
+// Transfers block for as long as they move data, so they get threads of
+// their own, and no more than this many run at once.
+#define EVENT_LOOP_TRANSFER_THREADS 16
+#define EVENT_LOOP_MAX_EVENTS 64
+
+// A coroutine nobody waits for. It runs right away until it first suspends
+// and frees itself once it is done.
+class Detached
+{
+public:
+    class promise_type
+    {
+    public:
+        Detached get_return_object() { return Detached(); }
+        std::suspend_never initial_suspend() noexcept { return {}; }
+        std::suspend_never final_suspend() noexcept { return {}; }
+        void return_void() {}
+        void unhandled_exception() { std::terminate(); }
+    };
+};
+
+// Finishes once, and then runs whatever waits for it, so that waiting
+// costs a callback rather than a thread.
+class Completion
+{
+    std::mutex _mutex;
+    bool isFinished = false;
+    std::vector<std::function<void()>> waiting;
+
+public:
+    bool finished();
+    // Runs next right away when already finished, or else on the thread
+    // that finishes it.
+    void then(std::function<void()> next);
+    void finish();
+};
+
+// A coroutine that starts once awaited, and resumes the one awaiting it
+// with its result when it is done.
+template <typename T>
+class Task
+{
+public:
+    class promise_type;
+
+private:
+    std::coroutine_handle<promise_type> handle;
+
+    class FinalAwaiter
+    {
+    public:
+        bool await_ready() noexcept { return false; }
+        std::coroutine_handle<> await_suspend(std::coroutine_handle<promise_type> finished) noexcept
+        {
+            return finished.promise().continuation;
+        }
+        void await_resume() noexcept {}
+    };
+
+public:
+    class promise_type
+    {
+    public:
+        std::optional<T> value;
+        std::coroutine_handle<> continuation;
+
+        Task get_return_object() { return Task(std::coroutine_handle<promise_type>::from_promise(*this)); }
+        std::suspend_always initial_suspend() noexcept { return {}; }
+        FinalAwaiter final_suspend() noexcept { return FinalAwaiter(); }
+        void return_value(T result) { value = std::move(result); }
+        void unhandled_exception() { std::terminate(); }
+    };
+
+    Task(std::coroutine_handle<promise_type> handle) : handle(handle) {}
+    Task(Task &&other) : handle(other.handle) { other.handle = nullptr; }
+    Task(const Task &) = delete;
+
+    ~Task()
+    {
+        if (handle)
+        {
+            handle.destroy();
+        }
+    }
+
+    bool await_ready() { return false; }
+
+    std::coroutine_handle<> await_suspend(std::coroutine_handle<> awaiting)
+    {
+        handle.promise().continuation = awaiting;
+        return handle;
+    }
+
+    T await_resume() { return std::move(*handle.promise().value); }
+};
+
+// Runs coroutines on one thread, resuming each when the socket it waits
+// for is ready, so a conversation that waits costs its coroutine frame
+// rather than a thread of its own.
+class EventLoop
+{
+    typedef std::chrono::steady_clock::time_point Deadline;
+
+    class Waiter
+    {
+    public:
+        std::coroutine_handle<> handle;
+        bool *timedOut;
+        bool hasDeadline;
+        std::multimap<Deadline, int>::iterator deadline;
+    };
+
+    int epoll;
+    int wakeup;
+
+    std::mutex _mutex;
+    std::vector<std::coroutine_handle<>> posted;
+
+    // Only touched on the loop's thread.
+    std::unordered_map<int, Waiter> waiting;
+    std::multimap<Deadline, int> deadlines;
+
+    WorkerPool workers;
+    WorkerPool transfers;
+    std::future<void> runner;
+
+    void run();
+    void watch(int socket, uint32_t events, int timeoutMilliseconds, bool *timedOut, std::coroutine_handle<> handle);
+    void resume(int socket, bool timedOut);
+    int nextTimeout();
+
+public:
+    class SocketAwaiter
+    {
+    public:
+        EventLoop *loop;
+        int socket;
+        uint32_t events;
+        int timeoutMilliseconds;
+        bool timedOut = false;
+
+        bool await_ready() { return false; }
+        void await_suspend(std::coroutine_handle<> handle) { loop->watch(socket, events, timeoutMilliseconds, &timedOut, handle); }
+        // False when the wait timed out.
+        bool await_resume() { return !timedOut; }
+    };
+
+    class PostAwaiter
+    {
+    public:
+        EventLoop *loop;
+
+        bool await_ready() { return false; }
+        void await_suspend(std::coroutine_handle<> handle) { loop->post(handle); }
+        void await_resume() {}
+    };
+
+    class BackgroundAwaiter
+    {
+    public:
+        EventLoop *loop;
+        WorkerPool *pool;
+        std::function<void()> work;
+
+        bool await_ready() { return false; }
+        void await_suspend(std::coroutine_handle<> handle);
+        void await_resume() {}
+    };
+
+    class CompletionAwaiter
+    {
+    public:
+        EventLoop *loop;
+        std::shared_ptr<Completion> completion;
+
+        bool await_ready() { return completion->finished(); }
+        void await_suspend(std::coroutine_handle<> handle);
+        void await_resume() {}
+    };
+
+    EventLoop(int workers = EVENT_LOOP_WORKERS, int transfers = EVENT_LOOP_TRANSFER_THREADS);
+
+    // Resumes handle on the loop's thread. Can be called from any thread.
+    void post(std::coroutine_handle<> handle);
+
+    // Continues the awaiting coroutine on the loop's thread.
+    PostAwaiter schedule();
+    // Continue once socket can be read from or written to, or was closed,
+    // or after timeoutMilliseconds when that is not negative. Only from
+    // coroutines on the loop's thread.
+    SocketAwaiter readable(int socket, int timeoutMilliseconds = -1);
+    SocketAwaiter writable(int socket, int timeoutMilliseconds = -1);
+    // Runs work on a worker and then continues on the loop's thread.
+    BackgroundAwaiter background(std::function<void()> work);
+    // Same, on one of the transfer threads, for work that moves a body.
+    BackgroundAwaiter transfer(std::function<void()> work);
+    // Continues on the loop's thread once completion finished.
+    CompletionAwaiter after(std::shared_ptr<Completion> completion);
+};
@@ -0,0 +1,367 @@
+#include <fstream>
+#include <vector>
+#include <string.h>
+#include <algorithm>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <nmmintrin.h>
+#define CRC32C_HAS_SSE42_KERNEL
+#endif
+
+#include "hash.h"
+#include "blake3.h"
+
+static const uint32_t SHA256_ROUND_CONSTANTS[64] = {
+    0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+    0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+    0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+    0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+    0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+    0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+    0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+    0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2};
+
+static uint32_t rotateRight(uint32_t value, int bits)
+{
+    return (value >> bits) | (value << (32 - bits));
+}
+
+Sha256::Sha256()
+{
+    uint32_t initial[8] = {
+        0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a,
+        0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19};
+
+    memcpy(state, initial, sizeof(state));
+}
+
+void Sha256::compress(const uint8_t *chunk)
+{
+    uint32_t w[64];
+
+    for (int i = 0; i < 16; i++)
+    {
+        w[i] = (uint32_t)chunk[i * 4] << 24 |
+               (uint32_t)chunk[i * 4 + 1] << 16 |
+               (uint32_t)chunk[i * 4 + 2] << 8 |
+               (uint32_t)chunk[i * 4 + 3];
+    }
+
+    for (int i = 16; i < 64; i++)
+    {
+        uint32_t s0 = rotateRight(w[i - 15], 7) ^ rotateRight(w[i - 15], 18) ^ (w[i - 15] >> 3);
+        uint32_t s1 = rotateRight(w[i - 2], 17) ^ rotateRight(w[i - 2], 19) ^ (w[i - 2] >> 10);
+        w[i] = w[i - 16] + s0 + w[i - 7] + s1;
+    }
+
+    uint32_t a = state[0], b = state[1], c = state[2], d = state[3];
+    uint32_t e = state[4], f = state[5], g = state[6], h = state[7];
+
+    for (int i = 0; i < 64; i++)
+    {
+        uint32_t s1 = rotateRight(e, 6) ^ rotateRight(e, 11) ^ rotateRight(e, 25);
+        uint32_t choice = (e & f) ^ (~e & g);
+        uint32_t temp1 = h + s1 + choice + SHA256_ROUND_CONSTANTS[i] + w[i];
+        uint32_t s0 = rotateRight(a, 2) ^ rotateRight(a, 13) ^ rotateRight(a, 22);
+        uint32_t majority = (a & b) ^ (a & c) ^ (b & c);
+        uint32_t temp2 = s0 + majority;
+
+        h = g;
+        g = f;
+        f = e;
+        e = d + temp1;
+        d = c;
+        c = b;
+        b = a;
+        a = temp1 + temp2;
+    }
+
+    state[0] += a;
+    state[1] += b;
+    state[2] += c;
+    state[3] += d;
+    state[4] += e;
+    state[5] += f;
+    state[6] += g;
+    state[7] += h;
+}
+
+void Sha256::update(const char *data, size_t size)
+{
+    const uint8_t *bytes = (const uint8_t *)data;
+    totalLength += size;
+
+    while (size > 0)
+    {
+        if (blockLength == 0 && size >= 64)
+        {
+            compress(bytes);
+            bytes += 64;
+            size -= 64;
+            continue;
+        }
+
+        size_t copied = std::min(size, 64 - blockLength);
+        memcpy(block + blockLength, bytes, copied);
+        blockLength += copied;
+        bytes += copied;
+        size -= copied;
+
+        if (blockLength == 64)
+        {
+            compress(block);
+            blockLength = 0;
+        }
+    }
+}
+
+void Sha256::update(std::string data)
+{
+    update(data.data(), data.size());
+}
+
+std::string Sha256::digest()
+{
+    uint64_t bitLength = totalLength * 8;
+
+    uint8_t padding[72] = {0x80};
+    size_t paddingLength = blockLength < 56 ? 56 - blockLength : 120 - blockLength;
+
+    for (int i = 0; i < 8; i++)
+    {
+        padding[paddingLength + i] = (uint8_t)(bitLength >> (56 - i * 8));
+    }
+
+    update((const char *)padding, paddingLength + 8);
+
+    std::string result(SHA256_DIGEST_SIZE, '\0');
+    for (int i = 0; i < 8; i++)
+    {
+        result[i * 4] = (char)(state[i] >> 24);
+        result[i * 4 + 1] = (char)(state[i] >> 16);
+        result[i * 4 + 2] = (char)(state[i] >> 8);
+        result[i * 4 + 3] = (char)state[i];
+    }
+
+    return result;
+}
+
+std::string sha256(std::string data)
+{
+    Sha256 hash;
+    hash.update(data);
+    return hash.digest();
+}
+
+std::string sha256File(std::string path)
+{
+    std::ifstream file(path, std::ios::in | std::ios::binary);
+    std::vector<char> buffer(64 * 1024);
+    Sha256 hash;
+
+    while (file)
+    {
+        file.read(buffer.data(), buffer.size());
+        hash.update(buffer.data(), file.gcount());
+    }
+
+    return hash.digest();
+}
+
+std::string contentHash(std::istream &file, uint64_t *size)
+{
+    std::string digest;
+    return blake3Stream(file, &digest, size) ? toHex(digest) : "";
+}
+
+std::string contentHashFile(std::string path, uint64_t *size)
+{
+    std::ifstream file(path, std::ios::in | std::ios::binary);
+    if (!file)
+    {
+        *size = 0;
+        return "";
+    }
+
+    return contentHash(file, size);
+}
+
+std::string toHex(std::string bytes)
+{
+    const char *digits = "0123456789abcdef";
+    std::string hex;
+
+    for (unsigned char byte : bytes)
+    {
+        hex.push_back(digits[byte >> 4]);
+        hex.push_back(digits[byte & 0x0f]);
+    }
+
+    return hex;
+}
+
+void RollingChecksum::reset(const char *data, size_t size)
+{
+    a = 0;
+    b = 0;
+    length = size;
+
+    for (size_t i = 0; i < size; i++)
+    {
+        a += (uint8_t)data[i];
+        b += (size - i) * (uint8_t)data[i];
+    }
+}
+
+void RollingChecksum::roll(uint8_t removed, uint8_t added)
+{
+    a = a - removed + added;
+    b = b - length * removed + a;
+}
+
+uint32_t RollingChecksum::value()
+{
+    return (a & 0xffff) | (b << 16);
+}
+
+uint64_t fnv1a(const char *data, size_t size, uint64_t hash)
+{
+    for (size_t i = 0; i < size; i++)
+    {
+        hash ^= (uint8_t)data[i];
+        hash *= FNV1A_PRIME;
+    }
+
+    return hash;
+}
+
+// Reflected form of the Castagnoli polynomial 0x1edc6f41.
+#define CRC32C_POLYNOMIAL 0x82f63b78
+
+// Slicing by 8: tables[k][b] is the CRC of byte b followed by k zero bytes,
+// so eight bytes are folded in with eight lookups.
+static const uint32_t (*crc32cTables())[256]
+{
+    static uint32_t tables[8][256];
+    static bool isBuilt = false;
+
+    if (!isBuilt)
+    {
+        for (uint32_t byte = 0; byte < 256; byte++)
+        {
+            uint32_t crc = byte;
+            for (int bit = 0; bit < 8; bit++)
+            {
+                crc = (crc >> 1) ^ (crc & 1 ? CRC32C_POLYNOMIAL : 0);
+            }
+            tables[0][byte] = crc;
+        }
+
+        for (int k = 1; k < 8; k++)
+        {
+            for (int byte = 0; byte < 256; byte++)
+            {
+                tables[k][byte] = (tables[k - 1][byte] >> 8) ^ tables[0][tables[k - 1][byte] & 0xff];
+            }
+        }
+
+        isBuilt = true;
+    }
+
+    return tables;
+}
+
+static uint32_t crc32cTable(const char *data, size_t size, uint32_t crc)
+{
+    const uint32_t(*tables)[256] = crc32cTables();
+    const uint8_t *bytes = (const uint8_t *)data;
+
+    while (size >= 8)
+    {
+        uint32_t low;
+        uint32_t high;
+        memcpy(&low, bytes, 4);
+        memcpy(&high, bytes + 4, 4);
+        low ^= crc;
+
+        crc = tables[7][low & 0xff] ^ tables[6][(low >> 8) & 0xff] ^
+              tables[5][(low >> 16) & 0xff] ^ tables[4][low >> 24] ^
+              tables[3][high & 0xff] ^ tables[2][(high >> 8) & 0xff] ^
+              tables[1][(high >> 16) & 0xff] ^ tables[0][high >> 24];
+
+        bytes += 8;
+        size -= 8;
+    }
+
+    while (size-- > 0)
+    {
+        crc = (crc >> 8) ^ tables[0][(crc ^ *bytes++) & 0xff];
+    }
+
+    return crc;
+}
+
+#ifdef CRC32C_HAS_SSE42_KERNEL
+__attribute__((target("sse4.2"))) static uint32_t crc32cSse42(const char *data, size_t size, uint32_t crc)
+{
+#ifdef __x86_64__
+    uint64_t wide = crc;
+    while (size >= 8)
+    {
+        uint64_t word;
+        memcpy(&word, data, 8);
+        wide = _mm_crc32_u64(wide, word);
+        data += 8;
+        size -= 8;
+    }
+    crc = wide;
+#endif
+
+    while (size-- > 0)
+    {
+        crc = _mm_crc32_u8(crc, *data++);
+    }
+
+    return crc;
+}
+#endif
+
+typedef uint32_t (*Crc32cFunction)(const char *data, size_t size, uint32_t crc);
+
+static bool hasSse42()
+{
+#ifdef CRC32C_HAS_SSE42_KERNEL
+    return __builtin_cpu_supports("sse4.2");
+#else
+    return false;
+#endif
+}
+
+static Crc32cFunction chooseCrc32c()
+{
+#ifdef CRC32C_HAS_SSE42_KERNEL
+    if (hasSse42())
+    {
+        return crc32cSse42;
+    }
+#endif
+
+    crc32cTables();
+    return crc32cTable;
+}
+
+uint32_t crc32c(const char *data, size_t size, uint32_t crc)
+{
+    static Crc32cFunction kernel = chooseCrc32c();
+    return ~kernel(data, size, ~crc);
+}
+
+uint32_t crc32c(std::string data, uint32_t crc)
+{
+    return crc32c(data.data(), data.size(), crc);
+}
+
+std::string crc32cKernel()
+{
+    return hasSse42() ? "sse4.2" : "table";
+}
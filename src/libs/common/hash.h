@@ -0,0 +1,64 @@
+#pragma once
+
+#include <string>
+#include <stdint.h>
+
+#define SHA256_DIGEST_SIZE 32
+
+class Sha256
+{
+    uint32_t state[8];
+    uint8_t block[64];
+    size_t blockLength = 0;
+    uint64_t totalLength = 0;
+
+    void compress(const uint8_t *chunk);
+
+public:
+    Sha256();
+
+    void update(const char *data, size_t size);
+    void update(std::string data);
+
+    // Raw 32 byte digest. The object must not be updated afterwards.
+    std::string digest();
+};
+
+std::string sha256(std::string data);
+std::string sha256File(std::string path);
+std::string toHex(std::string bytes);
+
+// Names what a file holds, as the hex BLAKE3 of its bytes. Both ends
+// compare it to skip moving bytes the other one already has. "" when the
+// file can't be read.
+std::string contentHash(std::istream &file, uint64_t *size);
+std::string contentHashFile(std::string path, uint64_t *size);
+
+// Adler style weak checksum from rsync that can slide over a window one byte
+// at a time.
+class RollingChecksum
+{
+    uint32_t a = 0;
+    uint32_t b = 0;
+    size_t length = 0;
+
+public:
+    void reset(const char *data, size_t size);
+    void roll(uint8_t removed, uint8_t added);
+    uint32_t value();
+};
+
+// FNV-1a, cheap enough to run over every byte of a transfer and to carry
+// on from a saved value as more bytes arrive.
+#define FNV1A_OFFSET_BASIS 0xcbf29ce484222325ULL
+#define FNV1A_PRIME 0x100000001b3ULL
+
+uint64_t fnv1a(const char *data, size_t size, uint64_t hash = FNV1A_OFFSET_BASIS);
+
+// CRC32C (Castagnoli), checked on every transfer. Like fnv1a it carries on
+// from a previous value, so crc32c(b, crc32c(a)) is the CRC of a and then b.
+// Runs on the SSE4.2 crc32 instruction when the CPU has it and on tables
+// otherwise.
+uint32_t crc32c(const char *data, size_t size, uint32_t crc = 0);
+uint32_t crc32c(std::string data, uint32_t crc = 0);
+std::string crc32cKernel();
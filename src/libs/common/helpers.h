@@ -1,5 +1,12 @@
+#pragma once
+
+#include <atomic>
+#include <algorithm>
 #include <future>
+#include <thread>
+#include <vector>
 #include <list>
+#include <memory>
 #include <unistd.h>
 #include <optional>
 #include <functional>
@@ -45,6 +52,201 @@ public:
 
         return value;
     }
+
+    T waitAndPop()
+    {
+        std::unique_lock<std::mutex> lock(_mutex);
+        _condition.wait(lock, [this]
+                        { return !_queue.empty(); });
+
+        T value = _queue.front();
+        _queue.pop();
+
+        return value;
+    }
+};
+
+#define SPSC_QUEUE_SPINS 64
+
+// Bounded queue between exactly one producing and one consuming thread.
+// Each side only writes its own index, so passing an item takes no lock.
+// A side that finds the queue full or empty spins a little and then sleeps
+// until the other one moves. Closing it, from either side, makes pushes
+// fail and pops fail once the rest was taken.
+template <typename T>
+class SpscQueue
+{
+    std::vector<T> slots;
+    alignas(64) std::atomic<size_t> head{0};
+    alignas(64) std::atomic<size_t> tail{0};
+    std::atomic<bool> isClosed{false};
+
+    std::mutex _mutex;
+    std::condition_variable _changed;
+    std::atomic<int> sleeping{0};
+
+    void wake()
+    {
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        if (sleeping.load() > 0)
+        {
+            std::lock_guard<std::mutex> lock(_mutex);
+            _changed.notify_all();
+        }
+    }
+
+    template <typename Predicate>
+    void waitUntil(Predicate isReady)
+    {
+        for (int i = 0; i < SPSC_QUEUE_SPINS; i++)
+        {
+            if (isReady())
+            {
+                return;
+            }
+            std::this_thread::yield();
+        }
+
+        std::unique_lock<std::mutex> lock(_mutex);
+        sleeping++;
+        _changed.wait(lock, isReady);
+        sleeping--;
+    }
+
+public:
+    SpscQueue(size_t capacity) : slots(capacity + 1) {}
+
+    // Moves from value only when it succeeds.
+    bool tryPush(T &value)
+    {
+        size_t position = tail.load(std::memory_order_relaxed);
+        size_t next = (position + 1) % slots.size();
+
+        if (next == head.load(std::memory_order_acquire))
+        {
+            return false;
+        }
+
+        slots[position] = std::move(value);
+        tail.store(next, std::memory_order_release);
+        wake();
+        return true;
+    }
+
+    bool tryPop(T *value)
+    {
+        size_t position = head.load(std::memory_order_relaxed);
+
+        if (position == tail.load(std::memory_order_acquire))
+        {
+            return false;
+        }
+
+        *value = std::move(slots[position]);
+        head.store((position + 1) % slots.size(), std::memory_order_release);
+        wake();
+        return true;
+    }
+
+    bool push(T value)
+    {
+        while (!isClosed.load(std::memory_order_acquire))
+        {
+            if (tryPush(value))
+            {
+                return true;
+            }
+
+            waitUntil([this]
+                      { return isClosed.load() || (tail.load() + 1) % slots.size() != head.load(); });
+        }
+
+        return false;
+    }
+
+    bool pop(T *value)
+    {
+        while (true)
+        {
+            if (tryPop(value))
+            {
+                return true;
+            }
+
+            // What was pushed before closing is still handed out.
+            if (isClosed.load(std::memory_order_acquire))
+            {
+                return tryPop(value);
+            }
+
+            waitUntil([this]
+                      { return isClosed.load() || head.load() != tail.load(); });
+        }
+    }
+
+    void close()
+    {
+        isClosed.store(true);
+        wake();
+    }
+};
+
+// Queue over a vector used as a circular buffer, for queues that are
+// pushed and popped all the time: once it grew to the most it held, it
+// doesn't allocate again.
+template <typename T>
+class RingBuffer
+{
+    std::vector<T> slots;
+    size_t first = 0;
+    size_t count = 0;
+
+    void grow()
+    {
+        std::vector<T> larger(std::max<size_t>(2 * slots.size(), 16));
+        for (size_t i = 0; i < count; i++)
+        {
+            larger[i] = std::move(slots[(first + i) % slots.size()]);
+        }
+
+        slots.swap(larger);
+        first = 0;
+    }
+
+public:
+    RingBuffer(size_t capacity = 0) : slots(capacity) {}
+
+    bool empty() const { return count == 0; }
+    size_t size() const { return count; }
+
+    T &front() { return slots[first]; }
+    T &back() { return slots[(first + count - 1) % slots.size()]; }
+
+    void push_back(T value)
+    {
+        if (count == slots.size())
+        {
+            grow();
+        }
+
+        slots[(first + count) % slots.size()] = std::move(value);
+        count++;
+    }
+
+    // Popped slots keep their value until they are reused, so types that
+    // hold on to something are reset.
+    void pop_front()
+    {
+        slots[first] = T();
+        first = (first + 1) % slots.size();
+        count--;
+    }
+
+    void pop_back()
+    {
+        back() = T();
+        count--;
+    }
 };
 
 template <typename T>
@@ -114,6 +316,51 @@ public:
     }
 };
 
+// Fixed set of threads draining one queue, to bound how much work of one
+// kind runs at the same time.
+class WorkerPool
+{
+    ThreadSafeQueue<std::function<void()>> tasks;
+    std::list<std::future<void>> workers;
+
+public:
+    WorkerPool(int size)
+    {
+        for (int i = 0; i < size; i++)
+        {
+            workers.push_back(std::async(
+                launch::async,
+                [this]
+                {
+                    while (true)
+                    {
+                        tasks.waitAndPop()();
+                    }
+                }));
+        }
+    }
+
+    void queue(std::function<void()> task)
+    {
+        tasks.queue(task);
+    }
+
+    // Runs task on the pool and waits for it. The promise is shared, as
+    // the worker may still be inside set_value once the wait is over.
+    void call(std::function<void()> task)
+    {
+        auto done = std::make_shared<std::promise<void>>();
+        std::future<void> result = done->get_future();
+        tasks.queue(
+            [&task, done]
+            {
+                task();
+                done->set_value();
+            });
+        result.wait();
+    }
+};
+
 time_t getAccessTime(std::string path);
 time_t getCreateTime(std::string path);
 time_t getModificationTime(std::string path);
@@ -1,6 +1,14 @@
 #include <fstream>
+#include <sstream>
+#include <algorithm>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <inttypes.h>
 
 #include "message.h"
+#include "compression.h"
+#include "transfer.h"
 #include "helpers.h"
 
 #define LOG_MESSAGES_SENT false
@@ -25,9 +33,34 @@ Message::Message(MessageType type, std::string filename)
 
 Message Message::InvalidMessage() { return Message(MessageType::InvalidMessage); }
 Message Message::EndCommand() { return Message(MessageType::EndCommand); }
+
+Message Message::EndCommand(uint32_t checksum)
+{
+    Message message(MessageType::EndCommand);
+    message.hasChecksum = true;
+    message.checksum = checksum;
+    return message;
+}
 Message Message::ListServerCommand() { return Message(MessageType::ListServerCommand); }
 Message Message::SubscribeUpdates() { return Message(MessageType::SubscribeUpdates); }
 Message Message::Start() { return Message(MessageType::Start); }
+
+Message Message::Start(std::string codec, std::string transferId)
+{
+    Message message(MessageType::Start);
+    message.data = codec;
+    message.transferId = transferId;
+    return message;
+}
+
+Message Message::Resume(uint64_t offset)
+{
+    Message message(MessageType::Resume);
+    message.offset = offset;
+    return message;
+}
+
+Message Message::Multiplex() { return Message(MessageType::Multiplex); }
 Message Message::Empty() { return Message(MessageType::Empty); }
 
 Message Message::DataMessage(std::string data)
@@ -37,6 +70,16 @@ Message Message::DataMessage(std::string data)
     return message;
 }
 
+Message Message::CheckedData(uint64_t offset, PooledBuffer body, uint32_t checksum)
+{
+    Message message(MessageType::CheckedData);
+    message.offset = offset;
+    message.body = body;
+    message.hasChecksum = true;
+    message.checksum = checksum;
+    return message;
+}
+
 Message Message::FileInfo(std::string filename, time_t mtime, time_t atime, time_t ctime)
 {
     Message message(MessageType::FileInfo);
@@ -57,6 +100,14 @@ Message Message::RemoteFileUpdate(std::string filename, time_t mtime, time_t ati
     return message;
 }
 
+Message Message::RemoteFileUpdate(std::string filename, time_t mtime, time_t atime, time_t ctime, std::string inlineData)
+{
+    Message message = Message::RemoteFileUpdate(filename, mtime, atime, ctime);
+    message.data = inlineData;
+    message.hasInlineData = true;
+    return message;
+}
+
 Message Message::RemoteFileDelete(std::string filename, time_t mtime, time_t atime, time_t ctime)
 {
     Message message(MessageType::RemoteFileDelete);
@@ -74,16 +125,89 @@ Message Message::Response(ResponseType type)
     return message;
 }
 
-Message Message::Login(std::string username)
+Message Message::Response(ResponseType type, std::string data)
+{
+    Message message = Message::Response(type);
+    message.data = data;
+    return message;
+}
+
+Message Message::Login(std::string username, int inlineLimit)
 {
     Message message(MessageType::Login);
     message.username = username;
+    message.inlineLimit = inlineLimit;
+    return message;
+}
+
+Message Message::UploadCommand(std::string filename, Durability durability)
+{
+    Message message(MessageType::UploadCommand, filename);
+    message.durability = durability;
+    return message;
+}
+
+Message Message::UploadCommand(std::string filename, std::string inlineData, Durability durability)
+{
+    Message message(MessageType::UploadCommand, filename);
+    message.data = inlineData;
+    message.hasInlineData = true;
+    message.durability = durability;
     return message;
 }
 
-Message Message::UploadCommand(std::string filename) { return Message(MessageType::UploadCommand, filename); }
 Message Message::DownloadCommand(std::string filename) { return Message(MessageType::DownloadCommand, filename); }
 Message Message::DeleteCommand(std::string filename) { return Message(MessageType::DeleteCommand, filename); }
+Message Message::DeltaUploadCommand(std::string filename, Durability durability)
+{
+    Message message(MessageType::DeltaUploadCommand, filename);
+    message.durability = durability;
+    return message;
+}
+
+Message Message::DeltaDownloadCommand(std::string filename) { return Message(MessageType::DeltaDownloadCommand, filename); }
+
+Message Message::ChunkedUploadCommand(std::string filename, Durability durability)
+{
+    Message message(MessageType::ChunkedUploadCommand, filename);
+    message.durability = durability;
+    return message;
+}
+
+Message Message::ParallelUploadCommand(std::string filename, uint64_t size, Durability durability)
+{
+    Message message(MessageType::ParallelUploadCommand, filename);
+    message.size = size;
+    message.durability = durability;
+    return message;
+}
+
+Message Message::ParallelDownloadCommand(std::string filename)
+{
+    return Message(MessageType::ParallelDownloadCommand, filename);
+}
+
+Message Message::TransferRange(std::string transferId, uint64_t offset, uint64_t size)
+{
+    Message message(MessageType::TransferRange);
+    message.transferId = transferId;
+    message.offset = offset;
+    message.size = size;
+    return message;
+}
+
+Message Message::RangeDownloadCommand(std::string filename, std::vector<ByteRange> ranges)
+{
+    Message message(MessageType::RangeDownloadCommand, filename);
+    message.ranges = ranges;
+    return message;
+}
+
+ByteRange ByteRange::clip(uint64_t fileSize)
+{
+    uint64_t start = std::min(offset, fileSize);
+    return ByteRange{start, std::min(size, fileSize - start)};
+}
 
 bool isFileNameValid(std::string filename)
 {
@@ -93,11 +217,80 @@ bool isFileNameValid(std::string filename)
     return true;
 }
 
-Message Message::Parse(char *_buffer)
+// Inline payloads are encoded as "<size>:<bytes>" right before the filename,
+// with a size of -1 when the message carries no payload.
+std::string parseInlinePayload(std::string data, Message *message)
+{
+    size_t separator = data.find(":");
+    if (separator == std::string::npos)
+    {
+        return data;
+    }
+
+    int size = atoi(data.substr(0, separator).c_str());
+    if (size < 0 || separator + 1 + size > data.length())
+    {
+        return data.substr(separator + 1);
+    }
+
+    message->data = data.substr(separator + 1, size);
+    message->hasInlineData = true;
+    return data.substr(separator + 1 + size);
+}
+
+// Upload commands lead with "<durability>:".
+std::string parseDurability(std::string data, Message *message)
+{
+    size_t separator = data.find(":");
+    if (separator == std::string::npos)
+    {
+        return data;
+    }
+
+    int durability = atoi(data.substr(0, separator).c_str());
+    if (durability >= Durability::DefaultDurability && durability <= Durability::ImmediateSync)
+    {
+        message->durability = (Durability)durability;
+    }
+
+    return data.substr(separator + 1);
+}
+
+// File contents are encoded as "<hash>,<size>:", with an empty hash when
+// the sender doesn't know it.
+std::string parseContent(std::string data, Message *message)
+{
+    size_t separator = data.find(":");
+    size_t comma = data.find(",");
+    if (separator == std::string::npos || comma > separator)
+    {
+        return data;
+    }
+
+    message->contentHash = data.substr(0, comma);
+    message->contentSize = strtoull(data.c_str() + comma + 1, nullptr, 10);
+    return data.substr(separator + 1);
+}
+
+std::string contentToPacket(Message *message)
+{
+    return message->contentHash + "," + std::to_string(message->contentSize) + ":";
+}
+
+std::string inlinePayloadToPacket(Message *message)
+{
+    if (!message->hasInlineData)
+    {
+        return "-1:";
+    }
+
+    return std::to_string(message->data.size()) + ":" + message->data;
+}
+
+Message Message::Parse(std::string buffer)
 {
     Message message;
 
-    std::string buffer = _buffer;
     if (buffer.length() == 0)
     {
         return Message::Empty();
@@ -119,8 +312,9 @@ Message Message::Parse(char *_buffer)
         time_t mtime = toTimeT(data.substr(0 * spacer, size));
         time_t atime = toTimeT(data.substr(1 * spacer, size));
         time_t ctime = toTimeT(data.substr(2 * spacer, size));
-        std::string filename = data.substr(3 * spacer);
-        return Message::FileInfo(filename, mtime, atime, ctime);
+        Message info = Message::FileInfo("", mtime, atime, ctime);
+        info.filename = parseContent(data.substr(3 * spacer), &info);
+        return info;
     }
 
     case MessageType::RemoteFileUpdate:
@@ -132,8 +326,9 @@ Message Message::Parse(char *_buffer)
         time_t mtime = toTimeT(data.substr(0 * spacer, size));
         time_t atime = toTimeT(data.substr(1 * spacer, size));
         time_t ctime = toTimeT(data.substr(2 * spacer, size));
-        std::string filename = data.substr(3 * spacer);
-        return Message::RemoteFileUpdate(filename, mtime, atime, ctime);
+        Message update = Message::RemoteFileUpdate("", mtime, atime, ctime);
+        update.filename = parseInlinePayload(parseContent(data.substr(3 * spacer), &update), &update);
+        return update;
     }
 
     case MessageType::RemoteFileDelete:
@@ -145,14 +340,40 @@ Message Message::Parse(char *_buffer)
         time_t mtime = toTimeT(data.substr(0 * spacer, size));
         time_t atime = toTimeT(data.substr(1 * spacer, size));
         time_t ctime = toTimeT(data.substr(2 * spacer, size));
-        std::string filename = data.substr(3 * spacer);
-        return Message::RemoteFileDelete(filename, mtime, atime, ctime);
+        Message remove = Message::RemoteFileDelete("", mtime, atime, ctime);
+        remove.filename = parseContent(data.substr(3 * spacer), &remove);
+        return remove;
     }
 
     case MessageType::Start:
+    {
+        size_t separator = data.find(":");
+        if (separator == std::string::npos)
+        {
+            return Message::Start(data);
+        }
+
+        return Message::Start(data.substr(0, separator), data.substr(separator + 1));
+    }
+
+    case MessageType::Resume:
+    {
+        return Message::Resume(strtoull(data.c_str(), nullptr, 10));
+    }
+
     case MessageType::EndCommand:
+    {
+        if (data.empty())
+        {
+            return Message::EndCommand();
+        }
+
+        return Message::EndCommand(strtoul(data.c_str(), nullptr, 10));
+    }
+
     case MessageType::ListServerCommand:
     case MessageType::SubscribeUpdates:
+    case MessageType::Multiplex:
     {
         return Message(messageType);
     }
@@ -162,20 +383,141 @@ Message Message::Parse(char *_buffer)
         return Message::DataMessage(data);
     }
 
+    // "<offset>:<checksum>:<data>"
+    case MessageType::CheckedData:
+    {
+        uint64_t offset;
+        uint32_t checksum;
+        int consumed = 0;
+        if (sscanf(data.c_str(), "%" SCNu64 ":%" SCNu32 ":%n", &offset, &checksum, &consumed) != 2 || consumed == 0)
+        {
+            return Message::InvalidMessage();
+        }
+
+        PooledBuffer body = bufferPool()->acquire(data.size() - consumed);
+        memcpy(body.data(), data.data() + consumed, data.size() - consumed);
+        body.resize(data.size() - consumed);
+        return Message::CheckedData(offset, body, checksum);
+    }
+
     case MessageType::Login:
     {
-        return Message::Login(data);
+        int separator = data.find(":");
+        int inlineLimit = atoi(data.substr(0, separator).c_str());
+        return Message::Login(data.substr(separator + 1), inlineLimit);
     }
 
     case MessageType::Response:
     {
         ResponseType responseType = (ResponseType)atoi(&data[0]);
-        return Message::Response(responseType);
+        size_t separator = data.find(":");
+        if (separator == std::string::npos)
+        {
+            return Message::Response(responseType);
+        }
+
+        return Message::Response(responseType, data.substr(separator + 1));
     }
 
     case MessageType::UploadCommand:
+    {
+        Message upload(messageType);
+        upload.filename = parseInlinePayload(parseContent(parseDurability(data, &upload), &upload), &upload);
+
+        if (!isFileNameValid(upload.filename))
+        {
+            return Message::InvalidMessage();
+        }
+
+        return upload;
+    }
+
+    case MessageType::DeltaUploadCommand:
+    case MessageType::ChunkedUploadCommand:
+    {
+        Message upload(messageType);
+        upload.filename = parseContent(parseDurability(data, &upload), &upload);
+
+        if (!isFileNameValid(upload.filename))
+        {
+            return Message::InvalidMessage();
+        }
+
+        return upload;
+    }
+
+    case MessageType::ParallelUploadCommand:
+    {
+        Message upload(messageType);
+        std::string sizeAndFilename = parseContent(parseDurability(data, &upload), &upload);
+        size_t separator = sizeAndFilename.find(":");
+        if (separator == std::string::npos)
+        {
+            return Message::InvalidMessage();
+        }
+
+        upload.size = strtoull(sizeAndFilename.c_str(), nullptr, 10);
+        upload.filename = sizeAndFilename.substr(separator + 1);
+
+        if (!isFileNameValid(upload.filename))
+        {
+            return Message::InvalidMessage();
+        }
+
+        return upload;
+    }
+
+    case MessageType::TransferRange:
+    {
+        Message range(messageType);
+        char transferId[64] = "";
+        if (sscanf(data.c_str(), "%" SCNu64 ":%" SCNu64 ":%63s", &range.offset, &range.size, transferId) != 3)
+        {
+            return Message::InvalidMessage();
+        }
+
+        range.transferId = transferId;
+        return range;
+    }
+
+    // "<offset>,<size>;<offset>,<size>...:<filename>"
+    case MessageType::RangeDownloadCommand:
+    {
+        Message download(messageType);
+        size_t separator = data.find(":");
+        if (separator == std::string::npos)
+        {
+            return Message::InvalidMessage();
+        }
+
+        std::istringstream ranges(data.substr(0, separator));
+        std::string range;
+        while (std::getline(ranges, range, ';'))
+        {
+            ByteRange byteRange;
+            if (sscanf(range.c_str(), "%" SCNu64 ",%" SCNu64, &byteRange.offset, &byteRange.size) != 2)
+            {
+                return Message::InvalidMessage();
+            }
+
+            download.ranges.push_back(byteRange);
+        }
+
+        download.filename = data.substr(separator + 1);
+
+        if (!isFileNameValid(download.filename) || download.ranges.empty() ||
+            download.ranges.size() > RANGE_DOWNLOAD_MAX_RANGES)
+        {
+            return Message::InvalidMessage();
+        }
+
+        return download;
+    }
+
     case MessageType::DownloadCommand:
     case MessageType::DeleteCommand:
+    case MessageType::DeltaDownloadCommand:
+    case MessageType::ParallelDownloadCommand:
     {
         if (!isFileNameValid(data))
         {
@@ -226,10 +568,30 @@ std::string toString(MessageType messageType)
         return "FileInfo";
     case MessageType::DataMessage:
         return "DataMessage";
+    case MessageType::CheckedData:
+        return "CheckedData";
     case MessageType::Response:
         return "Response";
     case MessageType::Start:
         return "Start";
+    case MessageType::Multiplex:
+        return "Multiplex";
+    case MessageType::DeltaUploadCommand:
+        return "DeltaUploadCommand";
+    case MessageType::DeltaDownloadCommand:
+        return "DeltaDownloadCommand";
+    case MessageType::ChunkedUploadCommand:
+        return "ChunkedUploadCommand";
+    case MessageType::Resume:
+        return "Resume";
+    case MessageType::ParallelUploadCommand:
+        return "ParallelUploadCommand";
+    case MessageType::ParallelDownloadCommand:
+        return "ParallelDownloadCommand";
+    case MessageType::TransferRange:
+        return "TransferRange";
+    case MessageType::RangeDownloadCommand:
+        return "RangeDownloadCommand";
     }
 
     return "MESSAGE TYPE NOT HANDLED";
@@ -290,11 +652,56 @@ void logMessage(Message *message, MessageDirection direction)
     std::cout << "DIRECTION NOT HANDLED" << std::endl;
 }
 
+// Reads a number and the ':' after it.
+static bool parseField(const char **position, const char *end, uint64_t *value)
+{
+    const char *start = *position;
+    *value = 0;
+
+    while (*position < end && **position >= '0' && **position <= '9' && *position - start < 20)
+    {
+        *value = *value * 10 + (**position - '0');
+        (*position)++;
+    }
+
+    if (*position == start || *position == end || **position != ':')
+    {
+        return false;
+    }
+
+    (*position)++;
+    return true;
+}
+
+// Data messages keep their payload in the buffer they were received in,
+// anything else is parsed from a copy.
+Message Message::Parse(PooledBuffer packet)
+{
+    const char *position = packet.data();
+    const char *end = position + packet.size();
+    uint64_t type;
+    uint64_t offset;
+    uint64_t checksum;
+
+    if (!parseField(&position, end, &type) || type != MessageType::CheckedData)
+    {
+        return Message::Parse(packet.toString());
+    }
+
+    if (!parseField(&position, end, &offset) || !parseField(&position, end, &checksum) || checksum > UINT32_MAX)
+    {
+        return Message::InvalidMessage();
+    }
+
+    size_t consumed = position - packet.data();
+    return Message::CheckedData(offset, packet.slice(consumed, packet.size() - consumed), checksum);
+}
+
 Message Message::Listen(int socket)
 {
-    char buffer[MAX_BUFFER_SIZE];
-    listenPacket(&buffer, socket);
-    Message message = Message::Parse(buffer);
+    PooledBuffer packet;
+    listenPacket(&packet, socket);
+    Message message = Message::Parse(std::move(packet));
     message.socket = socket;
 
     logMessage(&message, MessageDirection::RECEIVE);
@@ -309,6 +716,13 @@ std::string Message::toPacket()
         return "";
     };
 
+    // Acknowledgements go out for every data message, so they are formatted
+    // without a stream, which would allocate.
+    if (type == MessageType::Response && data.empty())
+    {
+        return std::to_string(type) + ":" + std::to_string(responseType);
+    }
+
     std::ostringstream packet;
 
     packet << type << ":";
@@ -316,37 +730,100 @@ std::string Message::toPacket()
     switch (type)
     {
     case MessageType::Login:
-        packet << this->username;
+        packet << this->inlineLimit << ":" << this->username;
         break;
 
     case MessageType::UploadCommand:
+        packet << this->durability << ":" << contentToPacket(this) << inlinePayloadToPacket(this) << this->filename;
+        break;
+
+    case MessageType::DeltaUploadCommand:
+    case MessageType::ChunkedUploadCommand:
+        packet << this->durability << ":" << contentToPacket(this) << this->filename;
+        break;
+
+    case MessageType::ParallelUploadCommand:
+        packet << this->durability << ":" << contentToPacket(this) << this->size << ":" << this->filename;
+        break;
+
+    case MessageType::TransferRange:
+        packet << this->offset << ":" << this->size << ":" << this->transferId;
+        break;
+
+    case MessageType::RangeDownloadCommand:
+        for (size_t i = 0; i < this->ranges.size(); i++)
+        {
+            packet << (i > 0 ? ";" : "") << this->ranges[i].offset << "," << this->ranges[i].size;
+        }
+        packet << ":" << this->filename;
+        break;
+
     case MessageType::DownloadCommand:
     case MessageType::DeleteCommand:
+    case MessageType::DeltaDownloadCommand:
+    case MessageType::ParallelDownloadCommand:
         packet << this->filename;
         break;
 
     case MessageType::Response:
         packet << this->responseType;
+        if (this->data.length() > 0)
+        {
+            packet << ":" << this->data;
+        }
         break;
 
     case MessageType::DataMessage:
         packet << this->data;
         break;
 
+    case MessageType::CheckedData:
+        packet << this->offset << ":" << this->checksum << ":";
+        packet.write(this->body.data(), this->body.size());
+        break;
+
     case MessageType::Start:
+        packet << this->data;
+        if (this->transferId.length() > 0)
+        {
+            packet << ":" << this->transferId;
+        }
+        break;
+
+    case MessageType::Resume:
+        packet << this->offset;
+        break;
+
     case MessageType::EndCommand:
+        if (this->hasChecksum)
+        {
+            packet << this->checksum;
+        }
+        break;
+
     case MessageType::ListServerCommand:
     case MessageType::InvalidMessage:
     case MessageType::SubscribeUpdates:
+    case MessageType::Multiplex:
         break;
 
     case MessageType::RemoteFileUpdate:
+        packet
+            << toString(this->mtime) << ":"
+            << toString(this->atime) << ":"
+            << toString(this->ctime) << ":"
+            << contentToPacket(this)
+            << inlinePayloadToPacket(this)
+            << this->filename;
+        break;
+
     case MessageType::RemoteFileDelete:
     case MessageType::FileInfo:
         packet
             << toString(this->mtime) << ":"
             << toString(this->atime) << ":"
             << toString(this->ctime) << ":"
+            << contentToPacket(this)
             << this->filename;
         break;
     }
@@ -381,9 +858,47 @@ Message Message::send(int socket, bool expectReply)
     return response;
 }
 
+Task<Message> Message::listen(EventLoop *loop, int socket, int timeoutMilliseconds, uint32_t maxSize)
+{
+    PooledBuffer packet;
+    co_await listenPacket(loop, &packet, socket, timeoutMilliseconds, maxSize);
+    Message message = Message::Parse(std::move(packet));
+    message.socket = socket;
+
+    logMessage(&message, MessageDirection::RECEIVE);
+
+    co_return std::move(message);
+}
+
+// Copies what it sends, since whoever replies may be gone before the
+// coroutine is done.
+static Task<Message> sendMessage(EventLoop *loop, Message message, int socket, bool expectReply)
+{
+    logMessage(&message, MessageDirection::SEND);
+
+    co_await sendPacket(loop, socket, message.toPacket());
+
+    Message response = Message::InvalidMessage();
+    if (expectReply)
+        response = co_await Message::listen(loop, socket);
+
+    co_return std::move(response);
+}
+
+Task<Message> Message::reply(EventLoop *loop, Message message, bool expectReply)
+{
+    return sendMessage(loop, std::move(message), this->socket, expectReply);
+}
+
+Task<Message> Message::send(EventLoop *loop, int socket, bool expectReply)
+{
+    this->socket = socket;
+    return sendMessage(loop, *this, socket, expectReply);
+}
+
 Message listenMessage(int socket)
 {
-    char buffer[MAX_BUFFER_SIZE];
+    std::string buffer;
     listenPacket(&buffer, socket);
     Message message = Message::Parse(buffer);
     message.socket = socket;
@@ -413,111 +928,880 @@ bool Message::isOk()
 
 // == FILE ============================================
 
-void deleteFile(Session session, string path)
+static bool writeAll(int file, const char *data, size_t size)
 {
-    Message message = Message::Listen(session.socket);
-    if (message.type != MessageType::Start)
+    size_t written = 0;
+
+    while (written < size)
     {
-        message.panic();
-        return;
+        ssize_t result = write(file, data + written, size - written);
+        if (result < 0)
+        {
+            return false;
+        }
+
+        written += result;
     }
 
-    remove(path.c_str());
-    message.Reply(Message::Response(ResponseType::Ok), false);
+    return true;
 }
 
-void downloadFile(Session session, string temporaryPath, string finalPath)
+// Heap allocations of one transfer stage after its first
+// TRANSFER_PIPELINE_WARMUP chunks, which are added to the pool's metrics
+// once it is done.
+class SteadyAllocations
 {
-    std::fstream file;
-    file.open(temporaryPath, ios::out);
+    uint64_t chunks = 0;
+    uint64_t start = 0;
+
+public:
+    void onChunk()
+    {
+        if (++chunks == TRANSFER_PIPELINE_WARMUP)
+        {
+            start = threadHeapAllocations();
+        }
+    }
+
+    uint64_t finish()
+    {
+        if (chunks < TRANSFER_PIPELINE_WARMUP)
+        {
+            return 0;
+        }
+
+        uint64_t allocations = threadHeapAllocations() - start;
+        bufferPool()->metrics.steadyAllocations += allocations;
+        return allocations;
+    }
+};
+
+// Accepts the codec announced in Start by echoing it in the Ok. Resumable
+// transfers that find a checkpoint of the same transfer id also offer its
+// offset and hash, and continue from where Resume says.
+// Whether a checked data message is intact and the one the receiver waits
+// for, and the rejection to reply with when it isn't.
+static bool isNextChecked(const Message &message, uint64_t received, Message *rejection)
+{
+    if (message.offset != received)
+    {
+        *rejection = Message::Response(ResponseType::Invalid);
+        return false;
+    }
+
+    if (crc32c(message.body.data(), message.body.size()) != message.checksum)
+    {
+        *rejection = Message::Response(ResponseType::Invalid, TRANSFER_CORRUPT_REPLY);
+        return false;
+    }
+
+    return true;
+}
+
+// The stages of a receiver after the network: one thread decompresses and
+// checksums the data messages the caller accepted, another hands them to
+// write, in order. The caller can acknowledge each one as soon as it is
+// pushed.
+class ReceivePipeline
+{
+    SpscQueue<PooledBuffer> received;
+    SpscQueue<PooledBuffer> decoded;
+    std::future<bool> decoder;
+    std::future<bool> writer;
+    uint32_t checksum = 0;
+
+    bool decodeLoop(bool isCompressed)
+    {
+        LzDecoder lzDecoder;
+        PooledBuffer data;
+        bool isDecoded = true;
+        SteadyAllocations allocations;
+
+        if (isCompressed)
+        {
+            lzDecoder.reserve(BUFFER_POOL_BUFFER_SIZE);
+        }
+
+        while (isDecoded && received.pop(&data))
+        {
+            if (isCompressed)
+            {
+                PooledBuffer plain = bufferPool()->acquire();
+                size_t size = 0;
+                isDecoded = lzDecoder.decode(data.data(), data.size(), plain.data(), plain.capacity(), &size);
+                plain.resize(size);
+                data = std::move(plain);
+            }
+
+            checksum = crc32c(data.data(), data.size(), checksum);
+            isDecoded = isDecoded && decoded.push(std::move(data));
+            allocations.onChunk();
+        }
+
+        allocations.finish();
+        received.close();
+        decoded.close();
+        return isDecoded;
+    }
+
+    bool writeLoop(std::function<bool(PooledBuffer &data)> write)
+    {
+        PooledBuffer data;
+        bool isWritten = true;
+        SteadyAllocations allocations;
+
+        while (isWritten && decoded.pop(&data))
+        {
+            isWritten = write(data);
+            data = PooledBuffer();
+            allocations.onChunk();
+        }
 
+        allocations.finish();
+        decoded.close();
+        return isWritten;
+    }
+
+public:
+    ReceivePipeline(bool isCompressed, std::function<bool(PooledBuffer &data)> write)
+        : received(TRANSFER_PIPELINE_DEPTH), decoded(TRANSFER_PIPELINE_DEPTH)
+    {
+        decoder = std::async(launch::async, [this, isCompressed]
+                             { return decodeLoop(isCompressed); });
+        writer = std::async(launch::async, [this, write]
+                            { return writeLoop(write); });
+    }
+
+    ~ReceivePipeline()
+    {
+        finish();
+    }
+
+    // False once a later stage failed.
+    bool push(PooledBuffer data)
+    {
+        return received.push(std::move(data));
+    }
+
+    // Waits until everything pushed was written, and says whether all of
+    // it was and what the checksum of the decoded bytes is.
+    bool finish(uint32_t *checksum = nullptr)
+    {
+        received.close();
+        bool isDecoded = !decoder.valid() || decoder.get();
+        bool isWritten = !writer.valid() || writer.get();
+
+        if (checksum != nullptr)
+        {
+            *checksum = this->checksum;
+        }
+        return isDecoded && isWritten;
+    }
+};
+
+bool receiveFile(Session session, string path, bool isResumable)
+{
     Message message = Message::Listen(session.socket);
 
     if (message.type != MessageType::Start)
     {
         message.panic();
-        return;
+        return false;
     }
 
-    message = message.Reply(Message::Response(ResponseType::Ok));
+    isResumable = isResumable && message.transferId.length() > 0;
+    std::string checkpointPath = path + TRANSFER_CHECKPOINT_SUFFIX;
 
-    while (true)
+    TransferCheckpoint checkpoint;
+    checkpoint.transferId = message.transferId;
+
+    TransferCheckpoint saved;
+    struct stat attributes;
+    if (isResumable && readCheckpoint(checkpointPath, &saved) && saved.transferId == checkpoint.transferId &&
+        stat(path.c_str(), &attributes) == 0 && (uint64_t)attributes.st_size >= saved.offset)
+    {
+        checkpoint = saved;
+    }
+
+    int file = open(path.c_str(), O_WRONLY | O_CREAT, 0644);
+    if (file < 0)
+    {
+        return false;
+    }
+
+    bool isCompressed = message.data == WIRE_COMPRESSION_CODEC;
+
+    std::string accepted = isCompressed ? WIRE_COMPRESSION_CODEC : "";
+    if (checkpoint.offset > 0)
+    {
+        accepted += ":" + std::to_string(checkpoint.offset) + ":" + std::to_string(checkpoint.hash);
+    }
+
+    message = message.Reply(Message::Response(ResponseType::Ok, accepted));
+
+    if (checkpoint.offset > 0)
     {
-        if (message.type == MessageType::DataMessage)
+        if (message.type != MessageType::Resume || (message.offset != 0 && message.offset != checkpoint.offset))
+        {
+            message.panic();
+            close(file);
+            return false;
+        }
+
+        // Resume messages don't carry the id, it stays the one of Start.
+        if (message.offset == 0)
         {
-            file << message.data;
-            message = message.Reply(Message::Response(ResponseType::Ok));
+            std::string transferId = checkpoint.transferId;
+            checkpoint = TransferCheckpoint();
+            checkpoint.transferId = transferId;
+        }
+
+        message = message.Reply(Message::Response(ResponseType::Ok));
+    }
+
+    if (ftruncate(file, checkpoint.offset) != 0 || lseek(file, checkpoint.offset, SEEK_SET) < 0)
+    {
+        close(file);
+        return false;
+    }
+
+    uint64_t checkpointed = checkpoint.offset;
+    auto saveCheckpoint = [&checkpoint, &checkpointed, &checkpointPath, file, isResumable]()
+    {
+        if (!isResumable || checkpoint.offset == checkpointed)
+        {
+            return;
+        }
+
+        if (fdatasync(file) == 0 && writeCheckpoint(checkpointPath, checkpoint))
+        {
+            checkpointed = checkpoint.offset;
+        }
+    };
+
+    // Checkpoints are taken by the writing stage, and after it stopped.
+    auto write = [&](PooledBuffer &data)
+    {
+        if (!writeAll(file, data.data(), data.size()))
+        {
+            return false;
+        }
+
+        if (isResumable)
+        {
+            checkpoint.offset += data.size();
+            checkpoint.hash = fnv1a(data.data(), data.size(), checkpoint.hash);
+
+            if (checkpoint.offset - checkpointed >= TRANSFER_CHECKPOINT_BYTES)
+            {
+                saveCheckpoint();
+            }
+        }
+
+        return true;
+    };
+
+    ReceivePipeline pipeline(isCompressed, write);
+
+    uint64_t received = 0;
+    uint32_t checksum = 0;
+    Message rejection = Message::Empty();
+    int corrupted = 0;
+
+    SteadyAllocations allocations;
+
+    while (message.type == MessageType::CheckedData)
+    {
+        if (!isNextChecked(message, received, &rejection))
+        {
+            if (rejection.data == TRANSFER_CORRUPT_REPLY && ++corrupted > TRANSFER_MAX_CORRUPT_CHUNKS)
+            {
+                std::cout << Color::red << "Too many corrupt chunks, giving up" << Color::reset << std::endl;
+                message.Reply(rejection, false);
+                break;
+            }
+
+            message = message.Reply(rejection);
             continue;
         }
 
-        if (message.type == MessageType::EndCommand)
+        received += message.body.size();
+
+        if (!pipeline.push(std::move(message.body)))
         {
-            message.Reply(Message::Response(ResponseType::Ok), false);
             break;
         }
 
+        message = message.Reply(Message::Response(ResponseType::Ok));
+        allocations.onChunk();
+    }
+
+    allocations.finish();
+    bool isWritten = pipeline.finish(&checksum);
+
+    // What was written doesn't match what was sent, so a retry must not
+    // resume from it.
+    if (isWritten && message.type == MessageType::EndCommand && (!message.hasChecksum || message.checksum != checksum))
+    {
+        std::cout << Color::red << "Checksum mismatch, discarding transfer" << Color::reset << std::endl;
+        message.Reply(Message::Response(ResponseType::Invalid), false);
+        removeCheckpoint(checkpointPath);
+        close(file);
+        return false;
+    }
+
+    if (!isWritten || message.type != MessageType::EndCommand)
+    {
+        saveCheckpoint();
         message.panic();
+        close(file);
+        return false;
     }
 
-    file.close();
-    rename(temporaryPath.c_str(), finalPath.c_str());
+    message.Reply(Message::Response(ResponseType::Ok), false);
+    close(file);
+    removeCheckpoint(checkpointPath);
+    return true;
 }
 
-void sendFile(Session session, string path)
+bool downloadFile(Session session, string temporaryPath, string finalPath)
 {
-    std::fstream file;
-    file.open(path, ios::in);
+    if (!receiveFile(session, temporaryPath, true))
+    {
+        return false;
+    }
 
-    Message message = Message::Start().send(session.socket);
+    return rename(temporaryPath.c_str(), finalPath.c_str()) == 0;
+}
 
-    if (!message.isOk())
+bool sendFile(Session session, string path)
+{
+    std::ifstream file(path, ios::in | ios::binary);
+    return sendFile(session, file, path);
+}
+
+// Hashes the first offset bytes the way the receiver did and leaves in data
+// what follows them, or rewinds to right after the sample when they differ.
+static bool skipReceived(std::istream &file, std::string sample, uint64_t offset, uint64_t receivedHash, std::string *data)
+{
+    size_t fromSample = std::min<uint64_t>(offset, sample.size());
+    uint64_t hash = fnv1a(sample.data(), fromSample);
+    uint64_t skipped = fromSample;
+
+    std::string buffer(TRANSFER_MAX_CHUNK, '\0');
+    while (skipped < offset && file)
     {
-        message.panic();
-        file.close();
-        return;
+        file.read(&buffer[0], std::min<uint64_t>(buffer.size(), offset - skipped));
+        hash = fnv1a(buffer.data(), file.gcount(), hash);
+        skipped += file.gcount();
     }
 
-    char ch;
-    string line;
-    std::cout << "Sending file..." << std::endl;
+    if (skipped == offset && hash == receivedHash)
+    {
+        *data = sample.substr(fromSample);
+        return true;
+    }
+
+    *data = sample;
+    file.clear();
+    file.seekg(sample.size());
+    return false;
+}
+
+// A data message that was sent and not acknowledged yet. Those sent from
+// body keep where they came from instead of their payload.
+class SentData
+{
+public:
+    uint64_t offset = 0;
+    PooledBuffer payload;
+    uint32_t checksum = 0;
+
+    uint64_t position = 0;
+    size_t size = 0;
+};
+
+// Bytes as the reading stage of sendStream takes them from the file. Those
+// read from body also say where, so they can be sent from there.
+class ReadData
+{
+public:
+    PooledBuffer data;
+    bool isBody = false;
+    uint64_t position = 0;
+};
+
+// Sends data and then up to remaining more bytes of file as data messages,
+// and ends the transfer once the receiver acknowledged all of them. When
+// the bytes are also open as body and go out uncompressed, they are sent
+// from it with sendfile instead of being read through file.
+//
+// Reading, checksumming and compressing, and sending run on threads of
+// their own, so a transfer takes about as long as the slowest of them.
+// Chunks are read into pooled buffers that are sent from as they are and
+// go back to the pool once acknowledged.
+static bool sendStream(Session session, std::istream &file, std::string data, uint64_t remaining, bool isCompressed, int body)
+{
+    Message message = Message::Empty();
+    TransferWindow window(session.socket);
+
+    RingBuffer<SentData> unacked(TRANSFER_MAX_MESSAGES_IN_FLIGHT);
+    std::map<uint64_t, SentData> rejected;
+    uint32_t checksum = 0;
+    int corrupted = 0;
+
+    bool isZeroCopy = body >= 0 && !isCompressed && file;
+    uint64_t position = 0;
+    if (isZeroCopy)
+    {
+        struct stat attributes;
+        std::streamoff start = file.tellg();
+        isZeroCopy = start >= 0 && fstat(body, &attributes) == 0;
+        position = start;
+        remaining = isZeroCopy ? std::min<uint64_t>(remaining, std::max<int64_t>(0, attributes.st_size - start)) : remaining;
+    }
+
+    SpscQueue<ReadData> read(TRANSFER_PIPELINE_DEPTH);
+    SpscQueue<SentData> prepared(TRANSFER_PIPELINE_DEPTH);
+    std::atomic<size_t> chunkSize(window.chunkSize());
+    std::atomic<bool> isReadFailed(false);
 
-    while (file >> noskipws >> ch)
+    auto readStage = [&]()
     {
-        line.push_back(ch);
+        SteadyAllocations allocations;
+        size_t taken = 0;
 
-        if (line.size() == 100)
+        while (true)
         {
-            message = message.Reply(Message::DataMessage(line));
+            ReadData chunk;
+            chunk.data = bufferPool()->acquire();
+            size_t size = std::min<size_t>(chunkSize, chunk.data.capacity());
+
+            if (taken < data.size())
+            {
+                size = std::min(size, data.size() - taken);
+                memcpy(chunk.data.data(), data.data() + taken, size);
+                chunk.data.resize(size);
+                taken += size;
+            }
+            else if (isZeroCopy && remaining > 0)
+            {
+                size = std::min<uint64_t>(size, remaining);
+                chunk.data.resize(size);
+                if (pread(body, chunk.data.data(), size, position) != (ssize_t)size)
+                {
+                    isReadFailed = true;
+                    break;
+                }
+
+                chunk.isBody = true;
+                chunk.position = position;
+                position += size;
+                remaining -= size;
+            }
+            else if (!isZeroCopy && remaining > 0 && file)
+            {
+                file.read(chunk.data.data(), std::min<uint64_t>(size, remaining));
+                chunk.data.resize(file.gcount());
+                remaining -= file.gcount();
+            }
 
-            if (!message.isOk())
+            if (chunk.data.empty() || !read.push(std::move(chunk)))
             {
-                message.panic();
-                file.close();
-                return;
+                break;
             }
 
-            line.clear();
+            allocations.onChunk();
+        }
+
+        allocations.finish();
+        read.close();
+    };
+
+    auto prepareStage = [&]()
+    {
+        LzEncoder encoder;
+        uint64_t offset = 0;
+        ReadData chunk;
+        SteadyAllocations allocations;
+
+        if (isCompressed)
+        {
+            encoder.reserve(BUFFER_POOL_BUFFER_SIZE);
         }
+
+        while (read.pop(&chunk))
+        {
+            checksum = crc32c(chunk.data.data(), chunk.data.size(), checksum);
+
+            SentData sent;
+            sent.offset = offset;
+
+            if (chunk.isBody)
+            {
+                // The bytes pass through memory once to be checksummed, but
+                // are not copied into the socket.
+                sent.checksum = crc32c(chunk.data.data(), chunk.data.size());
+                sent.position = chunk.position;
+                sent.size = chunk.data.size();
+            }
+            else if (isCompressed)
+            {
+                sent.payload = bufferPool()->acquire(LZ_STREAM_MESSAGE_BOUND(chunk.data.size()));
+                sent.payload.resize(encoder.encode(chunk.data.data(), chunk.data.size(), sent.payload.data()));
+                sent.checksum = crc32c(sent.payload.data(), sent.payload.size());
+            }
+            else
+            {
+                sent.checksum = crc32c(chunk.data.data(), chunk.data.size());
+                sent.payload = std::move(chunk.data);
+            }
+
+            chunk = ReadData();
+            offset += sent.size > 0 ? sent.size : sent.payload.size();
+            if (!prepared.push(std::move(sent)))
+            {
+                break;
+            }
+
+            allocations.onChunk();
+        }
+
+        allocations.finish();
+        read.close();
+        prepared.close();
+    };
+
+    // Data messages are pipelined: the receiver acknowledges each one in
+    // order, and acknowledgements are only waited for once the window is
+    // full. Rejected ones are sent again, in order, before anything new is
+    // taken from the pipeline.
+    auto awaitAck = [&]()
+    {
+        message = Message::Listen(session.socket);
+
+        if (message.type != MessageType::Response || unacked.empty() ||
+            (message.responseType != ResponseType::Ok && message.responseType != ResponseType::Invalid))
+        {
+            message.panic();
+            return false;
+        }
+
+        if (message.responseType == ResponseType::Ok)
+        {
+            window.onAck();
+        }
+        else
+        {
+            window.onReject();
+            rejected[unacked.front().offset] = std::move(unacked.front());
+
+            if (message.data == TRANSFER_CORRUPT_REPLY && ++corrupted > TRANSFER_MAX_CORRUPT_CHUNKS)
+            {
+                std::cout << Color::red << "Too many corrupt chunks, giving up" << Color::reset << std::endl;
+                return false;
+            }
+        }
+
+        unacked.pop_front();
+        return true;
+    };
+
+    // The header is formatted in place and sent together with the payload,
+    // which isn't copied into a packet.
+    auto send = [&](SentData sent)
+    {
+        while (!window.canSend())
+        {
+            if (!awaitAck())
+            {
+                return false;
+            }
+        }
+
+        char header[64];
+        int headerSize = snprintf(header, sizeof(header), "%d:%" PRIu64 ":%" PRIu32 ":", MessageType::CheckedData, sent.offset, sent.checksum);
+
+        size_t size = sent.size > 0 ? sent.size : sent.payload.size();
+        bool isSent = sent.size > 0
+                          ? sendFilePacket(session.socket, header, headerSize, body, sent.position, size)
+                          : sendPacket(session.socket, header, headerSize, sent.payload.data(), size);
+        if (!isSent)
+        {
+            return false;
+        }
+
+        window.onSend(size);
+        unacked.push_back(std::move(sent));
+        return true;
+    };
+
+    auto sendRejected = [&rejected, &send]()
+    {
+        while (!rejected.empty())
+        {
+            SentData sent = std::move(rejected.begin()->second);
+            rejected.erase(rejected.begin());
+
+            if (!send(std::move(sent)))
+            {
+                return false;
+            }
+        }
+
+        return true;
+    };
+
+    std::cout << "Sending file..." << std::endl;
+
+    auto reader = std::async(launch::async, readStage);
+    auto preparer = std::async(launch::async, prepareStage);
+
+    bool isSent = true;
+    SentData sent;
+    SteadyAllocations allocations;
+    while (isSent)
+    {
+        isSent = sendRejected();
+        if (!isSent || !prepared.pop(&sent))
+        {
+            break;
+        }
+
+        isSent = send(std::move(sent));
+        chunkSize = window.chunkSize();
+        allocations.onChunk();
+    }
+
+    while (isSent && (!unacked.empty() || !rejected.empty()))
+    {
+        isSent = sendRejected() && (unacked.empty() || awaitAck());
+    }
+
+    uint64_t steadyAllocations = allocations.finish();
+
+    // Stops the other stages when sending failed.
+    prepared.close();
+    preparer.wait();
+    reader.wait();
+
+    if (!isSent || isReadFailed)
+    {
+        return false;
+    }
+
+    std::cout << "OK! (" << window.current().toString();
+    if (COUNT_HEAP_ALLOCATIONS)
+    {
+        std::cout << ", " << steadyAllocations << " allocations in steady state";
+    }
+    std::cout << ")" << std::endl;
+
+    message = Message::EndCommand(checksum).send(session.socket);
+    return message.isOk();
+}
+
+// Offers compression when a sample of the start of the file shrinks, and
+// sends the file as is if the receiver doesn't take it up. Named transfers
+// can be resumed: when the receiver offers a checkpoint that matches, only
+// what comes after it is sent.
+bool sendFile(Session session, std::istream &file, std::string name, int body)
+{
+    std::string sample(WIRE_COMPRESSION_SAMPLE_SIZE, '\0');
+    file.read(&sample[0], WIRE_COMPRESSION_SAMPLE_SIZE);
+    sample.resize(file.gcount());
+
+    bool isOffered = isWorthCompressing(sample);
+    std::string transferId = name.empty() ? "" : transferIdOf(name, sample);
+    Message message = Message::Start(isOffered ? WIRE_COMPRESSION_CODEC : "", transferId).send(session.socket);
+
+    if (!message.isOk())
+    {
+        message.panic();
+        return false;
     }
 
-    if (line.size() > 0)
+    std::string codec = message.data.substr(0, message.data.find(":"));
+    uint64_t offset = 0;
+    uint64_t receivedHash = 0;
+    sscanf(message.data.c_str() + codec.size(), ":%" SCNu64 ":%" SCNu64, &offset, &receivedHash);
+
+    std::string data = sample;
+
+    if (offset > 0)
     {
-        message = message.Reply(Message::DataMessage(line));
+        bool isResumed = skipReceived(file, sample, offset, receivedHash, &data);
+        if (!file && !file.eof())
+        {
+            return false;
+        }
+
+        message = message.Reply(Message::Resume(isResumed ? offset : 0));
 
         if (!message.isOk())
         {
             message.panic();
-            file.close();
-            return;
+            return false;
+        }
+
+        if (isResumed)
+        {
+            std::cout << "Resuming from byte " << offset << std::endl;
+        }
+    }
+
+    return sendStream(session, file, data, UINT64_MAX, isOffered && codec == WIRE_COMPRESSION_CODEC, body);
+}
+
+bool sendRange(Session session, std::istream &file, uint64_t offset, uint64_t size, int body)
+{
+    file.seekg(offset);
+
+    std::string sample(std::min<uint64_t>(WIRE_COMPRESSION_SAMPLE_SIZE, size), '\0');
+    file.read(&sample[0], sample.size());
+    if ((size_t)file.gcount() != sample.size())
+    {
+        return false;
+    }
+
+    bool isOffered = isWorthCompressing(sample);
+    Message message = Message::Start(isOffered ? WIRE_COMPRESSION_CODEC : "").send(session.socket);
+
+    if (!message.isOk())
+    {
+        message.panic();
+        return false;
+    }
+
+    return sendStream(session, file, sample, size - sample.size(), isOffered && message.data == WIRE_COMPRESSION_CODEC, body);
+}
+
+bool receiveRange(Session session, int file, uint64_t offset, uint64_t size)
+{
+    Message message = Message::Listen(session.socket);
+
+    if (message.type != MessageType::Start)
+    {
+        message.panic();
+        return false;
+    }
+
+    bool isCompressed = message.data == WIRE_COMPRESSION_CODEC;
+    uint64_t received = 0;
+    uint64_t receivedWire = 0;
+    uint32_t checksum = 0;
+    Message rejection = Message::Empty();
+    int corrupted = 0;
+
+    auto write = [&](PooledBuffer &data)
+    {
+        if (received + data.size() > size ||
+            pwrite(file, data.data(), data.size(), offset + received) != (ssize_t)data.size())
+        {
+            return false;
         }
 
-        line.clear();
+        received += data.size();
+        return true;
+    };
+
+    ReceivePipeline pipeline(isCompressed, write);
+
+    message = message.Reply(Message::Response(ResponseType::Ok, isCompressed ? WIRE_COMPRESSION_CODEC : ""));
+
+    SteadyAllocations allocations;
+
+    while (message.type == MessageType::CheckedData)
+    {
+        if (!isNextChecked(message, receivedWire, &rejection))
+        {
+            if (rejection.data == TRANSFER_CORRUPT_REPLY && ++corrupted > TRANSFER_MAX_CORRUPT_CHUNKS)
+            {
+                std::cout << Color::red << "Too many corrupt chunks, giving up" << Color::reset << std::endl;
+                message.Reply(rejection, false);
+                break;
+            }
+
+            message = message.Reply(rejection);
+            continue;
+        }
+
+        receivedWire += message.body.size();
+
+        if (!pipeline.push(std::move(message.body)))
+        {
+            break;
+        }
+
+        message = message.Reply(Message::Response(ResponseType::Ok));
+        allocations.onChunk();
+    }
+
+    allocations.finish();
+    bool isWritten = pipeline.finish(&checksum);
+
+    if (isWritten && message.type == MessageType::EndCommand && message.checksum != checksum)
+    {
+        std::cout << Color::red << "Checksum mismatch in range" << Color::reset << std::endl;
+        message.Reply(Message::Response(ResponseType::Invalid), false);
+        return false;
     }
 
-    std::cout << "OK!" << std::endl;
+    if (!isWritten || message.type != MessageType::EndCommand || !message.hasChecksum || received != size)
+    {
+        message.panic();
+        return false;
+    }
 
-    message.Reply(Message::EndCommand());
+    message.Reply(Message::Response(ResponseType::Ok), false);
+    return true;
+}
+
+bool readInlinePayload(std::string path, int inlineLimit, std::string *data)
+{
+    struct stat attributes;
+    if (stat(path.c_str(), &attributes) != 0 || attributes.st_size > inlineLimit)
+    {
+        return false;
+    }
+
+    std::ifstream file(path, ios::in | ios::binary);
+    return readInlinePayload(file, inlineLimit, data);
+}
+
+bool readInlinePayload(std::istream &file, int inlineLimit, std::string *data)
+{
+    if (!file || inlineLimit < 0)
+    {
+        return false;
+    }
+
+    data->resize(inlineLimit + 1);
+    file.read(&(*data)[0], inlineLimit + 1);
+    data->resize(file.gcount());
+
+    return data->size() <= (size_t)inlineLimit;
+}
+
+bool writeInlinePayload(std::string data, std::string path)
+{
+    std::fstream file;
+    file.open(path, ios::out | ios::binary);
+    file << data;
     file.close();
+
+    return !file.fail();
+}
+
+bool commitInlinePayload(std::string data, std::string temporaryPath, std::string finalPath)
+{
+    if (!writeInlinePayload(data, temporaryPath) || rename(temporaryPath.c_str(), finalPath.c_str()) != 0)
+    {
+        remove(temporaryPath.c_str());
+        return false;
+    }
+
+    return true;
 }
 
 ServerConnection::ServerConnection(char *serverIpAddress, int port, std::string username)
@@ -525,11 +1809,28 @@ ServerConnection::ServerConnection(char *serverIpAddress, int port, std::string
     this->serverIpAddress = serverIpAddress;
     this->port = port;
     this->username = username;
+    this->isAddressResolved = resolveServerAddress(serverIpAddress, port, &serverAddress);
 }
 
 Message ServerConnection::connect()
 {
-    int socket = connectToServer(serverIpAddress, port);
+    if (multiplexer != nullptr)
+    {
+        Message message = Message::Response(ResponseType::Ok, std::to_string(inlineLimit));
+        message.socket = multiplexer->openStream();
+
+        if (message.socket == -1)
+        {
+            std::cout << "Connection with server lost!" << std::endl;
+            exit(-1);
+        }
+
+        return message;
+    }
+
+    int socket = isAddressResolved
+                     ? connectToAddress(serverAddress)
+                     : connectToServer(serverIpAddress, port);
     auto message = Message::Login(username).send(socket);
 
     if (!message.isOk())
@@ -538,5 +1839,22 @@ Message ServerConnection::connect()
         throw new std::exception();
     }
 
+    inlineLimit = std::min(INLINE_PAYLOAD_LIMIT, atoi(message.data.c_str()));
+
     return message;
-}
\ No newline at end of file
+}
+// Opens a single authenticated connection and carries every later connect()
+// as a new stream over it.
+void ServerConnection::enableMultiplexing()
+{
+    auto message = connect();
+    message = message.Reply(Message::Multiplex());
+
+    if (!message.isOk())
+    {
+        message.panic();
+        throw new std::exception();
+    }
+
+    multiplexer = new Multiplexer(message.socket, true, nullptr);
+}
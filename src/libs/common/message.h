@@ -1,7 +1,24 @@
+#pragma once
+
 #include <string.h>
 #include <iostream>
+#include <vector>
+#include <stdint.h>
 
 #include "socket.h"
+#include "multiplexer.h"
+
+// Files up to this size travel inside UploadCommand and RemoteFileUpdate
+// instead of a separate Start/DataMessage/EndCommand transfer. Each side
+// announces its limit on Login and the smaller one is used.
+#define INLINE_PAYLOAD_LIMIT (64 * 1024)
+
+// Most ranges a single RangeDownloadCommand may ask for.
+#define RANGE_DOWNLOAD_MAX_RANGES 64
+
+// Reply data to an upload of exactly what the server already holds, which
+// ends it without any transfer.
+#define UPLOAD_UNCHANGED "unchanged"
 
 enum MessageType
 {
@@ -20,6 +37,16 @@ enum MessageType
     DataMessage,
     Response,
     Start,
+    Multiplex,
+    DeltaUploadCommand,
+    DeltaDownloadCommand,
+    ChunkedUploadCommand,
+    Resume,
+    ParallelUploadCommand,
+    ParallelDownloadCommand,
+    TransferRange,
+    RangeDownloadCommand,
+    CheckedData,
 };
 
 enum ResponseType
@@ -29,6 +56,26 @@ enum ResponseType
     FileNotFound,
 };
 
+// How much an upload survives of a crash once the server acknowledges it.
+// DefaultDurability leaves the choice to the server.
+enum Durability
+{
+    DefaultDurability,
+    NoSync,
+    BatchedSync,
+    ImmediateSync,
+};
+
+class ByteRange
+{
+public:
+    uint64_t offset;
+    uint64_t size;
+
+    // The part of the range within a file of fileSize bytes.
+    ByteRange clip(uint64_t fileSize);
+};
+
 class Message
 {
 protected:
@@ -47,27 +94,68 @@ public:
     std::string username;
     int socket;
 
+    bool hasInlineData = false;
+    int inlineLimit = 0;
+    Durability durability = Durability::DefaultDurability;
+
+    // Transfers that can be resumed carry an id in Start, and the offset
+    // they continue from in Resume.
+    std::string transferId;
+    uint64_t offset = 0;
+    // Size of the file in ParallelUploadCommand, of the range in TransferRange.
+    uint64_t size = 0;
+    // Parts of the file a RangeDownloadCommand asks for, in order.
+    std::vector<ByteRange> ranges;
+
+    // What the file holds, in upload commands and file metadata. The hash
+    // is "" when the sender doesn't know it.
+    std::string contentHash;
+    uint64_t contentSize = 0;
+
+    // CRC32C of the data in CheckedData, which also carries its offset in
+    // the transfer, and of everything transferred in EndCommand.
+    bool hasChecksum = false;
+    uint32_t checksum = 0;
+    // Payload of CheckedData, left in the buffer it was read or received in.
+    PooledBuffer body;
+
     time_t mtime;
     time_t atime;
     time_t ctime;
 
     static Message Empty();
-    static Message UploadCommand(std::string filename);
+    static Message UploadCommand(std::string filename, Durability durability = Durability::DefaultDurability);
+    static Message UploadCommand(std::string filename, std::string inlineData, Durability durability = Durability::DefaultDurability);
     static Message DownloadCommand(std::string filename);
+    static Message DeltaUploadCommand(std::string filename, Durability durability = Durability::DefaultDurability);
+    static Message DeltaDownloadCommand(std::string filename);
+    static Message ChunkedUploadCommand(std::string filename, Durability durability = Durability::DefaultDurability);
+    static Message ParallelUploadCommand(std::string filename, uint64_t size, Durability durability = Durability::DefaultDurability);
+    static Message ParallelDownloadCommand(std::string filename);
+    static Message TransferRange(std::string transferId, uint64_t offset, uint64_t size);
+    static Message RangeDownloadCommand(std::string filename, std::vector<ByteRange> ranges);
     static Message DeleteCommand(std::string filename);
-    static Message Login(std::string username);
+    static Message Login(std::string username, int inlineLimit = INLINE_PAYLOAD_LIMIT);
     static Message EndCommand();
+    static Message EndCommand(uint32_t checksum);
     static Message ListServerCommand();
     static Message SubscribeUpdates();
     static Message FileInfo(std::string filename, time_t mtime, time_t atime, time_t ctime);
     static Message RemoteFileUpdate(std::string filename, time_t mtime, time_t atime, time_t ctime);
+    static Message RemoteFileUpdate(std::string filename, time_t mtime, time_t atime, time_t ctime, std::string inlineData);
     static Message RemoteFileDelete(std::string filename, time_t mtime, time_t atime, time_t ctime);
     static Message Response(ResponseType type);
+    static Message Response(ResponseType type, std::string data);
     static Message Start();
+    static Message Start(std::string codec, std::string transferId = "");
+    static Message Resume(uint64_t offset);
+    static Message Multiplex();
     static Message DataMessage(std::string data);
+    static Message CheckedData(uint64_t offset, PooledBuffer body, uint32_t checksum);
     static Message InvalidMessage();
 
-    static Message Parse(char *_buffer);
+    static Message Parse(std::string buffer);
+    static Message Parse(PooledBuffer packet);
 
     static Message Listen(int socket);
     std::string toPacket();
@@ -75,6 +163,14 @@ public:
     Message Reply(Message message, bool expectReply = true);
     Message send(int socket, bool expectReply = true);
 
+    // The same for coroutines on loop, which wait for the socket without
+    // holding up the loop. listen gives an empty message once
+    // timeoutMilliseconds passed, when that is not negative, and for
+    // packets larger than maxSize.
+    static Task<Message> listen(EventLoop *loop, int socket, int timeoutMilliseconds = -1, uint32_t maxSize = MAX_PACKET_SIZE);
+    Task<Message> reply(EventLoop *loop, Message message, bool expectReply = true);
+    Task<Message> send(EventLoop *loop, int socket, bool expectReply = true);
+
     bool isOk();
 
     void panic();
@@ -82,9 +178,22 @@ public:
 
 Message listenMessage(int socket);
 
-void deleteFile(Session session, std::string path);
-void downloadFile(Session session, std::string temporaryPath, std::string finalPath);
-void sendFile(Session session, std::string path);
+bool receiveFile(Session session, std::string path, bool isResumable = false);
+bool downloadFile(Session session, std::string temporaryPath, std::string finalPath);
+bool sendFile(Session session, std::string path);
+// body, when given, holds the same bytes as file and lets what isn't
+// compressed go out with sendfile.
+bool sendFile(Session session, std::istream &file, std::string name = "", int body = -1);
+
+// A range of a file: size bytes from offset, written at the same offset on
+// the receiving side.
+bool sendRange(Session session, std::istream &file, uint64_t offset, uint64_t size, int body = -1);
+bool receiveRange(Session session, int file, uint64_t offset, uint64_t size);
+
+bool readInlinePayload(std::string path, int inlineLimit, std::string *data);
+bool readInlinePayload(std::istream &file, int inlineLimit, std::string *data);
+bool writeInlinePayload(std::string data, std::string path);
+bool commitInlinePayload(std::string data, std::string temporaryPath, std::string finalPath);
 
 class ServerConnection
 {
@@ -92,8 +201,16 @@ public:
     int port;
     char *serverIpAddress;
     std::string username;
+    int inlineLimit = 0;
+
+    bool isAddressResolved = false;
+    sockaddr_in serverAddress;
+
+    Multiplexer *multiplexer = nullptr;
+
     ServerConnection(){};
 
     ServerConnection(char *serverIpAddress, int port, std::string username);
     Message connect();
+    void enableMultiplexing();
 };
\ No newline at end of file
@@ -0,0 +1,461 @@
+#include <vector>
+#include <iostream>
+#include <unistd.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <errno.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <arpa/inet.h>
+#include <netinet/tcp.h>
+
+#include "multiplexer.h"
+#include "socket.h"
+#include "helpers.h"
+
+// Deletes detached multiplexers, off their own threads which the
+// destructor waits for.
+static WorkerPool *reaper()
+{
+    static WorkerPool pool(1);
+    return &pool;
+}
+
+Multiplexer::Multiplexer(int socket, bool isInitiator, std::function<void(int)> onStreamOpened, bool isDetached)
+{
+    this->socket = socket;
+    this->isDetached = isDetached;
+    this->nextStreamId = isInitiator ? 1 : 2;
+    this->onStreamOpened = onStreamOpened;
+
+    // Frames of many small request/response conversations share this
+    // connection, waiting for a full segment would stall all of them
+    int noDelay = 1;
+    setsockopt(socket, IPPROTO_TCP, TCP_NODELAY, &noDelay, sizeof(noDelay));
+
+    pipe(wakeupPipe);
+    fcntl(wakeupPipe[0], F_SETFL, O_NONBLOCK);
+    fcntl(wakeupPipe[1], F_SETFL, O_NONBLOCK);
+
+    reader = std::async(
+        std::launch::async,
+        [this]
+        { readLoop(); });
+
+    writer = std::async(
+        std::launch::async,
+        [this]
+        { writeLoop(); });
+}
+
+Multiplexer::~Multiplexer()
+{
+    shutdown();
+    reader.wait();
+    writer.wait();
+
+    close(socket);
+    close(wakeupPipe[0]);
+    close(wakeupPipe[1]);
+}
+
+bool Multiplexer::isRemoteStream(uint32_t streamId)
+{
+    return (streamId % 2) != (nextStreamId % 2);
+}
+
+bool Multiplexer::isOpen()
+{
+    std::unique_lock<std::mutex> lock(_mutex);
+    return !isClosed;
+}
+
+// Must be called with _mutex held. Returns the application side of the stream.
+int Multiplexer::createStream(uint32_t streamId)
+{
+    int sockets[2];
+    if (socketpair(AF_UNIX, SOCK_STREAM, 0, sockets) != 0)
+    {
+        return -1;
+    }
+
+    int bufferSize = MULTIPLEXER_STREAM_WINDOW;
+    setsockopt(sockets[0], SOL_SOCKET, SO_SNDBUF, &bufferSize, sizeof(bufferSize));
+    setsockopt(sockets[1], SOL_SOCKET, SO_SNDBUF, &bufferSize, sizeof(bufferSize));
+    fcntl(sockets[0], F_SETFL, O_NONBLOCK);
+
+    MultiplexedStream stream;
+    stream.socket = sockets[0];
+    streams[streamId] = stream;
+
+    return sockets[1];
+}
+
+int Multiplexer::openStream()
+{
+    int applicationSocket;
+
+    {
+        std::unique_lock<std::mutex> lock(_mutex);
+
+        if (isClosed)
+        {
+            return -1;
+        }
+
+        applicationSocket = createStream(nextStreamId);
+        streams[nextStreamId].isAnnounced = false;
+        nextStreamId += 2;
+    }
+
+    wakeup();
+    return applicationSocket;
+}
+
+void Multiplexer::wakeup()
+{
+    char signal = 0;
+    write(wakeupPipe[1], &signal, 1);
+}
+
+bool Multiplexer::sendFrame(const Frame &frame)
+{
+    return sendFrame(frame.streamId, frame.kind, frame.payload.data(), frame.payload.size());
+}
+
+// The payload goes out from where it is, after the header.
+bool Multiplexer::sendFrame(uint32_t streamId, FrameKind kind, const char *payload, size_t size)
+{
+    char header[MULTIPLEXER_FRAME_HEADER_SIZE];
+
+    uint32_t networkStreamId = htonl(streamId);
+    uint32_t length = htonl(size);
+
+    memcpy(header, &networkStreamId, 4);
+    header[4] = (char)kind;
+    memcpy(header + 5, &length, 4);
+
+    iovec parts[2] = {
+        {header, MULTIPLEXER_FRAME_HEADER_SIZE},
+        {(void *)payload, size},
+    };
+
+    return writeExactly(socket, parts, size > 0 ? 2 : 1);
+}
+
+// Must be called with _mutex held. Moves as much queued data as the
+// application socket accepts without blocking.
+void Multiplexer::deliver(MultiplexedStream *stream)
+{
+    while (!stream->pendingDelivery.empty())
+    {
+        int written = send(
+            stream->socket,
+            stream->pendingDelivery.data(),
+            stream->pendingDelivery.size(),
+            MSG_NOSIGNAL | MSG_DONTWAIT);
+
+        if (written <= 0)
+        {
+            if (written < 0 && errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)
+            {
+                // The application closed its side, nothing else will be read
+                stream->pendingCredit += stream->pendingDelivery.size();
+                stream->pendingDelivery.clear();
+            }
+            return;
+        }
+
+        stream->pendingDelivery.erase(0, written);
+        stream->pendingCredit += written;
+    }
+}
+
+void Multiplexer::readLoop()
+{
+    std::vector<char> payload(MULTIPLEXER_STREAM_WINDOW);
+
+    while (true)
+    {
+        char header[MULTIPLEXER_FRAME_HEADER_SIZE];
+        if (!readExactly(socket, header, MULTIPLEXER_FRAME_HEADER_SIZE))
+        {
+            break;
+        }
+
+        uint32_t streamId;
+        uint32_t length;
+        memcpy(&streamId, header, 4);
+        memcpy(&length, header + 5, 4);
+        streamId = ntohl(streamId);
+        length = ntohl(length);
+        FrameKind kind = (FrameKind)header[4];
+
+        if (length > MULTIPLEXER_STREAM_WINDOW)
+        {
+            std::cerr << "Multiplexed frame of " << length << " bytes exceeds the stream window" << std::endl;
+            break;
+        }
+
+        if (length > 0 && !readExactly(socket, payload.data(), length))
+        {
+            break;
+        }
+
+        int openedSocket = -1;
+
+        {
+            std::unique_lock<std::mutex> lock(_mutex);
+
+            auto entry = streams.find(streamId);
+
+            if (entry == streams.end() &&
+                kind == FrameKind::StreamDataFrame &&
+                isRemoteStream(streamId) &&
+                streamId > lastRemoteStreamId)
+            {
+                lastRemoteStreamId = streamId;
+                openedSocket = createStream(streamId);
+                entry = streams.find(streamId);
+            }
+
+            if (entry == streams.end())
+            {
+                // Frame for a stream that was already closed on this side
+                continue;
+            }
+
+            MultiplexedStream *stream = &entry->second;
+
+            if (kind == FrameKind::StreamDataFrame)
+            {
+                // A peer sending past the credit it was granted would have
+                // pendingDelivery grow without bound.
+                if (stream->pendingDelivery.size() + stream->pendingCredit + length > MULTIPLEXER_STREAM_WINDOW)
+                {
+                    std::cerr << "Multiplexed stream " << streamId << " exceeded its window" << std::endl;
+                    break;
+                }
+
+                stream->pendingDelivery.append(payload.data(), length);
+                deliver(stream);
+            }
+
+            if (kind == FrameKind::StreamWindowFrame && length == 4)
+            {
+                uint32_t credit;
+                memcpy(&credit, payload.data(), 4);
+                stream->sendCredit += ntohl(credit);
+            }
+
+            if (kind == FrameKind::StreamCloseFrame)
+            {
+                stream->isRemoteClosed = true;
+            }
+        }
+
+        if (openedSocket != -1 && onStreamOpened)
+        {
+            onStreamOpened(openedSocket);
+        }
+
+        wakeup();
+    }
+
+    shutdown();
+}
+
+void Multiplexer::shutdown()
+{
+    {
+        std::unique_lock<std::mutex> lock(_mutex);
+
+        if (isClosed)
+        {
+            return;
+        }
+
+        isClosed = true;
+
+        for (auto const &entry : streams)
+        {
+            close(entry.second.socket);
+        }
+
+        streams.clear();
+    }
+
+    ::shutdown(socket, SHUT_RDWR);
+    wakeup();
+
+    if (isDetached)
+    {
+        reaper()->queue(
+            [this]
+            { delete this; });
+    }
+}
+
+void Multiplexer::writeLoop()
+{
+    std::vector<char> buffer(MULTIPLEXER_MAX_FRAME_PAYLOAD);
+
+    // Kept across rounds, so once they are large enough a round doesn't
+    // allocate.
+    std::vector<Frame> frames;
+    std::vector<pollfd> descriptors;
+    std::vector<uint32_t> readableStreamIds;
+
+    while (true)
+    {
+        frames.clear();
+        descriptors.clear();
+        readableStreamIds.clear();
+
+        pollfd wakeupDescriptor;
+        wakeupDescriptor.fd = wakeupPipe[0];
+        wakeupDescriptor.events = POLLIN;
+        descriptors.push_back(wakeupDescriptor);
+
+        {
+            std::unique_lock<std::mutex> lock(_mutex);
+
+            if (isClosed)
+            {
+                break;
+            }
+
+            for (auto entry = streams.begin(); entry != streams.end();)
+            {
+                uint32_t streamId = entry->first;
+                MultiplexedStream *stream = &entry->second;
+
+                deliver(stream);
+
+                // Streams are announced in id order, so the peer can tell a new
+                // stream from a late frame of one that was already closed
+                if (!stream->isAnnounced)
+                {
+                    frames.push_back(Frame(streamId, FrameKind::StreamDataFrame, ""));
+                    stream->isAnnounced = true;
+                }
+
+                if (stream->pendingCredit > 0)
+                {
+                    uint32_t credit = htonl(stream->pendingCredit);
+                    frames.push_back(Frame(streamId, FrameKind::StreamWindowFrame, std::string((char *)&credit, 4)));
+                    stream->pendingCredit = 0;
+                }
+
+                if (stream->isRemoteClosed && stream->pendingDelivery.empty())
+                {
+                    close(stream->socket);
+                    entry = streams.erase(entry);
+                    continue;
+                }
+
+                pollfd descriptor;
+                descriptor.fd = stream->socket;
+                descriptor.events = 0;
+                descriptor.revents = 0;
+
+                if (stream->sendCredit > 0)
+                {
+                    descriptor.events |= POLLIN;
+                }
+
+                if (!stream->pendingDelivery.empty())
+                {
+                    descriptor.events |= POLLOUT;
+                }
+
+                if (descriptor.events != 0)
+                {
+                    descriptors.push_back(descriptor);
+                    readableStreamIds.push_back(streamId);
+                }
+
+                entry++;
+            }
+        }
+
+        for (auto const &frame : frames)
+        {
+            if (!sendFrame(frame))
+            {
+                shutdown();
+                return;
+            }
+        }
+
+        if (poll(descriptors.data(), descriptors.size(), -1) < 0 && errno != EINTR)
+        {
+            break;
+        }
+
+        char drained[64];
+        while (read(wakeupPipe[0], drained, sizeof(drained)) > 0)
+        {
+        }
+
+        // Serve at most one frame per stream and round, starting after the
+        // stream served last, so a large transfer cannot starve the others.
+        int count = readableStreamIds.size();
+        int first = 0;
+        while (first < count && readableStreamIds[first] <= lastServedStreamId)
+        {
+            first++;
+        }
+
+        for (int i = 0; i < count; i++)
+        {
+            int index = (first + i) % count;
+            pollfd descriptor = descriptors[index + 1];
+            uint32_t streamId = readableStreamIds[index];
+
+            if (!(descriptor.revents & (POLLIN | POLLHUP | POLLERR)))
+            {
+                continue;
+            }
+
+            int bytesRead;
+            bool isStreamClosed = false;
+
+            {
+                std::unique_lock<std::mutex> lock(_mutex);
+
+                auto entry = streams.find(streamId);
+                if (entry == streams.end() || entry->second.sendCredit <= 0)
+                {
+                    continue;
+                }
+
+                MultiplexedStream *stream = &entry->second;
+                long size = std::min((long)buffer.size(), stream->sendCredit);
+                bytesRead = recv(stream->socket, buffer.data(), size, MSG_DONTWAIT);
+
+                if (bytesRead > 0)
+                {
+                    stream->sendCredit -= bytesRead;
+                }
+
+                if (bytesRead == 0 || (bytesRead < 0 && errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR))
+                {
+                    close(stream->socket);
+                    streams.erase(entry);
+                    isStreamClosed = true;
+                }
+            }
+
+            lastServedStreamId = streamId;
+
+            // Only this thread uses buffer, so the data is sent from it.
+            if ((bytesRead > 0 && !sendFrame(streamId, FrameKind::StreamDataFrame, buffer.data(), bytesRead)) ||
+                (isStreamClosed && !sendFrame(Frame(streamId, FrameKind::StreamCloseFrame, ""))))
+            {
+                shutdown();
+                return;
+            }
+        }
+    }
+}
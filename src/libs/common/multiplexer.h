@@ -0,0 +1,95 @@
+#pragma once
+
+#include <map>
+#include <mutex>
+#include <future>
+#include <string>
+#include <functional>
+#include <stdint.h>
+
+// Bytes a stream may have in flight before the receiving side hands them to
+// its application socket and grants them back.
+#define MULTIPLEXER_STREAM_WINDOW (256 * 1024)
+#define MULTIPLEXER_MAX_FRAME_PAYLOAD (16 * 1024)
+#define MULTIPLEXER_FRAME_HEADER_SIZE 9
+
+enum FrameKind
+{
+    StreamDataFrame,
+    StreamCloseFrame,
+    StreamWindowFrame,
+};
+
+class MultiplexedStream
+{
+public:
+    int socket = -1;
+    long sendCredit = MULTIPLEXER_STREAM_WINDOW;
+    long pendingCredit = 0;
+    std::string pendingDelivery;
+    bool isAnnounced = true;
+    bool isRemoteClosed = false;
+};
+
+class Frame
+{
+public:
+    uint32_t streamId;
+    FrameKind kind;
+    std::string payload;
+
+    Frame(uint32_t streamId, FrameKind kind, std::string payload)
+    {
+        this->streamId = streamId;
+        this->kind = kind;
+        this->payload = payload;
+    }
+};
+
+// Carries many independent streams over one connection. Every stream is
+// exposed to the application as one end of a local socketpair, so the usual
+// Message::Listen/Reply code works on it unchanged, while the multiplexer
+// moves bytes between the socketpairs and the shared connection.
+//
+// Only the writer thread writes to the connection and the reader thread never
+// blocks on a stream: data a stream's application is not reading yet stays
+// queued and is only granted back to the sender once delivered.
+//
+// The connection is the multiplexer's, closed once both threads are done.
+// A detached multiplexer has no other owner and deletes itself then.
+class Multiplexer
+{
+    int socket;
+    bool isDetached;
+    uint32_t nextStreamId;
+    uint32_t lastRemoteStreamId = 0;
+    std::function<void(int)> onStreamOpened;
+
+    std::mutex _mutex;
+    std::map<uint32_t, MultiplexedStream> streams;
+    uint32_t lastServedStreamId = 0;
+    bool isClosed = false;
+
+    int wakeupPipe[2];
+
+    std::future<void> reader;
+    std::future<void> writer;
+
+    bool isRemoteStream(uint32_t streamId);
+    int createStream(uint32_t streamId);
+    void deliver(MultiplexedStream *stream);
+    bool sendFrame(const Frame &frame);
+    bool sendFrame(uint32_t streamId, FrameKind kind, const char *payload, size_t size);
+    void wakeup();
+
+    void readLoop();
+    void writeLoop();
+    void shutdown();
+
+public:
+    Multiplexer(int socket, bool isInitiator, std::function<void(int)> onStreamOpened, bool isDetached = false);
+    ~Multiplexer();
+
+    int openStream();
+    bool isOpen();
+};
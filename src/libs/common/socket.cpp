@@ -10,11 +10,14 @@
 #include <string.h>
 #include <netdb.h>
 #include <sys/uio.h>
+#include <sys/sendfile.h>
 #include <sys/time.h>
 #include <sys/wait.h>
 #include <fcntl.h>
 #include <fstream>
 #include <sstream>
+#include <errno.h>
+#include <chrono>
 
 #include "socket.h"
 
@@ -24,34 +27,341 @@ std::string Color::yellow = "\033[33m";
 std::string Color::blue = "\033[34m";
 std::string Color::reset = "\033[0m";
 
-void clearBuffer(char (*buffer)[MAX_BUFFER_SIZE])
+bool readExactly(int socketDescriptor, char *buffer, size_t size)
 {
-    memset(buffer, 0, sizeof(*buffer));
+    size_t received = 0;
+
+    while (received < size)
+    {
+        int bytesRead = recv(socketDescriptor, buffer + received, size - received, 0);
+
+        if (bytesRead == -1 && errno == EINTR)
+        {
+            continue;
+        }
+
+        bool errorOnRead = bytesRead == -1;
+        bool isResponseEmpty = bytesRead == 0;
+        if (errorOnRead || isResponseEmpty)
+        {
+            return false;
+        }
+
+        received += bytesRead;
+    }
+
+    return true;
+}
+
+bool writeExactly(int socketDescriptor, const char *buffer, size_t size)
+{
+    size_t sent = 0;
+
+    while (sent < size)
+    {
+        int bytesSent = send(socketDescriptor, buffer + sent, size - sent, MSG_NOSIGNAL);
+
+        if (bytesSent == -1 && errno == EINTR)
+        {
+            continue;
+        }
+
+        if (bytesSent <= 0)
+        {
+            return false;
+        }
+
+        sent += bytesSent;
+    }
+
+    return true;
 }
 
-bool listenPacket(char (*buffer)[MAX_BUFFER_SIZE], int socketDescriptor)
+bool listenPacket(std::string *packet, int socketDescriptor)
 {
-    clearBuffer(buffer);
+    packet->clear();
+
+    uint32_t header;
+    if (!readExactly(socketDescriptor, (char *)&header, PACKET_HEADER_SIZE))
+    {
+        return true;
+    }
 
-    int bytesRead = recv(socketDescriptor, (char *)buffer, sizeof(*buffer), 0);
+    uint32_t size = ntohl(header);
+    if (size > MAX_PACKET_SIZE)
+    {
+        std::cerr << "Packet of " << size << " bytes exceeds the maximum packet size" << std::endl;
+        return true;
+    }
 
-    bool errorOnRead = bytesRead == -1;
-    bool isResponseEmpty = bytesRead == 0;
-    if (errorOnRead || isResponseEmpty)
+    packet->resize(size);
+    if (!readExactly(socketDescriptor, &(*packet)[0], size))
     {
+        packet->clear();
         return true;
     }
 
     return false;
 }
 
+bool listenPacket(PooledBuffer *packet, int socketDescriptor)
+{
+    *packet = PooledBuffer();
+
+    uint32_t header;
+    if (!readExactly(socketDescriptor, (char *)&header, PACKET_HEADER_SIZE))
+    {
+        return true;
+    }
+
+    uint32_t size = ntohl(header);
+    if (size > MAX_PACKET_SIZE)
+    {
+        std::cerr << "Packet of " << size << " bytes exceeds the maximum packet size" << std::endl;
+        return true;
+    }
+
+    *packet = bufferPool()->acquire(size);
+    packet->resize(size);
+    if (!readExactly(socketDescriptor, packet->data(), size))
+    {
+        *packet = PooledBuffer();
+        return true;
+    }
+
+    return false;
+}
+
+bool writeExactly(int socket, iovec *parts, int count, int flags)
+{
+    msghdr message;
+    memset(&message, 0, sizeof(message));
+    message.msg_iov = parts;
+    message.msg_iovlen = count;
+
+    while (message.msg_iovlen > 0)
+    {
+        ssize_t bytesSent = sendmsg(socket, &message, MSG_NOSIGNAL | flags);
+
+        if (bytesSent == -1 && errno == EINTR)
+        {
+            continue;
+        }
+
+        if (bytesSent <= 0)
+        {
+            return false;
+        }
+
+        while (message.msg_iovlen > 0 && (size_t)bytesSent >= message.msg_iov->iov_len)
+        {
+            bytesSent -= message.msg_iov->iov_len;
+            message.msg_iov++;
+            message.msg_iovlen--;
+        }
+
+        if (message.msg_iovlen > 0)
+        {
+            message.msg_iov->iov_base = (char *)message.msg_iov->iov_base + bytesSent;
+            message.msg_iov->iov_len -= bytesSent;
+        }
+    }
+
+    return true;
+}
+
 void sendPacket(int socket, std::string message)
 {
-    char buffer[MAX_BUFFER_SIZE];
-    clearBuffer(&buffer);
-    strcpy(buffer, message.c_str());
-    send(socket, (char *)&buffer, strlen(buffer), 0);
-    clearBuffer(&buffer);
+    if (message.empty())
+    {
+        return;
+    }
+
+    sendPacket(socket, message.data(), message.size(), nullptr, 0);
+}
+
+bool sendPacket(int socket, const char *prefix, size_t prefixSize, const char *data, size_t size)
+{
+    uint32_t header = htonl(prefixSize + size);
+
+    iovec parts[3] = {
+        {&header, PACKET_HEADER_SIZE},
+        {(void *)prefix, prefixSize},
+        {(void *)data, size},
+    };
+
+    return writeExactly(socket, parts, size > 0 ? 3 : 2);
+}
+
+bool sendFilePacket(int socket, const char *prefix, size_t prefixSize, int file, uint64_t offset, size_t size)
+{
+    uint32_t header = htonl(prefixSize + size);
+
+    iovec parts[2] = {
+        {&header, PACKET_HEADER_SIZE},
+        {(void *)prefix, prefixSize},
+    };
+
+    if (!writeExactly(socket, parts, 2, MSG_MORE))
+    {
+        return false;
+    }
+
+    off_t position = offset;
+    size_t sent = 0;
+
+    while (sent < size)
+    {
+        ssize_t bytesSent = sendfile(socket, file, &position, size - sent);
+
+        if (bytesSent == -1 && errno == EINTR)
+        {
+            continue;
+        }
+
+        if (bytesSent <= 0)
+        {
+            return false;
+        }
+
+        sent += bytesSent;
+    }
+
+    return true;
+}
+
+// What is left of a timeout that started deadline - timeoutMilliseconds
+// ago, or -1 for none.
+static int remainingMilliseconds(std::chrono::steady_clock::time_point deadline, int timeoutMilliseconds)
+{
+    if (timeoutMilliseconds < 0)
+    {
+        return -1;
+    }
+
+    auto left = std::chrono::ceil<std::chrono::milliseconds>(deadline - std::chrono::steady_clock::now());
+    return left.count() < 0 ? 0 : (int)left.count();
+}
+
+// Gives up once timeoutMilliseconds passed, when that is not negative.
+static Task<bool> readExactly(EventLoop *loop, int socket, char *buffer, size_t size, int timeoutMilliseconds)
+{
+    auto deadline = std::chrono::steady_clock::now() + std::chrono::milliseconds(timeoutMilliseconds);
+    size_t received = 0;
+
+    while (received < size)
+    {
+        ssize_t bytesRead = recv(socket, buffer + received, size - received, MSG_DONTWAIT);
+
+        if (bytesRead > 0)
+        {
+            received += bytesRead;
+            continue;
+        }
+
+        if (bytesRead < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+        {
+            if (!co_await loop->readable(socket, remainingMilliseconds(deadline, timeoutMilliseconds)))
+            {
+                co_return false;
+            }
+            continue;
+        }
+
+        if (bytesRead < 0 && errno == EINTR)
+        {
+            continue;
+        }
+
+        co_return false;
+    }
+
+    co_return true;
+}
+
+Task<bool> listenPacket(EventLoop *loop, PooledBuffer *packet, int socketDescriptor, int timeoutMilliseconds, uint32_t maxSize)
+{
+    *packet = PooledBuffer();
+
+    auto deadline = std::chrono::steady_clock::now() + std::chrono::milliseconds(timeoutMilliseconds);
+
+    uint32_t header;
+    if (!co_await readExactly(loop, socketDescriptor, (char *)&header, PACKET_HEADER_SIZE, timeoutMilliseconds))
+    {
+        co_return true;
+    }
+
+    uint32_t size = ntohl(header);
+    if (size > maxSize)
+    {
+        std::cerr << "Packet of " << size << " bytes exceeds the maximum of " << maxSize << std::endl;
+        co_return true;
+    }
+
+    *packet = bufferPool()->acquire(size);
+    packet->resize(size);
+    if (!co_await readExactly(loop, socketDescriptor, packet->data(), size, remainingMilliseconds(deadline, timeoutMilliseconds)))
+    {
+        *packet = PooledBuffer();
+        co_return true;
+    }
+
+    co_return false;
+}
+
+Task<bool> sendPacket(EventLoop *loop, int socket, std::string message)
+{
+    if (message.empty())
+    {
+        co_return true;
+    }
+
+    uint32_t header = htonl(message.size());
+    iovec parts[2] = {
+        {&header, PACKET_HEADER_SIZE},
+        {message.data(), message.size()},
+    };
+
+    msghdr packet;
+    memset(&packet, 0, sizeof(packet));
+    packet.msg_iov = parts;
+    packet.msg_iovlen = 2;
+
+    while (packet.msg_iovlen > 0)
+    {
+        ssize_t bytesSent = sendmsg(socket, &packet, MSG_NOSIGNAL | MSG_DONTWAIT);
+
+        if (bytesSent < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+        {
+            co_await loop->writable(socket);
+            continue;
+        }
+
+        if (bytesSent < 0 && errno == EINTR)
+        {
+            continue;
+        }
+
+        if (bytesSent <= 0)
+        {
+            co_return false;
+        }
+
+        while (packet.msg_iovlen > 0 && (size_t)bytesSent >= packet.msg_iov->iov_len)
+        {
+            bytesSent -= packet.msg_iov->iov_len;
+            packet.msg_iov++;
+            packet.msg_iovlen--;
+        }
+
+        if (packet.msg_iovlen > 0)
+        {
+            packet.msg_iov->iov_base = (char *)packet.msg_iov->iov_base + bytesSent;
+            packet.msg_iov->iov_len -= bytesSent;
+        }
+    }
+
+    co_return true;
 }
 
 void sendCustomPacket(int socket)
@@ -63,24 +373,36 @@ void sendCustomPacket(int socket)
 
 void awaitOk(int socket)
 {
-    char buffer[MAX_BUFFER_SIZE];
-    listenPacket(&buffer, socket);
+    std::string packet;
+    listenPacket(&packet, socket);
 }
 
 // = CLIENT METHODS ========================================================================
 
-int connectToServer(char *address, int port)
+bool resolveServerAddress(char *address, int port, sockaddr_in *resolvedAddress)
 {
-    sockaddr_in serverAddress;
-    bzero((char *)&serverAddress, sizeof(serverAddress));
+    addrinfo hints;
+    bzero((char *)&hints, sizeof(hints));
+    hints.ai_family = AF_INET;
+    hints.ai_socktype = SOCK_STREAM;
 
-    serverAddress.sin_family = AF_INET;
-    serverAddress.sin_port = htons(port);
+    addrinfo *results;
+    if (getaddrinfo(address, NULL, &hints, &results) != 0)
+    {
+        return false;
+    }
 
-    struct hostent *host = gethostbyname(address);
-    serverAddress.sin_addr.s_addr =
-        inet_addr(inet_ntoa(*(struct in_addr *)*host->h_addr_list));
+    bzero((char *)resolvedAddress, sizeof(*resolvedAddress));
+    *resolvedAddress = *(sockaddr_in *)results->ai_addr;
+    resolvedAddress->sin_family = AF_INET;
+    resolvedAddress->sin_port = htons(port);
+
+    freeaddrinfo(results);
+    return true;
+}
 
+int connectToAddress(sockaddr_in serverAddress)
+{
     int connectedSocket = socket(AF_INET, SOCK_STREAM, 0);
 
     int status = connect(
@@ -97,9 +419,22 @@ int connectToServer(char *address, int port)
     return connectedSocket;
 }
 
+int connectToServer(char *address, int port)
+{
+    sockaddr_in serverAddress;
+
+    if (!resolveServerAddress(address, port, &serverAddress))
+    {
+        std::cout << "Error resolving server address!" << std::endl;
+        exit(-1);
+    }
+
+    return connectToAddress(serverAddress);
+}
+
 // = SERVER METHODS ========================================================================
 
-int startServer(int port)
+int startServer(int port, bool reusePort)
 {
     sockaddr_in servAddr;
     bzero((char *)&servAddr, sizeof(servAddr));
@@ -107,13 +442,20 @@ int startServer(int port)
     servAddr.sin_addr.s_addr = htonl(INADDR_ANY);
     servAddr.sin_port = htons(port);
 
-    int serverConnection = socket(AF_INET, SOCK_STREAM, 0);
+    int serverConnection = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
     if (serverConnection < 0)
     {
         std::cerr << "Error establishing the server socket" << std::endl;
         exit(0);
     }
 
+    int enable = 1;
+    if (reusePort && setsockopt(serverConnection, SOL_SOCKET, SO_REUSEPORT, &enable, sizeof(enable)) < 0)
+    {
+        std::cerr << "Error sharing the server port" << std::endl;
+        exit(0);
+    }
+
     int bindStatus = bind(
         serverConnection,
         (struct sockaddr *)&servAddr,
@@ -125,31 +467,66 @@ int startServer(int port)
         exit(0);
     }
 
-    std::cout << "Server started!" << std::endl;
+    if (listen(serverConnection, ACCEPT_BACKLOG) < 0)
+    {
+        std::cerr << "Error listening to socket" << std::endl;
+        exit(0);
+    }
 
     return serverConnection;
 }
 
-int awaitConnection(int serverSocketDescriptor)
+Task<bool> acceptConnections(EventLoop *loop, int serverSocketDescriptor, std::vector<int> *clientSockets)
 {
-    int maxNumberOfConnections = 99;
-    int result = listen(serverSocketDescriptor, maxNumberOfConnections);
+    clientSockets->clear();
 
-    if (result == -1)
+    while (clientSockets->size() < ACCEPT_BATCH)
     {
-        std::cerr << "Error listening to socket" << std::endl;
-        exit(0);
+        int clientSocket = accept4(serverSocketDescriptor, nullptr, nullptr, SOCK_NONBLOCK | SOCK_CLOEXEC);
+
+        if (clientSocket >= 0)
+        {
+            clientSockets->push_back(clientSocket);
+            continue;
+        }
+
+        if (errno == EINTR || errno == ECONNABORTED)
+        {
+            continue;
+        }
+
+        // Those accepted so far are handed out first, the error comes back
+        // on the next call.
+        if (errno != EAGAIN && errno != EWOULDBLOCK)
+        {
+            if (!clientSockets->empty())
+            {
+                break;
+            }
+
+            std::cerr << "Error accepting request from client: " << strerror(errno) << std::endl;
+            co_return false;
+        }
+
+        if (!clientSockets->empty())
+        {
+            break;
+        }
+
+        co_await loop->readable(serverSocketDescriptor);
     }
 
-    sockaddr_in clientAddress;
-    socklen_t clientAddressSize = sizeof(clientAddress);
+    co_return true;
+}
 
-    int clientSocket = accept(serverSocketDescriptor, (sockaddr *)&clientAddress, &clientAddressSize);
-    if (clientSocket < 0)
+bool setNonBlocking(int socketDescriptor, bool nonBlocking)
+{
+    int flags = fcntl(socketDescriptor, F_GETFL, 0);
+    if (flags < 0)
     {
-        std::cerr << "Error accepting request from client!" << std::endl;
-        exit(1);
+        return false;
     }
 
-    return clientSocket;
+    flags = nonBlocking ? flags | O_NONBLOCK : flags & ~O_NONBLOCK;
+    return fcntl(socketDescriptor, F_SETFL, flags) == 0;
 }
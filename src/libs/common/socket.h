@@ -1,9 +1,26 @@
+#pragma once
+
 #include <string>
 #include <iostream>
 #include <ostream>
 #include <sstream>
+#include <vector>
+#include <netinet/in.h>
+#include <sys/uio.h>
+#include <stdint.h>
+
+#include "bufferPool.h"
+#include "eventLoop.h"
+
+// Every packet is sent as a 4 byte big endian length followed by its bytes,
+// so packets may carry binary data and are never merged or split by recv.
+#define PACKET_HEADER_SIZE 4
+#define MAX_PACKET_SIZE (16 * 1024 * 1024)
 
-#define MAX_BUFFER_SIZE 1500
+// Connections the kernel queues for a server socket until they are
+// accepted, and how many are accepted at once before those are handled.
+#define ACCEPT_BACKLOG 1024
+#define ACCEPT_BATCH 64
 
 class Color
 {
@@ -15,18 +32,44 @@ public:
     static std::string reset;
 };
 
-void clearBuffer(char (*buffer)[MAX_BUFFER_SIZE]);
-bool listenPacket(char (*buffer)[MAX_BUFFER_SIZE], int socketDescriptor);
+bool readExactly(int socketDescriptor, char *buffer, size_t size);
+bool writeExactly(int socketDescriptor, const char *buffer, size_t size);
+// Writes all of parts, gathered from where they are, and advances them past
+// what went out.
+bool writeExactly(int socketDescriptor, iovec *parts, int count, int flags = 0);
+bool listenPacket(std::string *packet, int socketDescriptor);
+// Receives into a buffer of the shared pool, or of its own when the packet
+// is larger than those.
+bool listenPacket(PooledBuffer *packet, int socketDescriptor);
 void sendPacket(int socket, std::string message);
+// Sends prefix and then data as one packet, gathered from where they are.
+bool sendPacket(int socket, const char *prefix, size_t prefixSize, const char *data, size_t size);
+// Sends prefix and then size bytes of file from offset as one packet, the
+// file bytes going from the page cache to the socket without a copy.
+bool sendFilePacket(int socket, const char *prefix, size_t prefixSize, int file, uint64_t offset, size_t size);
+// The same for coroutines on loop, which suspend while the socket isn't
+// ready instead of blocking the loop's thread. Receiving fails once
+// timeoutMilliseconds passed, when that is not negative, and on packets
+// larger than maxSize.
+Task<bool> listenPacket(EventLoop *loop, PooledBuffer *packet, int socketDescriptor, int timeoutMilliseconds = -1, uint32_t maxSize = MAX_PACKET_SIZE);
+Task<bool> sendPacket(EventLoop *loop, int socket, std::string message);
 void sendCustomPacket(int socket);
 void awaitOk(int socket);
 
 // client specific methods
 int connectToServer(char *address, int port);
+bool resolveServerAddress(char *address, int port, sockaddr_in *resolvedAddress);
+int connectToAddress(sockaddr_in serverAddress);
 
 // server specific methods
-int startServer(int port);
-int awaitConnection(int serverSocketDescriptor);
+// A listening, non-blocking socket. Sockets started with reusePort share
+// the port, and the kernel spreads new connections among them.
+int startServer(int port, bool reusePort = false);
+// Waits for connections and accepts as many as are queued, up to
+// ACCEPT_BATCH, as non-blocking sockets. False when accepting failed
+// before any connection was accepted.
+Task<bool> acceptConnections(EventLoop *loop, int serverSocketDescriptor, std::vector<int> *clientSockets);
+bool setNonBlocking(int socketDescriptor, bool nonBlocking);
 
 class Session
 {
@@ -34,6 +77,7 @@ public:
     int clientId;
     int socket;
     std::string username;
+    int inlineLimit = 0;
 
     Session(int _clientId, int _socket, std::string _username)
     {
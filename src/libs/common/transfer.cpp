@@ -0,0 +1,272 @@
+#include <mutex>
+#include <sstream>
+#include <fstream>
+#include <stdio.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <limits.h>
+#include <inttypes.h>
+#include <algorithm>
+
+#include "transfer.h"
+
+// Probing rounds send a quarter more than the estimate allows, to notice
+// when more bandwidth becomes available, and the round after drains it.
+#define TRANSFER_PROBE_ROUNDS 8
+#define TRANSFER_PROBE_GAIN 1.25
+#define TRANSFER_DRAIN_GAIN 0.75
+
+std::mutex estimatesMutex;
+std::map<int, TransferEstimate> estimates;
+
+std::map<int, TransferEstimate> transferEstimates()
+{
+    std::lock_guard<std::mutex> lock(estimatesMutex);
+    return estimates;
+}
+
+void forgetTransferEstimate(int socket)
+{
+    std::lock_guard<std::mutex> lock(estimatesMutex);
+    estimates.erase(socket);
+}
+
+std::string TransferEstimate::toString()
+{
+    std::ostringstream text;
+    text << (isStartup ? "startup" : "steady")
+         << ", rtt " << (uint64_t)minRtt << "us (smoothed " << (uint64_t)smoothedRtt << "us)"
+         << ", bandwidth " << (uint64_t)(bandwidth / 1024) << "KB/s"
+         << ", chunk " << chunkSize / 1024 << "KB"
+         << ", in flight " << inflightLimit / 1024 << "KB"
+         << ", " << transfers << " transfers, " << delivered << " bytes";
+    return text.str();
+}
+
+TransferWindow::TransferWindow(int socket) : inflight(TRANSFER_MAX_MESSAGES_IN_FLIGHT)
+{
+    this->socket = socket;
+
+    std::lock_guard<std::mutex> lock(estimatesMutex);
+    auto found = estimates.find(socket);
+    if (found != estimates.end())
+    {
+        estimate = found->second;
+    }
+
+    nextRoundDelivered = estimate.delivered;
+    deliveredTime = std::chrono::steady_clock::now();
+}
+
+TransferWindow::~TransferWindow()
+{
+    estimate.transfers++;
+
+    std::lock_guard<std::mutex> lock(estimatesMutex);
+    estimates[socket] = estimate;
+}
+
+size_t TransferWindow::chunkSize()
+{
+    return estimate.chunkSize;
+}
+
+bool TransferWindow::canSend()
+{
+    return inflight.empty() ||
+           (inflightBytes + estimate.chunkSize <= estimate.inflightLimit &&
+            inflight.size() < TRANSFER_MAX_MESSAGES_IN_FLIGHT);
+}
+
+bool TransferWindow::hasInflight()
+{
+    return !inflight.empty();
+}
+
+void TransferWindow::onSend(size_t size)
+{
+    TransferClock now = std::chrono::steady_clock::now();
+
+    // An idle connection has nothing being delivered, so rates are measured
+    // from when sending resumed rather than from the last acknowledgement.
+    if (inflight.empty())
+    {
+        deliveredTime = now;
+    }
+
+    inflight.push_back(SentMessage{size, now, estimate.delivered, deliveredTime});
+    inflightBytes += size;
+}
+
+void TransferWindow::onAck()
+{
+    if (inflight.empty())
+    {
+        return;
+    }
+
+    TransferClock now = std::chrono::steady_clock::now();
+    SentMessage message = inflight.front();
+    inflight.pop_front();
+    inflightBytes -= message.size;
+
+    estimate.delivered += message.size;
+    deliveredTime = now;
+
+    double rtt = std::chrono::duration<double, std::micro>(now - message.sent).count();
+    estimate.smoothedRtt = estimate.smoothedRtt == 0 ? rtt : estimate.smoothedRtt * 7 / 8 + rtt / 8;
+
+    if (estimate.minRtt == 0 || rtt <= estimate.minRtt ||
+        now - estimate.minRttTime > std::chrono::seconds(TRANSFER_MIN_RTT_SECONDS))
+    {
+        estimate.minRtt = rtt;
+        estimate.minRttTime = now;
+    }
+
+    double interval = std::chrono::duration<double>(now - message.deliveredTime).count();
+    if (interval > 0)
+    {
+        double rate = (estimate.delivered - message.delivered) / interval;
+
+        while (!estimate.rates.empty() && estimate.rates.back().second <= rate)
+        {
+            estimate.rates.pop_back();
+        }
+
+        estimate.rates.push_back({estimate.rounds, rate});
+        estimate.bandwidth = estimate.rates.front().second;
+    }
+
+    if (message.delivered >= nextRoundDelivered)
+    {
+        nextRoundDelivered = estimate.delivered;
+        onRoundEnd();
+    }
+
+    updateLimits();
+}
+
+// A rejected message leaves the window without having been delivered, so
+// it gives no rate sample.
+void TransferWindow::onReject()
+{
+    if (inflight.empty())
+    {
+        return;
+    }
+
+    inflightBytes -= inflight.front().size;
+    inflight.pop_front();
+}
+
+void TransferWindow::onRoundEnd()
+{
+    estimate.rounds++;
+
+    while (!estimate.rates.empty() &&
+           estimate.rates.front().first + TRANSFER_BANDWIDTH_ROUNDS < estimate.rounds)
+    {
+        estimate.rates.pop_front();
+    }
+
+    estimate.bandwidth = estimate.rates.empty() ? 0 : estimate.rates.front().second;
+
+    if (!estimate.isStartup)
+    {
+        return;
+    }
+
+    if (estimate.bandwidth >= estimate.fullBandwidth * TRANSFER_STARTUP_GROWTH)
+    {
+        estimate.fullBandwidth = estimate.bandwidth;
+        estimate.roundsWithoutGrowth = 0;
+        estimate.inflightLimit = std::min<uint64_t>(estimate.inflightLimit * 2, TRANSFER_MAX_INFLIGHT);
+        return;
+    }
+
+    if (++estimate.roundsWithoutGrowth >= TRANSFER_STARTUP_ROUNDS)
+    {
+        estimate.isStartup = false;
+    }
+}
+
+void TransferWindow::updateLimits()
+{
+    if (estimate.bandwidth > 0)
+    {
+        double chunkSize = estimate.bandwidth * TRANSFER_CHUNK_MICROSECONDS / 1e6;
+        chunkSize = std::max<double>(TRANSFER_MIN_CHUNK, std::min<double>(TRANSFER_MAX_CHUNK, chunkSize));
+        estimate.chunkSize = (size_t)chunkSize / TRANSFER_MIN_CHUNK * TRANSFER_MIN_CHUNK;
+    }
+
+    // Startup keeps at least two messages in flight while the limit grows.
+    if (estimate.isStartup)
+    {
+        estimate.chunkSize = std::max<size_t>(TRANSFER_MIN_CHUNK, std::min<size_t>(estimate.chunkSize, estimate.inflightLimit / 2));
+        return;
+    }
+
+    double gain = TRANSFER_INFLIGHT_GAIN;
+    int phase = estimate.rounds % TRANSFER_PROBE_ROUNDS;
+    if (phase == 0)
+    {
+        gain *= TRANSFER_PROBE_GAIN;
+    }
+    else if (phase == 1)
+    {
+        gain *= TRANSFER_DRAIN_GAIN;
+    }
+
+    double bandwidthDelay = estimate.bandwidth * estimate.minRtt / 1e6;
+    double inflightLimit = std::max<double>(bandwidthDelay * gain, 2.0 * estimate.chunkSize);
+    inflightLimit = std::max<double>(TRANSFER_MIN_INFLIGHT, std::min<double>(TRANSFER_MAX_INFLIGHT, inflightLimit));
+    estimate.inflightLimit = (uint64_t)inflightLimit;
+}
+
+TransferEstimate TransferWindow::current()
+{
+    return estimate;
+}
+
+bool readCheckpoint(std::string path, TransferCheckpoint *checkpoint)
+{
+    std::ifstream file(path);
+    return (bool)(file >> checkpoint->transferId >> checkpoint->offset >> checkpoint->hash);
+}
+
+// Written without streams or strings, since the writing stage of a
+// transfer saves one every TRANSFER_CHECKPOINT_BYTES.
+bool writeCheckpoint(const std::string &path, const TransferCheckpoint &checkpoint)
+{
+    char temporaryPath[PATH_MAX];
+    char line[256];
+    int pathLength = snprintf(temporaryPath, sizeof(temporaryPath), "%s.tmp", path.c_str());
+    int lineLength = snprintf(line, sizeof(line), "%s %" PRIu64 " %" PRIu64 "\n",
+                              checkpoint.transferId.c_str(), checkpoint.offset, checkpoint.hash);
+
+    if (pathLength >= (int)sizeof(temporaryPath) || lineLength >= (int)sizeof(line))
+    {
+        return false;
+    }
+
+    int file = open(temporaryPath, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (file < 0)
+    {
+        return false;
+    }
+
+    bool isWritten = write(file, line, lineLength) == lineLength;
+    isWritten = close(file) == 0 && isWritten;
+
+    return isWritten && rename(temporaryPath, path.c_str()) == 0;
+}
+
+void removeCheckpoint(std::string path)
+{
+    remove(path.c_str());
+}
+
+std::string transferIdOf(std::string name, std::string sample)
+{
+    return toHex(sha256(name + ":" + std::to_string(sample.size()) + ":" + sample)).substr(0, 32);
+}
@@ -0,0 +1,148 @@
+#pragma once
+
+#include <map>
+#include <string>
+#include <chrono>
+#include <stdint.h>
+
+#include "hash.h"
+#include "helpers.h"
+
+// Data messages are sized to about TRANSFER_CHUNK_MICROSECONDS worth of the
+// estimated bandwidth, so slow links get small messages and fast ones
+// amortize the per message cost over large ones.
+#define TRANSFER_MIN_CHUNK (4 * 1024)
+#define TRANSFER_MAX_CHUNK (1024 * 1024)
+#define TRANSFER_INITIAL_CHUNK (16 * 1024)
+#define TRANSFER_CHUNK_MICROSECONDS 1000
+
+// Bytes in flight start at TRANSFER_INITIAL_INFLIGHT, double every round
+// trip while the bandwidth keeps growing, then follow twice the estimated
+// bandwidth-delay product.
+#define TRANSFER_MIN_INFLIGHT (64 * 1024)
+#define TRANSFER_INITIAL_INFLIGHT (64 * 1024)
+#define TRANSFER_MAX_INFLIGHT (64 * 1024 * 1024)
+#define TRANSFER_MAX_MESSAGES_IN_FLIGHT 256
+#define TRANSFER_INFLIGHT_GAIN 2.0
+
+// Startup ends once the bandwidth grew less than TRANSFER_STARTUP_GROWTH
+// for TRANSFER_STARTUP_ROUNDS round trips in a row.
+#define TRANSFER_STARTUP_GROWTH 1.25
+#define TRANSFER_STARTUP_ROUNDS 3
+
+// The bandwidth is the highest delivery rate of the last rounds, and the
+// round trip time the lowest one seen in the last seconds.
+#define TRANSFER_BANDWIDTH_ROUNDS 10
+#define TRANSFER_MIN_RTT_SECONDS 10
+
+// Data messages of a transfer carry a CRC32C and their offset in it. The
+// receiver rejects one that doesn't match, and everything after it until
+// the sender went back and sent it again, and checks a CRC32C of all of
+// it before the transfer ends. Transfers give up after
+// TRANSFER_MAX_CORRUPT_CHUNKS corrupt messages.
+#define TRANSFER_MAX_CORRUPT_CHUNKS 16
+#define TRANSFER_CORRUPT_REPLY "corrupt"
+
+// Transfers run as pipelines of threads passing chunks through bounded
+// queues of TRANSFER_PIPELINE_DEPTH: reading, checksumming and compressing,
+// and sending, and on the other end receiving, decompressing and
+// checksumming, and writing. Chunks stay in the pooled buffer they were
+// read or received into until they are sent or written, and once each
+// stage handled TRANSFER_PIPELINE_WARMUP of them it shouldn't allocate.
+#define TRANSFER_PIPELINE_DEPTH 8
+#define TRANSFER_PIPELINE_WARMUP 16
+
+typedef std::chrono::steady_clock::time_point TransferClock;
+
+class TransferEstimate
+{
+public:
+    bool isStartup = true;
+
+    // Microseconds and bytes per second.
+    double minRtt = 0;
+    double smoothedRtt = 0;
+    double bandwidth = 0;
+
+    size_t chunkSize = TRANSFER_INITIAL_CHUNK;
+    uint64_t inflightLimit = TRANSFER_INITIAL_INFLIGHT;
+
+    uint64_t transfers = 0;
+    uint64_t delivered = 0;
+    uint64_t rounds = 0;
+
+    TransferClock minRttTime;
+    double fullBandwidth = 0;
+    int roundsWithoutGrowth = 0;
+    RingBuffer<std::pair<uint64_t, double>> rates{TRANSFER_MAX_MESSAGES_IN_FLIGHT};
+
+    std::string toString();
+};
+
+class SentMessage
+{
+public:
+    size_t size;
+    TransferClock sent;
+    uint64_t delivered;
+    TransferClock deliveredTime;
+};
+
+// Paces one transfer over a connection. Messages are sent while the bytes
+// in flight stay under the limit, and every acknowledgement updates the
+// connection's estimate with a round trip and a delivery rate sample.
+class TransferWindow
+{
+    int socket;
+    TransferEstimate estimate;
+
+    RingBuffer<SentMessage> inflight;
+    uint64_t inflightBytes = 0;
+    uint64_t nextRoundDelivered = 0;
+    TransferClock deliveredTime;
+
+    void onRoundEnd();
+    void updateLimits();
+
+public:
+    TransferWindow(int socket);
+    ~TransferWindow();
+
+    size_t chunkSize();
+    bool canSend();
+    bool hasInflight();
+
+    void onSend(size_t size);
+    void onAck();
+    void onReject();
+
+    TransferEstimate current();
+};
+
+// Estimates outlive transfers, so the next one on the same connection
+// starts where the last one left off.
+std::map<int, TransferEstimate> transferEstimates();
+void forgetTransferEstimate(int socket);
+
+// Receivers of resumable transfers save how much they have received and a
+// hash of it in <partial file>.checkpoint, every TRANSFER_CHECKPOINT_BYTES
+// and when the transfer breaks off. A sender retrying the transfer hashes
+// its own copy of that much and continues after it when the hashes match.
+#define TRANSFER_CHECKPOINT_BYTES (4 * 1024 * 1024)
+#define TRANSFER_CHECKPOINT_SUFFIX ".checkpoint"
+
+class TransferCheckpoint
+{
+public:
+    std::string transferId;
+    uint64_t offset = 0;
+    uint64_t hash = FNV1A_OFFSET_BASIS;
+};
+
+bool readCheckpoint(std::string path, TransferCheckpoint *checkpoint);
+bool writeCheckpoint(const std::string &path, const TransferCheckpoint &checkpoint);
+void removeCheckpoint(std::string path);
+
+// Transfers are named after what is sent and how it starts, so a retry of
+// the same file finds the checkpoint the last attempt left.
+std::string transferIdOf(std::string name, std::string sample);
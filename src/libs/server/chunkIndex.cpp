@@ -0,0 +1,214 @@
+#include <fstream>
+#include <memory>
+
+#include "chunkIndex.h"
+#include "../common/blake3.h"
+
+using namespace std;
+
+void ChunkIndex::replace(std::string filename, std::vector<ChunkReference> chunks)
+{
+    for (auto hash : hashesByFilename[filename])
+    {
+        auto location = locationsByHash.find(hash);
+        if (location != locationsByHash.end() && location->second.filename == filename)
+        {
+            locationsByHash.erase(location);
+        }
+    }
+
+    hashesByFilename.erase(filename);
+
+    for (auto const &chunk : chunks)
+    {
+        ChunkLocation location;
+        location.filename = filename;
+        location.offset = chunk.offset;
+        location.length = chunk.length;
+
+        locationsByHash[chunk.hash] = location;
+        hashesByFilename[filename].push_back(chunk.hash);
+    }
+}
+
+std::vector<ChunkReference> ChunkIndex::chunkStoredFile(std::string filename)
+{
+    std::unique_ptr<std::istream> file = storage->openContent(username, filename);
+    if (!file)
+    {
+        return {};
+    }
+
+    return chunkFile(*file);
+}
+
+void ChunkIndex::build()
+{
+    if (isBuilt)
+    {
+        return;
+    }
+
+    isBuilt = true;
+
+    for (auto const &file : storage->listFiles(username))
+    {
+        replace(file.filename, chunkStoredFile(file.filename));
+    }
+}
+
+// The file is chunked without holding the lock, so lookups by other uploads
+// don't wait for it. Should the file change meanwhile, the index is only
+// off until the next change, as locations are re-hashed before use.
+void ChunkIndex::indexFile(std::string filename)
+{
+    {
+        std::lock_guard<std::mutex> lock(_mutex);
+        if (!isBuilt)
+        {
+            return;
+        }
+    }
+
+    std::vector<ChunkReference> chunks = chunkStoredFile(filename);
+
+    std::lock_guard<std::mutex> lock(_mutex);
+    replace(filename, chunks);
+}
+
+void ChunkIndex::forgetFile(std::string filename)
+{
+    std::lock_guard<std::mutex> lock(_mutex);
+    replace(filename, {});
+}
+
+std::vector<uint32_t> ChunkIndex::copyChunks(std::vector<ChunkReference> chunks, std::ostream &file)
+{
+    std::vector<ChunkLocation> locations(chunks.size());
+    std::vector<bool> isIndexed(chunks.size(), false);
+
+    {
+        std::lock_guard<std::mutex> lock(_mutex);
+        build();
+
+        for (size_t i = 0; i < chunks.size(); i++)
+        {
+            auto location = locationsByHash.find(chunks[i].hash);
+            if (location != locationsByHash.end() && location->second.length == chunks[i].length)
+            {
+                locations[i] = location->second;
+                isIndexed[i] = true;
+            }
+        }
+    }
+
+    std::map<std::string, std::unique_ptr<std::istream>> sources;
+    std::vector<uint32_t> missing;
+    std::string data;
+
+    for (size_t i = 0; i < chunks.size(); i++)
+    {
+        if (!isIndexed[i])
+        {
+            missing.push_back(i);
+            continue;
+        }
+
+        auto &source = sources[locations[i].filename];
+        if (!source)
+        {
+            source = storage->openContent(username, locations[i].filename);
+        }
+
+        if (!source)
+        {
+            missing.push_back(i);
+            continue;
+        }
+
+        data.resize(chunks[i].length);
+        source->clear();
+        source->seekg(locations[i].offset);
+        source->read(&data[0], data.size());
+
+        if ((size_t)source->gcount() != data.size() || blake3(data) != chunks[i].hash)
+        {
+            missing.push_back(i);
+            continue;
+        }
+
+        file.seekp(chunks[i].offset);
+        file.write(data.data(), data.size());
+    }
+
+    return missing;
+}
+
+bool receiveChunked(Session session, ChunkIndex *chunkIndex, std::string path)
+{
+    std::vector<ChunkReference> chunks;
+    Message message = Message::Listen(session.socket);
+
+    while (message.type == MessageType::DataMessage)
+    {
+        if (!decodeChunkManifest(message.data, &chunks))
+        {
+            message.Reply(Message::Response(ResponseType::Invalid), false);
+            return false;
+        }
+
+        message = message.Reply(Message::Response(ResponseType::Ok));
+    }
+
+    if (message.type != MessageType::EndCommand)
+    {
+        message.panic();
+        return false;
+    }
+
+    std::fstream file;
+    file.open(path, ios::out | ios::binary);
+
+    std::vector<uint32_t> missing = chunkIndex->copyChunks(chunks, file);
+
+    message = message.Reply(Message::Response(ResponseType::Ok, encodeChunkIndexes(missing)));
+
+    if (message.type != MessageType::Start)
+    {
+        message.panic();
+        file.close();
+        return false;
+    }
+
+    message = message.Reply(Message::Response(ResponseType::Ok));
+
+    for (uint32_t index : missing)
+    {
+        ChunkReference chunk = chunks[index];
+
+        if (message.type != MessageType::DataMessage ||
+            message.data.size() != chunk.length ||
+            blake3(message.data) != chunk.hash)
+        {
+            message.Reply(Message::Response(ResponseType::Invalid), false);
+            file.close();
+            return false;
+        }
+
+        file.seekp(chunk.offset);
+        file.write(message.data.data(), message.data.size());
+
+        message = message.Reply(Message::Response(ResponseType::Ok));
+    }
+
+    if (message.type != MessageType::EndCommand)
+    {
+        message.panic();
+        file.close();
+        return false;
+    }
+
+    file.close();
+    message.Reply(Message::Response(ResponseType::Ok), false);
+    return true;
+}
@@ -0,0 +1,54 @@
+#pragma once
+
+#include <map>
+#include <mutex>
+#include <string>
+#include <vector>
+#include <ostream>
+#include <unordered_map>
+
+#include "../common/chunking.h"
+#include "storage.h"
+
+class ChunkLocation
+{
+public:
+    std::string filename;
+    uint64_t offset;
+    uint32_t length;
+};
+
+// Remembers where every chunk of a user's stored files lives, so an upload
+// can copy the chunks the server already holds instead of receiving them.
+// Locations are only hints: files change underneath the index, so a chunk
+// is always re-hashed before it is reused.
+class ChunkIndex
+{
+    StorageBackend *storage;
+    std::string username;
+
+    std::mutex _mutex;
+    bool isBuilt = false;
+    std::unordered_map<std::string, ChunkLocation> locationsByHash;
+    std::map<std::string, std::vector<std::string>> hashesByFilename;
+
+    void build();
+    void replace(std::string filename, std::vector<ChunkReference> chunks);
+    std::vector<ChunkReference> chunkStoredFile(std::string filename);
+
+public:
+    ChunkIndex(StorageBackend *storage, std::string username)
+    {
+        this->storage = storage;
+        this->username = username;
+    }
+
+    void indexFile(std::string filename);
+    void forgetFile(std::string filename);
+
+    // Writes every chunk found in the index at its offset in file and returns
+    // the indexes of the ones that still have to be sent.
+    std::vector<uint32_t> copyChunks(std::vector<ChunkReference> chunks, std::ostream &file);
+};
+
+bool receiveChunked(Session session, ChunkIndex *chunkIndex, std::string path);
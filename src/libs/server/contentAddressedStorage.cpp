@@ -0,0 +1,329 @@
+#include <fstream>
+#include <sstream>
+#include <filesystem>
+#include <sys/stat.h>
+
+#include "contentAddressedStorage.h"
+#include "sharding.h"
+#include "../common/hash.h"
+#include "../common/helpers.h"
+
+static void createFolder(std::string path)
+{
+    mkdir(path.c_str(), S_IRWXU | S_IRWXG | S_IROTH | S_IXOTH);
+}
+
+static bool exists(std::string path)
+{
+    struct stat attributes;
+    return stat(path.c_str(), &attributes) == 0;
+}
+
+ContentAddressedStorage::ContentAddressedStorage(std::string root)
+{
+    this->root = root;
+
+    createFolder(root);
+    createFolder(root + ".blobs");
+    createFolder(root + ".namespaces");
+    createFolder(root + ".staging");
+
+    int moved = shardFlatBlobs(root + ".blobs/");
+    if (moved > 0)
+    {
+        std::cout << "Moved " << moved << " blobs into hash buckets" << std::endl;
+    }
+
+    load();
+}
+
+std::string ContentAddressedStorage::blobPath(std::string blob)
+{
+    return shardedPath(root + ".blobs/", blob, blob);
+}
+
+std::string ContentAddressedStorage::journalPath(std::string username)
+{
+    return root + ".namespaces/" + username;
+}
+
+// Journal lines are "+\t<blob>\t<created>\t<updated>\t<filename>" and
+// "-\t<filename>".
+void ContentAddressedStorage::loadNamespace(std::string username)
+{
+    std::map<std::string, BlobReference> &files = namespaces[username];
+    std::ifstream journal(journalPath(username));
+    std::string line;
+
+    while (std::getline(journal, line))
+    {
+        std::istringstream entry(line);
+        std::string operation;
+        std::getline(entry, operation, '\t');
+
+        if (operation == "+")
+        {
+            BlobReference reference;
+            std::string created, updated, filename;
+            std::getline(entry, reference.blob, '\t');
+            std::getline(entry, created, '\t');
+            std::getline(entry, updated, '\t');
+            std::getline(entry, filename);
+
+            reference.created = atol(created.c_str());
+            reference.updated = atol(updated.c_str());
+            files[filename] = reference;
+        }
+
+        if (operation == "-")
+        {
+            std::string filename;
+            std::getline(entry, filename);
+            files.erase(filename);
+        }
+    }
+
+    journal.close();
+
+    std::string compactedPath = journalPath(username) + ".compacting";
+    std::ofstream compacted(compactedPath, std::ios::out | std::ios::trunc);
+
+    for (auto const &item : files)
+    {
+        compacted << "+\t" << item.second.blob << "\t"
+                  << item.second.created << "\t"
+                  << item.second.updated << "\t"
+                  << item.first << "\n";
+
+        reference(item.second.blob);
+    }
+
+    compacted.close();
+    rename(compactedPath.c_str(), journalPath(username).c_str());
+}
+
+void ContentAddressedStorage::load()
+{
+    for (const auto &entry : std::filesystem::directory_iterator(root + ".namespaces"))
+    {
+        std::string username = entry.path().filename();
+
+        if (entry.is_regular_file() && username.find(".compacting") == std::string::npos)
+        {
+            loadNamespace(username);
+        }
+    }
+
+    for (const auto &entry : std::filesystem::recursive_directory_iterator(root + ".blobs"))
+    {
+        std::string blob = entry.path().filename();
+
+        if (entry.is_regular_file() && referenceCounts.find(blob) == referenceCounts.end())
+        {
+            unreferencedSince[blob] = now();
+        }
+    }
+
+    for (const auto &entry : std::filesystem::directory_iterator(root + ".staging"))
+    {
+        ::remove(entry.path().c_str());
+    }
+}
+
+void ContentAddressedStorage::appendToJournal(std::string username, std::string entry)
+{
+    std::ofstream journal(journalPath(username), std::ios::out | std::ios::app);
+    journal << entry << "\n";
+}
+
+void ContentAddressedStorage::reference(std::string blob)
+{
+    referenceCounts[blob]++;
+    unreferencedSince.erase(blob);
+}
+
+void ContentAddressedStorage::release(std::string blob)
+{
+    if (--referenceCounts[blob] > 0)
+    {
+        return;
+    }
+
+    referenceCounts.erase(blob);
+    unreferencedSince[blob] = now();
+}
+
+void ContentAddressedStorage::collectGarbage()
+{
+    time_t current = now();
+
+    for (auto it = unreferencedSince.begin(); it != unreferencedSince.end();)
+    {
+        if (current - it->second < CONTENT_ADDRESSED_COLLECTION_DELAY_SECONDS)
+        {
+            it++;
+            continue;
+        }
+
+        ::remove(blobPath(it->first).c_str());
+        it = unreferencedSince.erase(it);
+    }
+}
+
+void ContentAddressedStorage::createUser(std::string username)
+{
+    std::lock_guard<std::mutex> lock(_mutex);
+
+    if (namespaces.find(username) == namespaces.end())
+    {
+        namespaces[username] = std::map<std::string, BlobReference>();
+        appendToJournal(username, "");
+    }
+}
+
+std::vector<std::string> ContentAddressedStorage::listUsers()
+{
+    std::lock_guard<std::mutex> lock(_mutex);
+    std::vector<std::string> usernames;
+
+    for (auto const &item : namespaces)
+    {
+        usernames.push_back(item.first);
+    }
+
+    return usernames;
+}
+
+std::vector<StoredFile> ContentAddressedStorage::listFiles(std::string username)
+{
+    std::lock_guard<std::mutex> lock(_mutex);
+    std::vector<StoredFile> files;
+
+    for (auto const &item : namespaces[username])
+    {
+        StoredFile file;
+        file.filename = item.first;
+        file.created = item.second.created;
+        file.updated = item.second.updated;
+        file.acessed = item.second.updated;
+        files.push_back(file);
+    }
+
+    return files;
+}
+
+std::string ContentAddressedStorage::pathOf(std::string username, std::string filename)
+{
+    std::lock_guard<std::mutex> lock(_mutex);
+    auto &files = namespaces[username];
+    auto file = files.find(filename);
+
+    if (file == files.end())
+    {
+        return "";
+    }
+
+    return blobPath(file->second.blob);
+}
+
+std::string ContentAddressedStorage::stage(std::string username, std::string filename)
+{
+    return stageFile(root + ".blobs", root + ".staging/" + username + "_" + filename);
+}
+
+std::string ContentAddressedStorage::stagePartial(std::string username, std::string filename)
+{
+    return stagePartialFile(root + ".partial", username + "_" + filename);
+}
+
+// The blob is referenced before it is published so a collection can't drop
+// an identical unreferenced one in between, and published outside the lock
+// so concurrent commits can share a group commit.
+bool ContentAddressedStorage::commit(std::string username, std::string filename, std::string stagedPath, Durability durability)
+{
+    return publish(username, filename, stagedPath, nullptr, durability);
+}
+
+bool ContentAddressedStorage::commitKeepingTimes(std::string username, std::string filename, std::string stagedPath, StoredFile times, Durability durability)
+{
+    return publish(username, filename, stagedPath, &times, durability);
+}
+
+// Without times the file is updated now, and keeps when it was created.
+bool ContentAddressedStorage::publish(std::string username, std::string filename, std::string stagedPath, const StoredFile *times, Durability durability)
+{
+    std::string blob = toHex(sha256File(stagedPath));
+    std::string path = blobPath(blob);
+
+    bool isStored;
+    {
+        std::lock_guard<std::mutex> lock(_mutex);
+        isStored = exists(path);
+        reference(blob);
+    }
+
+    if (isStored)
+    {
+        discardFile(stagedPath);
+    }
+    else if (!publishFile(stagedPath, path, durability) && !exists(path))
+    {
+        std::lock_guard<std::mutex> lock(_mutex);
+        release(blob);
+        return false;
+    }
+
+    {
+        std::lock_guard<std::mutex> lock(_mutex);
+        auto &files = namespaces[username];
+        auto previous = files.find(filename);
+
+        BlobReference file;
+        file.blob = blob;
+        file.updated = now();
+        file.created = file.updated;
+
+        if (previous != files.end())
+        {
+            file.created = previous->second.created;
+            release(previous->second.blob);
+        }
+
+        if (times != nullptr)
+        {
+            file.created = times->created;
+            file.updated = times->updated;
+        }
+
+        files[filename] = file;
+
+        appendToJournal(username, "+\t" + blob + "\t" +
+                                      std::to_string(file.created) + "\t" +
+                                      std::to_string(file.updated) + "\t" +
+                                      filename);
+
+        collectGarbage();
+    }
+
+    return syncPath(journalPath(username), durability);
+}
+
+bool ContentAddressedStorage::remove(std::string username, std::string filename)
+{
+    std::lock_guard<std::mutex> lock(_mutex);
+    auto &files = namespaces[username];
+    auto file = files.find(filename);
+
+    if (file == files.end())
+    {
+        return false;
+    }
+
+    release(file->second.blob);
+    files.erase(file);
+
+    appendToJournal(username, "-\t" + filename);
+
+    collectGarbage();
+    return true;
+}
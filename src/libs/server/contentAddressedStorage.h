@@ -0,0 +1,61 @@
+#pragma once
+
+#include <map>
+#include <mutex>
+
+#include "storage.h"
+
+// Unreferenced blobs are kept this long so transfers that already resolved
+// them through pathOf can finish reading.
+#define CONTENT_ADDRESSED_COLLECTION_DELAY_SECONDS 60
+
+class BlobReference
+{
+public:
+    std::string blob;
+    time_t created;
+    time_t updated;
+};
+
+// Keeps every distinct file body once, as <root>.blobs/<xx>/<yy>/<sha256>, no
+// matter how many users or names refer to it. Each user's namespace maps
+// names to blobs and is persisted as an append only journal in
+// <root>.namespaces/<username>, replayed and compacted on start.
+class ContentAddressedStorage : public StorageBackend
+{
+    std::string root;
+
+    std::mutex _mutex;
+    std::map<std::string, std::map<std::string, BlobReference>> namespaces;
+    std::map<std::string, long> referenceCounts;
+    std::map<std::string, time_t> unreferencedSince;
+
+    std::string blobPath(std::string blob);
+    std::string journalPath(std::string username);
+
+    void load();
+    void loadNamespace(std::string username);
+    void appendToJournal(std::string username, std::string entry);
+
+    void reference(std::string blob);
+    void release(std::string blob);
+    void collectGarbage();
+
+    bool publish(std::string username, std::string filename, std::string stagedPath, const StoredFile *times, Durability durability);
+
+public:
+    ContentAddressedStorage(std::string root);
+
+    void createUser(std::string username) override;
+    std::vector<std::string> listUsers() override;
+    std::vector<StoredFile> listFiles(std::string username) override;
+
+    std::string pathOf(std::string username, std::string filename) override;
+
+    std::string stage(std::string username, std::string filename) override;
+    std::string stagePartial(std::string username, std::string filename) override;
+    bool commit(std::string username, std::string filename, std::string stagedPath, Durability durability) override;
+    bool commitKeepingTimes(std::string username, std::string filename, std::string stagedPath, StoredFile times, Durability durability) override;
+
+    bool remove(std::string username, std::string filename) override;
+};
@@ -0,0 +1,354 @@
+#include <map>
+#include <set>
+#include <mutex>
+#include <thread>
+#include <chrono>
+#include <fcntl.h>
+#include <errno.h>
+#include <unistd.h>
+#include <stdio.h>
+#include <filesystem>
+#include <sys/stat.h>
+
+#include "durability.h"
+#include "sharding.h"
+
+#define LINKING_PREFIX ".linking-"
+
+static std::mutex stagedFilesMutex;
+static std::map<std::string, int> stagedFiles;
+
+static int stagedFileDescriptor(std::string stagedPath)
+{
+    std::lock_guard<std::mutex> lock(stagedFilesMutex);
+    auto staged = stagedFiles.find(stagedPath);
+    return staged == stagedFiles.end() ? -1 : staged->second;
+}
+
+static void forgetStagedFile(std::string stagedPath)
+{
+    std::lock_guard<std::mutex> lock(stagedFilesMutex);
+    auto staged = stagedFiles.find(stagedPath);
+
+    if (staged != stagedFiles.end())
+    {
+        close(staged->second);
+        stagedFiles.erase(staged);
+    }
+}
+
+static std::string folderOf(std::string path)
+{
+    size_t lastFolder = path.rfind("/");
+    return lastFolder == std::string::npos ? "." : path.substr(0, lastFolder + 1);
+}
+
+static bool syncAll(std::vector<int> files)
+{
+    bool isSynced = true;
+
+    for (int fd : files)
+    {
+        isSynced = fdatasync(fd) == 0 && isSynced;
+    }
+
+    return isSynced;
+}
+
+static bool syncAll(std::vector<std::string> paths)
+{
+    bool isSynced = true;
+
+    for (auto const &path : paths)
+    {
+        int fd = open(path.c_str(), O_RDONLY);
+        isSynced = fd >= 0 && fsync(fd) == 0 && isSynced;
+
+        if (fd >= 0)
+        {
+            close(fd);
+        }
+    }
+
+    return isSynced;
+}
+
+GroupCommitter::GroupCommitter()
+{
+    committer = std::async(
+        launch::async,
+        [this]
+        {
+            while (true)
+            {
+                std::vector<CommitRequest> batch;
+                batch.push_back(requests.waitAndPop());
+
+                std::this_thread::sleep_for(std::chrono::microseconds(GROUP_COMMIT_WINDOW_MICROSECONDS));
+
+                while (batch.size() < GROUP_COMMIT_MAX_BATCH)
+                {
+                    std::optional<CommitRequest> request = requests.pop();
+                    if (!request.has_value())
+                    {
+                        break;
+                    }
+
+                    batch.push_back(request.value());
+                }
+
+                commitBatch(batch);
+            }
+        });
+}
+
+// Each file and folder is synced once per batch however many commits
+// touched it, which is what makes small appends to one segment cheap.
+void GroupCommitter::commitBatch(std::vector<CommitRequest> batch)
+{
+    std::set<int> files;
+    for (auto const &request : batch)
+    {
+        files.insert(request.files.begin(), request.files.end());
+    }
+
+    std::set<int> failedFiles;
+    for (int fd : files)
+    {
+        if (fdatasync(fd) != 0)
+        {
+            failedFiles.insert(fd);
+        }
+    }
+
+    std::vector<bool> results;
+    std::set<std::string> paths;
+
+    for (auto const &request : batch)
+    {
+        bool isCommitted = true;
+        for (int fd : request.files)
+        {
+            isCommitted = isCommitted && failedFiles.count(fd) == 0;
+        }
+
+        isCommitted = isCommitted && (!request.publish || request.publish());
+        results.push_back(isCommitted);
+
+        if (isCommitted)
+        {
+            paths.insert(request.paths.begin(), request.paths.end());
+        }
+    }
+
+    bool arePathsSynced = syncAll(std::vector<std::string>(paths.begin(), paths.end()));
+
+    for (size_t i = 0; i < batch.size(); i++)
+    {
+        batch[i].done->set_value(results[i] && arePathsSynced);
+    }
+}
+
+bool GroupCommitter::commit(std::vector<int> files, std::function<bool()> publish, std::vector<std::string> paths, Durability durability)
+{
+    if (durability == Durability::DefaultDurability)
+    {
+        durability = defaultDurability;
+    }
+
+    if (durability == Durability::NoSync)
+    {
+        return !publish || publish();
+    }
+
+    if (durability == Durability::ImmediateSync)
+    {
+        return syncAll(files) && (!publish || publish()) && syncAll(paths);
+    }
+
+    std::promise<bool> done;
+    std::future<bool> result = done.get_future();
+
+    CommitRequest request;
+    request.files = files;
+    request.publish = publish;
+    request.paths = paths;
+    request.done = &done;
+    requests.queue(request);
+
+    return result.get();
+}
+
+GroupCommitter *groupCommitter()
+{
+    static GroupCommitter *committer = new GroupCommitter();
+    return committer;
+}
+
+bool parseDurability(std::string name, Durability *durability)
+{
+    if (name == "none")
+    {
+        *durability = Durability::NoSync;
+        return true;
+    }
+
+    if (name == "batched")
+    {
+        *durability = Durability::BatchedSync;
+        return true;
+    }
+
+    if (name == "immediate")
+    {
+        *durability = Durability::ImmediateSync;
+        return true;
+    }
+
+    return false;
+}
+
+std::string toString(Durability durability)
+{
+    switch (durability)
+    {
+    case Durability::DefaultDurability:
+        return "default";
+    case Durability::NoSync:
+        return "none";
+    case Durability::BatchedSync:
+        return "batched";
+    case Durability::ImmediateSync:
+        return "immediate";
+    }
+
+    return "unknown";
+}
+
+std::string stageFile(std::string folder, std::string fallbackPath)
+{
+    createParentFolders(folder + "/");
+
+    int fd = open(folder.c_str(), O_TMPFILE | O_RDWR, 0644);
+    if (fd < 0)
+    {
+        return fallbackPath;
+    }
+
+    std::string stagedPath = "/proc/self/fd/" + std::to_string(fd);
+
+    std::lock_guard<std::mutex> lock(stagedFilesMutex);
+    stagedFiles[stagedPath] = fd;
+    return stagedPath;
+}
+
+std::string stagePartialFile(std::string folder, std::string name)
+{
+    createParentFolders(folder + "/");
+
+    for (const auto &entry : std::filesystem::directory_iterator(folder))
+    {
+        struct stat attributes;
+        if (stat(entry.path().c_str(), &attributes) == 0 &&
+            attributes.st_mtime + TRANSFER_PARTIAL_EXPIRY_SECONDS < now())
+        {
+            ::remove(entry.path().c_str());
+        }
+    }
+
+    return folder + "/" + name;
+}
+
+// An unnamed file can only be linked to a name that is still free, so an
+// existing file is replaced through a temporary link and a rename.
+static bool linkStagedFile(std::string stagedPath, std::string path)
+{
+    if (linkat(AT_FDCWD, stagedPath.c_str(), AT_FDCWD, path.c_str(), AT_SYMLINK_FOLLOW) == 0)
+    {
+        return true;
+    }
+
+    if (errno != EEXIST)
+    {
+        return false;
+    }
+
+    std::string linkPath = folderOf(path) + LINKING_PREFIX + std::to_string(stagedFileDescriptor(stagedPath)) + "-" + extractFilenameFromPath(path);
+    ::remove(linkPath.c_str());
+
+    if (linkat(AT_FDCWD, stagedPath.c_str(), AT_FDCWD, linkPath.c_str(), AT_SYMLINK_FOLLOW) != 0)
+    {
+        return false;
+    }
+
+    if (rename(linkPath.c_str(), path.c_str()) != 0)
+    {
+        ::remove(linkPath.c_str());
+        return false;
+    }
+
+    return true;
+}
+
+bool publishFile(std::string stagedPath, std::string path, Durability durability)
+{
+    createParentFolders(path);
+
+    int fd = stagedFileDescriptor(stagedPath);
+    bool isUnnamed = fd >= 0;
+
+    if (!isUnnamed)
+    {
+        fd = open(stagedPath.c_str(), O_RDONLY);
+        if (fd < 0)
+        {
+            return false;
+        }
+    }
+
+    bool isPublished = groupCommitter()->commit(
+        {fd},
+        [stagedPath, path, isUnnamed]
+        {
+            return isUnnamed ? linkStagedFile(stagedPath, path) : rename(stagedPath.c_str(), path.c_str()) == 0;
+        },
+        {folderOf(path)},
+        durability);
+
+    if (isUnnamed)
+    {
+        forgetStagedFile(stagedPath);
+    }
+    else
+    {
+        close(fd);
+    }
+
+    return isPublished;
+}
+
+void discardFile(std::string stagedPath)
+{
+    if (stagedFileDescriptor(stagedPath) >= 0)
+    {
+        forgetStagedFile(stagedPath);
+        return;
+    }
+
+    ::remove(stagedPath.c_str());
+}
+
+bool syncFile(int fd, Durability durability)
+{
+    return groupCommitter()->commit({fd}, nullptr, {}, durability);
+}
+
+bool syncPath(std::string path, Durability durability)
+{
+    return groupCommitter()->commit({}, nullptr, {path}, durability);
+}
+
+bool isLinkingLeftover(std::string filename)
+{
+    return filename.rfind(LINKING_PREFIX, 0) == 0;
+}
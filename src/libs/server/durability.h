@@ -0,0 +1,73 @@
+#pragma once
+
+#include <string>
+#include <vector>
+#include <future>
+#include <functional>
+
+#include "../common/message.h"
+#include "../common/helpers.h"
+
+// How long the committer waits for more commits to join a batch before
+// syncing, and how many it takes at most.
+#define GROUP_COMMIT_WINDOW_MICROSECONDS 2000
+#define GROUP_COMMIT_MAX_BATCH 256
+#define DEFAULT_DURABILITY Durability::BatchedSync
+
+class CommitRequest
+{
+public:
+    // Files whose data has to reach the disk before publish runs.
+    std::vector<int> files;
+    std::function<bool()> publish;
+    // Files or folders whose metadata has to reach the disk after it.
+    std::vector<std::string> paths;
+
+    std::promise<bool> *done;
+};
+
+// Group commit: fdatasyncs, publishes and fsyncs of everything committed
+// within one window happen together, so concurrent uploads share the
+// flushes instead of paying one round of them each.
+class GroupCommitter
+{
+    ThreadSafeQueue<CommitRequest> requests;
+    std::future<void> committer;
+
+    void commitBatch(std::vector<CommitRequest> batch);
+
+public:
+    GroupCommitter();
+
+    Durability defaultDurability = DEFAULT_DURABILITY;
+
+    bool commit(std::vector<int> files, std::function<bool()> publish, std::vector<std::string> paths, Durability durability);
+};
+
+GroupCommitter *groupCommitter();
+
+bool parseDurability(std::string name, Durability *durability);
+std::string toString(Durability durability);
+
+// Uploads are written to an unnamed O_TMPFILE in the folder they end up in,
+// reachable through /proc/self/fd, so a crash never leaves a half written
+// file behind. Filesystems without O_TMPFILE get fallbackPath instead.
+std::string stageFile(std::string folder, std::string fallbackPath);
+
+// Uploads that can be resumed are staged under a name instead, so a retry
+// finds what the last attempt received. Ones nobody came back for within
+// TRANSFER_PARTIAL_EXPIRY_SECONDS are removed.
+#define TRANSFER_PARTIAL_EXPIRY_SECONDS (24 * 3600)
+
+std::string stagePartialFile(std::string folder, std::string name);
+
+// Syncs the staged data, links or renames it to path and syncs the folder,
+// as much as durability asks for.
+bool publishFile(std::string stagedPath, std::string path, Durability durability);
+void discardFile(std::string stagedPath);
+
+// Name of a link a crash left behind between linking and renaming.
+bool isLinkingLeftover(std::string filename);
+
+bool syncFile(int fd, Durability durability);
+bool syncPath(std::string path, Durability durability);
@@ -1,6 +1,11 @@
 #include <fstream>
+#include <sstream>
+#include <fcntl.h>
+#include <unistd.h>
 
 #include "fileManager.h"
+#include "../common/compression.h"
+#include "parallelTransfer.h"
 
 using namespace std;
 
@@ -33,6 +38,8 @@ std::string toString(FileActionType type)
         return Color::green + "SUBSCRIBE" + Color::reset;
     case FileActionType::Unsubscribe:
         return Color::green + "UNSUBSCRIBE" + Color::reset;
+    case FileActionType::Archive:
+        return Color::green + "ARCHIVE" + Color::reset;
     }
 
     throw new std::exception;
@@ -72,39 +79,452 @@ std::string toString(FileState fileState)
     return "TAG: " + toString(fileState.tag);
 }
 
-FileState uploadCommand(FileState lastFileState, FileAction fileAction, std::function<void(FileState)> onComplete)
+// A file without a body reads as empty.
+std::unique_ptr<std::istream> openStored(StorageBackend *storage, std::string username, std::string filename)
 {
-    FileState nextState;
-    nextState.tag = FileStateTag::Updating;
-    nextState.updated = fileAction.timestamp;
+    std::unique_ptr<std::istream> file = storage->openContent(username, filename);
+    if (!file)
+    {
+        file.reset(new std::istringstream(""));
+    }
 
-    if (lastFileState.IsEmptyState() || lastFileState.IsDeletingState())
+    return file;
+}
+
+bool contentOf(StorageBackend *storage, std::string username, std::string filename, FileState state, std::string *hash, uint64_t *size)
+{
+    if (state.content->get(hash, size))
     {
-        nextState.created = fileAction.timestamp;
-        nextState.acessed = fileAction.timestamp;
+        return true;
+    }
+
+    if (state.IsEmptyState() || state.IsDeletingState() ||
+        !state.executingOperation->finished())
+    {
+        return false;
+    }
+
+    std::unique_ptr<std::istream> file = storage->openContent(username, filename);
+    *hash = file ? contentHash(*file, size) : "";
+    if (hash->empty())
+    {
+        return false;
+    }
+
+    state.content->set(*hash, *size);
+    return true;
+}
+
+// The content of the file, and when the body is a plain file that isn't
+// archived also opens it as body, for sending it with sendfile. Both read
+// the same file, even if it is replaced meanwhile. Null when it has no body.
+std::unique_ptr<std::istream> openBody(StorageBackend *storage, std::string username, std::string filename, int *body)
+{
+    *body = -1;
+    std::string path = storage->pathOf(username, filename);
+    int file = path.empty() ? -1 : open(path.c_str(), O_RDONLY);
+
+    if (file < 0)
+    {
+        return storage->openContent(username, filename);
+    }
+
+    std::unique_ptr<std::istream> stream(new std::ifstream("/proc/self/fd/" + std::to_string(file), ios::in | ios::binary));
+    if (!*stream)
+    {
+        close(file);
+        return storage->openContent(username, filename);
+    }
+
+    if (isArchive(*stream))
+    {
+        close(file);
+        return openArchive(std::move(stream));
+    }
+
+    *body = file;
+    return stream;
+}
+
+// Like openBody, but like openStored a file without a body reads as empty.
+std::unique_ptr<std::istream> openStoredBody(StorageBackend *storage, std::string username, std::string filename, int *body)
+{
+    std::unique_ptr<std::istream> file = openBody(storage, username, filename, body);
+    if (!file)
+    {
+        file.reset(new std::istringstream(""));
+    }
+
+    return file;
+}
+
+// A body that merely starts like an archive is archived for real, so that
+// reading it back undoes exactly that.
+void archiveIfAmbiguous(std::string stagedPath)
+{
+    std::ifstream staged(stagedPath, ios::in | ios::binary);
+    if (!isArchive(staged))
+    {
+        return;
+    }
+
+    std::ostringstream data;
+    data << staged.rdbuf();
+    staged.close();
+
+    std::ofstream rewritten(stagedPath, ios::out | ios::binary | ios::trunc);
+    rewritten << archiveData(data.str());
+}
+
+// Stages and preallocates the file, then lets its ranges fill it in from
+// whichever connections they arrive on. It is committed once EndCommand
+// finds every byte accounted for.
+void receiveParallel(FileAction fileAction, FileContent *content)
+{
+    StorageBackend *storage = fileAction.storage;
+    string username = fileAction.session.username;
+    string stagedPath = storage->stage(username, fileAction.filename);
+
+    auto transfer = std::make_shared<ParallelTransfer>();
+    transfer->username = username;
+    transfer->size = fileAction.size;
+    transfer->file = open(stagedPath.c_str(), O_WRONLY);
+
+    if (transfer->file < 0 ||
+        (fileAction.size > 0 && posix_fallocate(transfer->file, 0, fileAction.size) != 0 && ftruncate(transfer->file, fileAction.size) != 0))
+    {
+        storage->abort(stagedPath);
+        Message::Response(ResponseType::Invalid).send(fileAction.session.socket, false);
+        return;
+    }
+
+    std::string transferId = parallelTransfers()->add(transfer);
+    Message::Response(ResponseType::Ok, transferId).send(fileAction.session.socket, false);
+
+    Message end = serveRanges(fileAction.session);
+    parallelTransfers()->remove(transferId);
+
+    if (end.type != MessageType::EndCommand || !transfer->isComplete())
+    {
+        storage->abort(stagedPath);
+        if (end.type == MessageType::EndCommand)
+        {
+            end.Reply(Message::Response(ResponseType::Invalid), false);
+        }
+        return;
+    }
+
+    uint64_t size;
+    std::string hash = contentHashFile(stagedPath, &size);
+
+    archiveIfAmbiguous(stagedPath);
+    bool isCommitted = storage->commit(username, fileAction.filename, stagedPath, fileAction.durability);
+    if (isCommitted)
+    {
+        content->set(hash, size);
+    }
+
+    end.Reply(Message::Response(isCommitted ? ResponseType::Ok : ResponseType::Invalid), false);
+}
+
+// Serves ranges of the file as it is now; uploads of it wait in the file
+// states until EndCommand.
+void sendParallel(FileAction fileAction)
+{
+    StorageBackend *storage = fileAction.storage;
+    string username = fileAction.session.username;
+    string filename = fileAction.filename;
+
+    auto transfer = std::make_shared<ParallelTransfer>();
+    transfer->username = username;
+    transfer->open = [storage, username, filename](int *body)
+    { return openStoredBody(storage, username, filename, body); };
+
+    int body;
+    std::unique_ptr<std::istream> file = openBody(storage, username, filename, &body);
+    if (body >= 0)
+    {
+        close(body);
+    }
+
+    std::streamoff size = -1;
+    if (file)
+    {
+        file->seekg(0, std::ios::end);
+        size = file->tellg();
     }
 
-    nextState.executingOperation = allocateFunction();
-    *(nextState.executingOperation) = async(
-        launch::async,
-        [fileAction, onComplete, lastFileState, nextState]
+    if (size < 0)
+    {
+        Message::Response(ResponseType::FileNotFound).send(fileAction.session.socket, false);
+        return;
+    }
+
+    transfer->size = size;
+    std::string transferId = parallelTransfers()->add(transfer);
+    Message::Response(ResponseType::Ok, transferId + ":" + std::to_string(size)).send(fileAction.session.socket, false);
+
+    Message end = serveRanges(fileAction.session);
+    parallelTransfers()->remove(transferId);
+
+    if (end.type == MessageType::EndCommand)
+    {
+        end.Reply(Message::Response(ResponseType::Ok), false);
+    }
+}
+
+// Replies with the size of the file and then sends each asked for range of
+// it, cut to the file, as a transfer of its own.
+void sendRanges(FileAction fileAction)
+{
+    int body;
+    auto file = openBody(fileAction.storage, fileAction.session.username, fileAction.filename, &body);
+
+    std::streamoff size = -1;
+    if (file)
+    {
+        file->seekg(0, std::ios::end);
+        size = file->tellg();
+    }
+
+    if (size < 0)
+    {
+        Message::Response(ResponseType::FileNotFound).send(fileAction.session.socket, false);
+    }
+    else
+    {
+        Message::Response(ResponseType::Ok, std::to_string(size)).send(fileAction.session.socket, false);
+
+        for (ByteRange range : fileAction.ranges)
         {
-            if (lastFileState.tag != FileStateTag::EmptyFile)
+            range = range.clip(size);
+            file->clear();
+            if (!sendRange(fileAction.session, *file, range.offset, range.size, body))
             {
-                (lastFileState.executingOperation)->wait();
+                break;
             }
+        }
+    }
+
+    if (body >= 0)
+    {
+        close(body);
+    }
+}
+
+// Receives the body of an upload that needs a transfer. It blocks until
+// the body is stored, so it runs on a transfer thread.
+void receiveUpload(FileAction fileAction, FileState nextState)
+{
+    StorageBackend *storage = fileAction.storage;
+    string username = fileAction.session.username;
+
+    if (fileAction.isParallel)
+    {
+        receiveParallel(fileAction, nextState.content.get());
+        return;
+    }
+
+    Message::Response(ResponseType::Ok).send(fileAction.session.socket, false);
+
+    // Whole file uploads can be resumed after a broken connection, so
+    // they are received into a partial file that outlives it.
+    bool isResumable = !fileAction.useChunks && !fileAction.useDelta;
+    string stagedPath = isResumable ? storage->stagePartial(username, fileAction.filename) : "";
+    isResumable = !stagedPath.empty();
+    if (!isResumable)
+    {
+        stagedPath = storage->stage(username, fileAction.filename);
+    }
+
+    bool isReceived;
+    if (fileAction.useChunks)
+    {
+        isReceived = receiveChunked(fileAction.session, fileAction.chunkIndex, stagedPath);
+    }
+    else if (fileAction.useDelta)
+    {
+        isReceived = sendSignatures(fileAction.session, *openStored(storage, username, fileAction.filename)) &&
+                     receiveDelta(fileAction.session, *openStored(storage, username, fileAction.filename), stagedPath);
+    }
+    else
+    {
+        isReceived = receiveFile(fileAction.session, stagedPath, isResumable);
+    }
+
+    if (isReceived)
+    {
+        uint64_t size;
+        std::string hash = contentHashFile(stagedPath, &size);
+
+        archiveIfAmbiguous(stagedPath);
+        if (storage->commit(username, fileAction.filename, stagedPath, fileAction.durability))
+        {
+            nextState.content->set(hash, size);
+        }
+    }
+    else if (!isResumable)
+    {
+        storage->abort(stagedPath);
+    }
+}
+
+// Uploads that hold nothing new, or carry their data inline, are answered
+// from the event loop. Those that transfer a body receive it on one of the
+// loop's transfer threads. Storage is read and written on the loop's
+// workers, and onComplete runs there too, as it reindexes the file.
+Detached uploadFile(FileAction fileAction, FileState lastFileState, FileState nextState, std::function<void(FileState)> onComplete)
+{
+    EventLoop *loop = fileAction.loop;
+    StorageBackend *storage = fileAction.storage;
+    string username = fileAction.session.username;
+
+    co_await loop->schedule();
+
+    if (lastFileState.tag != FileStateTag::EmptyFile)
+    {
+        co_await loop->after(lastFileState.executingOperation);
+    }
+
+    // An upload of what the file already holds ends before any transfer,
+    // and leaves storage and subscribers alone.
+    string uploadedHash = fileAction.contentHash;
+    uint64_t uploadedSize = fileAction.contentSize;
+    string storedHash;
+    uint64_t storedSize;
+    bool isUnchanged = false;
 
-            Message::Response(ResponseType::Ok).send(fileAction.session.socket, false);
-            string path = "out/" + fileAction.session.username + "/" + fileAction.filename;
-            string temporaryPath = "TEMP_" + fileAction.session.username + "_" + fileAction.filename;
+    auto lookup = loop->background(
+        [&]
+        {
+            if (fileAction.hasInlineData)
+            {
+                std::istringstream data(fileAction.inlineData);
+                uploadedHash = contentHash(data, &uploadedSize);
+            }
 
-            downloadFile(fileAction.session, temporaryPath, path);
-            onComplete(nextState);
+            isUnchanged = !uploadedHash.empty() &&
+                          contentOf(storage, username, fileAction.filename, lastFileState, &storedHash, &storedSize) &&
+                          storedHash == uploadedHash && storedSize == uploadedSize;
         });
+    co_await lookup;
+
+    FileState completed = nextState;
+
+    if (isUnchanged)
+    {
+        std::cout << "Upload of " << fileAction.filename << " holds nothing new" << std::endl;
+        nextState.content->set(storedHash, storedSize);
+        co_await Message::Response(ResponseType::Ok, UPLOAD_UNCHANGED).send(loop, fileAction.session.socket, false);
+
+        completed.isUnchanged = true;
+    }
+    else if (fileAction.hasInlineData)
+    {
+        bool isWritten;
+        auto write = loop->background(
+            [&]
+            {
+                std::string data = isArchive(fileAction.inlineData) ? archiveData(fileAction.inlineData) : fileAction.inlineData;
+                isWritten = storage->write(username, fileAction.filename, data, fileAction.durability);
+            });
+        co_await write;
+
+        if (isWritten)
+        {
+            nextState.content->set(uploadedHash, uploadedSize);
+            co_await Message::Response(ResponseType::Ok).send(loop, fileAction.session.socket, false);
+        }
+        else
+        {
+            std::cout << Color::red << "Failed to store " << fileAction.filename << Color::reset << std::endl;
+            co_await Message::Response(ResponseType::Invalid).send(loop, fileAction.session.socket, false);
+
+            completed.isFailed = true;
+        }
+    }
+    else
+    {
+        auto transfer = loop->transfer(
+            [fileAction, nextState]
+            { receiveUpload(fileAction, nextState); });
+        co_await transfer;
+    }
+
+    auto completion = loop->background(
+        [onComplete, completed]
+        { onComplete(completed); });
+    co_await completion;
+
+    nextState.executingOperation->finish();
+}
+
+FileState uploadCommand(FileState lastFileState, FileAction fileAction, std::function<void(FileState)> onComplete)
+{
+    FileState nextState;
+    nextState.tag = FileStateTag::Updating;
+    nextState.updated = fileAction.timestamp;
+    nextState.acessed = fileAction.timestamp;
+    nextState.created = fileAction.timestamp;
+
+    if (!lastFileState.IsEmptyState() && !lastFileState.IsDeletingState())
+    {
+        nextState.created = lastFileState.created;
+    }
+
+    nextState.executingOperation = std::make_shared<Completion>();
 
+    uploadFile(fileAction, lastFileState, nextState, onComplete);
     return nextState;
 }
 
+// Deleting is a few messages and a removal, so it runs on the event loop
+// and removes on one of its workers.
+Detached deleteFile(FileAction fileAction, FileState lastFileState, FileState nextState, std::function<void(FileState)> onComplete)
+{
+    EventLoop *loop = fileAction.loop;
+    int socket = fileAction.session.socket;
+
+    co_await loop->schedule();
+
+    bool isFound = lastFileState.tag != FileStateTag::EmptyFile;
+    if (isFound)
+    {
+        co_await loop->after(lastFileState.executingOperation);
+        isFound = lastFileState.tag != FileStateTag::Deleting;
+    }
+
+    if (!isFound)
+    {
+        co_await Message::Response(ResponseType::FileNotFound).send(loop, socket, false);
+    }
+    else
+    {
+        Message message = co_await Message::Response(ResponseType::Ok).send(loop, socket);
+
+        if (message.type != MessageType::Start)
+        {
+            message.panic();
+        }
+        else
+        {
+            auto removal = loop->background(
+                [fileAction]
+                { fileAction.storage->remove(fileAction.session.username, fileAction.filename); });
+            co_await removal;
+
+            co_await message.reply(loop, Message::Response(ResponseType::Ok), false);
+        }
+    }
+
+    auto completion = loop->background(
+        [onComplete, nextState]
+        { onComplete(nextState); });
+    co_await completion;
+
+    nextState.executingOperation->finish();
+}
+
 FileState deleteCommand(FileState lastFileState, FileAction fileAction, std::function<void(FileState)> onComplete)
 {
     FileState nextState;
@@ -114,34 +534,85 @@ FileState deleteCommand(FileState lastFileState, FileAction fileAction, std::fun
         nextState.tag = FileStateTag::Deleting;
     }
 
-    nextState.executingOperation = allocateFunction();
-    *(nextState.executingOperation) = async(
-        launch::async,
-        [fileAction, onComplete, lastFileState, nextState]
-        {
-            if (lastFileState.tag == FileStateTag::EmptyFile)
-            {
-                Message::Response(ResponseType::FileNotFound).send(fileAction.session.socket, false);
-                onComplete(nextState);
-                return;
-            }
+    nextState.executingOperation = std::make_shared<Completion>();
 
-            (lastFileState.executingOperation)->wait();
+    deleteFile(fileAction, lastFileState, nextState, onComplete);
+    return nextState;
+}
 
-            if (lastFileState.tag == FileStateTag::Deleting)
-            {
-                Message::Response(ResponseType::FileNotFound).send(fileAction.session.socket, false);
-                onComplete(nextState);
-                return;
-            }
+// Sends the body of a file, or the parts of it asked for. It blocks until
+// they are sent, so it runs on a transfer thread.
+void sendStored(FileAction fileAction)
+{
+    if (fileAction.isParallel)
+    {
+        sendParallel(fileAction);
+        return;
+    }
 
-            Message::Response(ResponseType::Ok).send(fileAction.session.socket, false);
-            string path = "out/" + fileAction.session.username + "/" + fileAction.filename;
-            deleteFile(fileAction.session, path);
-            onComplete(nextState);
-        });
+    if (!fileAction.ranges.empty())
+    {
+        sendRanges(fileAction);
+        return;
+    }
 
-    return nextState;
+    Message::Response(ResponseType::Ok).send(fileAction.session.socket, false);
+
+    int body;
+    auto file = openStoredBody(fileAction.storage, fileAction.session.username, fileAction.filename, &body);
+
+    Signatures signatures;
+    if (!fileAction.useDelta)
+    {
+        sendFile(fileAction.session, *file, fileAction.filename, body);
+    }
+    else if (receiveSignatures(fileAction.session, &signatures))
+    {
+        sendDelta(fileAction.session, *file, signatures);
+    }
+
+    if (body >= 0)
+    {
+        close(body);
+    }
+}
+
+// Reads wait for the update or delete before them, but run along with the
+// reads before them, and only finish after those did.
+Detached readFile(FileAction fileAction, FileState lastFileState, FileState nextState, std::function<void(FileState)> onComplete)
+{
+    EventLoop *loop = fileAction.loop;
+
+    co_await loop->schedule();
+
+    if (lastFileState.tag == FileStateTag::Updating || lastFileState.tag == FileStateTag::Deleting)
+    {
+        co_await loop->after(lastFileState.executingOperation);
+    }
+
+    if (lastFileState.tag == FileStateTag::EmptyFile || lastFileState.tag == FileStateTag::Deleting)
+    {
+        co_await Message::Response(ResponseType::FileNotFound).send(loop, fileAction.session.socket, false);
+    }
+    else
+    {
+        auto transfer = loop->transfer(
+            [fileAction]
+            { sendStored(fileAction); });
+        co_await transfer;
+
+        if (lastFileState.tag == FileStateTag::Reading)
+        {
+            co_await loop->after(lastFileState.executingOperation);
+        }
+    }
+
+    auto completion = loop->background(
+        [onComplete, nextState]
+        { onComplete(nextState); });
+    co_await completion;
+
+    nextState.executingOperation->finish();
 }
 
 FileState readCommand(FileState lastFileState, FileAction fileAction, std::function<void(FileState)> onComplete)
@@ -151,52 +622,97 @@ FileState readCommand(FileState lastFileState, FileAction fileAction, std::funct
     if (!lastFileState.IsEmptyState() && !lastFileState.IsDeletingState())
     {
         nextState.tag = FileStateTag::Reading;
+        nextState.created = lastFileState.created;
+        nextState.updated = lastFileState.updated;
         nextState.acessed = fileAction.timestamp;
+        nextState.content = lastFileState.content;
     }
 
-    nextState.executingOperation = allocateFunction();
-    *(nextState.executingOperation) = async(
-        launch::async,
-        [fileAction, onComplete, lastFileState, nextState]
-        {
-            if (lastFileState.tag == FileStateTag::EmptyFile)
-            {
-                Message::Response(ResponseType::FileNotFound).send(fileAction.session.socket, false);
-                onComplete(nextState);
-                return;
-            }
+    nextState.executingOperation = std::make_shared<Completion>();
 
-            if (lastFileState.tag == FileStateTag::Deleting)
-            {
-                (lastFileState.executingOperation)->wait();
-                Message::Response(ResponseType::FileNotFound).send(fileAction.session.socket, false);
-                onComplete(nextState);
-                return;
-            }
+    readFile(fileAction, lastFileState, nextState, onComplete);
+    return nextState;
+}
 
-            if (lastFileState.tag == FileStateTag::Reading || lastFileState.tag == FileStateTag::Updating)
-            {
+// Archives the body of a cold file, when that saves at least
+// TIERING_MIN_SAVINGS of it. Reads and compresses the whole file, so it
+// runs on a transfer thread.
+void archiveStored(FileAction fileAction, FileState lastFileState)
+{
+    StorageBackend *storage = fileAction.storage;
+    string username = fileAction.session.username;
+
+    std::unique_ptr<std::istream> file = storage->openRead(username, fileAction.filename);
+    if (!file || isArchive(*file))
+    {
+        return;
+    }
+
+    string stagedPath = storage->stage(username, fileAction.filename);
+    std::fstream archive(stagedPath, ios::in | ios::out | ios::binary | ios::trunc);
+    uint64_t archiveSize = archiveStream(*file, archive);
+    archive.close();
 
-                if (lastFileState.tag == FileStateTag::Updating)
-                {
-                    (lastFileState.executingOperation)->wait();
-                }
+    file->clear();
+    file->seekg(0, ios::end);
+    uint64_t originalSize = file->tellg();
 
-                Message::Response(ResponseType::Ok).send(fileAction.session.socket, false);
+    if (archiveSize == 0 || archiveSize > originalSize * (1 - TIERING_MIN_SAVINGS))
+    {
+        storage->abort(stagedPath);
+        return;
+    }
 
-                string path = "out/" + fileAction.session.username + "/" + fileAction.filename;
-                sendFile(fileAction.session, path);
+    // Archiving doesn't change the file, so it keeps being listed with the
+    // times it had, also after a restart.
+    StoredFile times;
+    times.created = lastFileState.created;
+    times.updated = lastFileState.updated;
+    times.acessed = lastFileState.acessed;
 
-                if (lastFileState.tag == FileStateTag::Reading)
-                {
-                    (lastFileState.executingOperation)->wait();
-                }
+    if (storage->commitKeepingTimes(username, fileAction.filename, stagedPath, times, Durability::BatchedSync))
+    {
+        compressionMetrics()->archivedFiles++;
+        compressionMetrics()->originalBytes += originalSize;
+        compressionMetrics()->archivedBytes += archiveSize;
+    }
+}
 
-                onComplete(nextState);
-                return;
-            }
-        });
+Detached archiveFile(FileAction fileAction, FileState lastFileState, FileState nextState, std::function<void(FileState)> onComplete)
+{
+    EventLoop *loop = fileAction.loop;
 
+    co_await loop->schedule();
+    co_await loop->after(lastFileState.executingOperation);
+
+    auto transfer = loop->transfer(
+        [fileAction, lastFileState]
+        { archiveStored(fileAction, lastFileState); });
+    co_await transfer;
+
+    auto completion = loop->background(
+        [onComplete, nextState]
+        { onComplete(nextState); });
+    co_await completion;
+
+    nextState.executingOperation->finish();
+}
+
+// Replaces the body of a cold file with an archive of it. Reads go through
+// openContent and don't notice.
+FileState archiveCommand(FileState lastFileState, FileAction fileAction, std::function<void(FileState)> onComplete)
+{
+    if (lastFileState.IsEmptyState() || lastFileState.IsDeletingState())
+    {
+        onComplete(lastFileState);
+        return lastFileState;
+    }
+
+    FileState nextState = lastFileState;
+    nextState.tag = FileStateTag::Updating;
+    nextState.executingOperation = std::make_shared<Completion>();
+
+    archiveFile(fileAction, lastFileState, nextState, onComplete);
     return nextState;
 }
 
@@ -219,5 +735,10 @@ FileState getNextState(FileState lastFileState, FileAction fileAction, std::func
         return readCommand(lastFileState, fileAction, onComplete);
     }
 
+    if (fileAction.type == FileActionType::Archive)
+    {
+        return archiveCommand(lastFileState, fileAction, onComplete);
+    }
+
     throw exception();
 }
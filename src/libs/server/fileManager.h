@@ -1,10 +1,23 @@
+#pragma once
+
 #include <future>
 #include <map>
-#include <filesystem>
+#include <set>
+#include <mutex>
+#include <memory>
 #include <string.h>
 
 #include "../common/helpers.h"
 #include "../common/message.h"
+#include "../common/delta.h"
+#include "chunkIndex.h"
+#include "storage.h"
+
+// Files nobody read for this long are archived, as long as that makes them
+// at least TIERING_MIN_SAVINGS smaller. Checked every interval.
+#define TIERING_ARCHIVE_AFTER_SECONDS (30 * 24 * 60 * 60)
+#define TIERING_INTERVAL_SECONDS (60 * 60)
+#define TIERING_MIN_SAVINGS 0.1
 
 enum FileActionType
 {
@@ -13,7 +26,8 @@ enum FileActionType
     Read,
     Delete,
     ListServer,
-    Unsubscribe
+    Unsubscribe,
+    Archive
 };
 
 class FileAction
@@ -24,6 +38,30 @@ public:
     FileActionType type;
     time_t timestamp;
 
+    bool hasInlineData = false;
+    std::string inlineData;
+
+    bool useDelta = false;
+    bool useChunks = false;
+    ChunkIndex *chunkIndex = nullptr;
+
+    // Moves as byte ranges over several connections, see parallelTransfer.h.
+    bool isParallel = false;
+    uint64_t size = 0;
+
+    // Reads only these parts of the file when there are any.
+    std::vector<ByteRange> ranges;
+
+    // What the uploader says the file holds, "" when it didn't say.
+    std::string contentHash;
+    uint64_t contentSize = 0;
+
+    Durability durability = Durability::DefaultDurability;
+
+    StorageBackend *storage = nullptr;
+    // Runs the parts of the command that don't hold a thread of their own.
+    EventLoop *loop = nullptr;
+
     FileAction(Session _session,
                std::string _filename,
                FileActionType _type,
@@ -44,15 +82,49 @@ enum FileStateTag
     Deleting
 };
 
+// Hash and size of what a file holds. The operation that writes the file
+// records them, and every state it carries over to shares them. Unknown
+// until that operation is done, or after a restart until first asked for.
+class FileContent
+{
+    std::mutex _mutex;
+    std::string hash;
+    uint64_t size = 0;
+
+public:
+    void set(std::string hash, uint64_t size)
+    {
+        std::lock_guard<std::mutex> lock(_mutex);
+        this->hash = hash;
+        this->size = size;
+    }
+
+    bool get(std::string *hash, uint64_t *size)
+    {
+        std::lock_guard<std::mutex> lock(_mutex);
+        *hash = this->hash;
+        *size = this->size;
+        return !this->hash.empty();
+    }
+};
+
 class FileState
 {
 public:
     FileStateTag tag;
-    std::future<void> *executingOperation;
+    // Finished once the command that made this state is done.
+    std::shared_ptr<Completion> executingOperation;
+
+    time_t created = 0;
+    time_t updated = 0;
+    time_t acessed = 0;
 
-    time_t created;
-    time_t updated;
-    time_t acessed;
+    std::shared_ptr<FileContent> content = std::make_shared<FileContent>();
+    // Set on the state an upload completes with when it held what the file
+    // already did, so nobody is told about it.
+    bool isUnchanged = false;
+    // Set on the state an upload completes with when storing it failed.
+    bool isFailed = false;
 
     bool IsEmptyState() { return this->tag == FileStateTag::EmptyFile; }
     bool IsReadingState() { return this->tag == FileStateTag::Reading; }
@@ -72,7 +144,11 @@ class UserFiles
 
 public:
     std::map<std::string, FileState> fileStatesByFilename;
-    std::list<int> *subscribers = new std::list<int>();
+    std::list<Session> *subscribers = new std::list<Session>();
+    ChunkIndex *chunkIndex = nullptr;
+
+    // Files already archived, or not worth it, since their last upload.
+    std::set<std::string> archivedFiles;
 
     FileState get(std::string filename)
     {
@@ -97,38 +173,29 @@ class FilesManager
     std::map<std::string, UserFiles *> userFilesByUsername;
 
 public:
-    FilesManager()
-    {
-        for (const auto &userEntry : std::filesystem::directory_iterator("out/"))
-        {
-            if (!userEntry.is_directory())
-            {
-                continue;
-            }
+    StorageBackend *storage;
+    time_t archiveAfter = TIERING_ARCHIVE_AFTER_SECONDS;
 
-            std::string username = extractLabelFromPath(userEntry.path());
+    FilesManager(StorageBackend *storage)
+    {
+        this->storage = storage;
 
+        for (auto const &username : storage->listUsers())
+        {
             UserFiles *userFiles = getFiles(username);
 
-            for (const auto &fileEntry : std::filesystem::directory_iterator("out/" + username))
+            for (auto const &file : storage->listFiles(username))
             {
-                if (!fileEntry.is_regular_file())
-                {
-                    continue;
-                }
-                std::string path = fileEntry.path();
-                std::string filename = extractLabelFromPath(path);
-
                 FileState fileState = FileState::Empty();
                 fileState.tag = FileStateTag::Updating;
-                fileState.executingOperation = allocateFunction();
-                *(fileState.executingOperation) = std::async(launch::async, [] {});
+                fileState.executingOperation = std::make_shared<Completion>();
+                fileState.executingOperation->finish();
 
-                fileState.acessed = getAccessTime(path);
-                fileState.created = getCreateTime(path);
-                fileState.updated = getModificationTime(path);
+                fileState.acessed = file.acessed;
+                fileState.created = file.created;
+                fileState.updated = file.updated;
 
-                userFiles->fileStatesByFilename[filename] = fileState;
+                userFiles->fileStatesByFilename[file.filename] = fileState;
             }
         }
     }
@@ -137,13 +204,25 @@ public:
     {
         if (userFilesByUsername.find(username) == userFilesByUsername.end())
         {
-            UserFiles *initial = (UserFiles *)malloc(sizeof(UserFiles));
-            *initial = UserFiles();
+            UserFiles *initial = new UserFiles();
+            initial->chunkIndex = new ChunkIndex(storage, username);
             userFilesByUsername[username] = initial;
         }
 
         return userFilesByUsername[username];
     }
+
+    std::vector<std::string> listUsernames()
+    {
+        std::vector<std::string> usernames;
+
+        for (auto const &item : userFilesByUsername)
+        {
+            usernames.push_back(item.first);
+        }
+
+        return usernames;
+    }
 };
 
 std::string toString(FileActionType type);
@@ -151,3 +230,7 @@ std::string fileActionToString(FileAction fileAction);
 std::string toString(FileState fileState);
 
 FileState getNextState(FileState lastFileState, FileAction fileAction, std::function<void(FileState)> onComplete);
+
+// The content of a file as far as its state knows it, hashed from storage
+// when no operation recorded it and none is running. False when unknown.
+bool contentOf(StorageBackend *storage, std::string username, std::string filename, FileState state, std::string *hash, uint64_t *size);
@@ -0,0 +1,290 @@
+#include <fstream>
+#include <string.h>
+#include <sys/statvfs.h>
+
+#include "multiRootStorage.h"
+#include "../common/hash.h"
+#include "../common/socket.h"
+
+static uint64_t ringPosition(std::string key)
+{
+    std::string digest = sha256(key);
+    uint64_t position;
+    memcpy(&position, digest.data(), sizeof(position));
+    return position;
+}
+
+static uint64_t capacityOf(std::string path)
+{
+    struct statvfs attributes;
+    if (statvfs(path.c_str(), &attributes) != 0)
+    {
+        return 1;
+    }
+
+    return std::max<uint64_t>(1, (uint64_t)attributes.f_blocks * attributes.f_frsize);
+}
+
+MultiRootStorage::MultiRootStorage(std::vector<std::string> paths, std::string backendName)
+{
+    long double totalCapacity = 0;
+
+    for (auto path : paths)
+    {
+        StorageRoot root;
+        root.path = path;
+        root.backend = createStorage(backendName, path);
+        root.capacity = capacityOf(path);
+
+        if (root.backend == nullptr)
+        {
+            return;
+        }
+
+        root.io = new WorkerPool(STORAGE_ROOT_IO_WORKERS);
+
+        totalCapacity += root.capacity;
+        roots.push_back(root);
+    }
+
+    long double averageCapacity = totalCapacity / roots.size();
+
+    for (size_t i = 0; i < roots.size(); i++)
+    {
+        int points = std::max(1, (int)(STORAGE_RING_POINTS_PER_ROOT * roots[i].capacity / averageCapacity));
+
+        for (int point = 0; point < points; point++)
+        {
+            ring[ringPosition(roots[i].path + "#" + std::to_string(point))] = i;
+        }
+
+        std::cout << "Storage root " << roots[i].path << ": "
+                  << roots[i].capacity / (1024 * 1024 * 1024) << "GB, "
+                  << points << " ring points" << std::endl;
+    }
+
+    rebalance();
+}
+
+bool MultiRootStorage::isValid()
+{
+    return !roots.empty() && !ring.empty();
+}
+
+int MultiRootStorage::placementOf(std::string username)
+{
+    auto point = ring.lower_bound(ringPosition(username));
+    if (point == ring.end())
+    {
+        point = ring.begin();
+    }
+
+    return point->second;
+}
+
+StorageRoot &MultiRootStorage::rootOf(std::string username)
+{
+    return roots[placementOf(username)];
+}
+
+void MultiRootStorage::moveUser(std::string username, StorageRoot &from, StorageRoot &to)
+{
+    to.backend->createUser(username);
+
+    for (auto const &file : from.backend->listFiles(username))
+    {
+        std::unique_ptr<std::istream> source = from.backend->openRead(username, file.filename);
+        if (!source)
+        {
+            continue;
+        }
+
+        std::string stagedPath = to.backend->stage(username, file.filename);
+        std::ofstream staged(stagedPath, std::ios::out | std::ios::binary | std::ios::trunc);
+        staged << source->rdbuf();
+        staged.close();
+
+        if (!staged || !to.backend->commitKeepingTimes(username, file.filename, stagedPath, file, Durability::ImmediateSync))
+        {
+            std::cout << Color::red << "Couldn't move " << file.filename << " of " << username
+                      << " to " << to.path << Color::reset << std::endl;
+            to.backend->abort(stagedPath);
+            continue;
+        }
+
+        from.backend->remove(username, file.filename);
+    }
+}
+
+// Moves every user found outside the root the ring places them in. Runs
+// before the server accepts connections.
+void MultiRootStorage::rebalance()
+{
+    for (auto &root : roots)
+    {
+        for (auto const &username : root.backend->listUsers())
+        {
+            StorageRoot &placement = rootOf(username);
+
+            if (&placement == &root || root.backend->listFiles(username).empty())
+            {
+                continue;
+            }
+
+            std::cout << Color::yellow << "Moving " << username << " from " << root.path
+                      << " to " << placement.path << Color::reset << std::endl;
+
+            moveUser(username, root, placement);
+        }
+    }
+}
+
+void MultiRootStorage::createUser(std::string username)
+{
+    StorageRoot &root = rootOf(username);
+    root.io->call([&]
+                  { root.backend->createUser(username); });
+}
+
+std::vector<std::string> MultiRootStorage::listUsers()
+{
+    std::vector<std::string> usernames;
+
+    for (auto &root : roots)
+    {
+        for (auto const &username : root.backend->listUsers())
+        {
+            if (&rootOf(username) == &root)
+            {
+                usernames.push_back(username);
+            }
+        }
+    }
+
+    return usernames;
+}
+
+std::vector<StoredFile> MultiRootStorage::listFiles(std::string username)
+{
+    return rootOf(username).backend->listFiles(username);
+}
+
+std::string MultiRootStorage::pathOf(std::string username, std::string filename)
+{
+    return rootOf(username).backend->pathOf(username, filename);
+}
+
+std::unique_ptr<std::istream> MultiRootStorage::openRead(std::string username, std::string filename)
+{
+    StorageRoot &root = rootOf(username);
+    std::unique_ptr<std::istream> file;
+
+    root.io->call([&]
+                  { file = root.backend->openRead(username, filename); });
+    return file;
+}
+
+void MultiRootStorage::rememberStaged(std::string stagedPath, std::string username)
+{
+    std::lock_guard<std::mutex> lock(_mutex);
+    rootsByStagedPath[stagedPath] = placementOf(username);
+}
+
+StorageRoot *MultiRootStorage::forgetStaged(std::string stagedPath)
+{
+    std::lock_guard<std::mutex> lock(_mutex);
+
+    auto staged = rootsByStagedPath.find(stagedPath);
+    if (staged == rootsByStagedPath.end())
+    {
+        return nullptr;
+    }
+
+    StorageRoot *root = &roots[staged->second];
+    rootsByStagedPath.erase(staged);
+    return root;
+}
+
+std::string MultiRootStorage::stage(std::string username, std::string filename)
+{
+    std::string stagedPath = rootOf(username).backend->stage(username, filename);
+    rememberStaged(stagedPath, username);
+    return stagedPath;
+}
+
+std::string MultiRootStorage::stagePartial(std::string username, std::string filename)
+{
+    std::string stagedPath = rootOf(username).backend->stagePartial(username, filename);
+    if (!stagedPath.empty())
+    {
+        rememberStaged(stagedPath, username);
+    }
+    return stagedPath;
+}
+
+bool MultiRootStorage::commit(std::string username, std::string filename, std::string stagedPath, Durability durability)
+{
+    StorageRoot &root = rootOf(username);
+    bool isCommitted;
+
+    forgetStaged(stagedPath);
+    root.io->call([&]
+                  { isCommitted = root.backend->commit(username, filename, stagedPath, durability); });
+    return isCommitted;
+}
+
+// Staged paths can be descriptors rather than paths under the root, so the
+// root is the one that staged it.
+void MultiRootStorage::abort(std::string stagedPath)
+{
+    StorageRoot *root = forgetStaged(stagedPath);
+    if (root == nullptr)
+    {
+        discardFile(stagedPath);
+        return;
+    }
+
+    root->io->call([&]
+                   { root->backend->abort(stagedPath); });
+}
+
+bool MultiRootStorage::write(std::string username, std::string filename, std::string data, Durability durability)
+{
+    StorageRoot &root = rootOf(username);
+    bool isWritten;
+
+    root.io->call([&]
+                  { isWritten = root.backend->write(username, filename, data, durability); });
+    return isWritten;
+}
+
+bool MultiRootStorage::commitKeepingTimes(std::string username, std::string filename, std::string stagedPath, StoredFile times, Durability durability)
+{
+    StorageRoot &root = rootOf(username);
+    bool isCommitted;
+
+    forgetStaged(stagedPath);
+    root.io->call([&]
+                  { isCommitted = root.backend->commitKeepingTimes(username, filename, stagedPath, times, durability); });
+    return isCommitted;
+}
+
+bool MultiRootStorage::writeKeepingTimes(std::string username, std::string filename, std::string data, StoredFile times, Durability durability)
+{
+    StorageRoot &root = rootOf(username);
+    bool isWritten;
+
+    root.io->call([&]
+                  { isWritten = root.backend->writeKeepingTimes(username, filename, data, times, durability); });
+    return isWritten;
+}
+
+bool MultiRootStorage::remove(std::string username, std::string filename)
+{
+    StorageRoot &root = rootOf(username);
+    bool isRemoved;
+
+    root.io->call([&]
+                  { isRemoved = root.backend->remove(username, filename); });
+    return isRemoved;
+}
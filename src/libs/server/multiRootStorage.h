@@ -0,0 +1,66 @@
+#pragma once
+
+#include <map>
+#include <mutex>
+#include <stdint.h>
+
+#include "storage.h"
+#include "../common/helpers.h"
+
+// Threads per root doing blocking storage work, so a saturated disk only
+// backs up its own queue.
+#define STORAGE_ROOT_IO_WORKERS 4
+// Ring points of a root of average capacity; bigger roots get more.
+#define STORAGE_RING_POINTS_PER_ROOT 128
+
+class StorageRoot
+{
+public:
+    std::string path;
+    StorageBackend *backend;
+    uint64_t capacity;
+    WorkerPool *io;
+};
+
+// Spreads users over several storage roots, usually one per disk, each with
+// its own backend. A user lives entirely in one root, picked on a consistent
+// hash ring weighted by root capacity, so adding a root only moves the users
+// whose ring arcs it takes over. Those are moved by the rebalance on start.
+class MultiRootStorage : public StorageBackend
+{
+    std::vector<StorageRoot> roots;
+    std::map<uint64_t, int> ring;
+
+    std::mutex _mutex;
+    std::map<std::string, int> rootsByStagedPath;
+
+    StorageRoot &rootOf(std::string username);
+    int placementOf(std::string username);
+    void rememberStaged(std::string stagedPath, std::string username);
+    StorageRoot *forgetStaged(std::string stagedPath);
+
+    void rebalance();
+    void moveUser(std::string username, StorageRoot &from, StorageRoot &to);
+
+public:
+    MultiRootStorage(std::vector<std::string> paths, std::string backendName);
+
+    bool isValid();
+
+    void createUser(std::string username) override;
+    std::vector<std::string> listUsers() override;
+    std::vector<StoredFile> listFiles(std::string username) override;
+
+    std::string pathOf(std::string username, std::string filename) override;
+    std::unique_ptr<std::istream> openRead(std::string username, std::string filename) override;
+
+    std::string stage(std::string username, std::string filename) override;
+    std::string stagePartial(std::string username, std::string filename) override;
+    bool commit(std::string username, std::string filename, std::string stagedPath, Durability durability) override;
+    void abort(std::string stagedPath) override;
+    bool write(std::string username, std::string filename, std::string data, Durability durability) override;
+    bool commitKeepingTimes(std::string username, std::string filename, std::string stagedPath, StoredFile times, Durability durability) override;
+    bool writeKeepingTimes(std::string username, std::string filename, std::string data, StoredFile times, Durability durability) override;
+
+    bool remove(std::string username, std::string filename) override;
+};
@@ -0,0 +1,183 @@
+#include <thread>
+#include <chrono>
+#include <unistd.h>
+
+#include "notifications.h"
+
+using namespace std;
+
+std::string toString(NotificationStats stats)
+{
+    return "queued: " + std::to_string(stats.queued) +
+           " coalesced: " + std::to_string(stats.coalesced) +
+           " collapsed into delete: " + std::to_string(stats.collapsedIntoDelete) +
+           " flushed: " + std::to_string(stats.flushed) +
+           " delivered: " + std::to_string(stats.delivered);
+}
+
+void NotificationCoalescer::notify(std::string username, std::list<Session> subscribers, Message message)
+{
+    std::unique_lock<std::mutex> lock(_mutex);
+
+    Key key(username, message.filename);
+    _stats.queued++;
+
+    auto existing = pendingByFile.find(key);
+    if (existing == pendingByFile.end())
+    {
+        order.push_back(key);
+    }
+    else
+    {
+        _stats.coalesced++;
+
+        if (existing->second.message.type == MessageType::RemoteFileUpdate &&
+            message.type == MessageType::RemoteFileDelete)
+        {
+            _stats.collapsedIntoDelete++;
+        }
+    }
+
+    PendingNotification notification;
+    notification.message = message;
+    notification.subscribers = subscribers;
+    pendingByFile[key] = notification;
+}
+
+NotificationStats NotificationCoalescer::stats()
+{
+    std::unique_lock<std::mutex> lock(_mutex);
+    return _stats;
+}
+
+void NotificationCoalescer::flushLoop()
+{
+    while (true)
+    {
+        std::this_thread::sleep_for(std::chrono::milliseconds(NOTIFICATION_COALESCING_WINDOW_MS));
+        flush();
+    }
+}
+
+std::shared_ptr<Completion> NotificationCoalescer::turn(int socket, std::shared_ptr<Completion> *previous)
+{
+    std::unique_lock<std::mutex> lock(_mutex);
+
+    std::shared_ptr<Completion> &last = sendingBySocket[socket];
+    if (!last)
+    {
+        last = std::make_shared<Completion>();
+        last->finish();
+    }
+
+    *previous = last;
+    last = std::make_shared<Completion>();
+    return last;
+}
+
+void NotificationCoalescer::close(int socket)
+{
+    std::shared_ptr<Completion> previous;
+    std::shared_ptr<Completion> closed = turn(socket, &previous);
+
+    previous->then(
+        [socket, closed]
+        {
+            ::close(socket);
+            closed->finish();
+        });
+}
+
+void NotificationCoalescer::onDelivered(int socket, long delivered, bool isLost)
+{
+    if (isLost)
+    {
+        onSubscriberLost(socket);
+    }
+
+    std::unique_lock<std::mutex> lock(_mutex);
+    _stats.delivered += delivered;
+}
+
+// Sends a subscriber what a flush has for it, once it is its turn.
+static Detached deliver(EventLoop *loop, NotificationCoalescer *coalescer, int socket, std::list<Message> messages)
+{
+    std::shared_ptr<Completion> previous;
+    std::shared_ptr<Completion> turn = coalescer->turn(socket, &previous);
+
+    co_await loop->schedule();
+    co_await loop->after(previous);
+
+    long delivered = 0;
+    bool isLost = false;
+
+    for (auto &message : messages)
+    {
+        bool isDelete = message.type == MessageType::RemoteFileDelete;
+        Message response = co_await message.send(loop, socket, !isDelete);
+
+        if (!isDelete && response.type == MessageType::Empty)
+        {
+            isLost = true;
+            break;
+        }
+
+        delivered++;
+    }
+
+    coalescer->onDelivered(socket, delivered, isLost);
+    turn->finish();
+}
+
+void NotificationCoalescer::flush()
+{
+    std::list<PendingNotification> notifications;
+
+    {
+        std::unique_lock<std::mutex> lock(_mutex);
+
+        for (auto const &key : order)
+        {
+            notifications.push_back(pendingByFile[key]);
+        }
+
+        pendingByFile.clear();
+        order.clear();
+    }
+
+    if (notifications.empty())
+    {
+        return;
+    }
+
+    std::map<int, std::list<Message>> messagesBySocket;
+
+    for (auto &notification : notifications)
+    {
+        for (auto const &subscriber : notification.subscribers)
+        {
+            Message message = notification.message;
+
+            if (message.hasInlineData && message.data.size() > (size_t)subscriber.inlineLimit)
+            {
+                message.hasInlineData = false;
+                message.data.clear();
+            }
+
+            messagesBySocket[subscriber.socket].push_back(message);
+        }
+    }
+
+    for (auto &item : messagesBySocket)
+    {
+        deliver(loop, this, item.first, item.second);
+    }
+
+    std::unique_lock<std::mutex> lock(_mutex);
+    _stats.flushed += notifications.size();
+
+    if (LOG_DEBUG_INFORMATION)
+    {
+        std::cout << "NOTIFICATIONS " << toString(_stats) << std::endl;
+    }
+}
@@ -0,0 +1,81 @@
+#pragma once
+
+#include <map>
+#include <list>
+#include <mutex>
+#include <future>
+#include <functional>
+
+#include "../common/helpers.h"
+#include "../common/message.h"
+#include "../common/eventLoop.h"
+
+#define NOTIFICATION_COALESCING_WINDOW_MS 200
+
+class NotificationStats
+{
+public:
+    long queued = 0;
+    long coalesced = 0;
+    long collapsedIntoDelete = 0;
+    long flushed = 0;
+    long delivered = 0;
+};
+
+std::string toString(NotificationStats stats);
+
+class PendingNotification
+{
+public:
+    Message message = Message::Empty();
+    std::list<Session> subscribers;
+};
+
+// Holds RemoteFileUpdate/RemoteFileDelete messages for a short window so that
+// bursts of changes on the same (user, filename) reach subscribers only once,
+// with the latest state.
+//
+// Flushed messages are sent from the event loop. Whatever is sent to a
+// subscriber socket takes a turn on it, so senders don't interleave their
+// messages.
+class NotificationCoalescer
+{
+    using Key = std::pair<std::string, std::string>;
+
+    EventLoop *loop;
+
+    std::mutex _mutex;
+    std::map<Key, PendingNotification> pendingByFile;
+    std::list<Key> order;
+    std::map<int, std::shared_ptr<Completion>> sendingBySocket;
+    NotificationStats _stats;
+
+    std::function<void(int)> onSubscriberLost;
+    std::future<void> flusher;
+
+    void flushLoop();
+    void flush();
+
+public:
+    NotificationCoalescer(EventLoop *loop, std::function<void(int)> onSubscriberLost)
+    {
+        this->loop = loop;
+        this->onSubscriberLost = onSubscriberLost;
+        this->flusher = std::async(
+            launch::async,
+            [this]
+            { flushLoop(); });
+    }
+
+    void notify(std::string username, std::list<Session> subscribers, Message message);
+
+    // Takes the next turn to send to socket, which starts once previous
+    // finished. The caller finishes the turn it got when done sending.
+    std::shared_ptr<Completion> turn(int socket, std::shared_ptr<Completion> *previous);
+    // Closes socket once everything before it was sent.
+    void close(int socket);
+    // Called by the sends of a flush when done.
+    void onDelivered(int socket, long delivered, bool isLost);
+
+    NotificationStats stats();
+};
@@ -0,0 +1,162 @@
+#include <random>
+#include <iterator>
+#include <algorithm>
+#include <unistd.h>
+
+#include "parallelTransfer.h"
+#include "../common/hash.h"
+
+ParallelTransfer::~ParallelTransfer()
+{
+    if (file >= 0)
+    {
+        close(file);
+    }
+}
+
+void ParallelTransfer::markReceived(uint64_t offset, uint64_t size)
+{
+    if (size == 0)
+    {
+        return;
+    }
+
+    uint64_t start = offset;
+    uint64_t end = offset + size;
+
+    // The first range that could touch this one starts at or before it.
+    auto range = received.upper_bound(start);
+    if (range != received.begin() && std::prev(range)->second >= start)
+    {
+        range--;
+    }
+
+    while (range != received.end() && range->first <= end)
+    {
+        start = std::min(start, range->first);
+        end = std::max(end, range->second);
+        range = received.erase(range);
+    }
+
+    received[start] = end;
+}
+
+bool ParallelTransfer::isComplete()
+{
+    std::unique_lock<std::mutex> lock(_mutex);
+    _idle.wait(lock, [this]
+               { return receiving == 0; });
+
+    if (size == 0)
+    {
+        return true;
+    }
+
+    return received.size() == 1 && received.begin()->first == 0 && received.begin()->second == size;
+}
+
+// Ids are random so a user can't reach a transfer of another one, which
+// find also checks.
+std::string ParallelTransfers::add(std::shared_ptr<ParallelTransfer> transfer)
+{
+    static std::random_device random;
+    std::string transferId;
+
+    std::lock_guard<std::mutex> lock(_mutex);
+    do
+    {
+        std::string bytes;
+        for (int i = 0; i < 4; i++)
+        {
+            uint32_t value = random();
+            bytes.append((char *)&value, sizeof(value));
+        }
+
+        transferId = toHex(bytes);
+    } while (transfers.count(transferId) > 0);
+
+    transfers[transferId] = transfer;
+    return transferId;
+}
+
+std::shared_ptr<ParallelTransfer> ParallelTransfers::find(std::string transferId, std::string username)
+{
+    std::lock_guard<std::mutex> lock(_mutex);
+    auto transfer = transfers.find(transferId);
+
+    if (transfer == transfers.end() || transfer->second->username != username)
+    {
+        return nullptr;
+    }
+
+    return transfer->second;
+}
+
+void ParallelTransfers::remove(std::string transferId)
+{
+    std::lock_guard<std::mutex> lock(_mutex);
+    transfers.erase(transferId);
+}
+
+ParallelTransfers *parallelTransfers()
+{
+    static ParallelTransfers transfers;
+    return &transfers;
+}
+
+Message serveRanges(Session session)
+{
+    while (true)
+    {
+        Message message = Message::Listen(session.socket);
+
+        if (message.type != MessageType::TransferRange)
+        {
+            return message;
+        }
+
+        serveRange(session, message);
+    }
+}
+
+bool serveRange(Session session, Message range)
+{
+    std::shared_ptr<ParallelTransfer> transfer = parallelTransfers()->find(range.transferId, session.username);
+
+    if (transfer == nullptr || range.offset > transfer->size || range.size > transfer->size - range.offset)
+    {
+        range.Reply(Message::Response(ResponseType::FileNotFound), false);
+        return false;
+    }
+
+    if (transfer->open)
+    {
+        int body;
+        std::unique_ptr<std::istream> file = transfer->open(&body);
+        range.Reply(Message::Response(ResponseType::Ok), false);
+        bool isSent = sendRange(session, *file, range.offset, range.size, body);
+
+        if (body >= 0)
+        {
+            close(body);
+        }
+        return isSent;
+    }
+
+    {
+        std::lock_guard<std::mutex> lock(transfer->_mutex);
+        transfer->receiving++;
+    }
+
+    range.Reply(Message::Response(ResponseType::Ok), false);
+    bool isReceived = receiveRange(session, transfer->file, range.offset, range.size);
+
+    std::lock_guard<std::mutex> lock(transfer->_mutex);
+    if (isReceived)
+    {
+        transfer->markReceived(range.offset, range.size);
+    }
+    transfer->receiving--;
+    transfer->_idle.notify_all();
+    return isReceived;
+}
@@ -0,0 +1,62 @@
+#pragma once
+
+#include <map>
+#include <mutex>
+#include <condition_variable>
+#include <memory>
+#include <string>
+#include <istream>
+#include <functional>
+#include <stdint.h>
+
+#include "../common/message.h"
+
+// A file moving as byte ranges over several connections at once. The
+// connection that starts it registers it and waits for EndCommand; every
+// TransferRange, on that connection or any other of the same user, looks it
+// up by id to write or read its range.
+class ParallelTransfer
+{
+public:
+    std::string username;
+    uint64_t size = 0;
+
+    // Uploads pwrite into file, downloads read through open, which also
+    // opens the body for sendfile when it can.
+    int file = -1;
+    std::function<std::unique_ptr<std::istream>(int *body)> open;
+
+    std::mutex _mutex;
+    std::condition_variable _idle;
+    // Byte ranges received so far, from start to end, merged where they
+    // touch or overlap, so a range sent again doesn't count twice.
+    std::map<uint64_t, uint64_t> received;
+    // Ranges being received right now. Their sender hears they arrived
+    // before they are counted, so completion waits for them.
+    int receiving = 0;
+
+    ~ParallelTransfer();
+
+    // Must be called with _mutex held.
+    void markReceived(uint64_t offset, uint64_t size);
+    // Whether every byte was received.
+    bool isComplete();
+};
+
+class ParallelTransfers
+{
+    std::mutex _mutex;
+    std::map<std::string, std::shared_ptr<ParallelTransfer>> transfers;
+
+public:
+    std::string add(std::shared_ptr<ParallelTransfer> transfer);
+    std::shared_ptr<ParallelTransfer> find(std::string transferId, std::string username);
+    void remove(std::string transferId);
+};
+
+ParallelTransfers *parallelTransfers();
+
+// Serves TransferRange requests on the registering connection until any
+// other message arrives, and returns that one.
+Message serveRanges(Session session);
+bool serveRange(Session session, Message range);
@@ -0,0 +1,596 @@
+#include <fstream>
+#include <sstream>
+#include <filesystem>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <algorithm>
+#include <set>
+
+#include "segmentStorage.h"
+#include "../common/helpers.h"
+#include "../common/socket.h"
+
+#define SEGMENT_RECORD_MAGIC 0x53475231
+#define SEGMENT_RECORD_HEADER_SIZE 29
+
+enum SegmentRecordKind
+{
+    SegmentPut = 1,
+    SegmentTombstone = 2,
+};
+
+// Record layout: [u32 magic][u8 kind][u16 username length][u16 filename
+// length][u32 body length][u64 created][u64 updated], then the username,
+// the filename and the body.
+static std::string encodeRecordHeader(SegmentRecordKind kind, std::string username, std::string filename, uint32_t length, time_t created, time_t updated)
+{
+    std::string header(SEGMENT_RECORD_HEADER_SIZE, '\0');
+    uint32_t magic = SEGMENT_RECORD_MAGIC;
+    uint8_t kindByte = kind;
+    uint16_t usernameLength = username.size();
+    uint16_t filenameLength = filename.size();
+    uint64_t createdValue = created;
+    uint64_t updatedValue = updated;
+
+    memcpy(&header[0], &magic, 4);
+    memcpy(&header[4], &kindByte, 1);
+    memcpy(&header[5], &usernameLength, 2);
+    memcpy(&header[7], &filenameLength, 2);
+    memcpy(&header[9], &length, 4);
+    memcpy(&header[13], &createdValue, 8);
+    memcpy(&header[21], &updatedValue, 8);
+
+    return header + username + filename;
+}
+
+class SegmentRecord
+{
+public:
+    SegmentRecordKind kind;
+    std::string username;
+    std::string filename;
+    uint32_t length;
+    time_t created;
+    time_t updated;
+    uint64_t dataOffset;
+    uint64_t size;
+};
+
+// Reads the record starting at offset, leaving the body unread. False at the
+// end of the segment or on a torn record.
+static bool readRecord(int fd, uint64_t offset, uint64_t segmentSize, SegmentRecord *record)
+{
+    char header[SEGMENT_RECORD_HEADER_SIZE];
+    if (offset + SEGMENT_RECORD_HEADER_SIZE > segmentSize ||
+        pread(fd, header, SEGMENT_RECORD_HEADER_SIZE, offset) != SEGMENT_RECORD_HEADER_SIZE)
+    {
+        return false;
+    }
+
+    uint32_t magic;
+    uint8_t kind;
+    uint16_t usernameLength, filenameLength;
+    uint64_t created, updated;
+
+    memcpy(&magic, &header[0], 4);
+    memcpy(&kind, &header[4], 1);
+    memcpy(&usernameLength, &header[5], 2);
+    memcpy(&filenameLength, &header[7], 2);
+    memcpy(&record->length, &header[9], 4);
+    memcpy(&created, &header[13], 8);
+    memcpy(&updated, &header[21], 8);
+
+    if (magic != SEGMENT_RECORD_MAGIC || (kind != SegmentPut && kind != SegmentTombstone))
+    {
+        return false;
+    }
+
+    record->kind = (SegmentRecordKind)kind;
+    record->created = created;
+    record->updated = updated;
+    record->dataOffset = offset + SEGMENT_RECORD_HEADER_SIZE + usernameLength + filenameLength;
+    record->size = record->dataOffset - offset + record->length;
+
+    if (offset + record->size > segmentSize)
+    {
+        return false;
+    }
+
+    std::string names(usernameLength + filenameLength, '\0');
+    if (pread(fd, &names[0], names.size(), offset + SEGMENT_RECORD_HEADER_SIZE) != (ssize_t)names.size())
+    {
+        return false;
+    }
+
+    record->username = names.substr(0, usernameLength);
+    record->filename = names.substr(usernameLength);
+    return true;
+}
+
+SegmentStorage::SegmentStorage(std::string root, StorageBackend *largeFiles)
+{
+    this->folder = root + ".segments/";
+    this->largeFiles = largeFiles;
+
+    mkdir(folder.c_str(), S_IRWXU | S_IRWXG | S_IROTH | S_IXOTH);
+
+    std::vector<uint32_t> existing;
+    for (const auto &entry : std::filesystem::directory_iterator(folder))
+    {
+        existing.push_back(atol(entry.path().filename().c_str()));
+    }
+
+    std::sort(existing.begin(), existing.end());
+
+    for (uint32_t segment : existing)
+    {
+        openSegment(segment);
+        replaySegment(segment);
+        activeSegment = segment;
+    }
+
+    if (activeSegment == 0)
+    {
+        activeSegment = 1;
+        openSegment(activeSegment);
+    }
+
+    compactor = std::async(launch::async, [this]
+                           { compactLoop(); });
+}
+
+std::string SegmentStorage::segmentPath(uint32_t segment)
+{
+    return folder + std::to_string(segment);
+}
+
+void SegmentStorage::openSegment(uint32_t segment)
+{
+    Segment opened;
+    opened.fd = open(segmentPath(segment).c_str(), O_RDWR | O_CREAT, 0644);
+
+    struct stat attributes;
+    fstat(opened.fd, &attributes);
+    opened.size = attributes.st_size;
+
+    segments[segment] = opened;
+}
+
+void SegmentStorage::replaySegment(uint32_t segment)
+{
+    Segment &replayed = segments[segment];
+    uint64_t offset = 0;
+    SegmentRecord record;
+
+    while (readRecord(replayed.fd, offset, replayed.size, &record))
+    {
+        forget(record.username, record.filename);
+
+        if (record.kind == SegmentPut)
+        {
+            SegmentEntry entry;
+            entry.segment = segment;
+            entry.offset = record.dataOffset;
+            entry.length = record.length;
+            entry.recordSize = record.size;
+            entry.created = record.created;
+            entry.updated = record.updated;
+
+            entries[record.username][record.filename] = entry;
+            replayed.liveBytes += record.size;
+        }
+
+        offset += record.size;
+    }
+
+    if (offset < replayed.size)
+    {
+        std::cout << Color::red << "Dropping torn tail of segment " << segment << Color::reset << std::endl;
+        ftruncate(replayed.fd, offset);
+        replayed.size = offset;
+    }
+}
+
+void SegmentStorage::forget(std::string username, std::string filename)
+{
+    auto &files = entries[username];
+    auto entry = files.find(filename);
+
+    if (entry == files.end())
+    {
+        return;
+    }
+
+    segments[entry->second.segment].liveBytes -= entry->second.recordSize;
+    files.erase(entry);
+}
+
+bool SegmentStorage::append(std::string username, std::string filename, bool isTombstone, std::string data, time_t created, time_t updated, SegmentEntry *entry)
+{
+    if (segments[activeSegment].size >= SEGMENT_MAX_SIZE)
+    {
+        activeSegment++;
+        openSegment(activeSegment);
+    }
+
+    Segment &segment = segments[activeSegment];
+
+    std::string record = encodeRecordHeader(
+        isTombstone ? SegmentTombstone : SegmentPut,
+        username,
+        filename,
+        data.size(),
+        created,
+        updated);
+
+    uint64_t dataOffset = segment.size + record.size();
+    record.append(data);
+
+    if (pwrite(segment.fd, record.data(), record.size(), segment.size) != (ssize_t)record.size())
+    {
+        return false;
+    }
+
+    segment.size += record.size();
+
+    entry->segment = activeSegment;
+    entry->offset = dataOffset;
+    entry->length = data.size();
+    entry->recordSize = record.size();
+    entry->created = created;
+    entry->updated = updated;
+    return true;
+}
+
+void SegmentStorage::createUser(std::string username)
+{
+    largeFiles->createUser(username);
+
+    std::lock_guard<std::mutex> lock(_mutex);
+    entries[username];
+}
+
+std::vector<std::string> SegmentStorage::listUsers()
+{
+    std::vector<std::string> usernames = largeFiles->listUsers();
+
+    std::lock_guard<std::mutex> lock(_mutex);
+    for (auto const &item : entries)
+    {
+        if (std::find(usernames.begin(), usernames.end(), item.first) == usernames.end())
+        {
+            usernames.push_back(item.first);
+        }
+    }
+
+    return usernames;
+}
+
+std::vector<StoredFile> SegmentStorage::listFiles(std::string username)
+{
+    std::vector<StoredFile> files;
+
+    std::lock_guard<std::mutex> lock(_mutex);
+    auto &small = entries[username];
+
+    for (auto const &file : largeFiles->listFiles(username))
+    {
+        if (small.find(file.filename) == small.end())
+        {
+            files.push_back(file);
+        }
+    }
+
+    for (auto const &item : small)
+    {
+        StoredFile file;
+        file.filename = item.first;
+        file.created = item.second.created;
+        file.updated = item.second.updated;
+        file.acessed = item.second.updated;
+        files.push_back(file);
+    }
+
+    return files;
+}
+
+std::string SegmentStorage::pathOf(std::string username, std::string filename)
+{
+    {
+        std::lock_guard<std::mutex> lock(_mutex);
+        auto &files = entries[username];
+        if (files.find(filename) != files.end())
+        {
+            return "";
+        }
+    }
+
+    return largeFiles->pathOf(username, filename);
+}
+
+std::unique_ptr<std::istream> SegmentStorage::openRead(std::string username, std::string filename)
+{
+    {
+        std::lock_guard<std::mutex> lock(_mutex);
+        auto &files = entries[username];
+        auto entry = files.find(filename);
+
+        if (entry != files.end())
+        {
+            std::string data(entry->second.length, '\0');
+            int fd = segments[entry->second.segment].fd;
+
+            if (pread(fd, &data[0], data.size(), entry->second.offset) != (ssize_t)data.size())
+            {
+                return nullptr;
+            }
+
+            return std::unique_ptr<std::istream>(new std::istringstream(data));
+        }
+    }
+
+    return largeFiles->openRead(username, filename);
+}
+
+std::string SegmentStorage::stage(std::string username, std::string filename)
+{
+    return largeFiles->stage(username, filename);
+}
+
+std::string SegmentStorage::stagePartial(std::string username, std::string filename)
+{
+    return largeFiles->stagePartial(username, filename);
+}
+
+bool SegmentStorage::commit(std::string username, std::string filename, std::string stagedPath, Durability durability)
+{
+    return publish(username, filename, stagedPath, nullptr, durability);
+}
+
+bool SegmentStorage::commitKeepingTimes(std::string username, std::string filename, std::string stagedPath, StoredFile times, Durability durability)
+{
+    return publish(username, filename, stagedPath, &times, durability);
+}
+
+bool SegmentStorage::publish(std::string username, std::string filename, std::string stagedPath, const StoredFile *times, Durability durability)
+{
+    struct stat attributes;
+    if (stat(stagedPath.c_str(), &attributes) != 0)
+    {
+        return false;
+    }
+
+    if (attributes.st_size <= SEGMENT_SMALL_FILE_LIMIT)
+    {
+        std::ifstream file(stagedPath, std::ios::in | std::ios::binary);
+        std::ostringstream data;
+        data << file.rdbuf();
+        file.close();
+
+        largeFiles->abort(stagedPath);
+        return store(username, filename, data.str(), times, durability);
+    }
+
+    bool isCommitted = times == nullptr ? largeFiles->commit(username, filename, stagedPath, durability)
+                                        : largeFiles->commitKeepingTimes(username, filename, stagedPath, *times, durability);
+    if (!isCommitted)
+    {
+        return false;
+    }
+
+    // The small body it replaces would come back with a lost tombstone.
+    int segmentFd;
+    {
+        std::lock_guard<std::mutex> lock(_mutex);
+        auto &files = entries[username];
+        if (files.find(filename) == files.end())
+        {
+            return true;
+        }
+
+        SegmentEntry tombstone;
+        if (!append(username, filename, true, "", 0, now(), &tombstone))
+        {
+            return false;
+        }
+
+        forget(username, filename);
+        segmentFd = segments[tombstone.segment].fd;
+    }
+
+    return syncFile(segmentFd, durability);
+}
+
+void SegmentStorage::abort(std::string stagedPath)
+{
+    largeFiles->abort(stagedPath);
+}
+
+bool SegmentStorage::write(std::string username, std::string filename, std::string data, Durability durability)
+{
+    return store(username, filename, data, nullptr, durability);
+}
+
+bool SegmentStorage::writeKeepingTimes(std::string username, std::string filename, std::string data, StoredFile times, Durability durability)
+{
+    return store(username, filename, data, &times, durability);
+}
+
+bool SegmentStorage::store(std::string username, std::string filename, std::string data, const StoredFile *times, Durability durability)
+{
+    if (data.size() > SEGMENT_SMALL_FILE_LIMIT)
+    {
+        return times == nullptr ? StorageBackend::write(username, filename, data, durability)
+                                : StorageBackend::writeKeepingTimes(username, filename, data, *times, durability);
+    }
+
+    bool wasSmall;
+    int segmentFd;
+    {
+        std::lock_guard<std::mutex> lock(_mutex);
+        auto &files = entries[username];
+        auto previous = files.find(filename);
+        wasSmall = previous != files.end();
+
+        time_t updated = now();
+        time_t created = wasSmall ? previous->second.created : updated;
+
+        if (times != nullptr)
+        {
+            created = times->created;
+            updated = times->updated;
+        }
+
+        SegmentEntry entry;
+        if (!append(username, filename, false, data, created, updated, &entry))
+        {
+            return false;
+        }
+
+        forget(username, filename);
+        files[filename] = entry;
+        segments[entry.segment].liveBytes += entry.recordSize;
+        segmentFd = segments[entry.segment].fd;
+    }
+
+    if (!wasSmall)
+    {
+        largeFiles->remove(username, filename);
+    }
+
+    // Appends landing in the same window share one fdatasync of the segment.
+    return syncFile(segmentFd, durability);
+}
+
+// The deleted body would come back with a tombstone lost in a crash.
+bool SegmentStorage::remove(std::string username, std::string filename)
+{
+    int segmentFd = -1;
+    {
+        std::lock_guard<std::mutex> lock(_mutex);
+        auto &files = entries[username];
+
+        if (files.find(filename) != files.end())
+        {
+            SegmentEntry tombstone;
+            if (!append(username, filename, true, "", 0, now(), &tombstone))
+            {
+                return false;
+            }
+
+            forget(username, filename);
+            segmentFd = segments[tombstone.segment].fd;
+        }
+    }
+
+    if (segmentFd >= 0)
+    {
+        return syncFile(segmentFd, Durability::DefaultDurability);
+    }
+
+    return largeFiles->remove(username, filename);
+}
+
+// Moves the live bodies of a sealed segment to the active one and deletes
+// it, once what was moved is on disk. Tombstones only have to survive while
+// an older segment could still hold a body they hide.
+void SegmentStorage::compact(uint32_t segment)
+{
+    Segment compacted = segments[segment];
+    bool hasOlderSegments = segments.begin()->first < segment;
+
+    uint64_t offset = 0;
+    SegmentRecord record;
+    std::set<uint32_t> written;
+
+    while (readRecord(compacted.fd, offset, compacted.size, &record))
+    {
+        auto &files = entries[record.username];
+        auto entry = files.find(record.filename);
+        offset += record.size;
+
+        if (record.kind == SegmentTombstone)
+        {
+            if (hasOlderSegments && entry == files.end())
+            {
+                SegmentEntry tombstone;
+                if (!append(record.username, record.filename, true, "", 0, record.updated, &tombstone))
+                {
+                    return;
+                }
+
+                written.insert(tombstone.segment);
+            }
+
+            continue;
+        }
+
+        if (entry == files.end() ||
+            entry->second.segment != segment ||
+            entry->second.offset != record.dataOffset)
+        {
+            continue;
+        }
+
+        std::string data(record.length, '\0');
+        pread(compacted.fd, &data[0], data.size(), record.dataOffset);
+
+        SegmentEntry moved;
+        if (!append(record.username, record.filename, false, data, record.created, record.updated, &moved))
+        {
+            return;
+        }
+
+        entry->second = moved;
+        segments[moved.segment].liveBytes += moved.recordSize;
+        written.insert(moved.segment);
+    }
+
+    // Appending may have started new segments, so their folder is synced
+    // too. Whatever the default durability, the records only exist in
+    // the segment about to be removed otherwise.
+    std::vector<int> writtenFds;
+    for (uint32_t target : written)
+    {
+        writtenFds.push_back(segments[target].fd);
+    }
+
+    if (!groupCommitter()->commit(writtenFds, nullptr, {folder}, Durability::ImmediateSync))
+    {
+        std::cout << Color::red << "Couldn't sync what segment " << segment << " was compacted into, keeping it" << Color::reset << std::endl;
+        return;
+    }
+
+    close(compacted.fd);
+    ::remove(segmentPath(segment).c_str());
+    segments.erase(segment);
+
+    std::cout << Color::blue << "Compacted segment " << segment << Color::reset << std::endl;
+}
+
+void SegmentStorage::compactLoop()
+{
+    while (true)
+    {
+        sleep(SEGMENT_COMPACTION_INTERVAL_SECONDS);
+
+        std::lock_guard<std::mutex> lock(_mutex);
+        std::vector<uint32_t> candidates;
+
+        for (auto const &item : segments)
+        {
+            if (item.first != activeSegment &&
+                item.second.liveBytes < SEGMENT_COMPACTION_LIVE_RATIO * item.second.size)
+            {
+                candidates.push_back(item.first);
+            }
+        }
+
+        for (uint32_t segment : candidates)
+        {
+            compact(segment);
+        }
+    }
+}
@@ -0,0 +1,87 @@
+#pragma once
+
+#include <map>
+#include <mutex>
+#include <future>
+#include <stdint.h>
+
+#include "storage.h"
+
+// Bodies up to this size are appended to segments, larger ones are handed
+// to the wrapped backend.
+#define SEGMENT_SMALL_FILE_LIMIT (64 * 1024)
+#define SEGMENT_MAX_SIZE (64 * 1024 * 1024)
+#define SEGMENT_COMPACTION_INTERVAL_SECONDS 30
+// A sealed segment is rewritten once less than this share of it is live.
+#define SEGMENT_COMPACTION_LIVE_RATIO 0.5
+
+class SegmentEntry
+{
+public:
+    uint32_t segment;
+    uint64_t offset;
+    uint32_t length;
+    uint64_t recordSize;
+    time_t created;
+    time_t updated;
+};
+
+class Segment
+{
+public:
+    int fd = -1;
+    uint64_t size = 0;
+    uint64_t liveBytes = 0;
+};
+
+// Log structured store for small files. Every write appends a record with
+// the body to the active segment in <root>.segments/ and every delete
+// appends a tombstone, so small file traffic turns into sequential appends
+// and startup replays a few segment files instead of stating every file.
+// Only the in-memory index knows where the live bodies are; a background
+// task rewrites mostly dead segments and drops them.
+class SegmentStorage : public StorageBackend
+{
+    std::string folder;
+    StorageBackend *largeFiles;
+
+    std::mutex _mutex;
+    std::map<std::string, std::map<std::string, SegmentEntry>> entries;
+    std::map<uint32_t, Segment> segments;
+    uint32_t activeSegment = 0;
+
+    std::future<void> compactor;
+
+    std::string segmentPath(uint32_t segment);
+    void openSegment(uint32_t segment);
+    void replaySegment(uint32_t segment);
+
+    bool append(std::string username, std::string filename, bool isTombstone, std::string data, time_t created, time_t updated, SegmentEntry *entry);
+    void forget(std::string username, std::string filename);
+
+    bool publish(std::string username, std::string filename, std::string stagedPath, const StoredFile *times, Durability durability);
+    bool store(std::string username, std::string filename, std::string data, const StoredFile *times, Durability durability);
+
+    void compact(uint32_t segment);
+    void compactLoop();
+
+public:
+    SegmentStorage(std::string root, StorageBackend *largeFiles);
+
+    void createUser(std::string username) override;
+    std::vector<std::string> listUsers() override;
+    std::vector<StoredFile> listFiles(std::string username) override;
+
+    std::string pathOf(std::string username, std::string filename) override;
+    std::unique_ptr<std::istream> openRead(std::string username, std::string filename) override;
+
+    std::string stage(std::string username, std::string filename) override;
+    std::string stagePartial(std::string username, std::string filename) override;
+    bool commit(std::string username, std::string filename, std::string stagedPath, Durability durability) override;
+    void abort(std::string stagedPath) override;
+    bool write(std::string username, std::string filename, std::string data, Durability durability) override;
+    bool commitKeepingTimes(std::string username, std::string filename, std::string stagedPath, StoredFile times, Durability durability) override;
+    bool writeKeepingTimes(std::string username, std::string filename, std::string data, StoredFile times, Durability durability) override;
+
+    bool remove(std::string username, std::string filename) override;
+};
@@ -0,0 +1,96 @@
+#include <iostream>
+#include <filesystem>
+#include <stdio.h>
+
+#include "sharding.h"
+#include "../common/hash.h"
+
+std::string shardOf(std::string hexDigest)
+{
+    std::string shard;
+
+    for (int level = 0; level < SHARD_LEVELS; level++)
+    {
+        shard += hexDigest.substr(level * 2, 2) + "/";
+    }
+
+    return shard;
+}
+
+std::string shardedPath(std::string folder, std::string hexDigest, std::string name)
+{
+    return folder + shardOf(hexDigest) + name;
+}
+
+std::string shardedPath(std::string folder, std::string name)
+{
+    return shardedPath(folder, toHex(sha256(name)), name);
+}
+
+void createParentFolders(std::string path)
+{
+    std::error_code error;
+    std::filesystem::create_directories(std::filesystem::path(path).parent_path(), error);
+}
+
+// A file already in the bucket is newer than the one left in the flat
+// layout, which is kept rather than overwriting it.
+static int moveInto(std::string from, std::string to)
+{
+    std::error_code error;
+    if (std::filesystem::exists(to, error))
+    {
+        std::cerr << "Not moving " << from << ", " << to << " already exists" << std::endl;
+        return 0;
+    }
+
+    createParentFolders(to);
+
+    if (rename(from.c_str(), to.c_str()) != 0)
+    {
+        std::cerr << "Couldn't move " << from << " to " << to << std::endl;
+        return 0;
+    }
+
+    return 1;
+}
+
+int shardFlatFiles(std::string folder)
+{
+    int moved = 0;
+
+    for (const auto &entry : std::filesystem::directory_iterator(folder))
+    {
+        if (entry.is_regular_file())
+        {
+            std::string filename = entry.path().filename();
+            moved += moveInto(entry.path(), shardedPath(folder, filename));
+        }
+    }
+
+    return moved;
+}
+
+int shardFlatBlobs(std::string folder)
+{
+    int moved = 0;
+
+    for (const auto &bucket : std::filesystem::directory_iterator(folder))
+    {
+        if (!bucket.is_directory())
+        {
+            continue;
+        }
+
+        for (const auto &entry : std::filesystem::directory_iterator(bucket.path()))
+        {
+            if (entry.is_regular_file())
+            {
+                std::string blob = entry.path().filename();
+                moved += moveInto(entry.path(), shardedPath(folder, blob, blob));
+            }
+        }
+    }
+
+    return moved;
+}
@@ -0,0 +1,22 @@
+#pragma once
+
+#include <string>
+
+// Two levels of 256 buckets, so no directory ends up with more than a few
+// thousand entries however many files a user has. The leaf keeps its name.
+#define SHARD_LEVELS 2
+
+// Buckets picked from the leading bytes of a hex digest of the name.
+std::string shardOf(std::string hexDigest);
+std::string shardedPath(std::string folder, std::string hexDigest, std::string name);
+std::string shardedPath(std::string folder, std::string name);
+
+void createParentFolders(std::string path);
+
+// Move what was stored in the flat layout into its bucket, returning how
+// many were moved. Files already in place are left alone, so both can be
+// run again after an interruption and on every start.
+// folder/<name> into folder/<xx>/<yy>/<name>.
+int shardFlatFiles(std::string folder);
+// folder/<xx>/<digest> into folder/<xx>/<yy>/<digest>.
+int shardFlatBlobs(std::string folder);
@@ -0,0 +1,311 @@
+#include <fstream>
+#include <filesystem>
+#include <sys/stat.h>
+#include <string.h>
+#include <fcntl.h>
+
+#include "storage.h"
+#include "contentAddressedStorage.h"
+#include "segmentStorage.h"
+#include "writeBehindStorage.h"
+#include "sharding.h"
+#include "../common/helpers.h"
+#include "../common/socket.h"
+#include "../common/compression.h"
+
+std::unique_ptr<std::istream> StorageBackend::openRead(std::string username, std::string filename)
+{
+    std::string path = pathOf(username, filename);
+    if (path.empty())
+    {
+        return nullptr;
+    }
+
+    std::unique_ptr<std::istream> file(new std::ifstream(path, std::ios::in | std::ios::binary));
+    if (!*file)
+    {
+        return nullptr;
+    }
+
+    return file;
+}
+
+std::unique_ptr<std::istream> StorageBackend::openContent(std::string username, std::string filename)
+{
+    std::unique_ptr<std::istream> file = openRead(username, filename);
+    if (!file || !isArchive(*file))
+    {
+        return file;
+    }
+
+    return openArchive(std::move(file));
+}
+
+bool StorageBackend::readInline(std::string username, std::string filename, int limit, std::string *data)
+{
+    std::unique_ptr<std::istream> file = openContent(username, filename);
+    if (!file || limit < 0)
+    {
+        return false;
+    }
+
+    data->resize(limit + 1);
+    file->read(&(*data)[0], limit + 1);
+    data->resize(file->gcount());
+
+    return data->size() <= (size_t)limit;
+}
+
+std::string StorageBackend::stagePartial(std::string, std::string)
+{
+    return "";
+}
+
+void StorageBackend::abort(std::string stagedPath)
+{
+    discardFile(stagedPath);
+}
+
+bool StorageBackend::write(std::string username, std::string filename, std::string data, Durability durability)
+{
+    std::string stagedPath = stage(username, filename);
+
+    std::ofstream file(stagedPath, std::ios::out | std::ios::binary | std::ios::trunc);
+    file << data;
+    file.close();
+
+    if (!file)
+    {
+        abort(stagedPath);
+        return false;
+    }
+
+    return commit(username, filename, stagedPath, durability);
+}
+
+bool StorageBackend::writeKeepingTimes(std::string username, std::string filename, std::string data, StoredFile times, Durability durability)
+{
+    std::string stagedPath = stage(username, filename);
+
+    std::ofstream file(stagedPath, std::ios::out | std::ios::binary | std::ios::trunc);
+    file << data;
+    file.close();
+
+    if (!file)
+    {
+        abort(stagedPath);
+        return false;
+    }
+
+    return commitKeepingTimes(username, filename, stagedPath, times, durability);
+}
+
+PlainStorage::PlainStorage(std::string root, bool isSharded)
+{
+    this->root = root;
+    this->isSharded = isSharded;
+    mkdir(root.c_str(), S_IRWXU | S_IRWXG | S_IROTH | S_IXOTH);
+
+    std::string staging = root + ".staging";
+    mkdir(staging.c_str(), S_IRWXU | S_IRWXG | S_IROTH | S_IXOTH);
+
+    if (isSharded)
+    {
+        shardFlatUsers();
+    }
+}
+
+// Files a server stored before sharding are moved into their buckets, so
+// they keep being listed and served after the upgrade.
+void PlainStorage::shardFlatUsers()
+{
+    for (auto const &username : listUsers())
+    {
+        int moved = shardFlatFiles(root + username + "/");
+
+        if (moved > 0)
+        {
+            std::cout << Color::blue << "Moved " << moved << " files of " << username
+                      << " into hash buckets" << Color::reset << std::endl;
+        }
+    }
+}
+
+std::string PlainStorage::pathFor(std::string username, std::string filename)
+{
+    std::string folder = root + username + "/";
+
+    if (!isSharded)
+    {
+        return folder + filename;
+    }
+
+    return shardedPath(folder, filename);
+}
+
+void PlainStorage::createUser(std::string username)
+{
+    std::string folder = root + username + "/";
+    mkdir(folder.c_str(), S_IRWXU | S_IRWXG | S_IROTH | S_IXOTH);
+}
+
+std::vector<std::string> PlainStorage::listUsers()
+{
+    std::vector<std::string> usernames;
+
+    for (const auto &entry : std::filesystem::directory_iterator(root))
+    {
+        std::string username = entry.path().filename();
+
+        if (!entry.is_directory() || username[0] == '.')
+        {
+            continue;
+        }
+
+        usernames.push_back(username);
+    }
+
+    return usernames;
+}
+
+std::vector<StoredFile> PlainStorage::listFiles(std::string username)
+{
+    std::vector<StoredFile> files;
+    int misplaced = 0;
+
+    for (auto entry = std::filesystem::recursive_directory_iterator(root + username);
+         entry != std::filesystem::recursive_directory_iterator();
+         entry++)
+    {
+        if (!entry->is_regular_file())
+        {
+            continue;
+        }
+
+        if (isLinkingLeftover(entry->path().filename()))
+        {
+            ::remove(entry->path().c_str());
+            continue;
+        }
+
+        if (isSharded != (entry.depth() == SHARD_LEVELS))
+        {
+            misplaced++;
+            continue;
+        }
+
+        std::string path = entry->path();
+
+        StoredFile file;
+        file.filename = entry->path().filename();
+        file.acessed = getAccessTime(path);
+        file.created = getCreateTime(path);
+        file.updated = getModificationTime(path);
+        files.push_back(file);
+    }
+
+    // Only "plain-flat" over a sharded store gets here, sharded stores
+    // moved their flat files when they started.
+    if (misplaced > 0)
+    {
+        std::cout << Color::red << "Ignoring " << misplaced << " files of " << username
+                  << " stored in hash buckets, start with \"plain\" to serve them" << Color::reset << std::endl;
+    }
+
+    return files;
+}
+
+std::string PlainStorage::pathOf(std::string username, std::string filename)
+{
+    std::string path = pathFor(username, filename);
+
+    struct stat attributes;
+    if (stat(path.c_str(), &attributes) != 0)
+    {
+        return "";
+    }
+
+    return path;
+}
+
+std::string PlainStorage::stage(std::string username, std::string filename)
+{
+    std::string folder = std::filesystem::path(pathFor(username, filename)).parent_path();
+    return stageFile(folder, root + ".staging/" + username + "_" + filename);
+}
+
+std::string PlainStorage::stagePartial(std::string username, std::string filename)
+{
+    return stagePartialFile(root + ".partial", username + "_" + filename);
+}
+
+bool PlainStorage::commit(std::string username, std::string filename, std::string stagedPath, Durability durability)
+{
+    return publishFile(stagedPath, pathFor(username, filename), durability);
+}
+
+// Plain files are listed with their access and modification times, which
+// survive publishing. The change time can't be set and moves on anyway.
+bool PlainStorage::commitKeepingTimes(std::string username, std::string filename, std::string stagedPath, StoredFile times, Durability durability)
+{
+    struct timespec values[2] = {{times.acessed, 0}, {times.updated, 0}};
+
+    if (utimensat(AT_FDCWD, stagedPath.c_str(), values, 0) != 0)
+    {
+        abort(stagedPath);
+        return false;
+    }
+
+    return commit(username, filename, stagedPath, durability);
+}
+
+bool PlainStorage::remove(std::string username, std::string filename)
+{
+    std::string path = pathFor(username, filename);
+    return ::remove(path.c_str()) == 0;
+}
+
+// "segmented" keeps small files in segments and the rest as plain files,
+// "segmented:<name>" hands the rest to another backend. "write-behind" and
+// "write-behind:<name>" work the same way.
+StorageBackend *createStorage(std::string name, std::string root)
+{
+    if (name == "write-behind")
+    {
+        return new WriteBehindStorage(root, new PlainStorage(root));
+    }
+
+    if (name.rfind("write-behind:", 0) == 0)
+    {
+        StorageBackend *backend = createStorage(name.substr(strlen("write-behind:")), root);
+        return backend == nullptr ? nullptr : new WriteBehindStorage(root, backend);
+    }
+
+    if (name == "segmented")
+    {
+        return new SegmentStorage(root, new PlainStorage(root));
+    }
+
+    if (name.rfind("segmented:", 0) == 0)
+    {
+        StorageBackend *largeFiles = createStorage(name.substr(strlen("segmented:")), root);
+        return largeFiles == nullptr ? nullptr : new SegmentStorage(root, largeFiles);
+    }
+
+    if (name == "plain")
+    {
+        return new PlainStorage(root);
+    }
+
+    if (name == "plain-flat")
+    {
+        return new PlainStorage(root, false);
+    }
+
+    if (name == "content-addressed")
+    {
+        return new ContentAddressedStorage(root);
+    }
+
+    return nullptr;
+}
@@ -0,0 +1,90 @@
+#pragma once
+
+#include <string>
+#include <vector>
+#include <memory>
+#include <istream>
+#include <ctime>
+
+#include "durability.h"
+
+class StoredFile
+{
+public:
+    std::string filename;
+    time_t created;
+    time_t updated;
+    time_t acessed;
+};
+
+// Where the server keeps file bodies. Uploads are written to a staged path
+// and then published with commit, downloads read through openRead. Commits
+// and writes return once the body is as durable as asked for.
+class StorageBackend
+{
+public:
+    virtual ~StorageBackend() {}
+
+    virtual void createUser(std::string username) = 0;
+    virtual std::vector<std::string> listUsers() = 0;
+    virtual std::vector<StoredFile> listFiles(std::string username) = 0;
+
+    // Local path holding the current body of a file, or "" when there is
+    // none or the body doesn't live in a file of its own. The path stays
+    // readable by whoever opened it after the file changes or is removed.
+    virtual std::string pathOf(std::string username, std::string filename) = 0;
+
+    // Null when the file has no body. Archived bodies are returned as they
+    // are stored, openContent undoes the archiving.
+    virtual std::unique_ptr<std::istream> openRead(std::string username, std::string filename);
+    std::unique_ptr<std::istream> openContent(std::string username, std::string filename);
+
+    virtual std::string stage(std::string username, std::string filename) = 0;
+    // Named staged path that outlives the connection, so an interrupted
+    // upload can be resumed into it. "" when the backend can't keep one.
+    virtual std::string stagePartial(std::string username, std::string filename);
+    virtual bool commit(std::string username, std::string filename, std::string stagedPath, Durability durability) = 0;
+    virtual void abort(std::string stagedPath);
+
+    // Stores a body that is already in memory.
+    virtual bool write(std::string username, std::string filename, std::string data, Durability durability);
+
+    // Same as commit and write, but the file keeps the given times instead
+    // of getting new ones, for bodies that only change how they're stored.
+    virtual bool commitKeepingTimes(std::string username, std::string filename, std::string stagedPath, StoredFile times, Durability durability) = 0;
+    virtual bool writeKeepingTimes(std::string username, std::string filename, std::string data, StoredFile times, Durability durability);
+
+    // Reads the whole body when it is at most limit bytes long.
+    bool readInline(std::string username, std::string filename, int limit, std::string *data);
+
+    virtual bool remove(std::string username, std::string filename) = 0;
+};
+
+// One plain file per user file, at <root><username>/<xx>/<yy>/<filename>
+// when sharded or <root><username>/<filename> in the legacy flat layout.
+class PlainStorage : public StorageBackend
+{
+    std::string root;
+    bool isSharded;
+
+    std::string pathFor(std::string username, std::string filename);
+    void shardFlatUsers();
+
+public:
+    PlainStorage(std::string root, bool isSharded = true);
+
+    void createUser(std::string username) override;
+    std::vector<std::string> listUsers() override;
+    std::vector<StoredFile> listFiles(std::string username) override;
+
+    std::string pathOf(std::string username, std::string filename) override;
+
+    std::string stage(std::string username, std::string filename) override;
+    std::string stagePartial(std::string username, std::string filename) override;
+    bool commit(std::string username, std::string filename, std::string stagedPath, Durability durability) override;
+    bool commitKeepingTimes(std::string username, std::string filename, std::string stagedPath, StoredFile times, Durability durability) override;
+
+    bool remove(std::string username, std::string filename) override;
+};
+
+StorageBackend *createStorage(std::string name, std::string root);
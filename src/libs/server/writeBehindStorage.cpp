@@ -0,0 +1,552 @@
+#include <fstream>
+#include <sstream>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <algorithm>
+
+#include "writeBehindStorage.h"
+#include "../common/helpers.h"
+#include "../common/socket.h"
+
+#define WRITE_BEHIND_RECORD_MAGIC 0x57424a31
+#define WRITE_BEHIND_RECORD_HEADER_SIZE 29
+
+enum WriteBehindRecordKind
+{
+    WriteBehindPut = 1,
+    WriteBehindDrop = 2,
+};
+
+// Same layout as segment records: [u32 magic][u8 kind][u16 username
+// length][u16 filename length][u32 body length][u64 created][u64 updated],
+// then the username, the filename and the body.
+static std::string encodeRecord(WriteBehindRecordKind kind, std::string username, std::string filename, std::string data, time_t created, time_t updated)
+{
+    std::string record(WRITE_BEHIND_RECORD_HEADER_SIZE, '\0');
+    uint32_t magic = WRITE_BEHIND_RECORD_MAGIC;
+    uint8_t kindByte = kind;
+    uint16_t usernameLength = username.size();
+    uint16_t filenameLength = filename.size();
+    uint32_t length = data.size();
+    uint64_t createdValue = created;
+    uint64_t updatedValue = updated;
+
+    memcpy(&record[0], &magic, 4);
+    memcpy(&record[4], &kindByte, 1);
+    memcpy(&record[5], &usernameLength, 2);
+    memcpy(&record[7], &filenameLength, 2);
+    memcpy(&record[9], &length, 4);
+    memcpy(&record[13], &createdValue, 8);
+    memcpy(&record[21], &updatedValue, 8);
+
+    return record + username + filename + data;
+}
+
+WriteBehindStorage::WriteBehindStorage(std::string root, StorageBackend *backend)
+{
+    this->folder = root + ".write-behind/";
+    this->backend = backend;
+
+    mkdir(folder.c_str(), S_IRWXU | S_IRWXG | S_IROTH | S_IXOTH);
+
+    journal = open(journalPath().c_str(), O_RDWR | O_CREAT, 0644);
+    replayJournal();
+
+    for (int i = 0; i < WRITE_BEHIND_FLUSH_THREADS; i++)
+    {
+        flushers.push_back(std::async(launch::async, [this]
+                                      { flushLoop(); }));
+    }
+}
+
+std::string WriteBehindStorage::journalPath()
+{
+    return folder + "journal";
+}
+
+void WriteBehindStorage::replayJournal()
+{
+    struct stat attributes;
+    fstat(journal, &attributes);
+
+    std::string contents(attributes.st_size, '\0');
+    if (pread(journal, &contents[0], contents.size(), 0) != (ssize_t)contents.size())
+    {
+        contents.clear();
+    }
+
+    uint64_t offset = 0;
+    while (offset + WRITE_BEHIND_RECORD_HEADER_SIZE <= contents.size())
+    {
+        uint32_t magic, length;
+        uint8_t kind;
+        uint16_t usernameLength, filenameLength;
+        uint64_t created, updated;
+
+        memcpy(&magic, &contents[offset], 4);
+        memcpy(&kind, &contents[offset + 4], 1);
+        memcpy(&usernameLength, &contents[offset + 5], 2);
+        memcpy(&filenameLength, &contents[offset + 7], 2);
+        memcpy(&length, &contents[offset + 9], 4);
+        memcpy(&created, &contents[offset + 13], 8);
+        memcpy(&updated, &contents[offset + 21], 8);
+
+        uint64_t size = WRITE_BEHIND_RECORD_HEADER_SIZE + usernameLength + filenameLength + length;
+        if (magic != WRITE_BEHIND_RECORD_MAGIC || offset + size > contents.size())
+        {
+            break;
+        }
+
+        uint64_t namesOffset = offset + WRITE_BEHIND_RECORD_HEADER_SIZE;
+        std::string username = contents.substr(namesOffset, usernameLength);
+        std::string filename = contents.substr(namesOffset + usernameLength, filenameLength);
+        auto &files = pending[username];
+        auto previous = files.find(filename);
+
+        if (previous != files.end())
+        {
+            pendingBytes -= previous->second.data.size();
+            files.erase(previous);
+        }
+
+        if (kind == WriteBehindPut)
+        {
+            PendingWrite write;
+            write.data = contents.substr(namesOffset + usernameLength + filenameLength, length);
+            write.created = created;
+            write.updated = updated;
+            write.sequence = nextSequence++;
+
+            pendingBytes += write.data.size();
+            files[filename] = write;
+        }
+
+        if (files.empty())
+        {
+            pending.erase(username);
+        }
+
+        offset += size;
+    }
+
+    if (offset < contents.size())
+    {
+        std::cout << Color::red << "Dropping torn tail of the write-behind journal" << Color::reset << std::endl;
+        ftruncate(journal, offset);
+    }
+
+    journalSize = offset;
+
+    if (!pending.empty())
+    {
+        std::cout << Color::yellow << "Replayed " << pendingBytes << " bytes of unflushed writes" << Color::reset << std::endl;
+    }
+}
+
+bool WriteBehindStorage::appendToJournal(bool isDrop, std::string username, std::string filename, std::string data, time_t created, time_t updated)
+{
+    std::string record = encodeRecord(isDrop ? WriteBehindDrop : WriteBehindPut, username, filename, data, created, updated);
+
+    if (pwrite(journal, record.data(), record.size(), journalSize) != (ssize_t)record.size())
+    {
+        return false;
+    }
+
+    journalSize += record.size();
+    return true;
+}
+
+// Syncs with the lock released so appends of concurrent writes can share
+// a group commit. The journal isn't truncated or rewritten meanwhile.
+bool WriteBehindStorage::syncJournal(std::unique_lock<std::mutex> &lock, Durability durability)
+{
+    int fd = journal;
+    syncing++;
+
+    lock.unlock();
+    bool isSynced = syncFile(fd, durability);
+    lock.lock();
+
+    syncing--;
+    return isSynced;
+}
+
+void WriteBehindStorage::rewriteJournal()
+{
+    std::string rewrittenPath = journalPath() + ".rewriting";
+    int rewritten = open(rewrittenPath.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0644);
+    uint64_t rewrittenSize = 0;
+
+    for (auto const &user : pending)
+    {
+        for (auto const &file : user.second)
+        {
+            std::string record = encodeRecord(WriteBehindPut, user.first, file.first, file.second.data, file.second.created, file.second.updated);
+
+            if (pwrite(rewritten, record.data(), record.size(), rewrittenSize) != (ssize_t)record.size())
+            {
+                close(rewritten);
+                ::remove(rewrittenPath.c_str());
+                return;
+            }
+
+            rewrittenSize += record.size();
+        }
+    }
+
+    if (fdatasync(rewritten) != 0 || rename(rewrittenPath.c_str(), journalPath().c_str()) != 0)
+    {
+        close(rewritten);
+        ::remove(rewrittenPath.c_str());
+        return;
+    }
+
+    syncPath(folder, Durability::ImmediateSync);
+
+    close(journal);
+    journal = rewritten;
+    journalSize = rewrittenSize;
+}
+
+bool WriteBehindStorage::hold(std::string username, std::string filename, std::string data, const StoredFile *times)
+{
+    PendingWrite *previous = findPending(username, filename);
+    uint64_t previousSize = previous == nullptr ? 0 : previous->data.size();
+
+    if (data.size() > WRITE_BEHIND_FILE_LIMIT ||
+        pendingBytes - previousSize + data.size() > WRITE_BEHIND_MEMORY_LIMIT)
+    {
+        return false;
+    }
+
+    PendingWrite write;
+    write.data = data;
+    write.updated = now();
+    write.created = previous == nullptr ? write.updated : previous->created;
+
+    if (times != nullptr)
+    {
+        write.created = times->created;
+        write.updated = times->updated;
+    }
+
+    write.sequence = nextSequence++;
+
+    if (!appendToJournal(false, username, filename, data, write.created, write.updated))
+    {
+        return false;
+    }
+
+    pendingBytes += data.size() - previousSize;
+    pending[username][filename] = write;
+
+    changed.notify_all();
+    return true;
+}
+
+// Called before the wrapped backend is changed directly, so a flush of an
+// older body can't land after the change.
+bool WriteBehindStorage::dropPending(std::unique_lock<std::mutex> &lock, std::string username, std::string filename)
+{
+    changed.wait(lock, [this, username, filename]
+                 { return flushing.count({username, filename}) == 0; });
+
+    PendingWrite *write = findPending(username, filename);
+    if (write == nullptr)
+    {
+        return false;
+    }
+
+    pendingBytes -= write->data.size();
+    pending[username].erase(filename);
+
+    if (pending[username].empty())
+    {
+        pending.erase(username);
+    }
+
+    appendToJournal(true, username, filename, "", 0, now());
+    return true;
+}
+
+PendingWrite *WriteBehindStorage::findPending(std::string username, std::string filename)
+{
+    auto user = pending.find(username);
+    if (user == pending.end())
+    {
+        return nullptr;
+    }
+
+    auto entry = user->second.find(filename);
+    return entry == user->second.end() ? nullptr : &entry->second;
+}
+
+bool WriteBehindStorage::nextPending(std::string *username, std::string *filename)
+{
+    for (auto const &user : pending)
+    {
+        for (auto const &file : user.second)
+        {
+            if (flushing.count({user.first, file.first}) == 0)
+            {
+                *username = user.first;
+                *filename = file.first;
+                return true;
+            }
+        }
+    }
+
+    return false;
+}
+
+void WriteBehindStorage::flushLoop()
+{
+    while (true)
+    {
+        std::unique_lock<std::mutex> lock(_mutex);
+
+        std::string username, filename;
+        changed.wait(lock, [this, &username, &filename]
+                     { return nextPending(&username, &filename); });
+
+        PendingWrite write = pending[username][filename];
+        flushing.insert({username, filename});
+
+        // The wrapped backend keeps the times the body was listed with.
+        StoredFile times;
+        times.created = write.created;
+        times.updated = write.updated;
+        times.acessed = write.updated;
+
+        lock.unlock();
+        bool isFlushed = backend->writeKeepingTimes(username, filename, write.data, times, Durability::BatchedSync);
+        lock.lock();
+
+        flushing.erase({username, filename});
+        changed.notify_all();
+
+        if (!isFlushed)
+        {
+            std::cout << Color::red << "Couldn't flush " << filename << " of " << username << ", retrying" << Color::reset << std::endl;
+            lock.unlock();
+            sleep(WRITE_BEHIND_RETRY_SECONDS);
+            continue;
+        }
+
+        auto &files = pending[username];
+        auto entry = files.find(filename);
+
+        if (entry != files.end() && entry->second.sequence == write.sequence)
+        {
+            pendingBytes -= entry->second.data.size();
+            files.erase(entry);
+        }
+
+        if (files.empty())
+        {
+            pending.erase(username);
+        }
+
+        if (syncing > 0)
+        {
+            continue;
+        }
+
+        if (pending.empty())
+        {
+            ftruncate(journal, 0);
+            journalSize = 0;
+        }
+        else if (journalSize > WRITE_BEHIND_JOURNAL_COMPACTION_SIZE)
+        {
+            rewriteJournal();
+        }
+    }
+}
+
+void WriteBehindStorage::createUser(std::string username)
+{
+    backend->createUser(username);
+}
+
+std::vector<std::string> WriteBehindStorage::listUsers()
+{
+    std::vector<std::string> usernames = backend->listUsers();
+
+    std::lock_guard<std::mutex> lock(_mutex);
+    for (auto const &user : pending)
+    {
+        if (std::find(usernames.begin(), usernames.end(), user.first) == usernames.end())
+        {
+            usernames.push_back(user.first);
+        }
+    }
+
+    return usernames;
+}
+
+std::vector<StoredFile> WriteBehindStorage::listFiles(std::string username)
+{
+    std::vector<StoredFile> files;
+    std::vector<StoredFile> stored = backend->listFiles(username);
+
+    std::lock_guard<std::mutex> lock(_mutex);
+    std::map<std::string, PendingWrite> held;
+    if (pending.find(username) != pending.end())
+    {
+        held = pending[username];
+    }
+
+    for (auto const &file : stored)
+    {
+        if (held.find(file.filename) == held.end())
+        {
+            files.push_back(file);
+        }
+    }
+
+    for (auto const &item : held)
+    {
+        StoredFile file;
+        file.filename = item.first;
+        file.created = item.second.created;
+        file.updated = item.second.updated;
+        file.acessed = item.second.updated;
+        files.push_back(file);
+    }
+
+    return files;
+}
+
+std::string WriteBehindStorage::pathOf(std::string username, std::string filename)
+{
+    {
+        std::lock_guard<std::mutex> lock(_mutex);
+        if (findPending(username, filename) != nullptr)
+        {
+            return "";
+        }
+    }
+
+    return backend->pathOf(username, filename);
+}
+
+std::unique_ptr<std::istream> WriteBehindStorage::openRead(std::string username, std::string filename)
+{
+    {
+        std::lock_guard<std::mutex> lock(_mutex);
+        PendingWrite *write = findPending(username, filename);
+
+        if (write != nullptr)
+        {
+            return std::unique_ptr<std::istream>(new std::istringstream(write->data));
+        }
+    }
+
+    return backend->openRead(username, filename);
+}
+
+std::string WriteBehindStorage::stage(std::string username, std::string filename)
+{
+    return backend->stage(username, filename);
+}
+
+std::string WriteBehindStorage::stagePartial(std::string username, std::string filename)
+{
+    return backend->stagePartial(username, filename);
+}
+
+bool WriteBehindStorage::commit(std::string username, std::string filename, std::string stagedPath, Durability durability)
+{
+    return publish(username, filename, stagedPath, nullptr, durability);
+}
+
+bool WriteBehindStorage::commitKeepingTimes(std::string username, std::string filename, std::string stagedPath, StoredFile times, Durability durability)
+{
+    return publish(username, filename, stagedPath, &times, durability);
+}
+
+bool WriteBehindStorage::publish(std::string username, std::string filename, std::string stagedPath, const StoredFile *times, Durability durability)
+{
+    struct stat attributes;
+    if (stat(stagedPath.c_str(), &attributes) != 0)
+    {
+        return false;
+    }
+
+    if (attributes.st_size <= WRITE_BEHIND_FILE_LIMIT)
+    {
+        std::ifstream file(stagedPath, std::ios::in | std::ios::binary);
+        std::ostringstream data;
+        data << file.rdbuf();
+        file.close();
+
+        backend->abort(stagedPath);
+        return store(username, filename, data.str(), times, durability);
+    }
+
+    {
+        std::unique_lock<std::mutex> lock(_mutex);
+        if (dropPending(lock, username, filename))
+        {
+            syncJournal(lock, durability);
+        }
+    }
+
+    return times == nullptr ? backend->commit(username, filename, stagedPath, durability)
+                            : backend->commitKeepingTimes(username, filename, stagedPath, *times, durability);
+}
+
+void WriteBehindStorage::abort(std::string stagedPath)
+{
+    backend->abort(stagedPath);
+}
+
+bool WriteBehindStorage::write(std::string username, std::string filename, std::string data, Durability durability)
+{
+    return store(username, filename, data, nullptr, durability);
+}
+
+bool WriteBehindStorage::writeKeepingTimes(std::string username, std::string filename, std::string data, StoredFile times, Durability durability)
+{
+    return store(username, filename, data, &times, durability);
+}
+
+bool WriteBehindStorage::store(std::string username, std::string filename, std::string data, const StoredFile *times, Durability durability)
+{
+    {
+        std::unique_lock<std::mutex> lock(_mutex);
+
+        if (hold(username, filename, data, times))
+        {
+            return syncJournal(lock, durability);
+        }
+
+        if (dropPending(lock, username, filename))
+        {
+            syncJournal(lock, durability);
+        }
+    }
+
+    return times == nullptr ? backend->write(username, filename, data, durability)
+                            : backend->writeKeepingTimes(username, filename, data, *times, durability);
+}
+
+bool WriteBehindStorage::remove(std::string username, std::string filename)
+{
+    bool wasPending;
+    {
+        std::unique_lock<std::mutex> lock(_mutex);
+        wasPending = dropPending(lock, username, filename);
+
+        if (wasPending)
+        {
+            syncJournal(lock, Durability::DefaultDurability);
+        }
+    }
+
+    bool isRemoved = backend->remove(username, filename);
+    return wasPending || isRemoved;
+}
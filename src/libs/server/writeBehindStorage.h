@@ -0,0 +1,87 @@
+#pragma once
+
+#include <map>
+#include <set>
+#include <mutex>
+#include <future>
+#include <condition_variable>
+#include <stdint.h>
+
+#include "storage.h"
+
+// Bodies held in memory waiting to be flushed, and the largest body that
+// is held at all. Anything beyond goes straight to the wrapped backend.
+#define WRITE_BEHIND_MEMORY_LIMIT (64 * 1024 * 1024)
+#define WRITE_BEHIND_FILE_LIMIT (4 * 1024 * 1024)
+// The journal is rewritten with only the pending bodies past this size.
+#define WRITE_BEHIND_JOURNAL_COMPACTION_SIZE (128 * 1024 * 1024)
+#define WRITE_BEHIND_FLUSH_THREADS 4
+#define WRITE_BEHIND_RETRY_SECONDS 1
+
+class PendingWrite
+{
+public:
+    std::string data;
+    time_t created;
+    time_t updated;
+    uint64_t sequence;
+};
+
+// Acknowledges writes once they are in memory and appended to the journal
+// in <root>.write-behind/, and flushes them to the wrapped backend in the
+// background. Until then reads are served from memory. Pending bodies
+// are replayed from the journal on start, and the journal is emptied
+// whenever everything has been flushed.
+class WriteBehindStorage : public StorageBackend
+{
+    std::string folder;
+    StorageBackend *backend;
+
+    std::mutex _mutex;
+    std::condition_variable changed;
+    std::map<std::string, std::map<std::string, PendingWrite>> pending;
+    std::set<std::pair<std::string, std::string>> flushing;
+    uint64_t pendingBytes = 0;
+    uint64_t nextSequence = 0;
+
+    int journal = -1;
+    uint64_t journalSize = 0;
+    int syncing = 0;
+
+    std::vector<std::future<void>> flushers;
+
+    std::string journalPath();
+    void replayJournal();
+    bool appendToJournal(bool isDrop, std::string username, std::string filename, std::string data, time_t created, time_t updated);
+    bool syncJournal(std::unique_lock<std::mutex> &lock, Durability durability);
+    void rewriteJournal();
+
+    bool hold(std::string username, std::string filename, std::string data, const StoredFile *times);
+    bool dropPending(std::unique_lock<std::mutex> &lock, std::string username, std::string filename);
+    PendingWrite *findPending(std::string username, std::string filename);
+    bool nextPending(std::string *username, std::string *filename);
+    void flushLoop();
+
+    bool publish(std::string username, std::string filename, std::string stagedPath, const StoredFile *times, Durability durability);
+    bool store(std::string username, std::string filename, std::string data, const StoredFile *times, Durability durability);
+
+public:
+    WriteBehindStorage(std::string root, StorageBackend *backend);
+
+    void createUser(std::string username) override;
+    std::vector<std::string> listUsers() override;
+    std::vector<StoredFile> listFiles(std::string username) override;
+
+    std::string pathOf(std::string username, std::string filename) override;
+    std::unique_ptr<std::istream> openRead(std::string username, std::string filename) override;
+
+    std::string stage(std::string username, std::string filename) override;
+    std::string stagePartial(std::string username, std::string filename) override;
+    bool commit(std::string username, std::string filename, std::string stagedPath, Durability durability) override;
+    void abort(std::string stagedPath) override;
+    bool write(std::string username, std::string filename, std::string data, Durability durability) override;
+    bool commitKeepingTimes(std::string username, std::string filename, std::string stagedPath, StoredFile times, Durability durability) override;
+    bool writeKeepingTimes(std::string username, std::string filename, std::string data, StoredFile times, Durability durability) override;
+
+    bool remove(std::string username, std::string filename) override;
+};
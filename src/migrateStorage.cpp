@@ -0,0 +1,50 @@
+#include <iostream>
+#include <filesystem>
+#include <stdio.h>
+
+#include "libs/server/sharding.h"
+
+using namespace std;
+
+// Moves a store written in the flat layout into hash sharded buckets:
+// out/<username>/<filename> into out/<username>/<xx>/<yy>/<filename> and
+// out/.blobs/<xx>/<sha256> into out/.blobs/<xx>/<yy>/<sha256>. Files already
+// in place are left alone, so it can be run again after an interruption.
+// The server does the same when it starts, this moves a store ahead of
+// that. The server must not be running.
+
+int main(int argc, char *argv[])
+{
+    std::string root = argc > 1 ? argv[1] : "out/";
+    if (root.back() != '/')
+    {
+        root += "/";
+    }
+
+    if (!std::filesystem::is_directory(root))
+    {
+        cerr << "Expected usage: ./migrateStorage [storage-root]" << endl;
+        exit(-1);
+    }
+
+    for (const auto &entry : std::filesystem::directory_iterator(root))
+    {
+        std::string name = entry.path().filename();
+
+        if (!entry.is_directory() || name[0] == '.')
+        {
+            continue;
+        }
+
+        int migrated = shardFlatFiles(root + name + "/");
+        cout << name << ": " << migrated << " files moved" << endl;
+    }
+
+    if (std::filesystem::is_directory(root + ".blobs"))
+    {
+        int migrated = shardFlatBlobs(root + ".blobs/");
+        cout << ".blobs: " << migrated << " blobs moved" << endl;
+    }
+
+    return 0;
+}
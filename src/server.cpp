@@ -13,36 +13,305 @@
 #include <algorithm>
 #include <iterator>
 #include <optional>
+#include <signal.h>
+#include <atomic>
+#include <thread>
+#include <sys/timerfd.h>
 
 #include "libs/server/fileManager.h"
+#include "libs/server/notifications.h"
+#include "libs/server/multiRootStorage.h"
+#include "libs/server/parallelTransfer.h"
+#include "libs/common/compression.h"
+#include "libs/common/transfer.h"
+#include "libs/common/blake3.h"
+#include "libs/common/bufferPool.h"
+#include "libs/common/eventLoop.h"
 
 using namespace std;
 
-void expectFileAction(Session, ThreadSafeQueue<FileAction> *);
+#define DEFAULT_STORAGE_BACKEND "plain"
+#define DEFAULT_STORAGE_ROOT "out/"
+
+// New connections are accepted by one thread per core, up to MAX_ACCEPTORS,
+// each with a socket of its own on the port. Clients that don't log in
+// within LOGIN_TIMEOUT_MILLISECONDS, or send a login larger than
+// LOGIN_MAX_PACKET_SIZE, are dropped. Acceptors that fail to accept, as
+// when the process ran out of descriptors, retry after a pause.
+#define MAX_ACCEPTORS 8
+#define LOGIN_TIMEOUT_MILLISECONDS 5000
+#define LOGIN_MAX_PACKET_SIZE 4096
+#define ACCEPT_RETRY_MILLISECONDS 100
+
+class Singleton;
+Detached expectFileAction(Session, Singleton *);
 
 class Singleton
 {
 protected:
 public:
     AsyncRunner *runner;
+    EventLoop *loop;
     ThreadSafeQueue<FileAction> *fileQueue;
     FilesManager *fileManager;
+    NotificationCoalescer *notifications;
+    std::atomic<int> clientCounter{0};
 
-    Singleton(ThreadSafeQueue<FileAction> *_fileQueue, AsyncRunner *_runner, FilesManager *_fileManager)
+    Singleton(ThreadSafeQueue<FileAction> *_fileQueue, AsyncRunner *_runner, EventLoop *_loop, FilesManager *_fileManager, NotificationCoalescer *_notifications)
     {
         fileQueue = _fileQueue;
         runner = _runner;
+        loop = _loop;
         fileManager = _fileManager;
+        notifications = _notifications;
     }
 
+    // Waits for the session's next command on the event loop, rather than
+    // on a thread of its own.
     void start(Session session)
     {
-        runner->queue(
-            [session, this]
-            { expectFileAction(session, fileQueue); });
+        expectFileAction(session, this);
     }
 };
 
+// Runs on the queue processor, the only thread touching the file states.
+void queueColdFiles(Singleton *singleton)
+{
+    time_t coldBefore = now() - singleton->fileManager->archiveAfter;
+
+    for (auto const &username : singleton->fileManager->listUsernames())
+    {
+        UserFiles *userFiles = singleton->fileManager->getFiles(username);
+
+        for (auto const &item : userFiles->fileStatesByFilename)
+        {
+            FileState state = item.second;
+
+            if (state.IsEmptyState() || state.IsDeletingState() ||
+                state.acessed > coldBefore ||
+                userFiles->archivedFiles.count(item.first) > 0)
+            {
+                continue;
+            }
+
+            userFiles->archivedFiles.insert(item.first);
+            singleton->fileQueue->queue(FileAction(Session(-1, -1, username), item.first, FileActionType::Archive, now()));
+        }
+    }
+}
+
+void logCompressionMetrics()
+{
+    CompressionMetrics *metrics = compressionMetrics();
+    uint64_t originalBytes = metrics->originalBytes;
+    uint64_t archivedBytes = metrics->archivedBytes;
+    uint64_t blocks = metrics->decompressedBlocks;
+
+    std::cout << Color::blue
+              << "Archived " << metrics->archivedFiles << " files, "
+              << originalBytes << " bytes down to " << archivedBytes
+              << " (" << (originalBytes == 0 ? 0 : 100 - archivedBytes * 100 / originalBytes) << "% saved). "
+              << "Decompressed " << blocks << " blocks, "
+              << (blocks == 0 ? 0 : metrics->decompressionMicroseconds / blocks) << "us each"
+              << Color::reset << std::endl;
+}
+
+void logBufferPoolMetrics()
+{
+    BufferPoolMetrics *metrics = &bufferPool()->metrics;
+
+    std::cout << Color::blue
+              << "Buffer pool holds " << metrics->buffers << " buffers in " << metrics->slabs << " slabs, "
+              << metrics->inUse << " in use. Handed out " << metrics->acquired << ", "
+              << metrics->oversized << " oversized.";
+
+    if (COUNT_HEAP_ALLOCATIONS)
+    {
+        std::cout << " " << metrics->steadyAllocations << " heap allocations by transfers in steady state";
+    }
+
+    std::cout << Color::reset << std::endl;
+}
+
+void tierColdFiles(Singleton *singleton)
+{
+    while (true)
+    {
+        sleep(TIERING_INTERVAL_SECONDS);
+        singleton->fileQueue->queue(FileAction(Session(-1, -1, ""), "", FileActionType::Archive, now()));
+        logCompressionMetrics();
+        logBufferPoolMetrics();
+        std::cout << Color::blue << "Notifications " << toString(singleton->notifications->stats()) << Color::reset << std::endl;
+    }
+}
+
+// Looking up contents and inline data reads storage, so that runs on the
+// loop's workers while the replies are sent from the loop. Notifications
+// for the subscriber wait until the updates were sent.
+Detached sendFileUpdates(EventLoop *loop, NotificationCoalescer *notifications, StorageBackend *storage, FileAction fileAction, list<pair<Message, FileState>> fileUpdates)
+{
+    std::shared_ptr<Completion> previous;
+    std::shared_ptr<Completion> turn = notifications->turn(fileAction.session.socket, &previous);
+
+    co_await loop->schedule();
+    co_await loop->after(previous);
+
+    Message message = co_await Message::Response(ResponseType::Ok).send(loop, fileAction.session.socket);
+
+    if (message.type != MessageType::Start)
+    {
+        message.panic();
+        turn->finish();
+        co_return;
+    }
+
+    for (auto &item : fileUpdates)
+    {
+        Message *fileUpdate = &item.first;
+        FileState *state = &item.second;
+
+        // Named, as GCC 12 destroys temporaries of a co_await in a loop
+        // twice.
+        auto lookup = loop->background(
+            [storage, fileAction, fileUpdate, state]
+            {
+                contentOf(storage, fileAction.session.username, fileUpdate->filename, *state, &fileUpdate->contentHash, &fileUpdate->contentSize);
+                fileUpdate->hasInlineData = storage->readInline(
+                    fileAction.session.username,
+                    fileUpdate->filename,
+                    fileAction.session.inlineLimit,
+                    &fileUpdate->data);
+            });
+        co_await lookup;
+
+        message = co_await message.reply(loop, *fileUpdate);
+
+        if (!message.isOk())
+        {
+            message.panic();
+            break;
+        }
+    }
+
+    turn->finish();
+}
+
+Detached sendFileInfos(EventLoop *loop, StorageBackend *storage, FileAction fileAction, list<pair<Message, FileState>> fileInfos, std::function<void(FileState)> onComplete)
+{
+    co_await loop->schedule();
+
+    Message message = co_await Message::Response(ResponseType::Ok).send(loop, fileAction.session.socket);
+
+    if (message.type != MessageType::Start)
+    {
+        message.panic();
+        co_return;
+    }
+
+    for (auto &item : fileInfos)
+    {
+        Message *fileInfo = &item.first;
+        FileState *state = &item.second;
+
+        auto lookup = loop->background(
+            [storage, fileAction, fileInfo, state]
+            { contentOf(storage, fileAction.session.username, fileInfo->filename, *state, &fileInfo->contentHash, &fileInfo->contentSize); });
+        co_await lookup;
+
+        message = co_await message.reply(loop, *fileInfo);
+
+        if (!message.isOk())
+        {
+            message.panic();
+            co_return;
+        }
+    }
+
+    message = co_await message.reply(loop, Message::EndCommand());
+
+    if (!message.isOk())
+    {
+        message.panic();
+        co_return;
+    }
+
+    onComplete(FileState::Empty());
+}
+
+Detached logIn(EventLoop *loop, int clientSocket, Singleton *singleton)
+{
+    int clientId = singleton->clientCounter++;
+
+    std::cout << Color::blue
+              << "New client connected on socket " << clientSocket
+              << ". Id: " << clientId
+              << Color::reset << std::endl;
+
+    Message login = co_await Message::listen(loop, clientSocket, LOGIN_TIMEOUT_MILLISECONDS, LOGIN_MAX_PACKET_SIZE);
+
+    if (login.type != MessageType::Login)
+    {
+        std::cout << "Login failed for Client id " << clientId << std::endl;
+        login.panic();
+        close(clientSocket);
+        co_return;
+    }
+
+    int inlineLimit = std::min(INLINE_PAYLOAD_LIMIT, std::max(0, login.inlineLimit));
+    co_await login.reply(loop, Message::Response(ResponseType::Ok, std::to_string(inlineLimit)), false);
+
+    // Everything past the login reads and writes the socket blocking.
+    setNonBlocking(clientSocket, false);
+
+    string username = login.username;
+    StorageBackend *storage = singleton->fileManager->storage;
+    auto createUser = loop->background(
+        [storage, username]
+        { storage->createUser(username); });
+    co_await createUser;
+
+    std::cout << "Client " << clientId << " logged in as " << username << std::endl;
+    Session session(clientId, clientSocket, username);
+    session.inlineLimit = inlineLimit;
+
+    singleton->start(session);
+}
+
+// Logins run on the acceptor's loop, so a client that is slow to log in
+// holds up neither accepting nor the others logging in.
+Detached acceptClients(EventLoop *loop, int serverSocket, Singleton *singleton)
+{
+    co_await loop->schedule();
+
+    // Made up front, as it is needed when there are no descriptors left.
+    int retryTimer = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+
+    std::vector<int> clientSockets;
+    while (true)
+    {
+        std::cout << Color::yellow << "Awaiting new connections: " << Color::reset << std::endl;
+
+        if (!co_await acceptConnections(loop, serverSocket, &clientSockets))
+        {
+            std::cout << Color::red << "Retrying to accept in " << ACCEPT_RETRY_MILLISECONDS << "ms" << Color::reset << std::endl;
+
+            itimerspec retry = {};
+            retry.it_value.tv_nsec = ACCEPT_RETRY_MILLISECONDS * 1000000L;
+            timerfd_settime(retryTimer, 0, &retry, nullptr);
+            co_await loop->readable(retryTimer);
+
+            uint64_t expirations;
+            read(retryTimer, &expirations, sizeof(expirations));
+            continue;
+        }
+
+        for (int clientSocket : clientSockets)
+        {
+            logIn(loop, clientSocket, singleton);
+        }
+    }
+}
+
 void processQueue(Singleton *singleton)
 {
     while (true)
@@ -56,51 +325,70 @@ void processQueue(Singleton *singleton)
         }
 
         FileAction fileAction = result.value();
+
+        if (fileAction.type == FileActionType::Archive && fileAction.filename.empty())
+        {
+            queueColdFiles(singleton);
+            continue;
+        }
+
         std::cout << "BEGIN: " << fileActionToString(fileAction) << endl;
 
         string username = fileAction.session.username;
 
         UserFiles *userFiles = singleton->fileManager->getFiles(username);
 
-        std::list<int> subscribers = *(userFiles->subscribers);
-        auto onComplete = [fileAction, singleton, subscribers](FileState nextState = FileState::Empty())
+        std::list<Session> subscribers = *(userFiles->subscribers);
+        auto onComplete = [fileAction, singleton, subscribers, userFiles](FileState nextState = FileState::Empty())
         {
             std::cout << "END: " << fileActionToString(fileAction) << endl;
+
+            if (fileAction.type == FileActionType::Archive)
+            {
+                return;
+            }
+
             singleton->start(fileAction.session);
 
             if (fileAction.type == FileActionType::Delete)
             {
-                for (auto const &subscriber : subscribers)
-                {
-                    Message::RemoteFileDelete(fileAction.filename, nextState.updated, nextState.acessed, nextState.created).send(subscriber, false);
-                }
+                userFiles->chunkIndex->forgetFile(fileAction.filename);
+                singleton->notifications->notify(
+                    fileAction.session.username,
+                    subscribers,
+                    Message::RemoteFileDelete(fileAction.filename, nextState.updated, nextState.acessed, nextState.created));
             }
 
-            if (fileAction.type == FileActionType::Upload)
+            if (fileAction.type == FileActionType::Upload && !nextState.isUnchanged && !nextState.isFailed)
             {
-                for (auto const &subscriber : subscribers)
-                {
-                    Message response = Message::RemoteFileUpdate(fileAction.filename, nextState.updated, nextState.acessed, nextState.created).send(subscriber);
-                    if (response.type == MessageType::Empty)
-                    {
-                        Session session = Session(1, subscriber, "");
-                        singleton->fileQueue->queue(FileAction(session, "", FileActionType::Unsubscribe, now()));
-                    }
-                }
+                Message update = Message::RemoteFileUpdate(fileAction.filename, nextState.updated, nextState.acessed, nextState.created);
+                nextState.content->get(&update.contentHash, &update.contentSize);
+                update.hasInlineData = singleton->fileManager->storage->readInline(
+                    fileAction.session.username,
+                    fileAction.filename,
+                    INLINE_PAYLOAD_LIMIT,
+                    &update.data);
+
+                singleton->notifications->notify(fileAction.session.username, subscribers, update);
+                userFiles->chunkIndex->indexFile(fileAction.filename);
             }
         };
 
         if (fileAction.type == FileActionType::Unsubscribe)
         {
-            userFiles->subscribers->remove(fileAction.session.socket);
-            close(fileAction.session.socket);
+            int socket = fileAction.session.socket;
+            userFiles->subscribers->remove_if(
+                [socket](Session subscriber)
+                { return subscriber.socket == socket; });
+            forgetTransferEstimate(fileAction.session.socket);
+            singleton->notifications->close(fileAction.session.socket);
             std::cout << "Connection with " << fileAction.session.username << " closed (socket: " << fileAction.session.socket << ")" << std::endl;
             continue;
         }
 
         if (fileAction.type == FileActionType::Subscribe)
         {
-            list<Message> fileUpdates;
+            list<pair<Message, FileState>> fileUpdates;
 
             for (auto const &item : userFiles->fileStatesByFilename)
             {
@@ -112,42 +400,18 @@ void processQueue(Singleton *singleton)
                     continue;
                 }
 
-                fileUpdates.push_front(Message::RemoteFileUpdate(name, state.updated, state.acessed, state.created));
+                fileUpdates.push_front({Message::RemoteFileUpdate(name, state.updated, state.acessed, state.created), state});
             }
 
-            userFiles->subscribers->push_front(fileAction.session.socket);
-
-            auto sendFileUpdates = [fileAction, fileUpdates, onComplete]
-            {
-                auto message = Message::Response(ResponseType::Ok).send(fileAction.session.socket);
-
-                if (message.type != MessageType::Start)
-                {
-                    message.panic();
-                    return;
-                }
-
-                for (auto const &fileInfo : fileUpdates)
-                {
-                    message = message.Reply(fileInfo);
-
-                    if (!message.isOk())
-                    {
-                        message.panic();
-                        return;
-                    }
-                }
-            };
+            userFiles->subscribers->push_front(fileAction.session);
 
-            singleton->runner->queue(
-                [sendFileUpdates]
-                { sendFileUpdates(); });
+            sendFileUpdates(singleton->loop, singleton->notifications, singleton->fileManager->storage, fileAction, fileUpdates);
             continue;
         }
 
         if (fileAction.type == FileActionType::ListServer)
         {
-            list<Message> fileInfos;
+            list<pair<Message, FileState>> fileInfos;
 
             for (auto const &item : userFiles->fileStatesByFilename)
             {
@@ -160,48 +424,32 @@ void processQueue(Singleton *singleton)
                     continue;
                 }
 
-                fileInfos.push_front(Message::FileInfo(name, state.updated, state.acessed, state.created));
+                fileInfos.push_front({Message::FileInfo(name, state.updated, state.acessed, state.created), state});
             }
 
-            auto sendFileInfos = [fileAction, fileInfos, onComplete]
-            {
-                auto message = Message::Response(ResponseType::Ok).send(fileAction.session.socket);
-
-                if (message.type != MessageType::Start)
-                {
-                    message.panic();
-                    return;
-                }
-
-                for (auto const &fileInfo : fileInfos)
-                {
-                    message = message.Reply(fileInfo);
-
-                    if (!message.isOk())
-                    {
-                        message.panic();
-                        return;
-                    }
-                }
-
-                message = message.Reply(Message::EndCommand());
+            sendFileInfos(singleton->loop, singleton->fileManager->storage, fileAction, fileInfos, onComplete);
+            continue;
+        }
 
-                if (!message.isOk())
-                {
-                    message.panic();
-                    return;
-                }
+        if (fileAction.type == FileActionType::Upload || fileAction.type == FileActionType::Delete)
+        {
+            userFiles->archivedFiles.erase(fileAction.filename);
+        }
 
-                onComplete();
-            };
+        FileState lastFileState = userFiles->get(fileAction.filename);
 
-            singleton->runner->queue(
-                [sendFileInfos]
-                { sendFileInfos(); });
+        // Files deleted since they were found cold are left alone, rather
+        // than getting a state of their own.
+        if (fileAction.type == FileActionType::Archive &&
+            (lastFileState.IsEmptyState() || lastFileState.IsDeletingState()))
+        {
+            onComplete(lastFileState);
             continue;
         }
 
-        FileState lastFileState = userFiles->get(fileAction.filename);
+        fileAction.chunkIndex = userFiles->chunkIndex;
+        fileAction.storage = singleton->fileManager->storage;
+        fileAction.loop = singleton->loop;
 
         auto nextState = getNextState(lastFileState, fileAction, onComplete);
         std::cout << toString(lastFileState) << " > " << toString(nextState) << endl;
@@ -218,108 +466,265 @@ std::future<void> startQueueProcessor(Singleton *singleton)
 
 int main(int argc, char *argv[])
 {
-    if (argc != 2)
+    std::vector<std::string> arguments;
+    time_t archiveAfter = TIERING_ARCHIVE_AFTER_SECONDS;
+    for (int i = 1; i < argc; i++)
     {
-        cerr << "Expected usage: ./server <port-number>" << endl;
+        std::string argument = argv[i];
+
+        if (argument.rfind("--archive-after=", 0) == 0)
+        {
+            archiveAfter = atol(argument.substr(strlen("--archive-after=")).c_str());
+            continue;
+        }
+
+        if (argument.rfind("--durability=", 0) != 0)
+        {
+            arguments.push_back(argument);
+            continue;
+        }
+
+        if (!parseDurability(argument.substr(strlen("--durability=")), &groupCommitter()->defaultDurability))
+        {
+            cerr << "Unknown durability: " << argument << endl;
+            exit(-1);
+        }
+    }
+
+    if (arguments.size() < 1)
+    {
+        cerr << "Expected usage: ./server <port-number> [plain|plain-flat|content-addressed|segmented[:<backend>]|write-behind[:<backend>]] [storage-root...] [--durability=none|batched|immediate] [--archive-after=<seconds>]" << endl;
         exit(-1);
     }
 
-    int port = atoi(argv[1]);
+    int port = atoi(arguments[0].c_str());
 
-    std::string serverPath = "out/";
-    mkdir(serverPath.c_str(), S_IRWXU | S_IRWXG | S_IROTH | S_IXOTH);
+    // sendfile has no MSG_NOSIGNAL, a client going away mid download must
+    // only fail the transfer.
+    signal(SIGPIPE, SIG_IGN);
 
-    int serverSocket = startServer(port);
+    std::string storageName = arguments.size() >= 2 ? arguments[1] : DEFAULT_STORAGE_BACKEND;
 
-    AsyncRunner runner;
-    ThreadSafeQueue<FileAction> queue;
-    FilesManager fileManager;
-    Singleton singleton(&queue, &runner, &fileManager);
+    std::vector<std::string> storageRoots;
+    for (size_t i = 2; i < arguments.size(); i++)
+    {
+        std::string root = arguments[i];
+        storageRoots.push_back(root.back() == '/' ? root : root + "/");
+    }
 
-    auto queueProcessor = async(launch::async, processQueue, &singleton);
+    if (storageRoots.empty())
+    {
+        storageRoots.push_back(DEFAULT_STORAGE_ROOT);
+    }
 
-    int clientCounter = 0;
-    while (true)
+    StorageBackend *storage = nullptr;
+    if (storageRoots.size() == 1)
     {
-        std::cout << Color::yellow << "Awaiting new connections: " << Color::reset << std::endl;
-        int clientSocket = awaitConnection(serverSocket);
-        int clientId = clientCounter++;
+        storage = createStorage(storageName, storageRoots.front());
+    }
+    else
+    {
+        MultiRootStorage *multiRootStorage = new MultiRootStorage(storageRoots, storageName);
+        storage = multiRootStorage->isValid() ? multiRootStorage : nullptr;
+    }
 
-        std::cout << Color::blue
-                  << "New client connected on socket " << clientSocket
-                  << ". Id: " << clientId
-                  << Color::reset << std::endl;
+    if (storage == nullptr)
+    {
+        cerr << "Unknown storage backend: " << storageName << endl;
+        exit(-1);
+    }
 
-        auto login = Message::Listen(clientSocket);
+    std::cout << "Uploads are acknowledged with " << toString(groupCommitter()->defaultDurability) << " durability by default" << std::endl;
+    std::cout << "Transfers are checked with CRC32C (" << crc32cKernel() << ")" << std::endl;
+    std::cout << "Contents are hashed with BLAKE3 (" << blake3Kernel() << ")" << std::endl;
 
-        if (login.type != MessageType::Login)
+    AsyncRunner runner;
+    EventLoop loop;
+    ThreadSafeQueue<FileAction> queue;
+    FilesManager fileManager(storage);
+    fileManager.archiveAfter = archiveAfter;
+    NotificationCoalescer notifications(
+        &loop,
+        [&queue](int subscriber)
         {
-            std::cout << "Login failed for Client id " << clientId << std::endl;
-            login.panic();
-            close(clientSocket);
-            continue;
-        }
+            Session session = Session(1, subscriber, "");
+            queue.queue(FileAction(session, "", FileActionType::Unsubscribe, now()));
+        });
+    Singleton singleton(&queue, &runner, &loop, &fileManager, &notifications);
 
-        login.Reply(Message::Response(ResponseType::Ok), false);
-
-        string username = login.username;
-        string folder = "out/" + username + "/";
-        mkdir(folder.c_str(), S_IRWXU | S_IRWXG | S_IROTH | S_IXOTH);
-
-        std::cout << "Client " << clientId << " logged in as " << username << std::endl;
-        Session session(clientId, clientSocket, username);
+    auto queueProcessor = async(launch::async, processQueue, &singleton);
+    auto tiering = async(launch::async, tierColdFiles, &singleton);
 
-        singleton.start(session);
+    int acceptors = std::clamp((int)std::thread::hardware_concurrency(), 1, MAX_ACCEPTORS);
+    std::list<EventLoop> acceptorLoops;
+    for (int i = 0; i < acceptors; i++)
+    {
+        int serverSocket = startServer(port, acceptors > 1);
+        acceptClients(&acceptorLoops.emplace_back(1, 0), serverSocket, &singleton);
     }
 
+    std::cout << "Server started! Accepting connections on " << acceptors << " threads" << std::endl;
+
+    queueProcessor.wait();
     return 0;
 }
 
-void expectFileAction(Session session, ThreadSafeQueue<FileAction> *queue)
+Detached expectFileAction(Session session, Singleton *singleton)
 {
+    ThreadSafeQueue<FileAction> *queue = singleton->fileQueue;
+    EventLoop *loop = singleton->loop;
+
+    co_await loop->schedule();
+
     std::ostringstream clientNameStream;
     clientNameStream << Color::yellow << "[" << session.clientId << "]" << Color::reset;
     std::string clientName = clientNameStream.str();
 
     while (true)
     {
-        Message message = Message::Listen(session.socket);
+        Message message = co_await Message::listen(loop, session.socket);
         std::cout << clientName << " queued " << message.type << std::endl;
 
         if (message.type == MessageType::SubscribeUpdates)
         {
             queue->queue(FileAction(session, "", FileActionType::Subscribe, message.timestamp));
-            return;
+            co_return;
         }
 
         if (message.type == MessageType::UploadCommand)
         {
-            queue->queue(FileAction(session, message.filename, FileActionType::Upload, message.timestamp));
-            return;
+            // Only as much inline data as was agreed on at login is taken.
+            if (message.hasInlineData && message.data.size() > (size_t)session.inlineLimit)
+            {
+                std::cout << clientName << " sent " << message.data.size() << " bytes inline, over its limit of " << session.inlineLimit << std::endl;
+                co_await message.reply(loop, Message::Response(ResponseType::Invalid), false);
+                continue;
+            }
+
+            FileAction upload(session, message.filename, FileActionType::Upload, message.timestamp);
+            upload.hasInlineData = message.hasInlineData;
+            upload.inlineData = message.data;
+            upload.durability = message.durability;
+            upload.contentHash = message.contentHash;
+            upload.contentSize = message.contentSize;
+            queue->queue(upload);
+            co_return;
         }
 
         if (message.type == MessageType::DownloadCommand)
         {
             queue->queue(FileAction(session, message.filename, FileActionType::Read, message.timestamp));
-            return;
+            co_return;
+        }
+
+        if (message.type == MessageType::DeltaUploadCommand)
+        {
+            FileAction upload(session, message.filename, FileActionType::Upload, message.timestamp);
+            upload.useDelta = true;
+            upload.durability = message.durability;
+            upload.contentHash = message.contentHash;
+            upload.contentSize = message.contentSize;
+            queue->queue(upload);
+            co_return;
+        }
+
+        if (message.type == MessageType::ChunkedUploadCommand)
+        {
+            FileAction upload(session, message.filename, FileActionType::Upload, message.timestamp);
+            upload.useChunks = true;
+            upload.durability = message.durability;
+            upload.contentHash = message.contentHash;
+            upload.contentSize = message.contentSize;
+            queue->queue(upload);
+            co_return;
+        }
+
+        if (message.type == MessageType::ParallelUploadCommand)
+        {
+            FileAction upload(session, message.filename, FileActionType::Upload, message.timestamp);
+            upload.isParallel = true;
+            upload.size = message.size;
+            upload.durability = message.durability;
+            upload.contentHash = message.contentHash;
+            upload.contentSize = message.contentSize;
+            queue->queue(upload);
+            co_return;
+        }
+
+        if (message.type == MessageType::ParallelDownloadCommand)
+        {
+            FileAction read(session, message.filename, FileActionType::Read, message.timestamp);
+            read.isParallel = true;
+            queue->queue(read);
+            co_return;
+        }
+
+        if (message.type == MessageType::RangeDownloadCommand)
+        {
+            FileAction read(session, message.filename, FileActionType::Read, message.timestamp);
+            read.ranges = message.ranges;
+            queue->queue(read);
+            co_return;
+        }
+
+        // Ranges of a transfer some other connection started don't touch
+        // the file states, so they are served right away, on a thread as
+        // they block until sent.
+        if (message.type == MessageType::TransferRange)
+        {
+            singleton->runner->queue(
+                [session, message, singleton]
+                {
+                    serveRange(session, message);
+                    singleton->start(session);
+                });
+            co_return;
+        }
+
+        if (message.type == MessageType::DeltaDownloadCommand)
+        {
+            FileAction read(session, message.filename, FileActionType::Read, message.timestamp);
+            read.useDelta = true;
+            queue->queue(read);
+            co_return;
         }
 
         if (message.type == MessageType::DeleteCommand)
         {
             queue->queue(FileAction(session, message.filename, FileActionType::Delete, message.timestamp));
-            return;
+            co_return;
         }
 
         if (message.type == MessageType::ListServerCommand)
         {
             queue->queue(FileAction(session, "", FileActionType::ListServer, message.timestamp));
-            return;
+            co_return;
+        }
+
+        if (message.type == MessageType::Multiplex)
+        {
+            co_await message.reply(loop, Message::Response(ResponseType::Ok), false);
+
+            std::cout << clientName << " multiplexing streams over socket " << session.socket << std::endl;
+
+            // Takes over the socket, and is deleted once the client is gone.
+            new Multiplexer(
+                session.socket,
+                false,
+                [session, singleton](int streamSocket)
+                {
+                    Session stream = session;
+                    stream.socket = streamSocket;
+                    singleton->start(stream);
+                },
+                true);
+            co_return;
         }
 
         if (message.type == MessageType::Empty)
         {
             queue->queue(FileAction(session, "", FileActionType::Unsubscribe, now()));
-            break;
+            co_return;
         }
 
         message.panic();